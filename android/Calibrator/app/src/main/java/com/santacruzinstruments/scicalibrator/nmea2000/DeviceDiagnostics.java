@@ -0,0 +1,123 @@
+package com.santacruzinstruments.scicalibrator.nmea2000;
+
+import java.nio.charset.StandardCharsets;
+import java.util.LinkedList;
+import java.util.List;
+import java.util.Locale;
+
+/**
+ * Decoded content of the proprietary PGN 130903 device runtime diagnostics
+ */
+public class DeviceDiagnostics {
+
+    public static final int ENTRY_TASK = 0;
+    public static final int ENTRY_QUEUE = 1;
+    public static final int ENTRY_FRAME_CONSUMER = 2;
+    public static final int ENTRY_LINK = 3;
+
+    private static final int HEADER_LEN = 33;
+    private static final int ENTRY_LEN = 11;
+    private static final int ENTRY_NAME_LEN = 8;
+
+    public static class Entry {
+        public final int type;
+        public final String name;
+        public final int value;
+        public final int capacity;
+
+        Entry(int type, String name, int value, int capacity) {
+            this.type = type;
+            this.name = name;
+            this.value = value;
+            this.capacity = capacity;
+        }
+    }
+
+    public final byte src;
+    public long uptimeSec;
+    public long freeHeap;
+    public long largestFreeBlock;
+    public long loopTimeMaxUs;
+    public long loopTimeMeanUs;
+    public int twaiTxErrorCounter;
+    public int twaiRxErrorCounter;
+    public int twaiTxFailed;
+    public int twaiRxMissed;
+    public int twaiBusErrors;
+    public int droppedQueueSends;
+    public final List<Entry> entries = new LinkedList<>();
+
+    private DeviceDiagnostics(byte src) {
+        this.src = src;
+    }
+
+    /**
+     * Decode PGN 130903 payload
+     * @return decoded diagnostics or null if the payload is too short
+     */
+    static public DeviceDiagnostics parse(byte src, byte[] data, int len, int offset) {
+        if ( len - offset < HEADER_LEN ){
+            return null;
+        }
+
+        DeviceDiagnostics d = new DeviceDiagnostics(src);
+        int idx = offset + 2; // Skip mfg and industry codes
+        d.uptimeSec = getUInt(data, idx, 4); idx += 4;
+        d.freeHeap = getUInt(data, idx, 4); idx += 4;
+        d.largestFreeBlock = getUInt(data, idx, 4); idx += 4;
+        d.loopTimeMaxUs = getUInt(data, idx, 4); idx += 4;
+        d.loopTimeMeanUs = getUInt(data, idx, 4); idx += 4;
+        d.twaiTxErrorCounter = (int) getUInt(data, idx, 1); idx += 1;
+        d.twaiRxErrorCounter = (int) getUInt(data, idx, 1); idx += 1;
+        d.twaiTxFailed = (int) getUInt(data, idx, 2); idx += 2;
+        d.twaiRxMissed = (int) getUInt(data, idx, 2); idx += 2;
+        d.twaiBusErrors = (int) getUInt(data, idx, 2); idx += 2;
+        d.droppedQueueSends = (int) getUInt(data, idx, 2); idx += 2;
+        int entriesNum = (int) getUInt(data, idx, 1); idx += 1;
+
+        for(int i = 0; i < entriesNum && idx + ENTRY_LEN <= offset + len; i++){
+            int type = (int) getUInt(data, idx, 1);
+            int nameLen = 0;
+            while ( nameLen < ENTRY_NAME_LEN && data[idx + 1 + nameLen] != 0 )
+                nameLen++;
+            String name = new String(data, idx + 1, nameLen, StandardCharsets.US_ASCII);
+            int value = (int) getUInt(data, idx + 1 + ENTRY_NAME_LEN, 1);
+            int capacity = (int) getUInt(data, idx + 2 + ENTRY_NAME_LEN, 1);
+            d.entries.add(new Entry(type, name, value, capacity));
+            idx += ENTRY_LEN;
+        }
+
+        return d;
+    }
+
+    private static long getUInt(byte[] data, int idx, int size) {
+        long v = 0;
+        for(int i = size - 1; i >= 0; i--){
+            v = (v << 8) | (data[idx + i] & 0xFF);
+        }
+        return v;
+    }
+
+    @Override
+    public String toString() {
+        StringBuilder sb = new StringBuilder();
+        sb.append(String.format(Locale.getDefault(), "Device %d up %d s\n", src & 0xFF, uptimeSec));
+        sb.append(String.format(Locale.getDefault(), "Heap free %d largest block %d\n", freeHeap, largestFreeBlock));
+        sb.append(String.format(Locale.getDefault(), "Loop max %d us mean %d us\n", loopTimeMaxUs, loopTimeMeanUs));
+        sb.append(String.format(Locale.getDefault(), "TWAI TEC %d REC %d tx failed %d rx missed %d bus errors %d\n",
+                twaiTxErrorCounter, twaiRxErrorCounter, twaiTxFailed, twaiRxMissed, twaiBusErrors));
+        sb.append(String.format(Locale.getDefault(), "Dropped queue sends %d\n", droppedQueueSends));
+        for(Entry e: entries){
+            if ( e.type == ENTRY_QUEUE ){
+                sb.append(String.format(Locale.getDefault(), "Queue %s %d/%d\n", e.name, e.value, e.capacity));
+            }else if ( e.type == ENTRY_FRAME_CONSUMER ){
+                sb.append(String.format(Locale.getDefault(), "Bridge %s lag %d dropped %d\n", e.name, e.value, e.capacity));
+            }else if ( e.type == ENTRY_LINK ){
+                sb.append(String.format(Locale.getDefault(), "Link %s %d B/s dropped %d\n", e.name, e.value * 256, e.capacity));
+            }else{
+                sb.append(String.format(Locale.getDefault(), "Task %s %.1f%%\n", e.name, e.value / 2.));
+            }
+        }
+        return sb.toString();
+    }
+}
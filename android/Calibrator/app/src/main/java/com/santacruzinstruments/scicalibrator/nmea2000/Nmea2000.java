@@ -31,11 +31,16 @@ public class Nmea2000 implements TransportTask.UsbConnectionListener {
         void OnConnectionStatus(boolean connected);
         void onRcvdValue(ItemType item, double value);
         void onRcvdCalibration(ItemType item, double cal);
+        void onRcvdDiagnostics(DeviceDiagnostics diagnostics);
 
     }
 
     public final static int SCI_MFG_CODE = 2020;  // # Our mfg code.
     public final static int SCI_INDUSTRY_CODE = 4;  // Marine industry
+    public final static int SCI_DIAGNOSTICS_PGN = 130903;  // Device runtime diagnostics
+
+    private final static int DIAGNOSTICS_REQUEST_TICKS = 5;  // Request diagnostics every 5 ticks
+    private int diagnosticsTickCount = 0;
 
     private static Nmea2000 instance = null;
 
@@ -70,6 +75,13 @@ public class Nmea2000 implements TransportTask.UsbConnectionListener {
         InputStream is = Objects.requireNonNull(getClass().getClassLoader()).getResourceAsStream("pgns.json");
         new N2KLib(null, is);
         canFrameAssembler = new CanFrameAssembler((pgn, priority, dest, src, time, rawBytes, len, hdrlen) -> {
+            if ( pgn == SCI_DIAGNOSTICS_PGN ){
+                DeviceDiagnostics diagnostics = DeviceDiagnostics.parse(src, rawBytes, len, hdrlen);
+                if ( diagnostics != null ){
+                    this.listener.onRcvdDiagnostics(diagnostics);
+                }
+                return;
+            }
             N2KPacket packet = new N2KPacket(pgn, priority, dest, src, time, rawBytes, len, hdrlen);
             if ( packet.isValid() ){
                 try {
@@ -197,6 +209,12 @@ public class Nmea2000 implements TransportTask.UsbConnectionListener {
                 Timber.d("Requesting IMU calibration");
                 requestCurrentCal(SciImuCalibration_pgn);
             }
+
+            if ( ++diagnosticsTickCount >= DIAGNOSTICS_REQUEST_TICKS ){
+                diagnosticsTickCount = 0;
+                Timber.d("Requesting diagnostics");
+                requestCurrentCal(SCI_DIAGNOSTICS_PGN);
+            }
         }
     }
 
@@ -36,6 +36,7 @@ public class TransportTask implements SerialInputOutputManager.Listener {
 
     private enum Connected { False, Pending, True }
     private static final int WRITE_WAIT_MILLIS = 2000; // 0 blocked infinitely on unprogrammed arduino
+    private static final int BAUD_RATE = 921600; // Must match USB_ACC_BAUD_RATE of aoa2nmea
 
     private static final String INTENT_ACTION_GRANT_USB = APPLICATION_ID + "INTENT_ACTION_GRANT_USB";
     private static final String INTENT_ACTION_DISCONNECT = APPLICATION_ID + "INTENT_ACTION_DISCONNECT";
@@ -171,7 +172,7 @@ public class TransportTask implements SerialInputOutputManager.Listener {
         try {
             Timber.d("Opening port ...");
             usbSerialPort.open(usbConnection);
-            usbSerialPort.setParameters(115200, UsbSerialPort.DATABITS_8, UsbSerialPort.STOPBITS_1, UsbSerialPort.PARITY_NONE);
+            usbSerialPort.setParameters(BAUD_RATE, UsbSerialPort.DATABITS_8, UsbSerialPort.STOPBITS_1, UsbSerialPort.PARITY_NONE);
 
             context.registerReceiver(disconnectBroadcastReceiver, new IntentFilter(INTENT_ACTION_DISCONNECT));
             usbSerialPort.setDTR(true); // for arduino, ...
@@ -164,12 +164,16 @@ public class MainFragment extends Fragment {
             if ( isConnected ){
                 binding.notConnectedIndicator.setVisibility(View.GONE);
                 binding.recyclerView.setVisibility(View.VISIBLE);
+                binding.diagnostics.setVisibility(View.VISIBLE);
             }else{
                 binding.notConnectedIndicator.setVisibility(View.VISIBLE);
                 binding.recyclerView.setVisibility(View.GONE);
+                binding.diagnostics.setVisibility(View.GONE);
             }
         });
 
+        mViewModel.getDiagnostics().observe(getViewLifecycleOwner(),
+                val -> binding.diagnostics.setText(val));
 
         RecyclerView recyclerView = binding.recyclerView;
         mCalItemViewAdapter = new CalItemViewAdapter(mViewModel, mCalibratableItems);
@@ -10,6 +10,7 @@ import androidx.lifecycle.LiveData;
 import androidx.lifecycle.MutableLiveData;
 import androidx.lifecycle.ViewModel;
 
+import com.santacruzinstruments.scicalibrator.nmea2000.DeviceDiagnostics;
 import com.santacruzinstruments.scicalibrator.nmea2000.ItemType;
 import com.santacruzinstruments.scicalibrator.nmea2000.Nmea2000;
 
@@ -19,11 +20,14 @@ import java.util.LinkedList;
 import java.util.List;
 import java.util.Locale;
 import java.util.Map;
+import java.util.TreeMap;
 
 public class MainViewModel extends ViewModel implements Nmea2000.N2KListener {
     private static final String INVALID_VALUE = "...";
 
     MutableLiveData<Boolean> isConnected = new MutableLiveData<>();
+    MutableLiveData<String> diagnostics = new MutableLiveData<>("");
+    private final TreeMap<Byte, DeviceDiagnostics> diagnosticsBySrc = new TreeMap<>();
 
     static class Calibratable{
         final String name;
@@ -132,4 +136,20 @@ public class MainViewModel extends ViewModel implements Nmea2000.N2KListener {
         c.cal.postValue((int) calValue);
     }
 
+    LiveData<String> getDiagnostics(){
+        return diagnostics;
+    }
+
+    @Override
+    public void onRcvdDiagnostics(DeviceDiagnostics d) {
+        StringBuilder sb = new StringBuilder();
+        synchronized (diagnosticsBySrc) {
+            diagnosticsBySrc.put(d.src, d);
+            for (DeviceDiagnostics dd : diagnosticsBySrc.values()) {
+                sb.append(dd.toString()).append("\n");
+            }
+        }
+        diagnostics.postValue(sb.toString());
+    }
+
 }
\ No newline at end of file
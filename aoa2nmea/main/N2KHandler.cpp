@@ -4,10 +4,14 @@
 
 #include "N2KHandler.h"
 #include "Event.hpp"
+#include "Trace.h"
+#include "BinLog.h"
 
 NMEA2000_esp32_twai NMEA2000(ESP32_CAN_TX_PIN, ESP32_CAN_RX_PIN,
                              TWAI_MODE, TWAI_TX_QUEUE_LEN);
 
+static const unsigned long TX_PGNS[] PROGMEM={SCI_DIAGNOSTICS_PGN,
+                                              0};
 
 static const char *TAG = "imu2nmea_N2KHandler";
 
@@ -15,6 +19,7 @@ static const char *TAG = "imu2nmea_N2KHandler";
 N2KHandler::N2KHandler(const xQueueHandle &evtQueue, LEDBlinker &ledBlinker)
     :m_ledBlinker(ledBlinker)
     ,m_busListener(evtQueue, ledBlinker)
+    ,m_diagnosticsGroupFunctionHandler(&NMEA2000, SCI_MFG_CODE, SCI_INDUSTRY_CODE)
 {
 }
 
@@ -49,6 +54,8 @@ void N2KHandler::Init() {
 
     NMEA2000.SetConfigurationInformation("https://github.com/sergei/sci2000");
     NMEA2000.SetMode(tNMEA2000::N2km_NodeOnly);
+    NMEA2000.ExtendTransmitMessages(TX_PGNS);
+    NMEA2000.AddGroupFunctionHandler(&m_diagnosticsGroupFunctionHandler);
     NMEA2000.SetOnOpen(OnOpen);
 }
 
@@ -57,6 +64,10 @@ static void n2k_task( void *me ) {
 }
 
 void N2KHandler::Start() {
+    // All the bridges read from this ring, so the TWAI path writes each frame once
+    NMEA2000.addBusListener(&m_frameRing);
+    DeviceDiagnostics::RegisterQueue("side", m_sideFrames.Handle());
+
     xTaskCreate(
             n2k_task,         /* Function that implements the task. */
             "N2KTask",            /* Text name for the task. */
@@ -71,8 +82,15 @@ void N2KHandler::Start() {
     Init();
 
     for( ;; ) {
+        int64_t loopStart = esp_timer_get_time();
+        // Frames from the bridges are only passed to the NMEA2000 stack from this task
+        injectSideFrames();
+
         // crank NMEA2000 state machine
+        SCI_TRACE(TRACE_N2K_PARSE_BEGIN, 0);
         NMEA2000.ParseMessages();
+        SCI_TRACE(TRACE_N2K_PARSE_END, 0);
+        DeviceDiagnostics::AddLoopTime(esp_timer_get_time() - loopStart);
         vTaskDelay(10 / portTICK_PERIOD_MS);
     }
 }
@@ -103,29 +121,35 @@ void N2KTwaiBusAlertListener::onAlert(uint32_t alerts, bool isError) {
                 .u= {.uiValue = alerts}
 
         };
-        xQueueSend(m_evtQueue, &evt, 0);
+        DeviceDiagnostics::QueueSend(m_evtQueue, &evt);
     }
 }
 
 
-bool N2KHandler::addBusListener(TwaiBusListener *listener) {
-    // Add listener to the list
-    if (m_listenerCount < MAX_TWAI_LISTENERS) {
-        m_listeners[m_listenerCount++] = listener;
-    }
-
-    return NMEA2000.addBusListener(listener);
+bool N2KHandler::addFrameConsumer(TwaiFrameCursor &cursor) {
+    if ( !m_frameRing.Subscribe(cursor) )
+        return false;
+    DeviceDiagnostics::RegisterFrameConsumer(&cursor);
+    return true;
 }
 
-void N2KHandler::onSideIfcTwaiFrame(unsigned long id, unsigned char len, const unsigned char *buf) {
-    // Send frame to CAN bus
+void N2KHandler::injectSideFrames() {
+    TwaiFrame frames[MAX_SIDE_FRAMES_PER_LOOP];
+    int n = m_sideFrames.Receive(frames, MAX_SIDE_FRAMES_PER_LOOP);
+    if ( n == 0 )
+        return;
+
     // Prevent loopback by suspending side interface
     NMEA2000.SuspendSideInterface(true);
-    NMEA2000.CANSendFrame(id, len, buf, false);
-    ESP_LOGD(TAG, "CAN< sent %d bytes: id=%08lX", len, id);
-
+    for(int i = 0; i < n; i++){
+        // Send frame to CAN bus
+        NMEA2000.CANSendFrame(frames[i].id, frames[i].len, frames[i].data, false);
+        BINLOG_D("CAN< sent %d bytes: id=%08X", frames[i].len, (unsigned)frames[i].id);
+    }
     NMEA2000.SuspendSideInterface(false);
 
-    // Send frame to local NMEA200 stack
-    NMEA2000.InjectSideTwaiFrame(id, len, buf);
+    // Send frames to local NMEA200 stack
+    for(int i = 0; i < n; i++){
+        NMEA2000.InjectSideTwaiFrame(frames[i].id, frames[i].len, frames[i].data);
+    }
 }
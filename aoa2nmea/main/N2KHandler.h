@@ -7,6 +7,9 @@
 #include <freertos/task.h>
 #include <freertos/timers.h>
 #include <CustomPgnGroupFunctionHandler.h>
+#include <DeviceDiagnostics.h>
+#include <TwaiFrameRing.h>
+#include <SideFrameQueue.h>
 
 #define ESP32_CAN_TX_PIN GPIO_NUM_32
 #define ESP32_CAN_RX_PIN GPIO_NUM_34
@@ -39,28 +42,35 @@ static const char *const MFG_MODEL_VER = "1.0.0.0 (2023-06-01)";
 static const int TWAI_TX_QUEUE_LEN = 20;
 
 
-class N2KHandler : public SideTwaiBusInterface{
+class N2KHandler {
 
 public:
     explicit N2KHandler(const xQueueHandle &evtQueue,  LEDBlinker &ledBlinker);
     void Start();
-    bool addBusListener(TwaiBusListener *listener);
-    void onSideIfcTwaiFrame(unsigned long id, unsigned char len, const unsigned char *buf) override;
+    /// Bridge reads the frames seen on the bus with this cursor
+    bool addFrameConsumer(TwaiFrameCursor &cursor);
+    /// Bridges post the frames received from their clients to this queue
+    SideFrameQueue &SideFrames() { return m_sideFrames; }
 
     [[noreturn]] void N2KTask();
 
 private:
     void Init();
     static void OnOpen();
+    void injectSideFrames();
+
+    static const int SIDE_FRAME_QUEUE_LEN = 32;
+    static const int MAX_SIDE_FRAMES_PER_LOOP = 16;
 
     LEDBlinker &m_ledBlinker;
     N2KTwaiBusAlertListener m_busListener;
+    DiagnosticsGroupFunctionHandler m_diagnosticsGroupFunctionHandler;
 
 
     ESP32N2kStream debugStream;
 
-    TwaiBusListener *m_listeners[MAX_TWAI_LISTENERS] = {nullptr};
-    int m_listenerCount = 0;
+    TwaiFrameRing m_frameRing;
+    SideFrameQueue m_sideFrames{SIDE_FRAME_QUEUE_LEN};
 };
 
 
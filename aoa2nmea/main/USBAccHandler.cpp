@@ -4,15 +4,21 @@
 #include <cstring>
 #include <sys/param.h>
 #include <lwip/def.h>
+#include <esp_timer.h>
 #include "USBAccHandler.h"
+#include "BinLog.h"
 
 static const char *TAG = "aoa2nmea_USBAccHandler";
 
-USBAccHandler::USBAccHandler(SideTwaiBusInterface &twaiBusSender, int tx_io_num, int rx_io_num, uart_port_t uart_num)
-:twaiBusSender(twaiBusSender)
+USBAccHandler::USBAccHandler(SideFrameQueue &sideFrames, int tx_io_num, int rx_io_num, uart_port_t uart_num,
+                             int baudRate, int rts_io_num, int cts_io_num)
+:sideFrames(sideFrames)
 ,tx_io_num(tx_io_num)
 ,rx_io_num(rx_io_num)
 ,uart_num(uart_num)
+,baudRate(baudRate)
+,rts_io_num(rts_io_num)
+,cts_io_num(cts_io_num)
 ,slipPacket(*this, *this)
 {
     esp_log_level_set(TAG, ESP_LOG_INFO); // enable DEBUG logs
@@ -23,7 +29,14 @@ static void gps_task(void *me ) {
     ((USBAccHandler *)me)->Task();
 }
 
+static void tx_frame_task(void *me ) {
+    ((USBAccHandler *)me)->TransmitFrameTask();
+}
+
 void USBAccHandler::Start() {
+    DeviceDiagnostics::RegisterLink(this);
+    m_throughputStartUs = esp_timer_get_time();
+
     xTaskCreate(
             gps_task,         /* Function that implements the task. */
             "GPSTask",            /* Text name for the task. */
@@ -32,25 +45,33 @@ void USBAccHandler::Start() {
             tskIDLE_PRIORITY + 1, /* Priority at which the task is created. */
             nullptr);        /* Used to pass out the created task's handle. */
 
+    xTaskCreate(
+            tx_frame_task,         /* Function that implements the task. */
+            "UsbTxFrameTask",      /* Text name for the task. */
+            4 * 1024,              /* Stack size in words, not bytes. */
+            (void *) this,         /* Parameter passed into the task. */
+            tskIDLE_PRIORITY + 1,  /* Priority at which the task is created. */
+            nullptr);              /* Used to pass out the created task's handle. */
+
 }
 
 void USBAccHandler::Task() {
-    ESP_LOGI(TAG, "Opening serial port");
+    bool flowControl = rts_io_num != UART_PIN_NO_CHANGE && cts_io_num != UART_PIN_NO_CHANGE;
+    ESP_LOGI(TAG, "Opening serial port %d baud, flow control %s", baudRate, flowControl ? "on" : "off");
     uart_config_t uart_config = {
-            .baud_rate = 115200,
+            .baud_rate = baudRate,
             .data_bits = UART_DATA_8_BITS,
             .parity = UART_PARITY_DISABLE,
             .stop_bits = UART_STOP_BITS_1,
-            .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-            .rx_flow_ctrl_thresh = 122,
+            .flow_ctrl = flowControl ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE,
+            .rx_flow_ctrl_thresh = 122,  // RTS is deasserted when 122 of 128 bytes of RX FIFO are used
             .source_clk = UART_SCLK_APB,
     };
 
     // Configure UART parameters
     ESP_ERROR_CHECK(uart_param_config(uart_num, &uart_config));
 
-    // Set UART pins(TX: IO4, RX: IO5, RTS: IO18, CTS: IO19)
-    ESP_ERROR_CHECK(uart_set_pin(uart_num, tx_io_num, rx_io_num, 0, 0));
+    ESP_ERROR_CHECK(uart_set_pin(uart_num, tx_io_num, rx_io_num, rts_io_num, cts_io_num));
 
     // Setup UART buffered IO with event queue
     // Install UART driver using an event queue here
@@ -59,7 +80,6 @@ void USBAccHandler::Task() {
 
 
     uart_event_t event;
-    size_t bytes2read;
     uint8_t dtmp[uart_buffer_size];
 
     for (;;) {
@@ -73,26 +93,18 @@ void USBAccHandler::Task() {
                 be full.*/
                 case UART_DATA:
                     ESP_LOGV(TAG, "[UART DATA]: %d", event.size);
-                    bytes2read = MIN(event.size, uart_buffer_size);
-                    uart_read_bytes(uart_num, dtmp, bytes2read, 0);
-                    for(int i=0; i < event.size; i++){
-                        slipPacket.onSlipByteReceived(dtmp[i]);
-                    }
+                    readAvailable(dtmp, sizeof(dtmp));
                     break;
                     //Event of HW FIFO overflow detected
                 case UART_FIFO_OVF:
-                    ESP_LOGI(TAG, "hw fifo overflow");
-                    // If fifo overflow happened, you should consider adding flow control for your application.
-                    // The ISR has already reset the rx FIFO,
-                    // As an example, we directly flush the rx buffer here in order to read more data.
-                    uart_flush_input(uart_num);
-                    xQueueReset(m_uartEventQueue);
-                    break;
                     //Event of UART ring buffer full
                 case UART_BUFFER_FULL:
-                    ESP_LOGI(TAG, "ring buffer full");
-                    // If buffer full happened, you should consider encreasing your buffer size
-                    // As an example, we directly flush the rx buffer here in order to read more data.
+                    // Where in the ring buffer the bytes were lost is not known, the ones received by now may
+                    // already follow the gap. So the ring buffer goes, and so does the rest of the packet the next
+                    // bytes belong to, no packet is made of the bytes from both sides of the gap
+                    ESP_LOGW(TAG, "%s", event.type == UART_FIFO_OVF ? "hw fifo overflow" : "ring buffer full");
+                    m_rxOverflows++;
+                    slipPacket.Resync();
                     uart_flush_input(uart_num);
                     xQueueReset(m_uartEventQueue);
                     break;
@@ -117,47 +129,201 @@ void USBAccHandler::Task() {
     }
 }
 
-void USBAccHandler::onTwaiFrameReceived(unsigned long id, unsigned char len, const unsigned char *buf) {
-    ESP_LOGV(TAG, "onTwaiFrameReceived: %ld, %d", id, len);
+void USBAccHandler::readAvailable(uint8_t *buf, int len) {
+    // Everything in the ring buffer at once, a single event may stand for many bytes
+    size_t available = 0;
+    uart_get_buffered_data_len(uart_num, &available);
+    int nread = uart_read_bytes(uart_num, buf, MIN((int)available, len), 0);
+    if ( nread > 0 ){
+        slipPacket.onSlipBytesReceived(buf, nread);
+    }
+}
+
+// Blocking UART writes only delay this task, the other bridges read the ring on their own
+void USBAccHandler::TransmitFrameTask() {
+    while (true) {
+        TwaiFrame frames[MAX_FRAMES_PER_READ];
+        int n = m_frameCursor.Read(frames, MAX_FRAMES_PER_READ, 1000 / portTICK_PERIOD_MS);
+        if ( m_compressedStartRequested.exchange(false) ){
+            m_encoder.Reset();
+            m_txFailed = false;
+            m_compressed = true;
+        }
+        if ( m_compressed ){
+            sendCompressed(frames, n);
+        }else{
+            for(int i = 0; i < n; i++){
+                N2kStreamMessage msg;
+                if ( !m_messageMode ){
+                    sendFrame(frames[i]);
+                }else if ( m_assembler.Add(frames[i], msg) ){
+                    sendMessage(msg);
+                }
+            }
+        }
+        flush();
+    }
+}
+
+void USBAccHandler::sendFrame(const TwaiFrame &frame) {
+    ESP_LOGV(TAG, "sendFrame: %08X, %d", (unsigned)frame.id, frame.len);
 
     unsigned char net_data[TWAI_FRAME_MAX_DLC + 5];
-    int net_id = htonl(id);
+    int net_id = htonl(frame.id);
     memcpy(net_data, &net_id, 4);
-    memcpy(net_data + 4, &len, 1);
-    for(int i = 0; i < len; i++){
-        net_data[5 + i] = buf[i];
-    }
-    int total_len = 5 + len;
+    memcpy(net_data + 4, &frame.len, 1);
+    memcpy(net_data + 5, frame.data, frame.len);
+    int total_len = 5 + frame.len;
 
     slipPacket.EncodeAndSendPacket(net_data, total_len);
 
 }
 
-void USBAccHandler::onTwaiFrameTransmit(unsigned long id, unsigned char len, const unsigned char *buf) {
-    onTwaiFrameReceived(id, len, buf);
+void USBAccHandler::sendMessage(const N2kStreamMessage &msg) {
+    unsigned char net_data[1 + N2K_MAX_ENCODED_MESSAGE];
+    net_data[0] = N2K_MESSAGE_MARKER;
+    int total_len = 1 + N2kEncodeMessage(msg, net_data + 1);
+
+    slipPacket.EncodeAndSendPacket(net_data, total_len);
+}
+
+void USBAccHandler::sendCompressed(const TwaiFrame *frames, int n) {
+    restartCompressedIfFailed();
+
+    // Records of all the frames read at once go into as few SLIP packets as possible
+    unsigned char packet[SLIP_BUF_LEN - 1];
+    int len = 0;
+    for(int i = 0; i < n; i++){
+        if ( len > 0 && len + FRAME_STREAM_MAX_RECORD > (int)sizeof(packet) ){
+            slipPacket.EncodeAndSendPacket(packet, len);
+            restartCompressedIfFailed();
+            len = 0;
+        }
+        if ( len == 0 ){
+            packet[len++] = FRAME_STREAM_MARKER;
+        }
+        len += m_encoder.Encode(frames[i].id, frames[i].len, frames[i].data, frames[i].timestampUs, packet + len);
+    }
+    if ( len > 0 ){
+        slipPacket.EncodeAndSendPacket(packet, len);
+        restartCompressedIfFailed();
+    }
+}
+
+void USBAccHandler::restartCompressedIfFailed() {
+    if ( !m_txFailed ){
+        return;
+    }
+    // The records still buffered refer to the dictionary entries the client never got, so they go too.
+    // The client resets its decoder on the lone marker, SLIP_END before it ends the packet cut short by the failed write
+    ESP_LOGW(TAG, "USB< Compressed stream restarted");
+    m_txLen = 0;
+    m_encoder.Reset();
+    m_txFailed = false;
+    slipPacket.SendEnd();
+    slipPacket.EncodeAndSendPacket(&FRAME_STREAM_MARKER, 1);
+}
+
+unsigned char *USBAccHandler::reserveEncodedBytes(int maxLen) {
+    if ( m_txLen + maxLen > TX_BUF_LEN ){
+        flush();
+    }
+    return m_txBuf + m_txLen;
+}
+
+void USBAccHandler::commitEncodedBytes(int len) {
+    m_txLen += len;
+}
+
+void USBAccHandler::sendEncodedBytes(unsigned char *buf, int len) {
+    memcpy(reserveEncodedBytes(len), buf, len);
+    commitEncodedBytes(len);
 }
 
 void USBAccHandler::flush() {
-    // Do nothing
+    if ( m_txLen == 0 ){
+        return;
+    }
+
+    // Blocks while the UART TX ring is full or CTS holds the transmitter
+    int nsent = uart_write_bytes(uart_num, m_txBuf, m_txLen);
+    BINLOG_D("USB< sent %d bytes", nsent);
+    if( nsent != m_txLen ){
+        ESP_LOGE(TAG, "USB< Error sending %d bytes", m_txLen);
+        m_txFailed = true;
+    }else{
+        m_bytesSent += nsent;
+    }
+    m_txLen = 0;
 }
 
-void USBAccHandler::sendEncodedBytes(unsigned char *buf, unsigned char len) {
-    int nsent = uart_write_bytes(uart_num, buf, len);
-    ESP_LOGD(TAG, "USB< sent %d bytes", nsent);
-    if( nsent != len ){
-        ESP_LOGE(TAG, "USB< Error sending %d bytes", len);
+uint32_t USBAccHandler::TakeThroughput() {
+    int64_t now = esp_timer_get_time();
+    uint32_t bytes = m_bytesSent.exchange(0);
+    int64_t elapsedUs = now - m_throughputStartUs;
+    m_throughputStartUs = now;
+    return elapsedUs > 0 ? (uint32_t)((int64_t)bytes * 1000000 / elapsedUs) : 0;
+}
+
+void USBAccHandler::onCompressedPacket(const unsigned char *buf, int len) {
+    if ( len == 0 ){
+        // Client starts the new session, both directions begin with empty dictionaries
+        ESP_LOGI(TAG, "USB> Compressed stream requested");
+        m_decoder.Reset();
+        m_compressedStartRequested = true;
+        return;
     }
+
+    int pos = 0;
+    while ( pos < len ){
+        uint32_t id, timestampUs;
+        uint8_t dlc, data[8];
+        int n = m_decoder.Decode(buf + pos, len - pos, id, dlc, data, timestampUs);
+        if ( n == 0 ){
+            ESP_LOGE(TAG, "USB> Invalid compressed record at %d of %d bytes", pos, len);
+            return;
+        }
+        pos += n;
+        if ( !sideFrames.Post(id, dlc, data, SIDE_FRAME_POST_TIMEOUT) ){
+            ESP_LOGW(TAG, "USB> Side frame queue full, dropped id=%08X", (unsigned)id);
+        }
+    }
+}
+
+void USBAccHandler::onPacketOversize(int len) {
+    ESP_LOGE(TAG, "USB> Oversize packet %d bytes", len);
 }
 
-void USBAccHandler::onPacketReceived(const unsigned char *recvbuf, unsigned char len) {
+void USBAccHandler::onPacketReceived(const unsigned char *recvbuf, int len) {
+    if ( len > 0 && recvbuf[0] == FRAME_STREAM_MARKER ){
+        onCompressedPacket(recvbuf + 1, len - 1);
+        return;
+    }
+    if ( len > 0 && recvbuf[0] == N2K_MESSAGE_MARKER ){
+        N2kStreamMessage msg;
+        if ( !N2kDecodeMessage(recvbuf + 1, len - 1, msg) ){
+            ESP_LOGE(TAG, "USB> Invalid message %d bytes", len);
+        }else if ( !sideFrames.PostMessage(msg, m_splitter, SIDE_FRAME_POST_TIMEOUT) ){
+            ESP_LOGW(TAG, "USB> Dropped PGN %lu len %d, %u rejected as too long for one frame", msg.pgn, msg.len, m_splitter.Rejected());
+        }
+        return;
+    }
+    if ( len < 5 ){
+        ESP_LOGE(TAG, "USB> Short packet %d bytes", len);
+        return;
+    }
+
     int net_id = 0;
     memcpy(&net_id, recvbuf, 4);
     int twai_id = ntohl(net_id);
     unsigned char twai_len = recvbuf[4];
 
     if( twai_len <= TWAI_FRAME_MAX_DLC ){
-        ESP_LOGD(TAG, "USB> received %d bytes: id=%08X len=%02X", len, twai_id, twai_len);
-        twaiBusSender.onSideIfcTwaiFrame(twai_id, twai_len, &recvbuf[5]);
+        BINLOG_D("USB> received %d bytes: id=%08X len=%02X", len, twai_id, twai_len);
+        // Waiting here stops reading the UART, so the host is slowed down instead of losing frames
+        if ( !sideFrames.Post(twai_id, twai_len, &recvbuf[5], SIDE_FRAME_POST_TIMEOUT) ){
+            ESP_LOGW(TAG, "USB> Side frame queue full, dropped id=%08X", twai_id);
+        }
     }else{
         ESP_LOGE(TAG, "USB> Invalid DLC %02X", twai_len);
     }
@@ -1,37 +1,83 @@
 #ifndef IMU2NMEA_GPSHANDLER_H
 #define IMU2NMEA_GPSHANDLER_H
 
+#include <atomic>
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include <hal/uart_types.h>
 #include <driver/uart.h>
 #include <NMEA2000_esp32_twai.h>
 #include "SlipPacket.h"
+#include "TwaiFrameRing.h"
+#include "SideFrameQueue.h"
+#include "N2kMessageStream.h"
+#include "FrameStreamCodec.h"
+#include "DeviceDiagnostics.h"
 
+static const int USB_ACC_DEFAULT_BAUD_RATE = 921600;
 
-class USBAccHandler :  public TwaiBusListener, SlipListener, ByteOutputStream {
+class USBAccHandler :  public SlipListener, ByteOutputStream, public DiagnosticsLink {
 public:
-    USBAccHandler(SideTwaiBusInterface &twaiBusSender, int tx_io_num, int rx_io_num, uart_port_t uart_num);
+    // RTS/CTS flow control is enabled when both pins are given
+    USBAccHandler(SideFrameQueue &sideFrames, int tx_io_num, int rx_io_num, uart_port_t uart_num,
+                  int baudRate = USB_ACC_DEFAULT_BAUD_RATE,
+                  int rts_io_num = UART_PIN_NO_CHANGE, int cts_io_num = UART_PIN_NO_CHANGE);
     void Start();
     [[noreturn]] void Task();
-public: // TwaiBusListener methods
-    // TWAI frame received from the bus
-    void onTwaiFrameReceived(unsigned long id, unsigned char len, const unsigned char *buf) override;
-    // TWAI frame transmitted to the bus
-    void onTwaiFrameTransmit(unsigned long id, unsigned char len, const unsigned char *buf) override;
-    // Flush any buffered data
-    void flush() override;
+    [[noreturn]] void TransmitFrameTask();
+    // Frames seen on the bus are read with this cursor
+    TwaiFrameCursor &FrameCursor() { return m_frameCursor; }
+    // Send and receive whole N2K messages instead of CAN frames, must be set before Start()
+    void SetMessageMode(bool enable) { m_messageMode = enable; }
+
+    // DiagnosticsLink, drops are the UART receive overflows
+    const char *Name() const override { return "usb"; }
+    bool Connected() const override { return true; }
+    uint32_t TakeThroughput() override;
+    uint32_t Drops() const override { return m_rxOverflows; }
+    void ResetDrops() override { m_rxOverflows = 0; }
 private:
-    SideTwaiBusInterface &twaiBusSender;
+    SideFrameQueue &sideFrames;
     const int tx_io_num;
     const int rx_io_num;
     const uart_port_t uart_num;
+    const int baudRate;
+    const int rts_io_num;
+    const int cts_io_num;
     SlipPacket slipPacket;
     QueueHandle_t m_uartEventQueue = nullptr;
-    const int uart_buffer_size = 4 * 1024;
+    static const int uart_buffer_size = 4 * 1024;
+    static const int TX_BUF_LEN = 2 * 1024;  // SLIP packets coalesced into one uart_write_bytes()
+    static const int MAX_FRAMES_PER_READ = 16;
+    static const TickType_t SIDE_FRAME_POST_TIMEOUT = 100 / portTICK_PERIOD_MS;
+    TwaiFrameCursor m_frameCursor{"usb"};
+    bool m_messageMode = false;
+    N2kMessageAssembler m_assembler;
+    N2kMessageSplitter m_splitter;
+    // Compressed stream session negotiated by the client, see FrameStreamCodec.h
+    std::atomic<bool> m_compressed{false};
+    std::atomic<bool> m_compressedStartRequested{false};
+    FrameStreamEncoder m_encoder;
+    FrameStreamDecoder m_decoder;
+    uint8_t m_txBuf[TX_BUF_LEN]{};
+    int m_txLen = 0;
+    bool m_txFailed = false;  // Bytes were lost since the compressed stream was last restarted
+    std::atomic<uint32_t> m_bytesSent{0};
+    int64_t m_throughputStartUs = 0;
+    std::atomic<uint32_t> m_rxOverflows{0};
 private: // Methods
-    void sendEncodedBytes(unsigned char *buf, unsigned char len) override;
-    void onPacketReceived(const unsigned char *buf, unsigned char len) override;
+    void readAvailable(uint8_t *buf, int len);
+    void flush();
+    void sendFrame(const TwaiFrame &frame);
+    void sendMessage(const N2kStreamMessage &msg);
+    void sendCompressed(const TwaiFrame *frames, int n);
+    void restartCompressedIfFailed();
+    void onCompressedPacket(const unsigned char *buf, int len);
+    unsigned char *reserveEncodedBytes(int maxLen) override;
+    void commitEncodedBytes(int len) override;
+    void sendEncodedBytes(unsigned char *buf, int len) override;
+    void onPacketReceived(const unsigned char *buf, int len) override;
+    void onPacketOversize(int len) override;
 };
 
 
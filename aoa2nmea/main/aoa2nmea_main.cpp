@@ -2,12 +2,16 @@
 #include "freertos/queue.h"
 #include "esp_log.h"
 #include "N2KHandler.h"
+#include "DeviceDiagnostics.h"
+#include "Trace.h"
+#include "BinLog.h"
 #include "LEDBlinker.h"
 #include "USBAccHandler.h"
 #include "Event.hpp"
 
 #define ENABLE_WIFI
 //#define ENABLE_BT
+//#define BRIDGE_MESSAGE_MODE  // Bridges send whole N2K messages instead of CAN frames
 
 xQueueHandle evt_queue;   // A queue to handle  send events from sensors to N2K
 
@@ -15,17 +19,22 @@ LEDBlinker ledBlinker(GPIO_NUM_2);
 
 N2KHandler n2KHandler(evt_queue, ledBlinker);
 
-USBAccHandler usbAccHandler(n2KHandler, 26, 27, UART_NUM_2);
+// Set RTS and CTS to the GPIOs wired to the USB bridge to enable the flow control
+#define USB_ACC_BAUD_RATE 921600
+#define USB_ACC_RTS_PIN UART_PIN_NO_CHANGE
+#define USB_ACC_CTS_PIN UART_PIN_NO_CHANGE
+USBAccHandler usbAccHandler(n2KHandler.SideFrames(), 26, 27, UART_NUM_2,
+                            USB_ACC_BAUD_RATE, USB_ACC_RTS_PIN, USB_ACC_CTS_PIN);
 
 #ifdef ENABLE_WIFI
 #include <nvs_flash.h>
 #include "N2kWifi.h"
-N2kWifi n2kWifi(n2KHandler);
+N2kWifi n2kWifi(n2KHandler.SideFrames());
 #endif
 
 #ifdef ENABLE_BT
 #include "N2kBt.h"
-N2kBt n2kBt(n2KHandler);
+N2kBt n2kBt(n2KHandler.SideFrames());
 #endif
 
 static const char *TAG = "aoa2nmea_main";
@@ -36,6 +45,9 @@ extern "C" [[noreturn]] void app_main(void)
 
     // Initialize event queue
     evt_queue = xQueueCreate(10, sizeof(Event));
+    DeviceDiagnostics::RegisterQueue("evt", evt_queue);
+
+    BinLog::Start();
 
 #ifdef ENABLE_WIFI
     //Initialize NVS
@@ -45,22 +57,32 @@ extern "C" [[noreturn]] void app_main(void)
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+#ifdef BRIDGE_MESSAGE_MODE
+    n2kWifi.SetMessageMode(true);
+#endif
     n2kWifi.Start();
-    n2KHandler.addBusListener(&n2kWifi);
+    n2KHandler.addFrameConsumer(n2kWifi.FrameCursor());
 #endif
 
 #ifdef ENABLE_BT
+#ifdef BRIDGE_MESSAGE_MODE
+    n2kBt.SetMessageMode(true);
+#endif
     n2kBt.Start();
-    n2KHandler.addBusListener((TwaiBusListener *)&n2kBt);
+    n2KHandler.addFrameConsumer(n2kBt.FrameCursor());
 #endif
 
-    n2KHandler.addBusListener(&usbAccHandler);
+#ifdef BRIDGE_MESSAGE_MODE
+    usbAccHandler.SetMessageMode(true);
+#endif
+    n2KHandler.addFrameConsumer(usbAccHandler.FrameCursor());
 
     ledBlinker.Start();
     usbAccHandler.Start();
     n2KHandler.Start();
 
     while (true) {
+        Trace::PollConsoleCommand();
         vTaskDelay(1000 / portTICK_PERIOD_MS);
     }
 
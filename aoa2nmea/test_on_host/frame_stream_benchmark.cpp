@@ -0,0 +1,294 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <chrono>
+#include <cstring>
+
+#include "../../idf-components/NMEA2000_utils/FrameStreamCodec.h"
+
+// Compares the bytes sent over the SLIP link by the raw frame stream and the compressed one,
+// and checks that the client decodes only correct frames when the device loses packets and restarts the stream.
+// Usage: frame_stream_benchmark [candump -l log] ...
+// The log is recorded on the boat, e.g. with udp2socketcan and candump -l vcan0. Without it the traffic of the
+// typical instruments is made up: heading, rate of turn and attitude at 10 Hz, wind, speed, rapid position,
+// COG/SOG, and GNSS position fast packets.
+
+static const int FRAMES_PER_PACKET = 16;        // Bridges send up to that many frames read from the ring at once
+static const int FULL_BUS_FRAMES_PER_SEC = 1850; // 250 kbit/s bus fully loaded with 8 byte frames
+static const int USB_BYTES_PER_SEC = 115200 / 10;
+static const int LOST_PACKET_EVERY = 7;         // Packet lost for the slow link in the restart check
+
+struct Frame {
+    uint32_t timestampUs;
+    uint32_t id;
+    uint8_t len;
+    uint8_t data[8];
+};
+
+// (1436509052.249713) can0 09F80103#FFFFFF7FFFFFFF7F
+static bool parseCandumpLine(const std::string &line, Frame &frame) {
+    size_t open = line.find('(');
+    size_t close = line.find(')');
+    size_t hash = line.find('#');
+    if ( open == std::string::npos || close == std::string::npos || hash == std::string::npos || hash < 8 ){
+        return false;
+    }
+    double ts = std::stod(line.substr(open + 1, close - open - 1));
+    frame.timestampUs = (uint32_t)(uint64_t)(ts * 1e6);
+    frame.id = std::stoul(line.substr(hash - 8, 8), nullptr, 16);
+    std::string hex = line.substr(hash + 1);
+    while ( !hex.empty() && isspace(hex.back()) ){
+        hex.pop_back();
+    }
+    frame.len = 0;
+    for(size_t i = 0; i + 1 < hex.size() && frame.len < 8; i += 2){
+        frame.data[frame.len++] = std::stoul(hex.substr(i, 2), nullptr, 16);
+    }
+    return true;
+}
+
+static int slipSize(const uint8_t *buf, int len) {
+    int n = 1;  // SLIP_END
+    for(int i = 0; i < len; i++){
+        n += buf[i] == 0xC0 || buf[i] == 0xDB ? 2 : 1;
+    }
+    return n;
+}
+
+static bool readLog(const char *logFileName, std::vector<Frame> &frames) {
+    std::ifstream logFileStream(logFileName, std::ios::in);
+    std::string line;
+    while (std::getline(logFileStream, line)) {
+        Frame frame{};
+        if ( parseCandumpLine(line, frame) ){
+            frames.push_back(frame);
+        }
+    }
+    return !frames.empty();
+}
+
+static uint32_t canId(int priority, unsigned long pgn, uint8_t source) {
+    return (uint32_t)priority << 26 | (uint32_t)pgn << 8 | source;
+}
+
+static void putU16(uint8_t *data, int value) {
+    data[0] = value;
+    data[1] = value >> 8;
+}
+
+// One minute of the instruments the bridges usually see, values wander like they do on the water
+static std::vector<Frame> makeTraffic() {
+    std::mt19937 rng(1);
+    std::normal_distribution<double> noise(0, 1);
+    std::vector<Frame> frames;
+    uint32_t t0 = 1000000;
+    uint8_t seq = 0;
+    for(int ms = 0; ms < 60000; ms += 25){
+        uint32_t ts = t0 + ms * 1000 + (uint32_t)(rng() % 500);
+        double s = ms * 0.001;
+        double heading = 1.2 + 0.3 * std::sin(s / 20) + 0.002 * noise(rng);
+        auto add = [&](int priority, unsigned long pgn, uint8_t source, std::initializer_list<int> words) {
+            Frame f{};
+            f.timestampUs = ts;
+            f.id = canId(priority, pgn, source);
+            f.len = 8;
+            memset(f.data, 0xFF, 8);
+            f.data[0] = seq;
+            int pos = 1;
+            for(int w : words){
+                putU16(f.data + pos, w);
+                pos += 2;
+            }
+            frames.push_back(f);
+        };
+        if ( ms % 100 == 0 ){
+            add(2, 127250, 1, {(int)(heading * 10000), 0x7FFF, 0x7FFF});               // Heading
+            add(2, 127251, 1, {(int)(0.015 * std::cos(s / 20) * 32000 + noise(rng) * 20), 0, 0});  // ROT
+            add(3, 127257, 1, {(int)(heading * 10000), (int)(noise(rng) * 30), (int)(0.1 * 10000 + noise(rng) * 30)});
+            add(2, 130306, 2, {(int)(700 + noise(rng) * 20), (int)(4500 + noise(rng) * 300), 0xFFFA});   // Wind
+            add(2, 129025, 3, {(int)(s * 10) & 0xFFFF, 0x1234, (int)(s * 20) & 0xFFFF});     // Rapid position
+            seq++;
+        }
+        if ( ms % 250 == 0 ){
+            add(2, 129026, 3, {(int)(heading * 10000 + noise(rng) * 100), (int)(300 + noise(rng) * 5), 0xFFFF});
+        }
+        if ( ms % 1000 == 0 ){
+            add(2, 128259, 4, {(int)(280 + noise(rng) * 5), 0xFFFF, 0xFFFF});              // Speed
+            add(3, 126992, 3, {19000, (int)(s * 10000) & 0xFFFF, 0});                      // System time
+            // GNSS position data, 43 bytes in 7 frames of the same CAN ID
+            for(int i = 0; i < 7; i++){
+                Frame f{};
+                f.timestampUs = ts + i * 600;
+                f.id = canId(3, 129029, 3);
+                f.len = 8;
+                f.data[0] = (uint8_t)((seq & 0x7) << 5 | i);
+                for(int j = 1; j < 8; j++){
+                    f.data[j] = (uint8_t)(i * 7 + j + (j > 5 ? ms / 1000 : 0));
+                }
+                frames.push_back(f);
+            }
+        }
+    }
+    return frames;
+}
+
+static bool sameFrame(const Frame &f, uint32_t id, uint8_t dlc, const uint8_t *data, uint32_t ts, uint32_t firstTick) {
+    return id == f.id && dlc == f.len && memcmp(data, f.data, dlc) == 0
+           && ts == (f.timestampUs / FRAME_STREAM_TICK_US - firstTick) * FRAME_STREAM_TICK_US;
+}
+
+// Every LOST_PACKET_EVERY-th packet is lost after the frames in it were encoded, like the one dropped from the full
+// BT queue or cut by the failed UART write. With restart the device sends the lone marker and resets its encoder
+// the way BtClient and USBAccHandler do. Returns number of frames decoded wrong, the lost ones don't count.
+static size_t checkLostPackets(const std::vector<Frame> &frames, bool restart, size_t &decoded) {
+    FrameStreamEncoder encoder;
+    FrameStreamDecoder decoder;
+    size_t wrong = 0;
+    decoded = 0;
+    uint32_t firstTick = frames[0].timestampUs / FRAME_STREAM_TICK_US;
+    bool sessionStarted = false;
+    int packetNo = 0;
+    for(size_t i = 0; i < frames.size(); i += FRAMES_PER_PACKET){
+        std::vector<uint8_t> packet(1 + FRAMES_PER_PACKET * FRAME_STREAM_MAX_RECORD);
+        size_t len = 1;
+        size_t end = std::min(i + FRAMES_PER_PACKET, frames.size());
+        for(size_t j = i; j < end; j++){
+            const Frame &f = frames[j];
+            len += encoder.Encode(f.id, f.len, f.data, f.timestampUs, packet.data() + len);
+        }
+        if ( ++packetNo % LOST_PACKET_EVERY == 0 ){
+            if ( restart ){
+                encoder.Reset();
+                decoder.Reset();  // Lone marker received
+                sessionStarted = false;
+            }
+            continue;
+        }
+
+        size_t pos = 1;
+        for(size_t j = i; j < end && pos < len; j++){
+            uint32_t id, ts;
+            uint8_t dlc, data[8];
+            int n = decoder.Decode(packet.data() + pos, (int)(len - pos), id, dlc, data, ts);
+            if ( n == 0 ){
+                wrong += end - j;
+                break;
+            }
+            pos += n;
+            if ( !sessionStarted ){
+                // Decoded timestamps count from the first record of the session
+                firstTick = frames[j].timestampUs / FRAME_STREAM_TICK_US;
+                sessionStarted = true;
+            }
+            decoded++;
+            if ( !sameFrame(frames[j], id, dlc, data, ts, firstTick) ){
+                wrong++;
+            }
+        }
+    }
+    return wrong;
+}
+
+static bool benchmark(const char *name, const std::vector<Frame> &frames) {
+    // Raw stream: one SLIP packet of id + len + payload per frame
+    size_t rawBytes = 0;
+    for(const Frame &f : frames){
+        uint8_t buf[13];
+        buf[0] = f.id >> 24; buf[1] = f.id >> 16; buf[2] = f.id >> 8; buf[3] = f.id;
+        buf[4] = f.len;
+        memcpy(buf + 5, f.data, f.len);
+        rawBytes += slipSize(buf, 5 + f.len);
+    }
+
+    // Compressed stream: marker followed by the records of FRAMES_PER_PACKET frames per SLIP packet
+    FrameStreamEncoder encoder;
+    std::vector<std::vector<uint8_t>> packets;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < frames.size(); i += FRAMES_PER_PACKET){
+        std::vector<uint8_t> packet(1 + FRAMES_PER_PACKET * FRAME_STREAM_MAX_RECORD);
+        packet[0] = FRAME_STREAM_MARKER;
+        size_t len = 1;
+        for(size_t j = i; j < i + FRAMES_PER_PACKET && j < frames.size(); j++){
+            const Frame &f = frames[j];
+            len += encoder.Encode(f.id, f.len, f.data, f.timestampUs, packet.data() + len);
+        }
+        packet.resize(len);
+        packets.push_back(packet);
+    }
+    auto encoded = std::chrono::steady_clock::now();
+
+    FrameStreamDecoder decoder;
+    size_t compressedBytes = 0;
+    size_t decoded = 0;
+    size_t mismatches = 0;
+    uint32_t firstTick = frames[0].timestampUs / FRAME_STREAM_TICK_US;
+    for(const std::vector<uint8_t> &packet : packets){
+        compressedBytes += slipSize(packet.data(), (int)packet.size());
+        size_t pos = 1;
+        while ( pos < packet.size() ){
+            uint32_t id, ts;
+            uint8_t dlc, data[8];
+            int n = decoder.Decode(packet.data() + pos, (int)(packet.size() - pos), id, dlc, data, ts);
+            if ( n == 0 ){
+                mismatches++;
+                break;
+            }
+            pos += n;
+            if ( !sameFrame(frames[decoded++], id, dlc, data, ts, firstTick) ){
+                mismatches++;
+            }
+        }
+    }
+    auto done = std::chrono::steady_clock::now();
+
+    double rawPerFrame = (double)rawBytes / frames.size();
+    double compressedPerFrame = (double)compressedBytes / frames.size();
+    std::cout << name << ": " << frames.size() << " frames" << std::endl;
+    std::cout << "  raw        " << rawBytes << " bytes, " << rawPerFrame << " bytes/frame, full bus needs "
+              << rawPerFrame * FULL_BUS_FRAMES_PER_SEC << " bytes/s" << std::endl;
+    std::cout << "  compressed " << compressedBytes << " bytes, " << compressedPerFrame << " bytes/frame, full bus needs "
+              << compressedPerFrame * FULL_BUS_FRAMES_PER_SEC << " bytes/s" << std::endl;
+    std::cout << "  ratio " << (double)rawBytes / compressedBytes << ", 115200 baud link carries "
+              << USB_BYTES_PER_SEC / compressedPerFrame << " frames/s compressed vs "
+              << USB_BYTES_PER_SEC / rawPerFrame << " raw" << std::endl;
+    std::cout << "  encode " << std::chrono::duration<double, std::nano>(encoded - start).count() / frames.size()
+              << " ns/frame, decode " << std::chrono::duration<double, std::nano>(done - encoded).count() / frames.size()
+              << " ns/frame" << std::endl;
+    bool ok = true;
+    if ( decoded != frames.size() || mismatches != 0 ){
+        std::cout << "  ROUND TRIP FAILED: decoded " << decoded << " mismatches " << mismatches << std::endl;
+        ok = false;
+    }
+
+    size_t restartDecoded, staleDecoded;
+    size_t restartWrong = checkLostPackets(frames, true, restartDecoded);
+    size_t staleWrong = checkLostPackets(frames, false, staleDecoded);
+    std::cout << "  every " << LOST_PACKET_EVERY << "th packet lost: " << restartWrong << " of " << restartDecoded
+              << " frames decoded wrong with restart, " << staleWrong << " of " << staleDecoded << " without" << std::endl;
+    if ( restartWrong != 0 ){
+        std::cout << "  RESTART FAILED" << std::endl;
+        ok = false;
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    bool ok = true;
+    if ( argc < 2 ){
+        ok = benchmark("made up traffic", makeTraffic());
+    }
+    for(int i = 1; i < argc; i++){
+        std::vector<Frame> frames;
+        if ( !readLog(argv[i], frames) ){
+            std::cout << argv[i] << ": no frames" << std::endl;
+            ok = false;
+            continue;
+        }
+        ok &= benchmark(argv[i], frames);
+    }
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+#include <iostream>
+#include <vector>
+#include <cstring>
+
+#include "../../idf-components/NMEA2000_utils/N2kMessageStream.h"
+#include "../../idf-components/NMEA2000_utils/N2kCanId.h"
+
+// Checks fast packet reassembly and splitting used by the bridges in message mode:
+// round trip of the longest message, frames out of order, missing frame, interleaved sources,
+// all assembler slots busy and the message that doesn't fit into single frame PGN.
+// Usage: n2k_message_stream_test
+
+static const unsigned long FAST_PGN = 129029;    // GNSS position data
+static const unsigned long SINGLE_PGN = 127250;  // Vessel heading
+
+static N2kStreamMessage makeMessage(unsigned long pgn, uint8_t source, int len, uint32_t timestampUs) {
+    N2kStreamMessage msg{};
+    msg.timestampUs = timestampUs;
+    msg.pgn = pgn;
+    msg.priority = 3;
+    msg.source = source;
+    msg.destination = 0xFF;
+    msg.len = len;
+    for(int i = 0; i < len; i++){
+        msg.data[i] = (uint8_t)(i * 7 + source);
+    }
+    return msg;
+}
+
+static std::vector<TwaiFrame> split(N2kMessageSplitter &splitter, const N2kStreamMessage &msg, uint32_t timestampUs) {
+    TwaiFrame frames[N2kMessageSplitter::MAX_FRAMES];
+    int n = splitter.Split(msg, frames);
+    std::vector<TwaiFrame> v(frames, frames + n);
+    for(TwaiFrame &f : v){
+        f.timestampUs = timestampUs;
+    }
+    return v;
+}
+
+static bool sameMessage(const N2kStreamMessage &a, const N2kStreamMessage &b) {
+    return a.pgn == b.pgn && a.priority == b.priority && a.source == b.source && a.len == b.len
+           && memcmp(a.data, b.data, a.len) == 0;
+}
+
+// Returns number of completed messages, the last one is stored in msg
+static int feed(N2kMessageAssembler &assembler, const std::vector<TwaiFrame> &frames, N2kStreamMessage &msg) {
+    int completed = 0;
+    for(const TwaiFrame &f : frames){
+        if ( assembler.Add(f, msg) ){
+            completed++;
+        }
+    }
+    return completed;
+}
+
+static bool check(const char *name, bool ok) {
+    std::cout << name << ": " << (ok ? "ok" : "failed") << std::endl;
+    return ok;
+}
+
+int main() {
+    bool ok = true;
+    N2kMessageSplitter splitter;
+    uint32_t t = 1000;
+
+    // Longest fast packet message survives the round trip
+    {
+        N2kMessageAssembler assembler;
+        N2kStreamMessage in = makeMessage(FAST_PGN, 10, N2K_MAX_MESSAGE_DATA, t);
+        std::vector<TwaiFrame> frames = split(splitter, in, t);
+        N2kStreamMessage out{};
+        ok &= check("round trip", frames.size() == 32 && feed(assembler, frames, out) == 1 && sameMessage(in, out)
+                                   && assembler.Drops() == 0);
+    }
+
+    // Frames out of order: the message is given up, the next one is assembled
+    {
+        N2kMessageAssembler assembler;
+        N2kStreamMessage in = makeMessage(FAST_PGN, 10, 43, t);
+        std::vector<TwaiFrame> frames = split(splitter, in, t);
+        std::swap(frames[1], frames[2]);
+        N2kStreamMessage out{};
+        bool given = feed(assembler, frames, out) == 0 && assembler.Drops() == 1;
+        frames = split(splitter, in, t += 1000);
+        ok &= check("out of order", given && feed(assembler, frames, out) == 1 && sameMessage(in, out));
+    }
+
+    // Missing frame: nothing is completed from the rest of the frames
+    {
+        N2kMessageAssembler assembler;
+        N2kStreamMessage in = makeMessage(FAST_PGN, 10, 43, t);
+        std::vector<TwaiFrame> frames = split(splitter, in, t);
+        frames.erase(frames.begin() + 3);
+        N2kStreamMessage out{};
+        ok &= check("missing frame", feed(assembler, frames, out) == 0 && assembler.Drops() == 1);
+    }
+
+    // Same PGN from two sources interleaved frame by frame
+    {
+        N2kMessageAssembler assembler;
+        N2kStreamMessage a = makeMessage(FAST_PGN, 10, 43, t);
+        N2kStreamMessage b = makeMessage(FAST_PGN, 11, 43, t);
+        std::vector<TwaiFrame> fa = split(splitter, a, t);
+        std::vector<TwaiFrame> fb = split(splitter, b, t);
+        std::vector<N2kStreamMessage> done;
+        for(size_t i = 0; i < fa.size(); i++){
+            N2kStreamMessage out{};
+            if ( assembler.Add(fa[i], out) ) done.push_back(out);
+            if ( assembler.Add(fb[i], out) ) done.push_back(out);
+        }
+        ok &= check("interleaved sources", done.size() == 2 && sameMessage(a, done[0]) && sameMessage(b, done[1]));
+    }
+
+    // All slots busy: the oldest incomplete message is given up for the new one
+    {
+        N2kMessageAssembler assembler;
+        const int sources = 9;
+        std::vector<std::vector<TwaiFrame>> frames;
+        std::vector<N2kStreamMessage> msgs;
+        for(int s = 0; s < sources; s++){
+            msgs.push_back(makeMessage(FAST_PGN, 20 + s, 43, t));
+            frames.push_back(split(splitter, msgs.back(), t += 100));
+        }
+        N2kStreamMessage out{};
+        // First frame of each message, the ninth one takes the slot of the first
+        for(int s = 0; s < sources; s++){
+            feed(assembler, {frames[s][0]}, out);
+        }
+        int completed = 0;
+        bool firstLost = true;
+        for(int s = 0; s < sources; s++){
+            std::vector<TwaiFrame> rest(frames[s].begin() + 1, frames[s].end());
+            int n = feed(assembler, rest, out);
+            if ( s == 0 ){
+                firstLost = n == 0;
+            }else if ( n == 1 && sameMessage(msgs[s], out) ){
+                completed++;
+            }
+        }
+        ok &= check("slots full", firstLost && completed == sources - 1 && assembler.Drops() == 1);
+    }
+
+    // Single frame PGN: up to 8 bytes go as is, longer message is rejected instead of being cut
+    {
+        N2kMessageSplitter s;
+        TwaiFrame frames[N2kMessageSplitter::MAX_FRAMES];
+        N2kStreamMessage in = makeMessage(SINGLE_PGN, 10, 8, t);
+        int n = s.Split(in, frames);
+        bool single = n == 1 && frames[0].len == 8 && memcmp(frames[0].data, in.data, 8) == 0
+                      && N2kCanIdPgn(frames[0].id) == SINGLE_PGN && N2kCanIdSource(frames[0].id) == 10;
+        N2kStreamMessage tooLong = makeMessage(SINGLE_PGN, 10, 9, t);
+        ok &= check("single frame", single && s.Split(tooLong, frames) == 0 && s.Rejected() == 1);
+    }
+
+    // Message encoding of the stream
+    {
+        N2kStreamMessage in = makeMessage(FAST_PGN, 10, 100, 0x12345678);
+        unsigned char buf[N2K_MAX_ENCODED_MESSAGE];
+        int len = N2kEncodeMessage(in, buf);
+        N2kStreamMessage out{};
+        ok &= check("encoding", len == N2K_MESSAGE_HEADER_SIZE + 100 && N2kDecodeMessage(buf, len, out)
+                                && sameMessage(in, out) && out.timestampUs == in.timestampUs
+                                && !N2kDecodeMessage(buf, len - 1, out));
+    }
+
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
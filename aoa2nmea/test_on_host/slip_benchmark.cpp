@@ -0,0 +1,198 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstring>
+
+#include "../../idf-components/N2K_BT/SlipPacket.h"
+
+// Compares the span based SLIP decoder and the in place encoder with the byte at a time ones they replaced
+// Usage: slip_benchmark [packets]
+
+static const int FRAME_PACKET_LEN = 13;     // 4 bytes ID, DLC and 8 bytes of payload
+static const int MESSAGE_PACKET_LEN = 234;  // Marker and the longest N2K message in message mode
+
+// Byte at a time decoder as it was before
+class ByteSlipDecoder {
+public:
+    explicit ByteSlipDecoder(SlipListener &listener) : listener(listener) {}
+    void onSlipByteReceived(unsigned char byte) {
+        if (byte == 0xC0) {
+            if (index > 0) {
+                listener.onPacketReceived(buf, index);
+            }
+            index = 0;
+        } else if (byte == 0xDB) {
+            escapeNext = true;
+        } else {
+            if (escapeNext) {
+                escapeNext = false;
+                byte = byte == 0xDC ? 0xC0 : byte == 0xDD ? 0xDB : byte;
+            }
+            if (index < SLIP_BUF_LEN) {
+                buf[index++] = byte;
+            }
+        }
+    }
+private:
+    SlipListener &listener;
+    unsigned char buf[SLIP_BUF_LEN]{};
+    int index = 0;
+    bool escapeNext = false;
+};
+
+// Byte at a time encoder into the stack buffer followed by the copy to the transmit buffer as it was before
+static void __attribute__((noinline)) byteEncode(const unsigned char *in, int len, ByteOutputStream &outStream) {
+    unsigned char out[OUT_BUF_LEN];
+    int n = 0;
+    for(int i = 0; i < len; i++){
+        if ( in[i] == 0xC0 ){
+            out[n++] = 0xDB;
+            out[n++] = 0xDC;
+        }else if ( in[i] == 0xDB ){
+            out[n++] = 0xDB;
+            out[n++] = 0xDD;
+        }else{
+            out[n++] = in[i];
+        }
+    }
+    out[n++] = 0xC0;
+    outStream.sendEncodedBytes(out, n);
+}
+
+class Sink : public SlipListener, public ByteOutputStream {
+public:
+    std::vector<unsigned char> tx;
+    size_t txLen = 0;
+    std::vector<std::vector<unsigned char>> packets;
+    bool keep = true;
+    uint64_t received = 0;
+    int oversize = 0;
+
+    void onPacketReceived(const unsigned char *buf, int len) override {
+        received += len;
+        if ( keep ){
+            packets.emplace_back(buf, buf + len);
+        }
+    }
+    void onPacketOversize(int /*len*/) override { oversize++; }
+    unsigned char *reserveEncodedBytes(int maxLen) override {
+        if ( txLen + maxLen > tx.size() ){
+            tx.resize(txLen + maxLen);
+        }
+        return tx.data() + txLen;
+    }
+    void commitEncodedBytes(int len) override { txLen += len; }
+    void sendEncodedBytes(unsigned char *buf, int len) override {
+        memcpy(reserveEncodedBytes(len), buf, len);
+        commitEncodedBytes(len);
+    }
+};
+
+template<typename F>
+static double nsPerPacket(int packets, F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / packets;
+}
+
+static bool benchmark(int packets, int packetLen) {
+    std::mt19937 rng(1);
+    std::vector<std::vector<unsigned char>> input(packets, std::vector<unsigned char>(packetLen));
+    for(auto &p : input){
+        for(auto &b : p){
+            b = rng() & 0xFF;
+        }
+    }
+
+    // In place encoder
+    Sink sink;
+    SlipPacket slip(sink, sink);
+    sink.tx.resize((size_t)packets * (2 * packetLen + 1));
+    double encodeNs = nsPerPacket(packets, [&]{
+        for(auto &p : input){
+            slip.EncodeAndSendPacket(p.data(), (int)p.size());
+        }
+    });
+    std::vector<unsigned char> stream(sink.tx.begin(), sink.tx.begin() + (long)sink.txLen);
+
+    Sink byteSink;
+    byteSink.tx.resize(sink.tx.size());
+    double byteEncodeNs = nsPerPacket(packets, [&]{
+        for(auto &p : input){
+            byteEncode(p.data(), (int)p.size(), byteSink);
+        }
+    });
+    if ( byteSink.txLen != stream.size() || memcmp(byteSink.tx.data(), stream.data(), stream.size()) != 0 ){
+        std::cout << "Encoders differ" << std::endl;
+        return false;
+    }
+
+    // Round trip
+    slip.onSlipBytesReceived(stream.data(), (int)stream.size());
+    if ( sink.packets != input ){
+        std::cout << "Round trip failed" << std::endl;
+        return false;
+    }
+
+    // Decoders, fed with the chunks of the SPP MTU size
+    const int CHUNK = 990;
+    sink.keep = false;
+    double decodeNs = nsPerPacket(packets, [&]{
+        for(size_t i = 0; i < stream.size(); i += CHUNK){
+            slip.onSlipBytesReceived(stream.data() + i, (int)std::min<size_t>(CHUNK, stream.size() - i));
+        }
+    });
+    ByteSlipDecoder byteDecoder(sink);
+    double byteDecodeNs = nsPerPacket(packets, [&]{
+        for(unsigned char b : stream){
+            byteDecoder.onSlipByteReceived(b);
+        }
+    });
+
+    // Oversize packet is reported, not truncated
+    std::vector<unsigned char> big(SLIP_BUF_LEN + 10, 0x55);
+    big.push_back(0xC0);
+    slip.onSlipBytesReceived(big.data(), (int)big.size());
+
+    std::cout << packets << " packets of " << packetLen << " bytes, " << stream.size() << " encoded bytes" << std::endl;
+    std::cout << "  encode in place " << encodeNs << " ns/packet, byte at a time " << byteEncodeNs << std::endl;
+    std::cout << "  decode spans    " << decodeNs << " ns/packet, byte at a time " << byteDecodeNs << std::endl;
+    return sink.oversize == 1;
+}
+
+// Bytes lost in the middle of a packet: the packets on both sides of the gap come out whole,
+// the one cut by it is dropped instead of being glued to the rest of the next one
+static bool checkResync() {
+    std::vector<std::vector<unsigned char>> input;
+    Sink sink;
+    SlipPacket slip(sink, sink);
+    sink.tx.resize(10 * (2 * FRAME_PACKET_LEN + 1));
+    for(int i = 0; i < 10; i++){
+        input.emplace_back(FRAME_PACKET_LEN, (unsigned char)(0x10 + i));
+        slip.EncodeAndSendPacket(input.back().data(), FRAME_PACKET_LEN);
+    }
+    const size_t encodedLen = FRAME_PACKET_LEN + 1;
+    // Gap from the middle of the 3rd packet to the middle of the 5th one
+    size_t gapStart = 2 * encodedLen + 5;
+    size_t gapEnd = 4 * encodedLen + 7;
+    slip.onSlipBytesReceived(sink.tx.data(), (int)gapStart);
+    slip.Resync();
+    slip.onSlipBytesReceived(sink.tx.data() + gapEnd, (int)(sink.txLen - gapEnd));
+
+    std::vector<std::vector<unsigned char>> expected(input.begin(), input.begin() + 2);
+    expected.insert(expected.end(), input.begin() + 5, input.end());
+    bool ok = sink.packets == expected;
+    std::cout << "resync after the lost bytes: " << (ok ? "ok" : "failed") << std::endl;
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int packets = argc > 1 ? atoi(argv[1]) : 100000;
+    bool ok = benchmark(packets, FRAME_PACKET_LEN);
+    ok = benchmark(packets, MESSAGE_PACKET_LEN) && ok;
+    ok = checkResync() && ok;
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
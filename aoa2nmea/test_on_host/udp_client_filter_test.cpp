@@ -0,0 +1,84 @@
+#include <iostream>
+
+#include "../../idf-components/N2K_WIFI/UdpClientFilter.h"
+
+// Checks the UDP client filter: fast packets are passed or dropped whole across the congestion backoff,
+// decimation is kept per source and the renewed subscription doesn't cut the messages in flight.
+// Usage: udp_client_filter_test
+
+using Result = UdpClientFilter::Result;
+
+static const unsigned long FAST_PGN = 129029;    // GNSS position data
+static const unsigned long SINGLE_PGN = 127250;  // Vessel heading
+static const int FAST_FRAMES = 7;                // 43 bytes
+
+// Returns number of frames of the fast packet passed
+static int feedMessage(UdpClientFilter &filter, uint8_t source, const bool *congested, int64_t nowUs) {
+    int passed = 0;
+    for(int i = 0; i < FAST_FRAMES; i++){
+        if ( filter.Accepts(FAST_PGN, source, i == 0, congested[i], nowUs + i * 1000) == Result::PASSED ){
+            passed++;
+        }
+    }
+    return passed;
+}
+
+static bool check(const char *name, bool ok) {
+    std::cout << name << ": " << (ok ? "ok" : "failed") << std::endl;
+    return ok;
+}
+
+int main() {
+    bool ok = true;
+    int64_t t = 1000000;
+
+    // Backoff ends in the middle of the message: its tail isn't sent without the first frame
+    {
+        UdpClientFilter filter;
+        filter.Set(0, nullptr, 0);
+        bool endsMid[FAST_FRAMES] = {true, true, true, false, false, false, false};
+        bool startsMid[FAST_FRAMES] = {false, false, false, true, true, true, true};
+        int droppedWhole = feedMessage(filter, 10, endsMid, t);
+        int passedWhole = feedMessage(filter, 10, startsMid, t += 100000);
+        ok &= check("backoff", droppedWhole == 0 && passedWhole == FAST_FRAMES);
+    }
+
+    // Tail frames of the message the client never saw the start of
+    {
+        UdpClientFilter filter;
+        filter.Set(0, nullptr, 0);
+        ok &= check("no first frame", filter.Accepts(FAST_PGN, 10, false, false, t) == Result::FILTERED
+                                      && filter.Accepts(SINGLE_PGN, 10, true, false, t) == Result::PASSED);
+    }
+
+    // Same PGN from two sources at 10 Hz each decimated to 1 s: both get through once a second
+    {
+        UdpClientFilter filter;
+        unsigned long pgns[] = {SINGLE_PGN};
+        filter.Set(1000, pgns, 1);
+        int passedA = 0, passedB = 0;
+        for(int i = 0; i < 50; i++){
+            int64_t now = t + i * 100000;
+            passedA += filter.Accepts(SINGLE_PGN, 10, true, false, now) == Result::PASSED;
+            passedB += filter.Accepts(SINGLE_PGN, 11, true, false, now + 1000) == Result::PASSED;
+        }
+        ok &= check("decimation per source", passedA == 5 && passedB == 5
+                                             && filter.Accepts(FAST_PGN, 10, true, false, t) == Result::FILTERED);
+    }
+
+    // Renewed subscription keeps the message going, the changed one starts over
+    {
+        UdpClientFilter filter;
+        filter.Set(0, nullptr, 0);
+        bool first = filter.Accepts(FAST_PGN, 10, true, false, t) == Result::PASSED;
+        filter.Set(0, nullptr, 0);
+        bool renewed = filter.Accepts(FAST_PGN, 10, false, false, t + 1000) == Result::PASSED;
+        unsigned long pgns[] = {FAST_PGN};
+        filter.Set(0, pgns, 1);
+        bool changed = filter.Accepts(FAST_PGN, 10, false, false, t + 2000) == Result::FILTERED;
+        ok &= check("renewal", first && renewed && changed);
+    }
+
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
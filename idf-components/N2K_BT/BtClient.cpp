@@ -0,0 +1,206 @@
+#include <cstdio>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "BtClient.h"
+
+static const char *TAG = "N2kBt_BtClient";
+
+void BtClient::Init(BtClientListener *listener, int idx) {
+    m_listener = listener;
+    snprintf(m_name, sizeof(m_name), "bt%d", idx);
+    m_mutex = xSemaphoreCreateMutex();
+}
+
+void BtClient::Open(uint32_t handle) {
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_txQueue.Clear();
+    m_writePending = false;
+    m_congested = false;
+    m_compressed = false;  // New client has to negotiate compression again
+    m_throughputStartUs = esp_timer_get_time();
+    m_handle = handle;
+    xSemaphoreGive(m_mutex);
+}
+
+void BtClient::Close() {
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    ESP_LOGI(TAG, "%s handle:%u closed, sent %u bytes, dropped %u packets", m_name, m_handle.load(),
+             m_bytesSent.load(), m_drops.load());
+    m_handle = INVALID_HANDLE;
+    m_txQueue.Clear();
+    m_compressed = false;
+    xSemaphoreGive(m_mutex);
+}
+
+void BtClient::OnDataReceived(const uint8_t *data, uint16_t len) {
+    m_slip.onSlipBytesReceived(data, len);
+}
+
+void BtClient::OnWrite(bool congested) {
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_writePending = false;
+    m_congested = congested;
+    flushLocked();
+    xSemaphoreGive(m_mutex);
+}
+
+void BtClient::OnCongestion(bool congested) {
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_congested = congested;
+    flushLocked();
+    xSemaphoreGive(m_mutex);
+}
+
+void BtClient::SendPacket(const unsigned char *buf, int len, bool priority) {
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    pushPacket(buf, len, priority);
+    xSemaphoreGive(m_mutex);
+}
+
+void BtClient::SendCompressed(const TwaiFrame *frames, int n) {
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    if ( m_compressedStartRequested.exchange(false) ){
+        m_encoder.Reset();
+        m_pushDropped = false;
+        m_compressed = true;
+    }
+    if ( !m_compressed || n == 0 ){
+        xSemaphoreGive(m_mutex);
+        return;
+    }
+    restartCompressedIfDropped();
+
+    // Records of all the frames read at once go into as few SLIP packets as possible
+    unsigned char packet[SLIP_BUF_LEN - 1];
+    int len = 1;  // Room for FRAME_STREAM_MARKER
+    for(int i = 0; i < n; i++){
+        len += m_encoder.Encode(frames[i].id, frames[i].len, frames[i].data, frames[i].timestampUs, packet + len);
+        if ( len + FRAME_STREAM_MAX_RECORD > (int)sizeof(packet) || i == n - 1 ){
+            pushCompressed(packet, len);
+            len = 1;
+        }
+    }
+    xSemaphoreGive(m_mutex);
+}
+
+void BtClient::Flush() {
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    flushLocked();
+    xSemaphoreGive(m_mutex);
+}
+
+uint32_t BtClient::TakeThroughput() {
+    int64_t now = esp_timer_get_time();
+    uint32_t bytes = m_bytesSent.exchange(0);
+    int64_t elapsedUs = now - m_throughputStartUs;
+    m_throughputStartUs = now;
+    return elapsedUs > 0 ? (uint32_t)((int64_t)bytes * 1000000 / elapsedUs) : 0;
+}
+
+void BtClient::pushPacket(const unsigned char *buf, int len, bool priority) {
+    m_pushPriority = priority;
+    m_slip.EncodeAndSendPacket(buf, len);
+}
+
+void BtClient::pushCompressed(unsigned char *packet, int len) {
+    // Every record depends on the ones before, so the compressed stream is never split into priority and bulk
+    // packets, and any packet dropped restarts the session
+    packet[0] = FRAME_STREAM_MARKER;
+    pushPacket(packet, len, false);
+    restartCompressedIfDropped();
+}
+
+void BtClient::restartCompressedIfDropped() {
+    if ( !m_pushDropped ){
+        return;
+    }
+    // The packets still queued refer to the dictionary entries the client never got, so they go too
+    ESP_LOGD(TAG, "%s compressed stream restarted", m_name);
+    m_txQueue.Clear();
+    m_encoder.Reset();
+    pushPacket(&FRAME_STREAM_MARKER, 1, false);
+    m_pushDropped = false;
+}
+
+unsigned char *BtClient::reserveEncodedBytes(int maxLen) {
+    int dropped = 0;
+    uint8_t *room = m_txQueue.Reserve(maxLen, m_pushPriority, dropped);
+    if ( dropped > 0 ){
+        m_drops += dropped;
+        m_pushDropped = true;
+    }
+    return room;
+}
+
+void BtClient::commitEncodedBytes(int len) {
+    m_txQueue.Commit(len);
+}
+
+void BtClient::sendEncodedBytes(unsigned char *buf, int len) {
+    // Only packets too big for the queue get here
+    ESP_LOGE(TAG, "%s dropped %d bytes packet", m_name, len);
+    m_drops++;
+    m_pushDropped = true;
+}
+
+void BtClient::flushLocked() {
+    if ( !IsOpen() || m_writePending || m_congested ){
+        return;
+    }
+
+    int len = m_txQueue.Pop(m_txBuf, MAX_SPP_MTU);
+    if ( len == 0 ){
+        return;
+    }
+
+    esp_err_t err = esp_spp_write(m_handle, len, m_txBuf);
+    if ( err == ESP_OK){
+        ESP_LOG_BUFFER_HEX_LEVEL("BT_TX", m_txBuf, len, ESP_LOG_DEBUG);
+        m_writePending = true;
+        m_bytesSent += len;
+    }else{
+        ESP_LOGE(TAG, "%s error sending bytes %s", m_name, esp_err_to_name(err));
+        m_drops++;
+        m_pushDropped = true;
+        if ( m_compressed ){
+            // Before the next write sends the packets that depend on the lost ones
+            restartCompressedIfDropped();
+        }
+    }
+}
+
+void BtClient::onPacketReceived(const unsigned char *buf, int len) {
+    if ( len > 0 && buf[0] == FRAME_STREAM_MARKER ){
+        onCompressedPacket(buf + 1, len - 1);
+    }else{
+        m_listener->onClientPacket(buf, len);
+    }
+}
+
+void BtClient::onPacketOversize(int len) {
+    ESP_LOGE(TAG, "%s oversize packet %d bytes", m_name, len);
+}
+
+void BtClient::onCompressedPacket(const unsigned char *buf, int len) {
+    if ( len == 0 ){
+        // Client starts the new session, both directions begin with empty dictionaries
+        ESP_LOGI(TAG, "%s compressed stream requested", m_name);
+        m_decoder.Reset();
+        m_compressedStartRequested = true;
+        return;
+    }
+
+    int pos = 0;
+    while ( pos < len ){
+        uint32_t id, timestampUs;
+        uint8_t dlc, data[8];
+        int n = m_decoder.Decode(buf + pos, len - pos, id, dlc, data, timestampUs);
+        if ( n == 0 ){
+            ESP_LOGE(TAG, "%s invalid compressed record at %d of %d bytes", m_name, pos, len);
+            return;
+        }
+        pos += n;
+        m_listener->onClientFrame(id, dlc, data);
+    }
+}
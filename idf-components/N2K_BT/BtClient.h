@@ -0,0 +1,95 @@
+#ifndef IMU2NMEA_BTCLIENT_H
+#define IMU2NMEA_BTCLIENT_H
+
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_spp_api.h"
+
+#include "SlipPacket.h"
+#include "BtTxQueue.h"
+#include "TwaiFrameRing.h"
+#include "FrameStreamCodec.h"
+#include "DeviceDiagnostics.h"
+
+class BtClientListener {
+public:
+    virtual void onClientPacket(const unsigned char *buf, int len) = 0;
+    virtual void onClientFrame(uint32_t id, uint8_t len, const uint8_t *data) = 0;
+};
+
+/// One SPP connection with its own SLIP decoder, transmit queue and compressed stream session.
+/// Only one write is outstanding at a time, the next one is sent on ESP_SPP_WRITE_EVT or when
+/// ESP_SPP_CONG_EVT clears the congestion, so a slow phone backs up and drops its own queue only.
+class BtClient : public SlipListener, ByteOutputStream, public DiagnosticsLink {
+public:
+    static const uint32_t INVALID_HANDLE = 0xFFFFFFFF;
+
+    BtClient() = default;
+    BtClient(const BtClient &) = delete;
+    BtClient &operator=(const BtClient &) = delete;
+    void Init(BtClientListener *listener, int idx);
+
+    // Called from the BT stack task
+    void Open(uint32_t handle);
+    void Close();
+    void OnDataReceived(const uint8_t *data, uint16_t len);
+    void OnWrite(bool congested);
+    void OnCongestion(bool congested);
+
+    // Called from the transmit task
+    bool IsOpen() const { return m_handle != INVALID_HANDLE; }
+    bool IsCompressed() const { return m_compressed; }
+    uint32_t Handle() const { return m_handle; }
+    void SendPacket(const unsigned char *buf, int len, bool priority);
+    /// Send the frames as the compressed stream if the client has requested it
+    void SendCompressed(const TwaiFrame *frames, int n);
+    /// Start the write unless one is in progress or the link is congested
+    void Flush();
+
+    // DiagnosticsLink
+    const char *Name() const override { return m_name; }
+    bool Connected() const override { return IsOpen(); }
+    uint32_t TakeThroughput() override;
+    uint32_t Drops() const override { return m_drops; }
+    void ResetDrops() override { m_drops = 0; }
+
+private:
+    static const uint16_t MAX_SPP_MTU = ESP_SPP_MAX_MTU;
+
+    unsigned char *reserveEncodedBytes(int maxLen) override;
+    void commitEncodedBytes(int len) override;
+    void sendEncodedBytes(unsigned char *buf, int len) override;
+    void onPacketReceived(const unsigned char *buf, int len) override;
+    void onPacketOversize(int len) override;
+    void onCompressedPacket(const unsigned char *buf, int len);
+    void pushPacket(const unsigned char *buf, int len, bool priority);
+    void pushCompressed(unsigned char *packet, int len);
+    void restartCompressedIfDropped();
+    void flushLocked();
+
+    BtClientListener *m_listener = nullptr;
+    char m_name[8]{};
+    std::atomic<uint32_t> m_handle{INVALID_HANDLE};
+    SlipPacket m_slip{*this, *this};
+    SemaphoreHandle_t m_mutex = nullptr;
+
+    // Guarded by m_mutex
+    BtTxQueue m_txQueue;
+    bool m_pushPriority = false;
+    bool m_pushDropped = false;  // Packet was lost in the queue or by the failed write since the last restart
+    bool m_writePending = false;
+    bool m_congested = false;
+    uint8_t m_txBuf[MAX_SPP_MTU]{};
+
+    std::atomic<bool> m_compressed{false};
+    std::atomic<bool> m_compressedStartRequested{false};
+    FrameStreamEncoder m_encoder;
+    FrameStreamDecoder m_decoder;
+
+    std::atomic<uint32_t> m_drops{0};
+    std::atomic<uint32_t> m_bytesSent{0};
+    int64_t m_throughputStartUs = 0;
+};
+
+#endif //IMU2NMEA_BTCLIENT_H
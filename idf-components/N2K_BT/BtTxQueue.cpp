@@ -0,0 +1,107 @@
+#include <cstring>
+#include <initializer_list>
+#include "BtTxQueue.h"
+
+uint8_t *BtPacketRing::Reserve(int maxLen, int &dropped) {
+    int needed = maxLen + 2;
+    if ( needed > m_size ){
+        return nullptr;
+    }
+
+    int tailRoom;
+    for(;;){
+        if ( Empty() ){
+            m_head = m_tail = 0;
+        }
+        tailRoom = m_size - m_head;
+        int total = tailRoom < needed ? tailRoom + needed : needed;
+        if ( m_size - m_used >= total ){
+            break;
+        }
+        DropOldest();
+        dropped++;
+    }
+
+    if ( tailRoom < needed ){
+        if ( tailRoom >= 2 ){
+            m_buf[m_head] = WRAP >> 8;
+            m_buf[m_head + 1] = WRAP & 0xFF;
+        }
+        m_used += tailRoom;
+        m_head = 0;
+    }
+
+    return m_buf + m_head + 2;
+}
+
+void BtPacketRing::Commit(int len) {
+    m_buf[m_head] = len >> 8;
+    m_buf[m_head + 1] = len & 0xFF;
+    advance(m_head, 2 + len);
+    m_used += 2 + len;
+}
+
+void BtPacketRing::advance(int &pos, int len) {
+    pos += len;
+    if ( pos == m_size ){
+        pos = 0;
+    }
+}
+
+void BtPacketRing::skipWrap() {
+    int tailRoom = m_size - m_tail;
+    if ( tailRoom < 2 || ((m_buf[m_tail] << 8) | m_buf[m_tail + 1]) == WRAP ){
+        m_used -= tailRoom;
+        m_tail = 0;
+    }
+}
+
+int BtPacketRing::FrontLen() {
+    if ( Empty() ){
+        return 0;
+    }
+    skipWrap();
+    return (m_buf[m_tail] << 8) | m_buf[m_tail + 1];
+}
+
+void BtPacketRing::Pop(uint8_t *out) {
+    int len = FrontLen();
+    memcpy(out, m_buf + m_tail + 2, len);
+    advance(m_tail, 2 + len);
+    m_used -= 2 + len;
+}
+
+void BtPacketRing::DropOldest() {
+    int len = FrontLen();
+    advance(m_tail, 2 + len);
+    m_used -= 2 + len;
+}
+
+uint8_t *BtTxQueue::Reserve(int maxLen, bool priority, int &dropped) {
+    m_reserved = priority ? &m_priority : &m_bulk;
+    return m_reserved->Reserve(maxLen, dropped);
+}
+
+void BtTxQueue::Commit(int len) {
+    m_reserved->Commit(len);
+}
+
+int BtTxQueue::Pop(uint8_t *out, int max) {
+    int len = 0;
+    for(BtPacketRing *ring : {&m_priority, &m_bulk}){
+        int next;
+        while ( (next = ring->FrontLen()) > 0 && len + next <= max ){
+            ring->Pop(out + len);
+            len += next;
+        }
+        if ( next > 0 ){
+            break;  // The next one goes first in the following write
+        }
+    }
+    return len;
+}
+
+void BtTxQueue::Clear() {
+    m_priority.Clear();
+    m_bulk.Clear();
+}
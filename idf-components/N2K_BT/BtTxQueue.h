@@ -0,0 +1,67 @@
+#ifndef IMU2NMEA_BTTXQUEUE_H
+#define IMU2NMEA_BTTXQUEUE_H
+
+#include <cstdint>
+
+/// Ring of whole variable length packets, each stored as two bytes of length followed by the packet bytes.
+/// Packets never wrap around the end of the buffer, so they are written in place and read with one memcpy.
+class BtPacketRing {
+public:
+    BtPacketRing(uint8_t *buf, int size) : m_buf(buf), m_size(size) {}
+    /// Make room for the packet of up to maxLen bytes dropping the oldest ones. Returns nullptr if it can never fit
+    uint8_t *Reserve(int maxLen, int &dropped);
+    /// Add the packet of len bytes written to the reserved room
+    void Commit(int len);
+    /// Length of the oldest packet, 0 if the ring is empty
+    int FrontLen();
+    /// Copy the oldest packet to out and remove it
+    void Pop(uint8_t *out);
+    void DropOldest();
+    bool Empty() const { return m_used == 0; }
+    void Clear() { m_tail = m_head; m_used = 0; }
+
+private:
+    static const uint16_t WRAP = 0xFFFF;  // Rest of the buffer is unused, next packet starts at the beginning
+
+    void skipWrap();
+    void advance(int &pos, int len);
+
+    uint8_t *m_buf;
+    int m_size;
+    int m_head = 0;
+    int m_tail = 0;
+    int m_used = 0;  // Including the unused ends of the buffer
+};
+
+/// Transmit queue of one SPP connection.
+/// Priority packets (heading, wind) and bulk packets are kept in separate rings, and the priority ones are sent first,
+/// so the bulk traffic backed up by the slow link is shed without touching the priority one.
+/// When the ring is full its oldest packets are dropped, they are the most stale ones anyway.
+/// Not thread safe, the owner serializes the access.
+class BtTxQueue {
+public:
+    static const int PRIORITY_RING_SIZE = 1024;
+    static const int BULK_RING_SIZE = 3072;
+
+    BtTxQueue() = default;
+    BtTxQueue(const BtTxQueue &) = delete;
+    BtTxQueue &operator=(const BtTxQueue &) = delete;
+
+    /// Room for the packet of up to maxLen bytes. Adds number of older packets dropped to make it to dropped
+    uint8_t *Reserve(int maxLen, bool priority, int &dropped);
+    /// Add the packet of len bytes written to the room taken by the last Reserve()
+    void Commit(int len);
+    /// Move whole packets, the priority ones first, to out up to max bytes. Returns the number of bytes
+    int Pop(uint8_t *out, int max);
+    bool Empty() const { return m_priority.Empty() && m_bulk.Empty(); }
+    void Clear();
+
+private:
+    uint8_t m_priorityBuf[PRIORITY_RING_SIZE]{};
+    uint8_t m_bulkBuf[BULK_RING_SIZE]{};
+    BtPacketRing m_priority{m_priorityBuf, PRIORITY_RING_SIZE};
+    BtPacketRing m_bulk{m_bulkBuf, BULK_RING_SIZE};
+    BtPacketRing *m_reserved = nullptr;
+};
+
+#endif //IMU2NMEA_BTTXQUEUE_H
@@ -2,6 +2,7 @@
 #include <lwip/def.h>
 
 #include "N2kBt.h"
+#include "N2kCanId.h"
 
 static const char *TAG = "N2kBt";
 
@@ -13,12 +14,11 @@ static void esp_bt_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *pa
     N2kBt::espBtGapCb(event, param);
 }
 
-N2kBt::N2kBt(SideTwaiBusInterface &twaiBusSender)
-: twaiBusSender(twaiBusSender)
-, slipPacket(*this, *this)
+N2kBt::N2kBt(SideFrameQueue &sideFrames)
+: sideFrames(sideFrames)
 {
-    for(uint32_t & m_BtSppHandle : m_BtSppHandles) {
-        m_BtSppHandle = INVALID_HANDLE;
+    for(int i = 0; i < MAX_CONNECTIONS; i++) {
+        m_clients[i].Init(this, i);
     }
 }
 
@@ -115,13 +115,9 @@ void N2kBt::espBtSppCb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
             ESP_LOGI(TAG, "ESP_SPP_CLOSE_EVT status:%d handle:%d close_by_remote:%d", param->close.status,
                      param->close.handle, param->close.async);
 
-            for(uint32_t & m_BtSppHandle : m_BtSppHandles){
-                if( m_BtSppHandle == param->close.handle){
-                    m_BtSppHandle = INVALID_HANDLE;
-                    break;
-                }
+            if ( BtClient *client = findClient(param->close.handle) ){
+                client->Close();
             }
-
             break;
         case ESP_SPP_START_EVT:
             if (param->start.status == ESP_SPP_SUCCESS) {
@@ -138,30 +134,34 @@ void N2kBt::espBtSppCb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
             break;
         case ESP_SPP_DATA_IND_EVT:
             ESP_LOG_BUFFER_HEX_LEVEL("BT_RX", param->data_ind.data, param->data_ind.len, ESP_LOG_DEBUG);
-            for(uint16_t i=0; i < param->data_ind.len; i++){
-                slipPacket.onSlipByteReceived(param->data_ind.data[i]);
+            if ( BtClient *client = findClient(param->data_ind.handle) ){
+                client->OnDataReceived(param->data_ind.data, param->data_ind.len);
             }
             break;
         case ESP_SPP_CONG_EVT:
-            ESP_LOGI(TAG, "ESP_SPP_CONG_EVT %d", param->cong.cong);
-            m_bCongDetected = param->cong.cong;             // Store congestion state
+            ESP_LOGD(TAG, "ESP_SPP_CONG_EVT handle:%d cong:%d", param->cong.handle, param->cong.cong);
+            if ( BtClient *client = findClient(param->cong.handle) ){
+                client->OnCongestion(param->cong.cong);
+            }
             break;
         case ESP_SPP_WRITE_EVT:
-            m_bCongDetected = param->write.cong;             // Store congestion state
+            if ( BtClient *client = findClient(param->write.handle) ){
+                client->OnWrite(param->write.cong);
+            }
             break;
         case ESP_SPP_SRV_OPEN_EVT:
             ESP_LOGI(TAG, "ESP_SPP_SRV_OPEN_EVT status:%d handle:%d, rem_bda:[%s]", param->srv_open.status,
                      param->srv_open.handle, bda2str(param->srv_open.rem_bda, bda_str, sizeof(bda_str)));
 
-            m_bCongDetected = false;                        // Clear congestion state
-            // Find free handle and store it
-            for(uint32_t & m_BtSppHandle : m_BtSppHandles){
-                if( m_BtSppHandle == INVALID_HANDLE){
-                    m_BtSppHandle = param->srv_open.handle;
-                    break;
-                }
+            if ( param->srv_open.status != ESP_SPP_SUCCESS ){
+                break;
+            }
+            // Find free client and give it the handle
+            if ( BtClient *client = findClient(BtClient::INVALID_HANDLE) ){
+                client->Open(param->srv_open.handle);
+            }else{
+                ESP_LOGE(TAG, "No free client for handle:%d", param->srv_open.handle);
             }
-
             break;
         case ESP_SPP_SRV_STOP_EVT:
             ESP_LOGI(TAG, "ESP_SPP_SRV_STOP_EVT");
@@ -175,6 +175,10 @@ void N2kBt::espBtSppCb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
 }
 
 
+static void tx_frame_task(void *me ) {
+    ((N2kBt *) me)->TransmitFrameTask();
+}
+
 void N2kBt::Start() {
 
     instance = this;
@@ -242,66 +246,112 @@ void N2kBt::Start() {
 
     ESP_LOGI(TAG, "Own address:[%s]", bda2str((uint8_t *)esp_bt_dev_get_address(), bda_str, sizeof(bda_str)));
 
+    for(BtClient &client : m_clients){
+        DeviceDiagnostics::RegisterLink(&client);
+    }
+
+    xTaskCreate(
+            tx_frame_task,         /* Function that implements the task. */
+            "BtTxFrameTask",       /* Text name for the task. */
+            4 * 1024,              /* Stack size in words, not bytes. */
+            (void *) this,         /* Parameter passed into the task. */
+            tskIDLE_PRIORITY + 1,  /* Priority at which the task is created. */
+            nullptr);              /* Used to pass out the created task's handle. */
+
+}
+
+// Each SPP connection has its own queue, so the slow phone only drops its own packets
+void N2kBt::TransmitFrameTask() {
+    while (true) {
+        TwaiFrame frames[MAX_FRAMES_PER_READ];
+        int n = m_frameCursor.Read(frames, MAX_FRAMES_PER_READ, 1000 / portTICK_PERIOD_MS);
+        for(int i = 0; i < n; i++){
+            N2kStreamMessage msg;
+            if ( !m_messageMode ){
+                sendFrame(frames[i]);
+            }else if ( m_assembler.Add(frames[i], msg) ){
+                sendMessage(msg);
+            }
+        }
+        for(BtClient &client : m_clients){
+            client.SendCompressed(frames, n);
+            client.Flush();
+        }
+    }
 }
 
-void N2kBt::onTwaiFrameReceived(unsigned long id, unsigned char len, const unsigned char *buf) {
+void N2kBt::sendFrame(const TwaiFrame &frame) {
 
     unsigned char net_data[TWAI_FRAME_MAX_DLC + 5];
-    int net_id = htonl(id);
+    int net_id = htonl(frame.id);
     memcpy(net_data, &net_id, 4);
-    memcpy(net_data + 4, &len, 1);
-    for(int i = 0; i < len; i++){
-        net_data[5 + i] = buf[i];
-    }
-    int total_len = 5 + len;
+    memcpy(net_data + 4, &frame.len, 1);
+    memcpy(net_data + 5, frame.data, frame.len);
+    int total_len = 5 + frame.len;
 
-    slipPacket.EncodeAndSendPacket(net_data, total_len);
+    sendPacket(net_data, total_len, isPriorityPgn(N2kCanIdPgn(frame.id)));
 }
 
-void N2kBt::onTwaiFrameTransmit(unsigned long id, unsigned char len, const unsigned char *buf) {
-    onTwaiFrameReceived(id, len, buf);
-}
+void N2kBt::sendMessage(const N2kStreamMessage &msg) {
+    unsigned char net_data[1 + N2K_MAX_ENCODED_MESSAGE];
+    net_data[0] = N2K_MESSAGE_MARKER;
+    int total_len = 1 + N2kEncodeMessage(msg, net_data + 1);
 
-void N2kBt::sendEncodedBytes(unsigned char *buf, unsigned char len) {
+    sendPacket(net_data, total_len, isPriorityPgn(msg.pgn));
+}
 
-    // Buffer multiple SLIP packets into single SPP packet up to MAX_SPP_MTU bytes
-    if( m_usSppBufferLen + len < MAX_SPP_MTU ){
-        memcpy(m_ucSppBuffer + m_usSppBufferLen, buf, len);
-        m_usSppBufferLen += len;
-        return;
+void N2kBt::sendPacket(const unsigned char *buf, int len, bool priority) {
+    for(BtClient &client : m_clients){
+        if( client.IsOpen() && !client.IsCompressed() ){
+            client.SendPacket(buf, len, priority);
+        }
     }
-
-    // Enough data accumulated send it
-    flush();
 }
 
-void N2kBt::flush() {
-
-    if( m_usSppBufferLen == 0){
-        return;
+BtClient *N2kBt::findClient(uint32_t handle) {
+    for(BtClient &client : m_clients){
+        if( client.Handle() == handle ){
+            return &client;
+        }
     }
+    return nullptr;
+}
 
-    if(m_bCongDetected){  // TODO check it for each handle separately
-        m_usSppBufferLen = 0;  // Drop this data, it will be obsolete anyway
-        return;
+// These are kept when the link can't carry everything
+bool N2kBt::isPriorityPgn(unsigned long pgn) {
+    switch (pgn) {
+        case 127250:  // Vessel heading
+        case 127251:  // Rate of turn
+        case 127257:  // Attitude
+        case 130306:  // Wind data
+            return true;
+        default:
+            return false;
     }
+}
 
-    for(uint32_t & m_BtSppHandle : m_BtSppHandles){
-        if( m_BtSppHandle != INVALID_HANDLE){
-            esp_err_t err = esp_spp_write(m_BtSppHandle, m_usSppBufferLen, m_ucSppBuffer);
-            if ( err == ESP_OK){
-                ESP_LOG_BUFFER_HEX_LEVEL("BT_TX", m_ucSppBuffer, m_usSppBufferLen, ESP_LOG_DEBUG);
-            }else{
-                ESP_LOGE(TAG, "Error sending bytes %s", esp_err_to_name(err));
-            }
-        }
+void N2kBt::onClientFrame(uint32_t id, uint8_t len, const uint8_t *data) {
+    // Called from the BT stack task, so don't wait for the room in the queue
+    if ( !sideFrames.Post(id, len, data, 0) ){
+        ESP_LOGD(TAG, "Side frame queue full, dropped id=%08X", (unsigned)id);
     }
-
-    m_usSppBufferLen = 0;
 }
 
+void N2kBt::onClientPacket(const unsigned char *recvbuf, int len) {
+    if ( len > 0 && recvbuf[0] == N2K_MESSAGE_MARKER ){
+        N2kStreamMessage msg;
+        if ( !N2kDecodeMessage(recvbuf + 1, len - 1, msg) ){
+            ESP_LOGE(TAG, "Invalid message %d bytes", len);
+        }else if ( !sideFrames.PostMessage(msg, m_splitter, 0) ){
+            ESP_LOGD(TAG, "Dropped PGN %lu len %d, %u rejected as too long for one frame", msg.pgn, msg.len, m_splitter.Rejected());
+        }
+        return;
+    }
+    if ( len < 5 ){
+        ESP_LOGE(TAG, "Short packet %d bytes", len);
+        return;
+    }
 
-void N2kBt::onPacketReceived(const unsigned char *recvbuf, unsigned char len) {
     int net_id = 0;
     memcpy(&net_id, recvbuf, 4);
     int twai_id = ntohl(net_id);
@@ -309,7 +359,10 @@ void N2kBt::onPacketReceived(const unsigned char *recvbuf, unsigned char len) {
 
     if( twai_len <= TWAI_FRAME_MAX_DLC ){
         ESP_LOGD(TAG, "received %d bytes: id=%08X len=%02X", len, twai_id, twai_len);
-        twaiBusSender.onSideIfcTwaiFrame(twai_id, twai_len, &recvbuf[5]);
+        // Called from the BT stack task, so don't wait for the room in the queue
+        if ( !sideFrames.Post(twai_id, twai_len, &recvbuf[5], 0) ){
+            ESP_LOGD(TAG, "Side frame queue full, dropped id=%08X", twai_id);
+        }
     }else{
         ESP_LOGE(TAG, "Invalid DLC %02X", twai_len);
     }
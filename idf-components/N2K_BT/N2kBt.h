@@ -13,20 +13,22 @@
 
 #include "N2kMessages.h"
 #include "../NMEA2000_esp32_twai/NMEA2000_esp32_twai.h"
-#include "SlipPacket.h"
+#include "TwaiFrameRing.h"
+#include "SideFrameQueue.h"
+#include "N2kMessageStream.h"
+#include "BtClient.h"
 
-class N2kBt : public TwaiBusListener, SlipListener, ByteOutputStream {
+class N2kBt : public BtClientListener {
 
 public:
-    explicit N2kBt(SideTwaiBusInterface &twaiBusSender);
-    // TWAI frame received from the bus
-    void onTwaiFrameReceived(unsigned long id, unsigned char len, const unsigned char *buf) override;
-    // TWAI frame transmitted to the bus
-    void onTwaiFrameTransmit(unsigned long id, unsigned char len, const unsigned char *buf) override;
-
-    void flush() override;
+    explicit N2kBt(SideFrameQueue &sideFrames);
+    // Frames seen on the bus are read with this cursor
+    TwaiFrameCursor &FrameCursor() { return m_frameCursor; }
+    // Send and receive whole N2K messages instead of CAN frames, must be set before Start()
+    void SetMessageMode(bool enable) { m_messageMode = enable; }
 
     void Start();
+    [[noreturn]] void TransmitFrameTask();
 
 public:
     static void espBtGapCb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param);
@@ -39,22 +41,26 @@ private: // Constants
     const esp_spp_role_t role_slave = ESP_SPP_ROLE_SLAVE;
     const char * SPP_SERVER_NAME = "N2K_SERVER";
     const char * EXAMPLE_DEVICE_NAME = "N2kSerialPort";
-    const uint32_t INVALID_HANDLE = 0xFFFFFFFF;
-    static const uint8_t MAX_CONNECTIONS = 20;
-    static const uint16_t MAX_SPP_MTU = ESP_SPP_MAX_MTU;
+    static const uint8_t MAX_CONNECTIONS = CONFIG_BTDM_CTRL_BR_EDR_MAX_ACL_CONN;  // Controller won't accept more
+    static const int MAX_FRAMES_PER_READ = 16;
 
 private: // Methods
-    void sendEncodedBytes(unsigned char *buf, unsigned char len) override;
-    void onPacketReceived(const unsigned char *buf, unsigned char len) override;
+    void onClientPacket(const unsigned char *buf, int len) override;
+    void onClientFrame(uint32_t id, uint8_t len, const uint8_t *data) override;
+    void sendFrame(const TwaiFrame &frame);
+    void sendMessage(const N2kStreamMessage &msg);
+    void sendPacket(const unsigned char *buf, int len, bool priority);
+    BtClient *findClient(uint32_t handle);
+    static bool isPriorityPgn(unsigned long pgn);
     static char *bda2str(uint8_t *bda, char *str, size_t size);
 
 private: // Fields
-    SideTwaiBusInterface &twaiBusSender;
-    SlipPacket slipPacket;
-    uint32_t m_BtSppHandles[MAX_CONNECTIONS]{};
-    bool m_bCongDetected = false;
-    uint8_t m_ucSppBuffer[MAX_SPP_MTU]{};
-    uint16_t m_usSppBufferLen = 0;
+    SideFrameQueue &sideFrames;
+    TwaiFrameCursor m_frameCursor{"bt"};
+    bool m_messageMode = false;
+    N2kMessageAssembler m_assembler;
+    N2kMessageSplitter m_splitter;
+    BtClient m_clients[MAX_CONNECTIONS];
 };
 
 
@@ -1,49 +1,135 @@
-#include <esp_log.h>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include "SlipPacket.h"
 
-void SlipPacket::onSlipByteReceived(unsigned char byte) {
-    if (byte == SLIP_END) {
-        if (slipBufferIndex > 0) {
-            listener.onPacketReceived(slipBuffer, slipBufferIndex);
+static const uint32_t ONES = 0x01010101;
+static const uint32_t HIGHS = 0x80808080;
+
+// True if any byte of w equals the byte repeated in pattern
+static inline bool hasByte(uint32_t w, uint32_t pattern) {
+    uint32_t x = w ^ pattern;
+    return ((x - ONES) & ~x & HIGHS) != 0;
+}
+
+int SlipPacket::findSpecial(const unsigned char *buf, int len) {
+    int i = 0;
+    for(; i + 4 <= len; i += 4){
+        uint32_t w;
+        memcpy(&w, buf + i, 4);
+        if ( hasByte(w, SLIP_END * ONES) || hasByte(w, SLIP_ESC * ONES) ){
+            break;
+        }
+    }
+    for(; i < len; i++){
+        if ( buf[i] == SLIP_END || buf[i] == SLIP_ESC ){
+            break;
         }
-        slipBufferIndex = 0;
-    } else if (byte == SLIP_ESC) {
-        escapeNext = true;
-    } else {
-        if (escapeNext) {
+    }
+    return i;
+}
+
+void SlipPacket::onSlipBytesReceived(const unsigned char *buf, int len) {
+    int i = 0;
+    if ( discardToEnd ){
+        auto end = (const unsigned char *)memchr(buf, SLIP_END, len);
+        if ( end == nullptr ){
+            return;
+        }
+        i = (int)(end - buf) + 1;
+        discardToEnd = false;
+    }
+    while ( i < len ) {
+        if ( escapeNext && buf[i] != SLIP_END ) {
             escapeNext = false;
+            unsigned char byte = buf[i++];
             if (byte == SLIP_ESC_END) {
                 byte = SLIP_END;
             } else if (byte == SLIP_ESC_ESC) {
                 byte = SLIP_ESC;
             }
+            append(&byte, 1);
+            continue;
+        }
+
+        int run = findSpecial(buf + i, len - i);
+        append(buf + i, run);
+        i += run;
+        if ( i == len ){
+            break;
         }
-        if (slipBufferIndex < sizeof(slipBuffer)) {
-            slipBuffer[slipBufferIndex++] = byte;
+
+        if ( buf[i++] == SLIP_END ) {
+            endPacket();
+        } else {
+            escapeNext = true;
         }
     }
 }
 
-void SlipPacket::EncodeAndSendPacket(const unsigned char *inputBuffer, unsigned char len) {
-    unsigned char outputBuffer[OUT_BUF_LEN];
-    int outIdx = 0;
+void SlipPacket::Resync() {
+    slipBufferIndex = 0;
+    escapeNext = false;
+    discardToEnd = true;
+}
 
-    for(int i=0; i < len; i++) {
-        if( outIdx >= OUT_BUF_LEN - 4 ) {
-            ESP_LOGE("SlipPacket", "EncodeAndSendPacket: outBuf overflow");
-            return;
-        }
+void SlipPacket::append(const unsigned char *buf, int len) {
+    if ( slipBufferIndex < SLIP_BUF_LEN ){
+        memcpy(slipBuffer + slipBufferIndex, buf, std::min(len, SLIP_BUF_LEN - slipBufferIndex));
+    }
+    slipBufferIndex += len;
+}
 
-        if(inputBuffer[i] == SLIP_END ) {
-            outputBuffer[outIdx++] = SLIP_ESC;
-            outputBuffer[outIdx++] = SLIP_ESC_END;
-        } else if(inputBuffer[i] == SLIP_ESC ) {
-            outputBuffer[outIdx++] = SLIP_ESC;
-            outputBuffer[outIdx++] = SLIP_ESC_ESC;
-        } else {
-            outputBuffer[outIdx++] = inputBuffer[i];
+void SlipPacket::endPacket() {
+    if (slipBufferIndex > SLIP_BUF_LEN) {
+        listener.onPacketOversize(slipBufferIndex);
+    } else if (slipBufferIndex > 0) {
+        listener.onPacketReceived(slipBuffer, slipBufferIndex);
+    }
+    slipBufferIndex = 0;
+    escapeNext = false;
+}
+
+int SlipPacket::encode(const unsigned char *in, int len, unsigned char *out) {
+    int outIdx = 0;
+    int i = 0;
+    while ( i < len ) {
+        int run = findSpecial(in + i, len - i);
+        memcpy(out + outIdx, in + i, run);
+        outIdx += run;
+        i += run;
+        if ( i == len ){
+            break;
         }
+        out[outIdx++] = SLIP_ESC;
+        out[outIdx++] = in[i++] == SLIP_END ? SLIP_ESC_END : SLIP_ESC_ESC;
+    }
+    out[outIdx++] = SLIP_END;
+    return outIdx;
+}
+
+bool SlipPacket::EncodeAndSendPacket(const unsigned char *inputBuffer, int len) {
+    if ( len > SLIP_BUF_LEN ){
+        return false;
+    }
+
+    unsigned char *out = outStream.reserveEncodedBytes(2 * len + 1);
+    if ( out != nullptr ){
+        outStream.commitEncodedBytes(encode(inputBuffer, len, out));
+    }else{
+        unsigned char outputBuffer[OUT_BUF_LEN];
+        outStream.sendEncodedBytes(outputBuffer, encode(inputBuffer, len, outputBuffer));
+    }
+    return true;
+}
+
+void SlipPacket::SendEnd() {
+    unsigned char end = SLIP_END;
+    unsigned char *out = outStream.reserveEncodedBytes(1);
+    if ( out != nullptr ){
+        *out = end;
+        outStream.commitEncodedBytes(1);
+    }else{
+        outStream.sendEncodedBytes(&end, 1);
     }
-    outputBuffer[outIdx++] = SLIP_END;
-    outStream.sendEncodedBytes(outputBuffer, outIdx);
 }
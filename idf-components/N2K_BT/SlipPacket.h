@@ -2,33 +2,55 @@
 #define IMU2NMEA_SLIPPACKET_H
 
 
-static const int OUT_BUF_LEN = 64;
-static const int SLIP_BUF_LEN = 128;
+static const int SLIP_BUF_LEN = 256;  // Fits the whole N2K message sent in message mode
+static const int OUT_BUF_LEN = 2 * SLIP_BUF_LEN + 1;  // Every byte escaped plus SLIP_END
 
 class SlipListener{
 public:
-    virtual void onPacketReceived(const unsigned char *buf, unsigned char len) = 0;
+    virtual void onPacketReceived(const unsigned char *buf, int len) = 0;
+    /// Packet longer than SLIP_BUF_LEN was dropped
+    virtual void onPacketOversize(int len) = 0;
 };
 
 class ByteOutputStream{
 public:
-    virtual void sendEncodedBytes(unsigned char *buf, unsigned char len) = 0;
+    /// Room for up to maxLen encoded bytes in the transmit buffer, so the packet is encoded in place.
+    /// nullptr makes SlipPacket encode into its own buffer and call sendEncodedBytes() instead
+    virtual unsigned char *reserveEncodedBytes(int /*maxLen*/) { return nullptr; }
+    /// First len bytes of the reserved room are filled
+    virtual void commitEncodedBytes(int /*len*/) {}
+    virtual void sendEncodedBytes(unsigned char *buf, int len) = 0;
 };
 
+/// SLIP framing of the packets. Both directions scan a word at a time for SLIP_END and SLIP_ESC,
+/// so the runs of plain bytes are copied with memcpy.
+/// The code has no ESP-IDF dependencies, so the host tools can use it as is.
 class SlipPacket{
 public:
     SlipPacket(SlipListener &listener, ByteOutputStream &outStream)
             :listener(listener), outStream(outStream){}
-    void EncodeAndSendPacket(const unsigned char *inputBuffer, unsigned char len);
-    void onSlipByteReceived(unsigned char byte);
+    /// Returns false if the packet is longer than SLIP_BUF_LEN
+    bool EncodeAndSendPacket(const unsigned char *inputBuffer, int len);
+    /// Send lone SLIP_END, so the receiver discards what it got of the packet cut short by the lost bytes
+    void SendEnd();
+    void onSlipBytesReceived(const unsigned char *buf, int len);
+    /// Discard the packet received so far and the bytes up to the next SLIP_END, the bytes were lost
+    /// and the ones received next are the rest of the packet they belong to
+    void Resync();
 
 private:
+    void append(const unsigned char *buf, int len);
+    void endPacket();
+    static int encode(const unsigned char *in, int len, unsigned char *out);
+    static int findSpecial(const unsigned char *buf, int len);
+
     SlipListener &listener;
     ByteOutputStream &outStream;
 
     unsigned char slipBuffer[SLIP_BUF_LEN];
-    unsigned char slipBufferIndex = 0;
+    int slipBufferIndex = 0;  // Keeps counting past the end of slipBuffer to report the oversize packet
     bool escapeNext = false;
+    bool discardToEnd = false;
 
     static const unsigned char SLIP_END = 0xC0;
     static const unsigned char SLIP_ESC = 0xDB;
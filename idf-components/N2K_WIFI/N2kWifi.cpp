@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <cstring>
 #include <esp_netif.h>
 #include <esp_event.h>
@@ -5,18 +6,22 @@
 #include <esp_wifi.h>
 #include <esp_log.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include <lwip/sockets.h>
 #include "N2kWifi.h"
+#include "Trace.h"
+#include "BlackBox.h"
 
 #include "KnownSsidList.h"
 
 static const char *TAG = "imu2nmea_N2kWifi";
 static const char * BROADCAST_IPV4_ADDR  = "255.255.255.255";
 
-N2kWifi::N2kWifi(SideTwaiBusInterface &twaiBusSender)
-        : twaiBusSender(twaiBusSender) {
-    txFrameQueue = xQueueCreate(20, sizeof(NetworkMsg));
+N2kWifi::N2kWifi(SideFrameQueue &sideFrames, int batchDelayMs)
+        : sideFrames(sideFrames)
+        , m_batchDelayMs(batchDelayMs) {
     rxFrameQueue = xQueueCreate(10, sizeof(NetworkMsg));
+    m_clientsMutex = xSemaphoreCreateMutex();
 }
 
 static void tx_frame_task(void *me ) {
@@ -68,7 +73,7 @@ void N2kWifi::Start() {
             .queue_size = 10,
             .task_name = "WiFiLoop",
             .task_priority = tskIDLE_PRIORITY + 1,
-            .task_stack_size = 48 * 1024,
+            .task_stack_size = 8 * 1024,
             .task_core_id = 0
     };
 
@@ -105,28 +110,147 @@ void N2kWifi::ReceiveFrameTask() {
 }
 
 
-bool N2kWifi::CheckScanResults(char *ssid, char *password) {
-    uint16_t number = DEFAULT_SCAN_LIST_SIZE;
-    wifi_ap_record_t ap_info[DEFAULT_SCAN_LIST_SIZE];
-    memset(ap_info, 0, sizeof(ap_info));
+const SsidPassList *N2kWifi::FindKnownSsid(const char *ssid) {
+    for (const SsidPassList &item : knownSsidList) {
+        if (strcmp(ssid, item.ssid) == 0) {
+            return &item;
+        }
+    }
+    return nullptr;
+}
 
-    ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&number, ap_info));
+bool N2kWifi::ConnectToCachedAp() {
+    if ( !m_hasCachedAp ){
+        return false;
+    }
+    const SsidPassList *known = FindKnownSsid(m_cachedAp.ssid);
+    if ( known == nullptr ){
+        ESP_LOGI(TAG, "Cached SSID %s is not known anymore", m_cachedAp.ssid);
+        WifiApCache::Forget();
+        m_hasCachedAp = false;
+        return false;
+    }
+    ESP_LOGI(TAG, "Connect to cached AP %s on channel %d", m_cachedAp.ssid, m_cachedAp.channel);
+    m_connectingToCachedAp = true;
+    Connect(*known, m_cachedAp.bssid, m_cachedAp.channel);
+    return true;
+}
+
+void N2kWifi::StartScan() {
+    // The channel of the cached AP goes first, then the rest of them in order
+    int first = m_hasCachedAp && m_cachedAp.channel <= WIFI_CHANNELS ? m_cachedAp.channel : 0;
+    int channel = m_scanStep + 1;
+    if ( first > 0 ){
+        channel = m_scanStep == 0 ? first : (m_scanStep < first ? m_scanStep : m_scanStep + 1);
+    }
+
+    wifi_scan_config_t scan_config = {};
+    scan_config.channel = channel;
+    esp_wifi_scan_start(&scan_config, false);
+}
+
+bool N2kWifi::CheckScanResults() {
     uint16_t ap_count = 0;
     ESP_ERROR_CHECK(esp_wifi_scan_get_ap_num(&ap_count));
-    ESP_LOGI(TAG, "Total APs scanned = %u", ap_count);
-
-    for (int i = 0; (i < DEFAULT_SCAN_LIST_SIZE) && (i < ap_count); i++) {
-        ESP_LOGI(TAG, "SSID \t\t[%s]", ap_info[i].ssid);
-        for (auto item : knownSsidList) {
-            if (strcmp((char *)ap_info[i].ssid, item.ssid) == 0) {
-                ESP_LOGI(TAG, "Found known SSID %s", item.ssid);
-                strcpy((char *)ssid, item.ssid);
-                strcpy((char *)password, item.password);
-                return true;
-            }
+
+    // The driver frees its whole list on this call, so all of the records are read at once.
+    // One channel rarely has more than SCAN_BATCH_SIZE APs, a crowded marina one goes to the heap
+    wifi_ap_record_t batch[SCAN_BATCH_SIZE];
+    wifi_ap_record_t *ap_info = batch;
+    uint16_t number = SCAN_BATCH_SIZE;
+    if ( ap_count > SCAN_BATCH_SIZE ){
+        auto *all = (wifi_ap_record_t *)malloc(ap_count * sizeof(wifi_ap_record_t));
+        if ( all != nullptr ){
+            ap_info = all;
+            number = ap_count;
+        }else{
+            ESP_LOGW(TAG, "No memory for %u AP records, reading %d of them", ap_count, SCAN_BATCH_SIZE);
+        }
+    }
+    ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&number, ap_info));
+    ESP_LOGD(TAG, "%u APs scanned, %u read", ap_count, number);
+
+    // Strongest known AP wins
+    const wifi_ap_record_t *best = nullptr;
+    const SsidPassList *bestKnown = nullptr;
+    for (int i = 0; i < number; i++) {
+        ESP_LOGD(TAG, "SSID \t\t[%s] %d dBm", ap_info[i].ssid, ap_info[i].rssi);
+        const SsidPassList *known = FindKnownSsid((const char *)ap_info[i].ssid);
+        if ( known != nullptr && (best == nullptr || ap_info[i].rssi > best->rssi) ){
+            best = &ap_info[i];
+            bestKnown = known;
         }
     }
-    return false;
+    if ( best != nullptr ){
+        ESP_LOGI(TAG, "Found known SSID %s on channel %d, %d dBm", bestKnown->ssid, best->primary, best->rssi);
+        Connect(*bestKnown, best->bssid, best->primary);
+    }
+
+    if ( ap_info != batch ){
+        free(ap_info);
+    }
+    return best != nullptr;
+}
+
+void N2kWifi::Connect(const SsidPassList &known, const uint8_t *bssid, uint8_t channel) {
+    // Read default config
+    wifi_config_t wifi_config = {};
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+    // Set desired ssid and password, the BSSID and channel skip the scan the driver does on connect
+    strlcpy((char *)wifi_config.sta.ssid, known.ssid, sizeof(wifi_config.sta.ssid));
+    strlcpy((char *)wifi_config.sta.password, known.password, sizeof(wifi_config.sta.password));
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.channel = channel;
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    // Start the connection  process
+    ESP_ERROR_CHECK(esp_wifi_connect());
+}
+
+void N2kWifi::OnConnected(const void *event_data) {
+    auto *event = (const wifi_event_sta_connected_t *)event_data;
+    ESP_LOGI(TAG, "Connected to %.*s on channel %d in %lld ms", event->ssid_len, event->ssid, event->channel,
+             (esp_timer_get_time() - m_linkDownUs) / 1000);
+    m_connectingToCachedAp = false;
+    m_scanStep = 0;
+
+    CachedAp ap{};
+    memcpy(ap.ssid, event->ssid, event->ssid_len < sizeof(ap.ssid) - 1 ? event->ssid_len : sizeof(ap.ssid) - 1);
+    memcpy(ap.bssid, event->bssid, sizeof(ap.bssid));
+    ap.channel = event->channel;
+    WifiApCache::Save(ap);
+    m_cachedAp = ap;
+    m_hasCachedAp = true;
+
+    StartServer();
+}
+
+void N2kWifi::OnDisconnected() {
+    bool wasConnected = isWifiConnected;
+    StopServer();
+    if ( wasConnected ){
+        m_linkDownUs = esp_timer_get_time();
+        // Most likely the same AP is back in a moment
+        ESP_LOGI(TAG, "Lost WiFi connection, reconnect");
+        if ( ConnectToCachedAp() ){
+            return;
+        }
+    }else if ( m_connectingToCachedAp ){
+        ESP_LOGI(TAG, "Cached AP is not there, scan");
+        m_connectingToCachedAp = false;
+    }else{
+        ESP_LOGI(TAG, "Failed to connect, scan again");
+    }
+    m_scanStep = 0;
+    StartScan();
+}
+
+void N2kWifi::NoteDatagramSent() {
+    int64_t linkDownUs = m_linkDownUs;
+    if ( linkDownUs != 0 ){
+        m_linkDownUs = 0;
+        ESP_LOGI(TAG, "First datagram sent %lld ms after the link went down", (esp_timer_get_time() - linkDownUs) / 1000);
+    }
 }
 
 void N2kWifi::StartWifi() {
@@ -146,40 +270,30 @@ void N2kWifi::StartWifi() {
     ESP_ERROR_CHECK(esp_wifi_start());
 }
 
-void N2kWifi::WifiEventHandler(int32_t event_id, void *) {
-    char ssid[32]="xxx";
-    char pass[64]="xxx";
+void N2kWifi::WifiEventHandler(int32_t event_id, void *event_data) {
     switch (event_id) {
         case WIFI_EVENT_STA_START:
-            ESP_LOGI(TAG, "Start scan");
-            esp_wifi_scan_start(nullptr, false);
+            m_linkDownUs = esp_timer_get_time();
+            m_hasCachedAp = WifiApCache::Load(m_cachedAp);
+            if ( !ConnectToCachedAp() ){
+                ESP_LOGI(TAG, "Start scan");
+                StartScan();
+            }
             break;
         case WIFI_EVENT_SCAN_DONE:
-            ESP_LOGI(TAG, "Scan done");
-            if (CheckScanResults(ssid, pass)){
-                ESP_LOGI(TAG, "Will connect to %s", ssid);
-                // Read default config
-                wifi_config_t wifi_config = {};
-                ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
-                // Set desired ssid and password
-                strcpy((char *)wifi_config.sta.ssid, ssid);
-                strcpy((char *)wifi_config.sta.password, pass);
-                ESP_LOGI(TAG, "Setting WiFi configuration SSID %s...", wifi_config.sta.ssid);
-                ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-                // Start the connection  process
-                ESP_ERROR_CHECK(esp_wifi_connect());
-            }else{
-                ESP_LOGI(TAG, "No known SSID found, scan again");
-                esp_wifi_scan_start(nullptr, false);
+            if ( !CheckScanResults() ){
+                m_scanStep = (m_scanStep + 1) % WIFI_CHANNELS;
+                if ( m_scanStep == 0 ){
+                    ESP_LOGI(TAG, "No known SSID found, scan again");
+                }
+                StartScan();
             }
             break;
         case WIFI_EVENT_STA_CONNECTED:
-            StartServer();
+            OnConnected(event_data);
             break;
         case WIFI_EVENT_STA_DISCONNECTED:
-            StopServer();
-            ESP_LOGI(TAG, "Lost WiFi connection, scan again");
-            esp_wifi_scan_start(nullptr, false);
+            OnDisconnected();
             break;
         default:
             break;
@@ -193,6 +307,7 @@ void N2kWifi::StartServer() {
 
 void N2kWifi::StopServer() {
     isWifiConnected = false;
+    m_frameCursor.Wake();
 }
 
 int N2kWifi::CreateBoundUdpSocket()
@@ -239,6 +354,9 @@ void N2kWifi::ListenForUdpInput() {
         return;
     }
     ESP_LOGI(TAG, "Socket created");
+    for(RxSequence &rx : m_rxSeq){
+        rx.valid = false;
+    }
 
     struct timeval tv = {
             .tv_sec = 2,
@@ -262,7 +380,7 @@ void N2kWifi::ListenForUdpInput() {
 
         if (FD_ISSET(sock, &rfds)) {
             // Incoming datagram received
-            unsigned char recvbuf[MAX_UDP_FRAME_SIZE];
+            unsigned char recvbuf[MAX_UDP_BATCH_SIZE];
             char raddr_name[32] = { 0 };
 
             struct sockaddr_storage raddr{}; // Large enough for both IPv4 or IPv6
@@ -279,19 +397,184 @@ void N2kWifi::ListenForUdpInput() {
                     inet_ntoa_r(((struct sockaddr_in *)&raddr)->sin_addr,
                                 raddr_name, sizeof(raddr_name)-1);
             }
-            int net_id = 0;
-            memcpy(&net_id, recvbuf, 4);
-            int twai_id = ntohl(net_id);
-            unsigned char twai_len = recvbuf[4];
-
-            if( twai_len <= TWAI_FRAME_MAX_DLC ){
-                ESP_LOGD(TAG, "received %d bytes from %s: id=%08X len=%02X", len, raddr_name, twai_id, twai_len);
-                twaiBusSender.onSideIfcTwaiFrame(twai_id, twai_len, &recvbuf[5]);
+            if ( len == (int)strlen(TRACE_DUMP_CMD) && memcmp(recvbuf, TRACE_DUMP_CMD, len) == 0
+                    && raddr.ss_family == PF_INET ){
+                ESP_LOGI(TAG, "Trace dump requested by %s", raddr_name);
+                SendTraceDump(*(struct sockaddr_in *)&raddr);
+                continue;
+            }
+            if ( len == (int)strlen(BLACKBOX_DUMP_CMD) && memcmp(recvbuf, BLACKBOX_DUMP_CMD, len) == 0
+                    && raddr.ss_family == PF_INET ){
+                ESP_LOGI(TAG, "Black box dump requested by %s", raddr_name);
+                SendBlackBoxDump(*(struct sockaddr_in *)&raddr);
+                continue;
+            }
+
+            if ( len >= (int)strlen(SUBSCRIBE_CMD) && memcmp(recvbuf, SUBSCRIBE_CMD, strlen(SUBSCRIBE_CMD)) == 0
+                    && raddr.ss_family == PF_INET ){
+                char cmd[MAX_UDP_BATCH_SIZE + 1];
+                memcpy(cmd, recvbuf, len);
+                cmd[len] = 0;
+                onSubscribe(sock, cmd, *(struct sockaddr_in *)&raddr, raddr_name);
+                continue;
+            }
+            if ( len == (int)strlen(UNSUBSCRIBE_CMD) && memcmp(recvbuf, UNSUBSCRIBE_CMD, len) == 0
+                    && raddr.ss_family == PF_INET ){
+                onUnsubscribe(*(struct sockaddr_in *)&raddr, raddr_name);
+                continue;
+            }
+
+            if ( len > 0 && (recvbuf[0] == UDP_BATCH_VERSION || recvbuf[0] == UDP_MESSAGE_BATCH_VERSION)
+                    && raddr.ss_family == PF_INET ){
+                onBatchReceived(recvbuf, len, *(struct sockaddr_in *)&raddr, raddr_name);
             }else{
-                ESP_LOGE(TAG, "Invalid DLC %02X", twai_len);
+                onFrameReceived(recvbuf, len, raddr_name);
             }
         }
     }
+    close(sock);
+}
+
+void N2kWifi::onSubscribe(int sock, char *cmd, const struct sockaddr_in &raddr, const char *raddr_name) {
+    // SUBSCRIBE,<decimation_ms>[,<pgn>,<pgn>...]
+    char *savePtr = nullptr;
+    strtok_r(cmd, ",", &savePtr);
+    char *token = strtok_r(nullptr, ",", &savePtr);
+    int decimationMs = token != nullptr ? (int)strtol(token, nullptr, 10) : 0;
+    unsigned long pgns[MAX_CLIENT_PGNS];
+    int pgnCount = 0;
+    while ( pgnCount < MAX_CLIENT_PGNS && (token = strtok_r(nullptr, ",", &savePtr)) != nullptr ){
+        pgns[pgnCount++] = strtoul(token, nullptr, 10);
+    }
+
+    xSemaphoreTake(m_clientsMutex, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    UdpClient *client = nullptr;
+    for(UdpClient &c : m_clients){
+        if ( c.IsActive(now) && c.IsAddress(raddr) ){
+            client = &c;
+            break;
+        }
+    }
+    for(int i = 0; client == nullptr && i < MAX_UDP_CLIENTS; i++){
+        if ( !m_clients[i].IsActive(now) ){
+            client = &m_clients[i];
+        }
+    }
+    if ( client != nullptr ){
+        client->Subscribe(raddr, decimationMs, pgns, pgnCount, now);
+    }
+    xSemaphoreGive(m_clientsMutex);
+
+    char reply[32];
+    if ( client != nullptr ){
+        ESP_LOGI(TAG, "%s:%d subscribed to %d PGNs, decimation %d ms", raddr_name, ntohs(raddr.sin_port), pgnCount, decimationMs);
+        snprintf(reply, sizeof(reply), "SUBSCRIBED,%d", pgnCount);
+    }else{
+        ESP_LOGW(TAG, "No room for %s:%d", raddr_name, ntohs(raddr.sin_port));
+        snprintf(reply, sizeof(reply), "REJECTED");
+    }
+    sendto(sock, reply, strlen(reply), 0, (struct sockaddr *)&raddr, sizeof(raddr));
+}
+
+void N2kWifi::onUnsubscribe(const struct sockaddr_in &raddr, const char *raddr_name) {
+    xSemaphoreTake(m_clientsMutex, portMAX_DELAY);
+    for(UdpClient &c : m_clients){
+        if ( c.IsAddress(raddr) ){
+            ESP_LOGI(TAG, "%s:%d unsubscribed, %u frames and %u datagrams dropped", raddr_name, ntohs(raddr.sin_port),
+                     c.FrameDrops(), c.DatagramDrops());
+            c.Unsubscribe();
+        }
+    }
+    xSemaphoreGive(m_clientsMutex);
+}
+
+void N2kWifi::checkRxSequence(uint16_t seq, const struct sockaddr_in &raddr, const char *raddr_name) {
+    RxSequence *rx = nullptr;
+    for(RxSequence &r : m_rxSeq){
+        if ( r.valid && r.addr == raddr.sin_addr.s_addr && r.port == raddr.sin_port ){
+            rx = &r;
+            break;
+        }
+    }
+    if ( rx == nullptr ){
+        // New sender takes a free slot or the one of the sender not heard from for longest
+        rx = &m_rxSeq[0];
+        for(RxSequence &r : m_rxSeq){
+            if ( !r.valid || (rx->valid && r.lastSeenUs < rx->lastSeenUs) ){
+                rx = &r;
+            }
+        }
+        *rx = {raddr.sin_addr.s_addr, raddr.sin_port, seq, 0, false};
+    }
+
+    if ( rx->valid ){
+        uint16_t gap = seq - (uint16_t)(rx->seq + 1);
+        if ( gap != 0 && gap < 0x8000 ){
+            m_rxLostDatagrams += gap;
+            ESP_LOGW(TAG, "Lost %d datagrams from %s:%d, %u total", gap, raddr_name, ntohs(raddr.sin_port), m_rxLostDatagrams);
+        }
+    }
+    rx->seq = seq;
+    rx->lastSeenUs = esp_timer_get_time();
+    rx->valid = true;
+}
+
+void N2kWifi::onBatchReceived(const unsigned char *buf, int len, const struct sockaddr_in &raddr, const char *raddr_name) {
+    if ( len < UDP_BATCH_HEADER_SIZE ){
+        ESP_LOGE(TAG, "Short batch %d bytes from %s", len, raddr_name);
+        return;
+    }
+
+    checkRxSequence((buf[1] << 8) | buf[2], raddr, raddr_name);
+
+    int frameCount = buf[3];
+    int pos = UDP_BATCH_HEADER_SIZE;
+    for(int i = 0; i < frameCount; i++){
+        if ( pos >= len || pos + 1 + buf[pos] > len ){
+            ESP_LOGE(TAG, "Truncated batch from %s, frame %d of %d", raddr_name, i, frameCount);
+            return;
+        }
+        if ( buf[0] == UDP_MESSAGE_BATCH_VERSION ){
+            onMessageReceived(buf + pos + 1, buf[pos], raddr_name);
+        }else{
+            onFrameReceived(buf + pos + 1, buf[pos], raddr_name);
+        }
+        pos += 1 + buf[pos];
+    }
+}
+
+void N2kWifi::onMessageReceived(const unsigned char *buf, int len, const char *raddr_name) {
+    N2kStreamMessage msg;
+    if ( !N2kDecodeMessage(buf, len, msg) ){
+        ESP_LOGE(TAG, "Invalid message %d bytes from %s", len, raddr_name);
+        return;
+    }
+    ESP_LOGD(TAG, "received PGN %lu from %s", msg.pgn, raddr_name);
+    if ( !sideFrames.PostMessage(msg, m_splitter, 0) ){
+        ESP_LOGD(TAG, "Dropped PGN %lu len %d, %u rejected as too long for one frame", msg.pgn, msg.len, m_splitter.Rejected());
+    }
+}
+
+void N2kWifi::onFrameReceived(const unsigned char *buf, int len, const char *raddr_name) {
+    if ( len < 5 ){
+        ESP_LOGE(TAG, "Short frame %d bytes from %s", len, raddr_name);
+        return;
+    }
+
+    int net_id = 0;
+    memcpy(&net_id, buf, 4);
+    int twai_id = ntohl(net_id);
+    unsigned char twai_len = buf[4];
+
+    if( twai_len <= TWAI_FRAME_MAX_DLC && 5 + twai_len <= len ){
+        ESP_LOGD(TAG, "received %d bytes from %s: id=%08X len=%02X", len, raddr_name, twai_id, twai_len);
+        if ( !sideFrames.Post(twai_id, twai_len, &buf[5], 0) ){
+            ESP_LOGD(TAG, "Side frame queue full, dropped id=%08X", twai_id);
+        }
+    }else{
+        ESP_LOGE(TAG, "Invalid DLC %02X", twai_len);
+    }
 }
 
 void N2kWifi::BroadcastCanFramesOverUdp() {
@@ -318,65 +601,188 @@ void N2kWifi::BroadcastCanFramesOverUdp() {
     broadcastAddr.sin_port = htons(UDP_TX_PORT);         /* Broadcast port */
     broadcastAddr.sin_len = sizeof(broadcastAddr);
 
-    xQueueReset(txFrameQueue);
+    // Don't send the frames collected while we were disconnected
+    m_frameCursor.Reset();
 
-    while (isWifiConnected){
-        NetworkMsg msg{};
+    m_broadcastBatch.Reset();
+    const int64_t delayUs = m_batchDelayMs * 1000LL;
 
-        portBASE_TYPE evt_res = xQueueReceive(txFrameQueue, &msg, 1000 / portTICK_PERIOD_MS);
+    bool sendFailed = false;
+    TickType_t ticksToWait = 1000 / portTICK_PERIOD_MS;
+    while (isWifiConnected && !sendFailed){
+        TwaiFrame frames[MAX_FRAMES_PER_READ];
+        int n = m_frameCursor.Read(frames, MAX_FRAMES_PER_READ, ticksToWait);
 
-        if (evt_res == pdTRUE) {
-            if (msg.type == NetworkMsgType::WIFI_DISCONNECTED) {
-                ESP_LOGI(TAG, "Wifi disconnected");
-                break;
+        xSemaphoreTake(m_clientsMutex, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        bool broadcast = m_broadcastEnabled;
+
+        for(int f = 0; f < n && !sendFailed; f++){
+            if ( m_messageMode ){
+                N2kStreamMessage msg;
+                if ( m_assembler.Add(frames[f], msg) ){
+                    sendFailed = !queueMessage(msg, broadcast, sock, broadcastAddr, now);
+                }
+                continue;
             }
-            if( msg.type == NetworkMsgType::CAN_FRAME) {
-                unsigned char udp_data[MAX_UDP_FRAME_SIZE];
-                int net_id = htonl(msg.id);
-                memcpy(udp_data, &net_id, 4);
-                memcpy(udp_data + 4, &msg.len, 1);
-                for(int i = 0; i < msg.len; i++){
-                    udp_data[5 + i] = msg.pdu[i];
+            if ( broadcast ){
+                if ( !m_broadcastBatch.Fits(frames[f]) ){
+                    sendFailed = !flush(sock, broadcastAddr);
                 }
-                int len = 5 + msg.len;
-                int sent = sendto(sock, udp_data, len, 0, (struct sockaddr *)&broadcastAddr, sizeof(broadcastAddr));
-                if (sent < 0) {
-                    ESP_LOGE(TAG, "Failed to send CAN frame. Error %d", errno);
-                    break;
-                }else{
-                    ESP_LOGD(TAG, "Sent CAN frame %d bytes", sent);
+                m_broadcastBatch.Add(frames[f], now);
+            }
+            for(UdpClient &client : m_clients){
+                if ( client.IsActive(now) && client.Accepts(frames[f], now) ){
+                    client.Add(frames[f], sock, now);
                 }
             }
         }
+
+        // Send the datagrams that waited long enough and wake up in time to send the rest
+        int64_t oldestUs = now;
+        if ( !sendFailed && !m_broadcastBatch.Empty() ){
+            if ( now - m_broadcastBatch.StartUs() >= delayUs ){
+                sendFailed = !flush(sock, broadcastAddr);
+            }else{
+                oldestUs = m_broadcastBatch.StartUs();
+            }
+        }
+        for(UdpClient &client : m_clients){
+            if ( client.IsActive(now) ){
+                bool hadPending = client.HasPending();
+                client.Flush(sock, delayUs, now);
+                if ( hadPending && !client.HasPending() ){
+                    NoteDatagramSent();
+                }
+                if ( client.HasPending() && client.PendingSinceUs() < oldestUs ){
+                    oldestUs = client.PendingSinceUs();
+                }
+            }
+        }
+        xSemaphoreGive(m_clientsMutex);
+
+        ticksToWait = oldestUs < now ? (oldestUs + delayUs - now) / 1000 / portTICK_PERIOD_MS + 1
+                                     : 1000 / portTICK_PERIOD_MS;
     }
     close(sock);
 }
 
-void N2kWifi::onTwaiFrameReceived(unsigned long id, unsigned char len, const unsigned char *buf) {
-    ESP_LOGD(TAG, "onTwaiFrameReceived CAN frame %08lX %02X", id, len);
-    NetworkMsg msg{};
-    msg.type = NetworkMsgType::CAN_FRAME;
-    msg.id = id;
-    msg.len = len;
-    memcpy(msg.pdu, buf, len);
-    if( !xQueueSend(txFrameQueue, &msg, 0) ){
-        ESP_LOGD(TAG, "onTwaiFrameReceived Failed to send CAN frame to queue");
+bool N2kWifi::queueMessage(const N2kStreamMessage &msg, bool broadcast, int sock, const struct sockaddr_in &addr,
+                           int64_t nowUs) {
+    unsigned char record[N2K_MAX_ENCODED_MESSAGE];
+    int len = N2kEncodeMessage(msg, record);
+
+    bool sendFailed = false;
+    if ( broadcast ){
+        if ( !m_broadcastBatch.FitsRecord(len) ){
+            sendFailed = !flush(sock, addr);
+        }
+        m_broadcastBatch.AddRecord(record, len, nowUs);
     }
+    for(UdpClient &client : m_clients){
+        if ( client.IsActive(nowUs) && client.AcceptsPgn(msg.pgn, msg.source, true, nowUs) ){
+            client.AddRecord(record, len, sock, nowUs);
+        }
+    }
+    return !sendFailed;
 }
 
-void N2kWifi::onTwaiFrameTransmit(unsigned long id, unsigned char len, const unsigned char *buf) {
-    ESP_LOGD(TAG, "onTwaiFrameTransmit CAN frame %08lX %02X", id, len);
-    NetworkMsg msg{};
-    msg.type = NetworkMsgType::CAN_FRAME;
-    msg.id = id;
-    msg.len = len;
-    memcpy(msg.pdu, buf, len);
-    if ( !xQueueSend(txFrameQueue, &msg, 0) ){
-        ESP_LOGD(TAG, "onTwaiFrameTransmit Failed to send CAN frame to queue");
+void N2kWifi::SetMessageMode(bool enable) {
+    m_messageMode = enable;
+    unsigned char version = enable ? UDP_MESSAGE_BATCH_VERSION : UDP_BATCH_VERSION;
+    m_broadcastBatch.SetVersion(version);
+    for(UdpClient &client : m_clients){
+        client.SetVersion(version);
     }
 }
 
-void N2kWifi::flush() {
+bool N2kWifi::flush(int sock, const struct sockaddr_in &addr) {
+    if ( m_broadcastBatch.Empty() ){
+        return true;
+    }
 
+    int sent = m_broadcastBatch.Send(sock, addr, 0);
+    if (sent < 0) {
+        ESP_LOGE(TAG, "Failed to send CAN frames. Error %d", errno);
+        return false;
+    }
+    ESP_LOGD(TAG, "Sent %d bytes of CAN frames", sent);
+    NoteDatagramSent();
+    return true;
 }
 
+/// Sends trace events as UDP datagrams, each one carrying the array of TraceEvent structures
+class UdpTraceSink: public TraceSink {
+public:
+    UdpTraceSink(int sock, const struct sockaddr_in &addr): m_sock(sock), m_addr(addr) {}
+    void write(const TraceEvent *events, int count) override {
+        const int maxEventsPerDatagram = 100;
+        for(int i = 0; i < count; i += maxEventsPerDatagram){
+            int n = count - i < maxEventsPerDatagram ? count - i : maxEventsPerDatagram;
+            if ( sendto(m_sock, &events[i], n * sizeof(TraceEvent), 0, (struct sockaddr *)&m_addr, sizeof(m_addr)) < 0 ){
+                ESP_LOGE(TAG, "Failed to send trace. Error %d", errno);
+                return;
+            }
+        }
+    }
+private:
+    int m_sock;
+    struct sockaddr_in m_addr;
+};
+
+void N2kWifi::SendTraceDump(const struct sockaddr_in &requester) {
+    int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket. Error %d", errno);
+        return;
+    }
+
+    struct sockaddr_in addr = requester;
+    addr.sin_port = htons(UDP_TRACE_PORT);
+    UdpTraceSink sink(sock, addr);
+    int count = Trace::Dump(sink);
+    ESP_LOGI(TAG, "Sent %d trace events", count);
+    close(sock);
+}
+
+/// Sends black box records as UDP datagrams, each one carrying 4 bytes little endian datagram sequence number
+/// followed by the array of BlackBoxRecord structures, so the receiver can tell the lost datagrams
+class UdpBlackBoxSink: public BlackBoxSink {
+public:
+    static const int MAX_RECORDS = 16;
+    UdpBlackBoxSink(int sock, const struct sockaddr_in &addr): m_sock(sock), m_addr(addr) {}
+    void write(const BlackBoxRecord *records, int count) override {
+        for(int i = 0; i < count; i += MAX_RECORDS){
+            int n = count - i < MAX_RECORDS ? count - i : MAX_RECORDS;
+            memcpy(m_buf, &m_seq, sizeof(m_seq));
+            memcpy(m_buf + sizeof(m_seq), &records[i], n * sizeof(BlackBoxRecord));
+            if ( sendto(m_sock, m_buf, sizeof(m_seq) + n * sizeof(BlackBoxRecord), 0,
+                        (struct sockaddr *)&m_addr, sizeof(m_addr)) < 0 ){
+                ESP_LOGE(TAG, "Failed to send black box records. Error %d", errno);
+            }
+            m_seq++;
+            // The whole partition is sent at once, give lwIP a chance to empty its buffers
+            vTaskDelay(1);
+        }
+    }
+private:
+    int m_sock;
+    struct sockaddr_in m_addr;
+    uint32_t m_seq = 0;
+    uint8_t m_buf[sizeof(uint32_t) + MAX_RECORDS * sizeof(BlackBoxRecord)];
+};
+
+void N2kWifi::SendBlackBoxDump(const struct sockaddr_in &requester) {
+    int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket. Error %d", errno);
+        return;
+    }
+
+    struct sockaddr_in addr = requester;
+    addr.sin_port = htons(UDP_TRACE_PORT);
+    UdpBlackBoxSink sink(sock, addr);
+    int count = BlackBox::Dump(sink);
+    ESP_LOGI(TAG, "Sent %d black box records", count);
+    close(sock);
+}
@@ -3,8 +3,15 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "N2kMessages.h"
 #include "../NMEA2000_esp32_twai/NMEA2000_esp32_twai.h"
+#include "TwaiFrameRing.h"
+#include "SideFrameQueue.h"
+#include "N2kMessageStream.h"
+#include "UdpBatch.h"
+#include "UdpClient.h"
+#include "WifiApCache.h"
 enum NetworkMsgType {
     CAN_FRAME
     ,WIFI_CONNECTED
@@ -24,33 +31,94 @@ struct SsidPassList{
 };
 const int UDP_RX_PORT = 2023;
 const int UDP_TX_PORT = 2024;
-const int DEFAULT_SCAN_LIST_SIZE = 256;
+const int UDP_TRACE_PORT = 2025;  // Trace and black box dumps are sent to this port of the requester
+static const char *const TRACE_DUMP_CMD = "TRACE";
+static const char *const BLACKBOX_DUMP_CMD = "BLACKBOX";
+// Channels are scanned one at a time, this many results are read on the stack, more of them on the heap
+const int SCAN_BATCH_SIZE = 16;
+const int WIFI_CHANNELS = 13;
 
-class N2kWifi : public TwaiBusListener {
+const int MAX_UDP_CLIENTS = 4;
+// Senders of the batched datagrams tracked for the lost datagram count, the one not heard from for longest is replaced
+const int MAX_UDP_RX_SOURCES = 4;
+
+class N2kWifi {
 public:
-    N2kWifi(SideTwaiBusInterface &twaiBusSender);
+    explicit N2kWifi(SideFrameQueue &sideFrames, int batchDelayMs = DEFAULT_UDP_BATCH_DELAY_MS);
     void Start();
     [[noreturn]] void TransmitFrameTask();
     [[noreturn]] void ReceiveFrameTask();
 
     void WifiEventHandler(int32_t event_id, void *event_data);
-    void onTwaiFrameReceived(unsigned long id, unsigned char len, const unsigned char *buf) override;
-    void onTwaiFrameTransmit(unsigned long id, unsigned char len, const unsigned char *buf) override;
-    void flush() override;
+    // Frames seen on the bus are read with this cursor
+    TwaiFrameCursor &FrameCursor() { return m_frameCursor; }
+    // Send whole N2K messages instead of CAN frames, must be set before Start()
+    // Both frames and messages are accepted from the clients regardless of the mode
+    void SetMessageMode(bool enable);
+    // Broadcast to UDP_TX_PORT goes on regardless of the unicast clients unless it's disabled here
+    void SetBroadcast(bool enable) { m_broadcastEnabled = enable; }
 
 private:
-    static bool CheckScanResults(char *ssid, char *password);
+    static const int MAX_FRAMES_PER_READ = 16;
+
+    static const SsidPassList *FindKnownSsid(const char *ssid);
+    bool ConnectToCachedAp();
+    void StartScan();
+    bool CheckScanResults();
+    void Connect(const SsidPassList &known, const uint8_t *bssid, uint8_t channel);
+    void OnConnected(const void *event_data);
+    void OnDisconnected();
     void StartWifi();
     void StartServer();
     void StopServer();
     void ListenForUdpInput();
+    static void SendTraceDump(const struct sockaddr_in &requester);
+    static void SendBlackBoxDump(const struct sockaddr_in &requester);
+    bool flush(int sock, const struct sockaddr_in &addr);
+    void onSubscribe(int sock, char *cmd, const struct sockaddr_in &raddr, const char *raddr_name);
+    void onUnsubscribe(const struct sockaddr_in &raddr, const char *raddr_name);
+    void onBatchReceived(const unsigned char *buf, int len, const struct sockaddr_in &raddr, const char *raddr_name);
+    void checkRxSequence(uint16_t seq, const struct sockaddr_in &raddr, const char *raddr_name);
+    void onFrameReceived(const unsigned char *buf, int len, const char *raddr_name);
+    void onMessageReceived(const unsigned char *buf, int len, const char *raddr_name);
+    bool queueMessage(const N2kStreamMessage &msg, bool broadcast, int sock, const struct sockaddr_in &addr, int64_t nowUs);
 
 private:
-    SideTwaiBusInterface &twaiBusSender;
-    xQueueHandle txFrameQueue;
+    SideFrameQueue &sideFrames;
+    TwaiFrameCursor m_frameCursor{"wifi"};
     xQueueHandle rxFrameQueue;
     bool volatile isWifiConnected = false;
 
+    // Fast reconnect, only touched by the Wi-Fi event loop
+    CachedAp m_cachedAp{};
+    bool m_hasCachedAp = false;
+    bool m_connectingToCachedAp = false;
+    int m_scanStep = 0;   // Position in the channel scan order
+    // Time the link went down, the time to the first datagram sent after the connection is logged
+    int64_t volatile m_linkDownUs = 0;
+    void NoteDatagramSent();
+
+    const int m_batchDelayMs;
+    UdpBatch m_broadcastBatch;
+    bool m_messageMode = false;
+    N2kMessageAssembler m_assembler;
+    N2kMessageSplitter m_splitter;
+
+    bool volatile m_broadcastEnabled = true;
+    UdpClient m_clients[MAX_UDP_CLIENTS];
+    SemaphoreHandle_t m_clientsMutex;
+
+    // Each sender numbers its datagrams on its own
+    struct RxSequence {
+        uint32_t addr;
+        uint16_t port;
+        uint16_t seq;
+        int64_t lastSeenUs;
+        bool valid;
+    };
+    RxSequence m_rxSeq[MAX_UDP_RX_SOURCES]{};
+    uint32_t m_rxLostDatagrams = 0;
+
     void BroadcastCanFramesOverUdp();
 
     static int CreateBoundUdpSocket();
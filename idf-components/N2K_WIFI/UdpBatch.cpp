@@ -0,0 +1,41 @@
+#include <cstring>
+#include "UdpBatch.h"
+
+void UdpBatch::Add(const TwaiFrame &frame, int64_t nowUs) {
+    unsigned char record[5 + sizeof(frame.data)];
+    int net_id = htonl(frame.id);
+    memcpy(record, &net_id, 4);
+    record[4] = frame.len;
+    memcpy(record + 5, frame.data, frame.len);
+    AddRecord(record, 5 + frame.len, nowUs);
+}
+
+void UdpBatch::AddRecord(const unsigned char *record, int len, int64_t nowUs) {
+    if ( m_frames == 0 ){
+        m_startUs = nowUs;
+    }
+
+    m_buf[m_len] = len;
+    memcpy(m_buf + m_len + 1, record, len);
+    m_len += 1 + len;
+    m_frames++;
+}
+
+int UdpBatch::Send(int sock, const struct sockaddr_in &addr, int flags) {
+    m_buf[0] = m_version;
+    m_buf[1] = m_seq >> 8;
+    m_buf[2] = m_seq & 0xFF;
+    m_buf[3] = m_frames;
+
+    int sent = sendto(sock, m_buf, m_len, flags, (struct sockaddr *)&addr, sizeof(addr));
+    m_seq++;  // Gap in the sequence tells the receiver about the datagram that failed to send
+    m_len = UDP_BATCH_HEADER_SIZE;
+    m_frames = 0;
+    return sent;
+}
+
+void UdpBatch::Reset() {
+    m_len = UDP_BATCH_HEADER_SIZE;
+    m_frames = 0;
+    m_seq = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef IMU2NMEA_UDPBATCH_H
+#define IMU2NMEA_UDPBATCH_H
+
+#include <cstdint>
+#include <lwip/sockets.h>
+#include "TwaiFrameRing.h"
+
+/*
+    Batched UDP datagram carrying several CAN frames, used on both UDP_TX_PORT and UDP_RX_PORT
+    Byte 0: Version, UDP_BATCH_VERSION for CAN frames, UDP_MESSAGE_BATCH_VERSION for whole N2K messages
+    Byte 1-2: Sequence number, big endian, incremented by one for each datagram
+    Byte 3: Number of frames to follow
+    Repeated for each frame:
+    Byte 0: Number of bytes to follow, 5 + DLC
+    Byte 1-4: CAN ID, big endian
+    Byte 5: DLC
+    Byte 6-13: Data
+    In message mode each record after the length byte is the message encoded as described in N2kMessageStream.h
+
+    The legacy datagram with single frame (CAN ID, DLC, Data) is still accepted on UDP_RX_PORT.
+    It starts with the upper byte of 29 bit CAN ID, so it never starts with UDP_BATCH_VERSION.
+ */
+const unsigned char UDP_BATCH_VERSION = 0x81;
+const unsigned char UDP_MESSAGE_BATCH_VERSION = 0x82;
+const int UDP_BATCH_HEADER_SIZE = 4;
+const int MAX_UDP_BATCH_SIZE = 1400;            // Fits into single Ethernet MTU
+const int DEFAULT_UDP_BATCH_DELAY_MS = 20;      // The frame waits no longer than that for the datagram to fill up
+
+/// CAN frames collected into single batched datagram
+class UdpBatch {
+public:
+    bool Empty() const { return m_frames == 0; }
+    bool Fits(const TwaiFrame &frame) const { return FitsRecord(5 + frame.len); }
+    bool FitsRecord(int len) const { return m_len + 1 + len <= MAX_UDP_BATCH_SIZE; }
+    /// Time when the oldest frame was added
+    int64_t StartUs() const { return m_startUs; }
+    void Add(const TwaiFrame &frame, int64_t nowUs);
+    /// Add record of up to 255 bytes, e.g. encoded N2K message
+    void AddRecord(const unsigned char *record, int len, int64_t nowUs);
+    void SetVersion(unsigned char version) { m_version = version; }
+    /// Send the datagram and start the new one. Returns sendto() result
+    int Send(int sock, const struct sockaddr_in &addr, int flags);
+    /// Forget the frames and the sequence number, e.g. for the new client
+    void Reset();
+
+private:
+    unsigned char m_buf[MAX_UDP_BATCH_SIZE]{};
+    int m_len = UDP_BATCH_HEADER_SIZE;
+    int m_frames = 0;
+    int64_t m_startUs = 0;
+    uint16_t m_seq = 0;
+    unsigned char m_version = UDP_BATCH_VERSION;
+};
+
+#endif //IMU2NMEA_UDPBATCH_H
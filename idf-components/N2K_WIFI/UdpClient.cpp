@@ -0,0 +1,85 @@
+#include <esp_log.h>
+#include "UdpClient.h"
+#include "N2kCanId.h"
+
+static const char *TAG = "imu2nmea_UdpClient";
+
+bool UdpClient::IsActive(int64_t nowUs) const {
+    return m_subscribed && nowUs - m_lastSeenUs < UDP_CLIENT_TIMEOUT_SEC * 1000000LL;
+}
+
+bool UdpClient::IsAddress(const struct sockaddr_in &addr) const {
+    return m_addr.sin_addr.s_addr == addr.sin_addr.s_addr && m_addr.sin_port == addr.sin_port;
+}
+
+void UdpClient::Subscribe(const struct sockaddr_in &addr, int decimationMs, const unsigned long *pgns, int pgnCount,
+                          int64_t nowUs) {
+    if ( !m_subscribed || !IsAddress(addr) ){
+        // New client starts with empty buffer and sequence number
+        m_addr = addr;
+        m_batch.Reset();
+        m_frameDrops = 0;
+        m_datagramDrops = 0;
+        m_backoffUs = 0;
+        m_backoffUntilUs = 0;
+        m_filter.Reset();
+    }
+
+    m_subscribed = true;
+    m_lastSeenUs = nowUs;
+    // Renewal with the same PGNs keeps the messages in flight going
+    m_filter.Set(decimationMs, pgns, pgnCount);
+}
+
+void UdpClient::Unsubscribe() {
+    m_subscribed = false;
+}
+
+bool UdpClient::Accepts(const TwaiFrame &frame, int64_t nowUs) {
+    unsigned long pgn = N2kCanIdPgn(frame.id);
+    bool firstFrame = !N2kIsFastPacketPgn(pgn) || (frame.data[0] & 0x1F) == 0;
+    return AcceptsPgn(pgn, N2kCanIdSource(frame.id), firstFrame, nowUs);
+}
+
+bool UdpClient::AcceptsPgn(unsigned long pgn, uint8_t source, bool firstFrame, int64_t nowUs) {
+    UdpClientFilter::Result result = m_filter.Accepts(pgn, source, firstFrame, nowUs < m_backoffUntilUs, nowUs);
+    if ( result == UdpClientFilter::Result::CONGESTED ){
+        m_frameDrops++;
+    }
+    return result == UdpClientFilter::Result::PASSED;
+}
+
+void UdpClient::Add(const TwaiFrame &frame, int sock, int64_t nowUs) {
+    if ( !m_batch.Fits(frame) ){
+        Send(sock, nowUs);
+    }
+    m_batch.Add(frame, nowUs);
+}
+
+void UdpClient::AddRecord(const unsigned char *record, int len, int sock, int64_t nowUs) {
+    if ( !m_batch.FitsRecord(len) ){
+        Send(sock, nowUs);
+    }
+    m_batch.AddRecord(record, len, nowUs);
+}
+
+void UdpClient::Flush(int sock, int64_t delayUs, int64_t nowUs) {
+    if ( !m_batch.Empty() && nowUs - m_batch.StartUs() >= delayUs ){
+        Send(sock, nowUs);
+    }
+}
+
+void UdpClient::Send(int sock, int64_t nowUs) {
+    // Don't wait for the lwIP buffers, other clients must not be delayed by this one
+    if ( m_batch.Send(sock, m_addr, MSG_DONTWAIT) < 0 ){
+        m_datagramDrops++;
+        m_backoffUs = m_backoffUs == 0 ? MIN_BACKOFF_US : m_backoffUs * 2;
+        if ( m_backoffUs > MAX_BACKOFF_US ){
+            m_backoffUs = MAX_BACKOFF_US;
+        }
+        m_backoffUntilUs = nowUs + m_backoffUs;
+        ESP_LOGD(TAG, "Client congested, error %d, backing off for %d ms", errno, (int)(m_backoffUs / 1000));
+    }else{
+        m_backoffUs = 0;
+    }
+}
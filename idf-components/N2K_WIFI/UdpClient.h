@@ -0,0 +1,68 @@
+#ifndef IMU2NMEA_UDPCLIENT_H
+#define IMU2NMEA_UDPCLIENT_H
+
+#include <cstdint>
+#include <lwip/sockets.h>
+#include "TwaiFrameRing.h"
+#include "UdpBatch.h"
+#include "UdpClientFilter.h"
+
+/*
+    Client registers by sending the text datagram to UDP_RX_PORT
+    SUBSCRIBE,<decimation_ms>[,<pgn>,<pgn>...]
+    and receives the batched datagrams of matching frames unicast to the address and port it sent the command from.
+    Empty PGN list means all PGNs. With non-zero decimation_ms each listed PGN is sent no more often than that
+    from each source address. Fast packets are sent whole or not at all, see UdpClientFilter.
+    The device replies with SUBSCRIBED,<number of PGNs> or REJECTED if there is no room for one more client.
+    Client has to repeat SUBSCRIBE at least every UDP_CLIENT_TIMEOUT_SEC seconds, UNSUBSCRIBE stops the stream.
+ */
+static const char *const SUBSCRIBE_CMD = "SUBSCRIBE";
+static const char *const UNSUBSCRIBE_CMD = "UNSUBSCRIBE";
+const int UDP_CLIENT_TIMEOUT_SEC = 30;
+
+/// Client subscribed to the unicast stream with its own PGN filter and send buffer
+class UdpClient {
+public:
+    bool IsActive(int64_t nowUs) const;
+    bool IsAddress(const struct sockaddr_in &addr) const;
+    void Subscribe(const struct sockaddr_in &addr, int decimationMs, const unsigned long *pgns, int pgnCount, int64_t nowUs);
+    void Unsubscribe();
+
+    /// Frame passes PGN filter and decimation and the client isn't congested
+    bool Accepts(const TwaiFrame &frame, int64_t nowUs);
+    /// Same for the frame of the message from the source or the whole message if firstFrame is set
+    bool AcceptsPgn(unsigned long pgn, uint8_t source, bool firstFrame, int64_t nowUs);
+    /// Add frame to the send buffer, sending it first if it's full
+    void Add(const TwaiFrame &frame, int sock, int64_t nowUs);
+    /// Add encoded N2K message to the send buffer, sending it first if it's full
+    void AddRecord(const unsigned char *record, int len, int sock, int64_t nowUs);
+    void SetVersion(unsigned char version) { m_batch.SetVersion(version); }
+    /// Send the buffered frames if the oldest one is older than delayUs
+    void Flush(int sock, int64_t delayUs, int64_t nowUs);
+    bool HasPending() const { return !m_batch.Empty(); }
+    int64_t PendingSinceUs() const { return m_batch.StartUs(); }
+
+    const struct sockaddr_in &Address() const { return m_addr; }
+    /// Frames not queued because the link was congested
+    uint32_t FrameDrops() const { return m_frameDrops; }
+    /// Datagrams lwIP could not take
+    uint32_t DatagramDrops() const { return m_datagramDrops; }
+
+private:
+    void Send(int sock, int64_t nowUs);
+
+    static const int64_t MIN_BACKOFF_US = 10000;
+    static const int64_t MAX_BACKOFF_US = 1000000;
+
+    struct sockaddr_in m_addr{};
+    bool m_subscribed = false;
+    int64_t m_lastSeenUs = 0;
+    UdpClientFilter m_filter;
+    UdpBatch m_batch;
+    int64_t m_backoffUs = 0;
+    int64_t m_backoffUntilUs = 0;
+    uint32_t m_frameDrops = 0;
+    uint32_t m_datagramDrops = 0;
+};
+
+#endif //IMU2NMEA_UDPCLIENT_H
@@ -0,0 +1,103 @@
+#include "UdpClientFilter.h"
+#include "N2kCanId.h"
+
+void UdpClientFilter::Set(int decimationMs, const unsigned long *pgns, int pgnCount) {
+    int count = pgnCount < MAX_CLIENT_PGNS ? pgnCount : MAX_CLIENT_PGNS;
+    bool same = decimationMs * 1000LL == m_decimationUs && count == m_pgnCount;
+    for(int i = 0; same && i < count; i++){
+        same = m_pgns[i] == pgns[i];
+    }
+    if ( same ){
+        return;
+    }
+    m_decimationUs = decimationMs * 1000LL;
+    m_pgnCount = count;
+    for(int i = 0; i < count; i++){
+        m_pgns[i] = pgns[i];
+    }
+    Reset();
+}
+
+void UdpClientFilter::Reset() {
+    for(MessageState &state : m_states){
+        state.used = false;
+    }
+}
+
+bool UdpClientFilter::isListed(unsigned long pgn) const {
+    if ( m_pgnCount == 0 ){
+        return true;
+    }
+    for(int i = 0; i < m_pgnCount; i++){
+        if ( m_pgns[i] == pgn ){
+            return true;
+        }
+    }
+    return false;
+}
+
+UdpClientFilter::MessageState *UdpClientFilter::find(unsigned long pgn, uint8_t source) {
+    for(MessageState &state : m_states){
+        if ( state.used && state.pgn == pgn && state.source == source ){
+            return &state;
+        }
+    }
+    return nullptr;
+}
+
+UdpClientFilter::MessageState *UdpClientFilter::add(unsigned long pgn, uint8_t source, int64_t nowUs) {
+    MessageState *oldest = &m_states[0];
+    for(MessageState &state : m_states){
+        if ( !state.used ){
+            oldest = &state;
+            break;
+        }
+        if ( state.lastSeenUs < oldest->lastSeenUs ){
+            oldest = &state;
+        }
+    }
+    *oldest = MessageState{};
+    oldest->pgn = pgn;
+    oldest->source = source;
+    oldest->used = true;
+    oldest->lastSentUs = nowUs - m_decimationUs;
+    return oldest;
+}
+
+UdpClientFilter::Result UdpClientFilter::Accepts(unsigned long pgn, uint8_t source, bool firstFrame, bool congested,
+                                                 int64_t nowUs) {
+    if ( !isListed(pgn) ){
+        return Result::FILTERED;
+    }
+
+    MessageState *state = find(pgn, source);
+    if ( !firstFrame ){
+        if ( state == nullptr ){
+            return Result::FILTERED;    // Subscribed in the middle of the message or its state was replaced
+        }
+        state->lastSeenUs = nowUs;
+        return state->result;
+    }
+
+    bool decimated = m_pgnCount > 0 && m_decimationUs > 0;
+    if ( state == nullptr && (decimated || N2kIsFastPacketPgn(pgn)) ){
+        state = add(pgn, source, nowUs);
+    }
+
+    // The link to this client is congested, don't let its buffer hold the frames that will be obsolete anyway
+    Result result = Result::PASSED;
+    if ( congested ){
+        result = Result::CONGESTED;
+    }else if ( decimated && nowUs - state->lastSentUs < m_decimationUs ){
+        result = Result::FILTERED;
+    }
+
+    if ( state != nullptr ){
+        state->lastSeenUs = nowUs;
+        state->result = result;
+        if ( result == Result::PASSED ){
+            state->lastSentUs = nowUs;
+        }
+    }
+    return result;
+}
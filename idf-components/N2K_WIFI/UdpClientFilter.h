@@ -0,0 +1,52 @@
+#ifndef IMU2NMEA_UDPCLIENTFILTER_H
+#define IMU2NMEA_UDPCLIENTFILTER_H
+
+#include <cstdint>
+
+const int MAX_CLIENT_PGNS = 16;
+
+/// Decides which frames go to the UDP client: PGN list, decimation and the congestion backoff.
+/// Everything is decided on the first frame of the message, the rest of its frames follow that decision,
+/// so the client gets the whole fast packet or none of it. The decision and the decimation time are kept
+/// per PGN and source address, the same PGN from the other source is neither mixed in nor starved.
+/// The code has no ESP-IDF dependencies, so the host tools can use it as is.
+class UdpClientFilter {
+public:
+    enum class Result {
+        PASSED,
+        FILTERED,       // Not subscribed to, decimated or the first frame wasn't seen
+        CONGESTED,      // Dropped because of the congestion backoff
+    };
+
+    /// The state of the messages is kept if the subscription is only renewed
+    void Set(int decimationMs, const unsigned long *pgns, int pgnCount);
+    /// Forget the state of the messages, e.g. for the new client
+    void Reset();
+    /// firstFrame is set for the single frame and for the whole message as well
+    Result Accepts(unsigned long pgn, uint8_t source, bool firstFrame, bool congested, int64_t nowUs);
+
+private:
+    // Fast packets in flight and the decimated PGNs from each source, the least recently seen one is replaced.
+    // The replaced decimated one is sent a bit earlier, no harm done
+    static const int MAX_MESSAGE_STATES = 32;
+
+    struct MessageState {
+        unsigned long pgn;
+        int64_t lastSentUs;
+        int64_t lastSeenUs;
+        uint8_t source;
+        bool used;
+        Result result;      // Of the first frame
+    };
+
+    bool isListed(unsigned long pgn) const;
+    MessageState *find(unsigned long pgn, uint8_t source);
+    MessageState *add(unsigned long pgn, uint8_t source, int64_t nowUs);
+
+    int64_t m_decimationUs = 0;
+    unsigned long m_pgns[MAX_CLIENT_PGNS]{};
+    int m_pgnCount = 0;
+    MessageState m_states[MAX_MESSAGE_STATES]{};
+};
+
+#endif //IMU2NMEA_UDPCLIENTFILTER_H
@@ -0,0 +1,51 @@
+#include <cstring>
+#include <nvs.h>
+#include <esp_log.h>
+#include "WifiApCache.h"
+
+static const char *TAG = "imu2nmea_WifiApCache";
+
+bool WifiApCache::Load(CachedAp &ap) {
+    nvs_handle_t handle;
+    if ( nvs_open(NVS_WIFI_NAMESPACE, NVS_READONLY, &handle) != ESP_OK ){
+        return false;
+    }
+    size_t len = sizeof(ap);
+    esp_err_t err = nvs_get_blob(handle, NVS_KEY_LAST_AP, &ap, &len);
+    nvs_close(handle);
+    if ( err != ESP_OK || len != sizeof(ap) ){
+        return false;
+    }
+    ap.ssid[sizeof(ap.ssid) - 1] = '\0';
+    return true;
+}
+
+void WifiApCache::Save(const CachedAp &ap) {
+    CachedAp stored{};
+    if ( Load(stored) && memcmp(&stored, &ap, sizeof(ap)) == 0 ){
+        return;
+    }
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_WIFI_NAMESPACE, NVS_READWRITE, &handle);
+    if ( err != ESP_OK ){
+        ESP_LOGE(TAG, "Error (%s) opening NVS handle", esp_err_to_name(err));
+        return;
+    }
+    err = nvs_set_blob(handle, NVS_KEY_LAST_AP, &ap, sizeof(ap));
+    if ( err == ESP_OK ){
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    ESP_LOGI(TAG, "Saved AP %s channel %d: %s", ap.ssid, ap.channel, esp_err_to_name(err));
+}
+
+void WifiApCache::Forget() {
+    nvs_handle_t handle;
+    if ( nvs_open(NVS_WIFI_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK ){
+        return;
+    }
+    nvs_erase_key(handle, NVS_KEY_LAST_AP);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
@@ -0,0 +1,28 @@
+#ifndef IMU2NMEA_WIFIAPCACHE_H
+#define IMU2NMEA_WIFIAPCACHE_H
+
+#include <cstdint>
+
+static const char *const NVS_WIFI_NAMESPACE = "n2kwifi";
+static const char *const NVS_KEY_LAST_AP = "last_ap";
+
+/// Access point the station was connected to last time
+struct CachedAp {
+    char ssid[33];
+    uint8_t bssid[6];
+    uint8_t channel;
+};
+
+/// Keeps the last access point in NVS, so after the reboot or the lost connection the station connects to it
+/// on its channel right away instead of scanning all channels first.
+/// NVS flash must be initialized by the application.
+class WifiApCache {
+public:
+    /// Returns false if nothing is stored
+    static bool Load(CachedAp &ap);
+    /// Written only if it differs from what is stored, so the flash isn't worn out by the reconnects to the same AP
+    static void Save(const CachedAp &ap);
+    static void Forget();
+};
+
+#endif //IMU2NMEA_WIFIAPCACHE_H
@@ -0,0 +1,109 @@
+#include <cstdio>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/ringbuf.h"
+#include "BinLog.h"
+
+static const char *TAG = "mhu2nmea_BinLog";
+
+static RingbufHandle_t s_ringBuf = nullptr;
+
+// Up to that many record bytes are packed into one console line
+static const size_t LINE_RECORDS_LEN = 96;
+
+std::atomic<uint32_t> BinLog::s_dropped(0);
+
+void BinLog::PutString(uint8_t *rec, size_t &len, bool &truncated, const char *s) {
+    size_t strLen = s == nullptr ? 0 : strnlen(s, MAX_STR_LEN + 1);
+    bool cut = strLen > MAX_STR_LEN;
+    if ( cut ){
+        strLen = MAX_STR_LEN;
+    }
+    if ( truncated || len + 1 + strLen > MAX_RECORD_LEN ){
+        truncated = true;
+        return;
+    }
+    rec[len++] = strLen | (cut ? TRUNCATED_FLAG : 0);
+    memcpy(rec + len, s, strLen);
+    len += strLen;
+}
+
+void BinLog::Commit(uint8_t *rec, size_t len, bool truncated, uint32_t fmtId, esp_log_level_t level) {
+    auto timestampUs = (uint32_t)esp_timer_get_time();
+    memcpy(rec, &fmtId, 4);
+    memcpy(rec + 4, &timestampUs, 4);
+    rec[8] = level;
+    rec[9] = (len - HEADER_LEN) | (truncated ? TRUNCATED_FLAG : 0);
+
+    // Records are dropped until the task is started or if the console can't keep up
+    if ( s_ringBuf == nullptr || xRingbufferSend(s_ringBuf, rec, len, 0) != pdTRUE ){
+        s_dropped++;
+    }
+}
+
+static void binlog_task(void *) {
+    BinLog::Task();
+}
+
+void BinLog::Start() {
+    s_ringBuf = xRingbufferCreate(RING_SIZE, RINGBUF_TYPE_NOSPLIT);
+    if ( s_ringBuf == nullptr ){
+        ESP_LOGE(TAG, "Failed to create ring buffer");
+        return;
+    }
+
+    xTaskCreate(
+            binlog_task,      /* Function that implements the task. */
+            "BinLogTask",     /* Text name for the task. */
+            4 * 1024,         /* Stack size in words, not bytes. */
+            nullptr,          /* Parameter passed into the task. */
+            tskIDLE_PRIORITY, /* Lowest priority, the console is not time critical */
+            nullptr );        /* Used to pass out the created task's handle. */
+}
+
+static size_t base64Encode(const uint8_t *in, size_t len, char *out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for(size_t i = 0; i < len; i += 3){
+        uint32_t v = in[i] << 16;
+        if ( i + 1 < len ) v |= in[i + 1] << 8;
+        if ( i + 2 < len ) v |= in[i + 2];
+        out[o++] = alphabet[(v >> 18) & 0x3F];
+        out[o++] = alphabet[(v >> 12) & 0x3F];
+        out[o++] = i + 1 < len ? alphabet[(v >> 6) & 0x3F] : '=';
+        out[o++] = i + 2 < len ? alphabet[v & 0x3F] : '=';
+    }
+    out[o] = '\0';
+    return o;
+}
+
+[[noreturn]] void BinLog::Task() {
+    uint8_t line[LINE_RECORDS_LEN + MAX_RECORD_LEN];
+    char encoded[(sizeof(line) + 2) / 3 * 4 + 1];
+    size_t lineLen = 0;
+    uint32_t reportedDrops = 0;
+
+    while (true) {
+        size_t recLen = 0;
+        // Wait for the next record a bit to pack several records into one line
+        auto *rec = (uint8_t *)xRingbufferReceive(s_ringBuf, &recLen, lineLen == 0 ? portMAX_DELAY : 10 / portTICK_PERIOD_MS);
+        if ( rec != nullptr ){
+            memcpy(line + lineLen, rec, recLen);
+            lineLen += recLen;
+            vRingbufferReturnItem(s_ringBuf, rec);
+        }
+
+        if ( lineLen > 0 && (rec == nullptr || lineLen >= LINE_RECORDS_LEN) ){
+            base64Encode(line, lineLen, encoded);
+            printf("BL:%s\n", encoded);
+            lineLen = 0;
+        }
+
+        uint32_t drops = s_dropped;
+        if ( rec == nullptr && drops != reportedDrops ){
+            ESP_LOGW(TAG, "%u records dropped", drops - reportedDrops);
+            reportedDrops = drops;
+        }
+    }
+}
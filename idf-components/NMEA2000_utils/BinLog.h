@@ -0,0 +1,105 @@
+#ifndef MHU2NMEA_BINLOG_H
+#define MHU2NMEA_BINLOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <esp_log.h>
+
+// Per module level, define it before including this file, the same way as LOG_LOCAL_LEVEL
+#ifndef BINLOG_LOCAL_LEVEL
+#define BINLOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+
+/// Deferred format logging. Instead of calling vsnprintf() the record stores the id of the format string
+/// and the raw arguments. The records are sent to the console as base64 "BL:" lines and turned back into text
+/// by mhu2nmea/scripts/binlog_decoder.py that finds the format strings by scanning the same sources.
+///
+/// Record layout:
+///    4 bytes format id (FNV-1a hash of the format string)
+///    4 bytes timestamp, lower 32 bits of esp_timer_get_time()
+///    1 byte level
+///    1 byte length of the arguments, bit 7 is set when arguments did not fit and were cut off
+///    Arguments without type tags, the decoder takes the types from the conversions in the format string:
+///    int32 or uint32 for the integers, int64 or uint64 for %lld and %llu, float for %f, %e and %g,
+///    length byte and up to 15 characters for %s, bit 7 of the length byte is set when the string was cut off
+class BinLog {
+public:
+    static constexpr uint32_t FormatId(const char *fmt) {
+        uint32_t h = 2166136261u;
+        while ( *fmt ){
+            h ^= (uint8_t)*fmt++;
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    /// Create ring buffer and the task sending the records to the console
+    static void Start();
+
+    template<typename... Args>
+    static void Write(uint32_t fmtId, esp_log_level_t level, Args... args) {
+        uint8_t rec[MAX_RECORD_LEN];
+        size_t len = HEADER_LEN;
+        bool truncated = false;
+        (Put(rec, len, truncated, args), ...);
+        Commit(rec, len, truncated, fmtId, level);
+    }
+
+    /// Number of records dropped because the task was not started or the console could not keep up
+    static uint32_t Dropped() { return s_dropped; }
+
+    [[noreturn]] static void Task();
+
+private:
+    static const size_t MAX_RECORD_LEN = 64;
+    static const size_t HEADER_LEN = 10;
+    static const size_t MAX_STR_LEN = 15;
+    static const size_t RING_SIZE = 4096;
+
+    static const uint8_t TRUNCATED_FLAG = 0x80;
+
+    template<typename T>
+    static void Put(uint8_t *rec, size_t &len, bool &truncated, T v) {
+        if constexpr (std::is_floating_point<T>::value) {
+            PutValue(rec, len, truncated, (float)v);
+        } else if constexpr (std::is_pointer<T>::value) {
+            PutString(rec, len, truncated, (const char *)v);
+        } else if constexpr (sizeof(T) > 4) {
+            PutValue(rec, len, truncated, (uint64_t)v);
+        } else {
+            PutValue(rec, len, truncated, (uint32_t)v);
+        }
+    }
+
+    template<typename T>
+    static void PutValue(uint8_t *rec, size_t &len, bool &truncated, T v) {
+        if ( truncated || len + sizeof(v) > MAX_RECORD_LEN ){
+            truncated = true;
+            return;
+        }
+        memcpy(rec + len, &v, sizeof(v));  // ESP32 is little endian
+        len += sizeof(v);
+    }
+
+    static void PutString(uint8_t *rec, size_t &len, bool &truncated, const char *s);
+    static void Commit(uint8_t *rec, size_t len, bool truncated, uint32_t fmtId, esp_log_level_t level);
+
+    static std::atomic<uint32_t> s_dropped;
+};
+
+#define BINLOG_LEVEL(level, fmt, ...) do { \
+        if ( (level) <= BINLOG_LOCAL_LEVEL ) { \
+            constexpr uint32_t binlogFmtId = BinLog::FormatId(fmt); \
+            BinLog::Write(binlogFmtId, level, ##__VA_ARGS__); \
+        } \
+    } while(0)
+
+#define BINLOG_E(fmt, ...) BINLOG_LEVEL(ESP_LOG_ERROR, fmt, ##__VA_ARGS__)
+#define BINLOG_W(fmt, ...) BINLOG_LEVEL(ESP_LOG_WARN, fmt, ##__VA_ARGS__)
+#define BINLOG_I(fmt, ...) BINLOG_LEVEL(ESP_LOG_INFO, fmt, ##__VA_ARGS__)
+#define BINLOG_D(fmt, ...) BINLOG_LEVEL(ESP_LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define BINLOG_V(fmt, ...) BINLOG_LEVEL(ESP_LOG_VERBOSE, fmt, ##__VA_ARGS__)
+
+#endif //MHU2NMEA_BINLOG_H
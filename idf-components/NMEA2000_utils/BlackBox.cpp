@@ -0,0 +1,271 @@
+#include <cstdio>
+#include <cstddef>
+#include <atomic>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
+#include "BlackBox.h"
+
+static const char *TAG = "mhu2nmea_BlackBox";
+
+static const uint32_t SECTOR_SIZE = 4096;
+static const uint32_t SECTOR_MAGIC = 0x58424253;  // "SBBX"
+// The first slot of each sector is occupied by the header
+static const uint32_t SLOTS_PER_SECTOR = SECTOR_SIZE / sizeof(BlackBoxRecord);
+static const uint8_t ERASED_TYPE = 0xFF;
+
+static const size_t RING_SIZE = 4096;
+static const int BATCH_RECORDS = 32;       // Records staged in RAM before they are written to flash
+static const int BATCH_TIMEOUT_MS = 1000;  // Partial batch is written if nothing comes for that long
+
+struct SectorHeader {
+    uint32_t magic;
+    uint32_t sequence;
+};
+
+static const esp_partition_t *s_partition = nullptr;
+static RingbufHandle_t s_ringBuf = nullptr;
+static SemaphoreHandle_t s_flashMutex = nullptr;
+static uint32_t s_sectorCount = 0;
+static uint32_t s_sector = 0;    // Sector being written
+static uint32_t s_sequence = 0;  // Sequence number of this sector
+static uint32_t s_slot = 0;      // Next free slot in this sector
+static std::atomic<uint32_t> s_dropped(0);
+
+static bool readHeader(uint32_t sector, SectorHeader &header) {
+    return esp_partition_read(s_partition, sector * SECTOR_SIZE, &header, sizeof(header)) == ESP_OK
+           && header.magic == SECTOR_MAGIC;
+}
+
+// Erase the next sector and mark it with the next sequence number, the sectors that fail are skipped
+static bool startNextSector() {
+    for(uint32_t attempt = 0; attempt < s_sectorCount; attempt++){
+        s_sector = (s_sector + 1) % s_sectorCount;
+        s_sequence++;
+        SectorHeader header = {SECTOR_MAGIC, s_sequence};
+        if ( esp_partition_erase_range(s_partition, s_sector * SECTOR_SIZE, SECTOR_SIZE) == ESP_OK
+             && esp_partition_write(s_partition, s_sector * SECTOR_SIZE, &header, sizeof(header)) == ESP_OK ){
+            s_slot = 1;
+            return true;
+        }
+        ESP_LOGE(TAG, "Failed to prepare sector %d, skipping it", s_sector);
+    }
+    return false;
+}
+
+static void writeRecords(const BlackBoxRecord *records, int count) {
+    xSemaphoreTake(s_flashMutex, portMAX_DELAY);
+    while ( count > 0 ){
+        if ( s_slot >= SLOTS_PER_SECTOR && !startNextSector() ){
+            ESP_LOGE(TAG, "No writable sectors, %d records lost", count);
+            break;
+        }
+
+        int n = (int)(SLOTS_PER_SECTOR - s_slot) < count ? (int)(SLOTS_PER_SECTOR - s_slot) : count;
+        size_t offset = s_sector * SECTOR_SIZE + s_slot * sizeof(BlackBoxRecord);
+        if ( esp_partition_write(s_partition, offset, records, n * sizeof(BlackBoxRecord)) != ESP_OK ){
+            ESP_LOGE(TAG, "Failed to write sector %d", s_sector);
+            s_slot = SLOTS_PER_SECTOR;  // Retry in the next sector
+            continue;
+        }
+        s_slot += n;
+        records += n;
+        count -= n;
+    }
+    xSemaphoreGive(s_flashMutex);
+}
+
+static void blackbox_task(void *) {
+    BlackBox::Task();
+}
+
+void BlackBox::Start() {
+    s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                           (esp_partition_subtype_t)SCI_BLACKBOX_PARTITION_SUBTYPE,
+                                           SCI_BLACKBOX_PARTITION_NAME);
+    if ( s_partition == nullptr ){
+        ESP_LOGW(TAG, "No %s partition, recording is disabled", SCI_BLACKBOX_PARTITION_NAME);
+        return;
+    }
+    // The partition tables are laid out for 2MB flash, the partition must not run past the end of the chip
+    size_t flashSize = spi_flash_get_chip_size();
+    if ( s_partition->address + s_partition->size > flashSize ){
+        ESP_LOGE(TAG, "%s partition ends at 0x%x past %u bytes of flash, recording is disabled",
+                 SCI_BLACKBOX_PARTITION_NAME, s_partition->address + s_partition->size, flashSize);
+        s_partition = nullptr;
+        return;
+    }
+    s_sectorCount = s_partition->size / SECTOR_SIZE;
+    s_flashMutex = xSemaphoreCreateMutex();
+
+    // The sector with the highest sequence number is the one written last
+    bool found = false;
+    for(uint32_t sector = 0; sector < s_sectorCount; sector++){
+        SectorHeader header{};
+        if ( readHeader(sector, header) && (!found || header.sequence > s_sequence) ){
+            found = true;
+            s_sector = sector;
+            s_sequence = header.sequence;
+        }
+    }
+
+    if ( found ){
+        // Continue after the last written record
+        for(s_slot = 1; s_slot < SLOTS_PER_SECTOR; s_slot++){
+            uint8_t type = 0;
+            size_t offset = s_sector * SECTOR_SIZE + s_slot * sizeof(BlackBoxRecord) + offsetof(BlackBoxRecord, type);
+            if ( esp_partition_read(s_partition, offset, &type, 1) != ESP_OK || type == ERASED_TYPE ){
+                break;
+            }
+        }
+    }else{
+        s_sector = s_sectorCount - 1;
+        s_sequence = 0;
+        if ( !startNextSector() ){
+            ESP_LOGE(TAG, "Failed to initialize %s partition", SCI_BLACKBOX_PARTITION_NAME);
+            s_partition = nullptr;
+            return;
+        }
+    }
+    ESP_LOGI(TAG, "Recording to sector %d of %d slot %d sequence %d", s_sector, s_sectorCount, s_slot, s_sequence);
+
+    s_ringBuf = xRingbufferCreate(RING_SIZE, RINGBUF_TYPE_NOSPLIT);
+    if ( s_ringBuf == nullptr ){
+        ESP_LOGE(TAG, "Failed to create ring buffer");
+        return;
+    }
+
+    xTaskCreate(
+            blackbox_task,    /* Function that implements the task. */
+            "BlackBoxTask",   /* Text name for the task. */
+            4 * 1024,         /* Stack size in words, not bytes. */
+            nullptr,          /* Parameter passed into the task. */
+            tskIDLE_PRIORITY, /* Lowest priority, writing to flash is not time critical */
+            nullptr );        /* Used to pass out the created task's handle. */
+
+    Record(BB_BOOT, 0, (int32_t)s_sequence);
+}
+
+void BlackBox::Record(BlackBoxRecordType type, uint8_t channel, int32_t v0, int32_t v1, int32_t v2) {
+    if ( s_ringBuf == nullptr )
+        return;
+
+    BlackBoxRecord rec = {(uint32_t)esp_timer_get_time(), type, channel, 0, {v0, v1, v2}};
+    // Never wait, the record is dropped if the writer can't keep up
+    if ( xRingbufferSend(s_ringBuf, &rec, sizeof(rec), 0) != pdTRUE ){
+        s_dropped++;
+    }
+}
+
+uint32_t BlackBox::Dropped() {
+    return s_dropped;
+}
+
+void BlackBox::RecordPgnValue(unsigned long pgn, uint8_t field, double value, int32_t reference) {
+    // N2kDoubleNA is -1e9, it doesn't fit either
+    int32_t scaled = value > -2e6 && value < 2e6 ? (int32_t)(value * 1000) : SCI_BLACKBOX_VALUE_NA;
+    Record(BB_PGN_VALUE, field, (int32_t)pgn, scaled, reference);
+}
+
+[[noreturn]] void BlackBox::Task() {
+    BlackBoxRecord batch[BATCH_RECORDS];
+    int count = 0;
+    uint32_t reportedDrops = 0;
+
+    while (true) {
+        size_t len = 0;
+        auto *rec = (BlackBoxRecord *)xRingbufferReceive(s_ringBuf, &len, BATCH_TIMEOUT_MS / portTICK_PERIOD_MS);
+        if ( rec != nullptr ){
+            batch[count++] = *rec;
+            vRingbufferReturnItem(s_ringBuf, rec);
+        }
+
+        if ( count == BATCH_RECORDS || (rec == nullptr && count > 0) ){
+            writeRecords(batch, count);
+            count = 0;
+        }
+
+        uint32_t drops = s_dropped;
+        if ( rec == nullptr && drops != reportedDrops ){
+            ESP_LOGW(TAG, "%u records dropped", drops - reportedDrops);
+            reportedDrops = drops;
+        }
+    }
+}
+
+int BlackBox::Dump(BlackBoxSink &sink) {
+    if ( s_partition == nullptr )
+        return 0;
+
+    // The flash is locked only while a chunk is copied out, so the sink can take its time
+    // and the writer keeps recording meanwhile
+    xSemaphoreTake(s_flashMutex, portMAX_DELAY);
+    uint32_t lastSector = s_sector;
+    uint32_t lastSequence = s_sequence;
+    xSemaphoreGive(s_flashMutex);
+
+    const uint32_t chunkSlots = 16;
+    BlackBoxRecord records[chunkSlots];
+    int total = 0;
+
+    // The sector after the one being written is the oldest
+    for(uint32_t i = 1; i <= s_sectorCount; i++){
+        uint32_t sector = (lastSector + i) % s_sectorCount;
+        SectorHeader header{};
+        xSemaphoreTake(s_flashMutex, portMAX_DELAY);
+        bool valid = readHeader(sector, header);
+        xSemaphoreGive(s_flashMutex);
+        // Sectors erased after the dump started hold the newer records, they are not part of this dump
+        if ( !valid || header.sequence > lastSequence )
+            continue;
+
+        for(uint32_t slot = 1; slot < SLOTS_PER_SECTOR; slot += chunkSlots){
+            uint32_t n = SLOTS_PER_SECTOR - slot < chunkSlots ? SLOTS_PER_SECTOR - slot : chunkSlots;
+            uint32_t count = 0;
+
+            xSemaphoreTake(s_flashMutex, portMAX_DELAY);
+            SectorHeader current{};
+            // The writer may have recycled the sector since the previous chunk
+            if ( readHeader(sector, current) && current.sequence == header.sequence
+                 && esp_partition_read(s_partition, sector * SECTOR_SIZE + slot * sizeof(BlackBoxRecord),
+                                       records, n * sizeof(BlackBoxRecord)) == ESP_OK ){
+                while ( count < n && records[count].type != ERASED_TYPE )
+                    count++;
+            }
+            xSemaphoreGive(s_flashMutex);
+
+            if ( count > 0 )
+                sink.write(records, (int)count);
+            total += (int)count;
+
+            if ( count < n )
+                break;  // The rest of the sector is not written yet
+        }
+    }
+
+    return total;
+}
+
+class ConsoleBlackBoxSink: public BlackBoxSink {
+public:
+    void write(const BlackBoxRecord *records, int count) override {
+        for(int i = 0; i < count; i++){
+            const BlackBoxRecord &r = records[i];
+            printf("BBX,%u,%u,%u,%d,%d,%d\n", r.timestampUs, r.type, r.channel, r.v[0], r.v[1], r.v[2]);
+        }
+    }
+};
+
+int BlackBox::DumpToConsole() {
+    ConsoleBlackBoxSink sink;
+    printf("BBX_BEGIN\n");
+    int count = Dump(sink);
+    printf("BBX_END,%d\n", count);
+    fflush(stdout);
+    return count;
+}
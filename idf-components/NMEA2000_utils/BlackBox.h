@@ -0,0 +1,67 @@
+#ifndef MHU2NMEA_BLACKBOX_H
+#define MHU2NMEA_BLACKBOX_H
+
+#include <cstdint>
+#include <climits>
+
+// Recorded instead of the values that are not available or don't fit
+#define SCI_BLACKBOX_VALUE_NA INT32_MIN
+
+// Data partition subtype of the recorder, see partitions.csv of the project
+#define SCI_BLACKBOX_PARTITION_SUBTYPE 0x40
+#define SCI_BLACKBOX_PARTITION_NAME "blackbox"
+
+enum BlackBoxRecordType : uint8_t {
+    BB_BOOT = 1,           // Device started
+    BB_AWA_ADC = 2,        // v: red, green, blue ADC values
+    BB_PULSE_PERIOD = 3,   // channel: PCNT unit, v: elapsed us, pulses per interrupt
+    BB_UART_SENTENCE = 4,  // channel: UART port, v: sentence length, sentence id characters
+    BB_PGN_VALUE = 5,      // channel: field index, v: PGN, value * 1000
+    // 0xFF is never used, it's the erased flash
+};
+
+struct BlackBoxRecord {
+    uint32_t timestampUs;  // Lower 32 bits of esp_timer_get_time()
+    uint8_t type;          // BlackBoxRecordType
+    uint8_t channel;
+    uint16_t reserved;
+    int32_t v[3];
+};
+
+class BlackBoxSink {
+public:
+    virtual void write(const BlackBoxRecord *records, int count) = 0;
+};
+
+/// Black box recorder of the raw sensor samples.
+/// The records are put into the RAM staging ring buffer without blocking the caller and the low priority task
+/// writes them to the "blackbox" data partition in batches.
+/// The partition is the circular log of 4K sectors. Each sector starts with the header carrying the sequence number,
+/// sectors are filled and erased one after another so all of them wear out evenly.
+/// After the restart the recorder continues in the partially written sector instead of erasing the new one.
+/// Flash writes disable the cache, so the interrupts that must not stall meanwhile have to be placed in IRAM.
+/// The recorded data is converted by mhu2nmea/scripts/blackbox_decoder.py
+class BlackBox {
+public:
+    /// Find the partition, locate the write position and start the writer task.
+    /// Recording is disabled if the partition is not present.
+    static void Start();
+
+    /// Stage the record, never blocks. Not for the use in ISR
+    static void Record(BlackBoxRecordType type, uint8_t channel, int32_t v0, int32_t v1 = 0, int32_t v2 = 0);
+    /// Record the value sent in the PGN field scaled by 1000, NA values are recorded as SCI_BLACKBOX_VALUE_NA
+    static void RecordPgnValue(unsigned long pgn, uint8_t field, double value, int32_t reference = 0);
+
+    /// Number of records dropped because the writer could not keep up
+    static uint32_t Dropped();
+
+    /// Pass all recorded records to the sink from the oldest to the newest one, returns the number of records.
+    /// Recording goes on during the dump, the sink is called without holding the flash lock
+    static int Dump(BlackBoxSink &sink);
+    /// Dump to stdout as BBX lines
+    static int DumpToConsole();
+
+    [[noreturn]] static void Task();
+};
+
+#endif //MHU2NMEA_BLACKBOX_H
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cstring>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <driver/twai.h>
+#include "DeviceDiagnostics.h"
+#include "TwaiFrameRing.h"
+
+static const char *TAG = "mhu2nmea_DeviceDiagnostics";
+
+DeviceDiagnostics::QueueEntry DeviceDiagnostics::s_queues[MAX_QUEUES];
+int DeviceDiagnostics::s_queueCount = 0;
+TwaiFrameCursor *DeviceDiagnostics::s_frameConsumers[MAX_FRAME_CONSUMERS];
+int DeviceDiagnostics::s_frameConsumerCount = 0;
+DiagnosticsLink *DeviceDiagnostics::s_links[MAX_LINKS];
+int DeviceDiagnostics::s_linkCount = 0;
+std::vector<DeviceDiagnostics::TaskRunTime> DeviceDiagnostics::s_prevTaskRunTimes;
+uint32_t DeviceDiagnostics::s_prevTotalRunTime = 0;
+std::atomic<uint32_t> DeviceDiagnostics::s_droppedSends(0);
+int64_t DeviceDiagnostics::s_loopTimeMaxUs = 0;
+int64_t DeviceDiagnostics::s_loopTimeSumUs = 0;
+uint32_t DeviceDiagnostics::s_loopCount = 0;
+
+void DeviceDiagnostics::RegisterQueue(const char *name, QueueHandle_t queue) {
+    if ( s_queueCount < MAX_QUEUES ){
+        s_queues[s_queueCount++] = {name, queue};
+    }else{
+        ESP_LOGE(TAG, "No room to register queue %s", name);
+    }
+}
+
+void DeviceDiagnostics::RegisterFrameConsumer(TwaiFrameCursor *cursor) {
+    if ( s_frameConsumerCount < MAX_FRAME_CONSUMERS ){
+        s_frameConsumers[s_frameConsumerCount++] = cursor;
+    }else{
+        ESP_LOGE(TAG, "No room to register frame consumer %s", cursor->Name());
+    }
+}
+
+void DeviceDiagnostics::RegisterLink(DiagnosticsLink *link) {
+    if ( s_linkCount < MAX_LINKS ){
+        s_links[s_linkCount++] = link;
+    }else{
+        ESP_LOGE(TAG, "No room to register link %s", link->Name());
+    }
+}
+
+bool DeviceDiagnostics::QueueSend(QueueHandle_t queue, const void *item) {
+    if ( xQueueSend(queue, item, 0) != pdTRUE ){
+        s_droppedSends++;
+        return false;
+    }
+    return true;
+}
+
+void DeviceDiagnostics::AddLoopTime(int64_t loopTimeUs) {
+    s_loopTimeMaxUs = std::max(s_loopTimeMaxUs, loopTimeUs);
+    s_loopTimeSumUs += loopTimeUs;
+    s_loopCount++;
+}
+
+void DeviceDiagnostics::ResetStats() {
+    s_loopTimeMaxUs = 0;
+    s_loopTimeSumUs = 0;
+    s_loopCount = 0;
+    s_droppedSends = 0;
+    for(int i = 0; i < s_frameConsumerCount; i++){
+        s_frameConsumers[i]->ResetDrops();
+    }
+    for(int i = 0; i < s_linkCount; i++){
+        s_links[i]->ResetDrops();
+    }
+}
+
+bool DeviceDiagnostics::Send(tNMEA2000 &nmea2000, uint16_t indMfgCode, int iDev) {
+    auto uptimeSec = (uint32_t)(esp_timer_get_time() / 1000000);
+    auto freeHeap = (uint32_t)heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    auto largestBlock = (uint32_t)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    uint32_t loopMeanUs = s_loopCount > 0 ? (uint32_t)(s_loopTimeSumUs / s_loopCount) : 0;
+
+    twai_status_info_t twaiStatus = {};
+    if ( twai_get_status_info(&twaiStatus) != ESP_OK ){
+        ESP_LOGD(TAG, "TWAI driver is not installed");
+    }
+
+    tN2kMsg N2kMsg;
+    N2kMsg.SetPGN(SCI_DIAGNOSTICS_PGN);
+    N2kMsg.Priority=6;
+    N2kMsg.Add2ByteUInt(indMfgCode);
+    N2kMsg.Add4ByteUInt(uptimeSec);
+    N2kMsg.Add4ByteUInt(freeHeap);
+    N2kMsg.Add4ByteUInt(largestBlock);
+    N2kMsg.Add4ByteUInt((uint32_t)s_loopTimeMaxUs);
+    N2kMsg.Add4ByteUInt(loopMeanUs);
+    N2kMsg.AddByte((uint8_t)std::min<uint32_t>(twaiStatus.tx_error_counter, 0xFF));
+    N2kMsg.AddByte((uint8_t)std::min<uint32_t>(twaiStatus.rx_error_counter, 0xFF));
+    N2kMsg.Add2ByteUInt((uint16_t)std::min<uint32_t>(twaiStatus.tx_failed_count, 0xFFFD));
+    N2kMsg.Add2ByteUInt((uint16_t)std::min<uint32_t>(twaiStatus.rx_missed_count, 0xFFFD));
+    N2kMsg.Add2ByteUInt((uint16_t)std::min<uint32_t>(twaiStatus.bus_error_count, 0xFFFD));
+    N2kMsg.Add2ByteUInt((uint16_t)std::min<uint32_t>(s_droppedSends, 0xFFFD));
+
+    // Number of entries goes first, so remember where to patch it
+    int entriesCountIdx = N2kMsg.DataLen;
+    N2kMsg.AddByte(0);
+
+    // Queues, consumers and links go first, the busiest tasks take the room that is left
+    int entries = 0;
+    for(int i = 0; i < s_queueCount && entries < DIAG_MAX_ENTRIES; i++){
+        UBaseType_t waiting = uxQueueMessagesWaiting(s_queues[i].queue);
+        UBaseType_t capacity = waiting + uxQueueSpacesAvailable(s_queues[i].queue);
+        AddEntry(N2kMsg, DIAG_ENTRY_QUEUE, s_queues[i].name,
+                 (uint8_t)std::min<UBaseType_t>(waiting, 0xFF), (uint8_t)std::min<UBaseType_t>(capacity, 0xFF));
+        entries++;
+    }
+    for(int i = 0; i < s_frameConsumerCount && entries < DIAG_MAX_ENTRIES; i++){
+        AddEntry(N2kMsg, DIAG_ENTRY_FRAME_CONSUMER, s_frameConsumers[i]->Name(),
+                 (uint8_t)std::min<uint32_t>(s_frameConsumers[i]->Lag(), 0xFF),
+                 (uint8_t)std::min<uint32_t>(s_frameConsumers[i]->Drops(), 0xFF));
+        entries++;
+    }
+    for(int i = 0; i < s_linkCount; i++){
+        // Throughput is measured between two reports, so take it even for the idle links
+        uint32_t throughput = s_links[i]->TakeThroughput();
+        if ( s_links[i]->Connected() && entries < DIAG_MAX_ENTRIES ){
+            AddEntry(N2kMsg, DIAG_ENTRY_LINK, s_links[i]->Name(),
+                     (uint8_t)std::min<uint32_t>(throughput / 256, 0xFF),
+                     (uint8_t)std::min<uint32_t>(s_links[i]->Drops(), 0xFF));
+            entries++;
+        }
+    }
+    entries += AddTaskEntries(N2kMsg, std::min(MAX_TASK_ENTRIES, DIAG_MAX_ENTRIES - entries));
+    N2kMsg.Data[entriesCountIdx] = entries;
+    if ( N2kMsg.DataLen != DIAG_HEADER_LEN + entries * DIAG_ENTRY_LEN ){
+        ESP_LOGE(TAG, "Diagnostics message is %d bytes, expected %d", N2kMsg.DataLen, DIAG_HEADER_LEN + entries * DIAG_ENTRY_LEN);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Send diagnostics uptime=%u heap=%u/%u loop max=%lld mean=%u dropped=%u entries=%d",
+             uptimeSec, freeHeap, largestBlock, s_loopTimeMaxUs, loopMeanUs, (uint32_t)s_droppedSends, entries);
+
+    // Loop time statistics are reported for the interval between two requests
+    s_loopTimeMaxUs = 0;
+    s_loopTimeSumUs = 0;
+    s_loopCount = 0;
+
+    return nmea2000.SendMsg(N2kMsg, iDev);
+}
+
+void DeviceDiagnostics::AddEntry(tN2kMsg &N2kMsg, DiagEntryType type, const char *name, uint8_t value, uint8_t capacity) {
+    N2kMsg.AddByte(type);
+    size_t nameLen = strnlen(name, ENTRY_NAME_LEN);
+    for(int i = 0; i < ENTRY_NAME_LEN; i++){
+        N2kMsg.AddByte(i < nameLen ? name[i] : 0);
+    }
+    N2kMsg.AddByte(value);
+    N2kMsg.AddByte(capacity);
+}
+
+int DeviceDiagnostics::AddTaskEntries(tN2kMsg &N2kMsg, int maxEntries) {
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    // Leave room for the tasks created between the two calls
+    std::vector<TaskStatus_t> taskStatus(uxTaskGetNumberOfTasks() + 4);
+    uint32_t totalRunTime = 0;
+    UBaseType_t taskCount = uxTaskGetSystemState(taskStatus.data(), taskStatus.size(), &totalRunTime);
+    if ( taskCount == 0 ){
+        ESP_LOGE(TAG, "More than %d tasks, no CPU stats", (int)taskStatus.size());
+        return 0;
+    }
+
+    // Run time counters are cumulative, so compute the share since the previous report.
+    // The task not seen before gets its first sample as the baseline, its lifetime is not the delta.
+    uint32_t totalDelta = (totalRunTime - s_prevTotalRunTime) * portNUM_PROCESSORS;
+    std::vector<uint32_t> taskDelta(taskCount, 0);
+    for(int i = 0; i < taskCount; i++){
+        for(const auto &prev : s_prevTaskRunTimes){
+            if( prev.handle == taskStatus[i].xHandle){
+                taskDelta[i] = taskStatus[i].ulRunTimeCounter - prev.runTime;
+                break;
+            }
+        }
+    }
+
+    s_prevTaskRunTimes.resize(taskCount);
+    for(int i = 0; i < taskCount; i++){
+        s_prevTaskRunTimes[i] = {taskStatus[i].xHandle, taskStatus[i].ulRunTimeCounter};
+    }
+    s_prevTotalRunTime = totalRunTime;
+
+    if ( totalDelta == 0 || maxEntries <= 0 ){
+        return 0;
+    }
+
+    // Report the busiest tasks first
+    std::vector<int> order(taskCount);
+    for(int i = 0; i < taskCount; i++){
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&taskDelta](int a, int b){ return taskDelta[a] > taskDelta[b]; });
+
+    int entries = std::min((int)taskCount, maxEntries);
+    for(int i = 0; i < entries; i++){
+        int idx = order[i];
+        // 0.5 % units
+        auto share = (uint32_t)((uint64_t)taskDelta[idx] * 200 / totalDelta);
+        AddEntry(N2kMsg, DIAG_ENTRY_TASK, taskStatus[idx].pcTaskName, (uint8_t)std::min<uint32_t>(share, 200), 0xFF);
+    }
+    return entries;
+#else
+    return 0;
+#endif
+}
+
+bool DiagnosticsGroupFunctionHandler::ProcessRequest(const tN2kMsg &N2kMsg, uint32_t TransmissionInterval,
+                                                     uint16_t TransmissionIntervalOffset,
+                                                     uint8_t NumberOfParameterPairs, int Index, int iDev) {
+    ESP_LOGI(TAG, "DiagnosticsGroupFunctionHandler::ProcessRequest iDev=%d", iDev);
+    return DeviceDiagnostics::Send(*pNMEA2000, m_indMfgCode, iDev);
+}
+
+bool DiagnosticsGroupFunctionHandler::ProcessCommand(const tN2kMsg &N2kMsg, uint8_t PrioritySetting,
+                                                     uint8_t NumberOfParameterPairs, int Index, int iDev) {
+    ESP_LOGI(TAG, "DiagnosticsGroupFunctionHandler::ProcessCommand NumberOfParameterPairs=%d", NumberOfParameterPairs);
+    for( int i=0; i < NumberOfParameterPairs; i++){
+        uint8_t fn = N2kMsg.GetByte(Index);
+        switch (fn){ // NOLINT(hicpp-multiway-paths-covered)
+            case 4: // Field 4: Uptime, any value resets statistics
+                N2kMsg.Get4ByteUInt(Index);
+                DeviceDiagnostics::ResetStats();
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
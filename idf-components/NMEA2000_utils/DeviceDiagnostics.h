@@ -0,0 +1,145 @@
+#ifndef MHU2NMEA_DEVICEDIAGNOSTICS_H
+#define MHU2NMEA_DEVICEDIAGNOSTICS_H
+
+#include <atomic>
+#include <vector>
+#include <esp_attr.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "NMEA2000.h"
+#include "CustomPgnGroupFunctionHandler.h"
+
+static const unsigned long SCI_DIAGNOSTICS_PGN = 130903;  // Device runtime diagnostics
+/*
+    Proprietary PGN 130903 device runtime diagnostics
+    Field 1: MfgCode 11 bits
+    Field 2: reserved 2 bits. Must be set all 1
+    Field 3: Industry code 3 bits. Use Marine=4
+    Field 4: Uptime, 4 bytes seconds
+    Field 5: FreeHeap, 4 bytes bytes
+    Field 6: LargestFreeBlock, 4 bytes bytes
+    Field 7: LoopTimeMax, 4 bytes microseconds since previous report
+    Field 8: LoopTimeMean, 4 bytes microseconds since previous report
+    Field 9: TwaiTxErrorCounter, 1 byte
+    Field 10: TwaiRxErrorCounter, 1 byte
+    Field 11: TwaiTxFailed, 2 bytes
+    Field 12: TwaiRxMissed, 2 bytes
+    Field 13: TwaiBusErrors, 2 bytes
+    Field 14: DroppedQueueSends, 2 bytes
+    Field 15: Number of entries to follow, 1 byte, at most DIAG_MAX_ENTRIES so the message fits into the fast packet
+    Repeated for each entry:
+    Field 16: EntryType, 1 byte 0 - task, 1 - queue, 2 - frame ring consumer, 3 - bridge client link
+    Field 17: EntryName, 8 bytes ASCII padded with zeroes
+    Field 18: EntryValue, 1 byte task CPU share in 0.5% units, number of items waiting in the queue,
+              number of frames the consumer lags behind or link throughput in 256 bytes/s units
+    Field 19: EntryCapacity, 1 byte queue length, 0xFF for tasks, frames dropped by the consumer
+              or packets dropped for the link
+
+    Send command with Field 4 set to any value to reset loop time, dropped sends, frames and packets statistics
+ */
+
+const int DIAG_HEADER_LEN = 33;  // Fields 1-15
+const int DIAG_ENTRY_LEN = 11;   // Fields 16-19
+const int DIAG_MAX_ENTRIES = (tN2kMsg::MaxDataLen - DIAG_HEADER_LEN) / DIAG_ENTRY_LEN;
+static_assert(DIAG_HEADER_LEN + DIAG_MAX_ENTRIES * DIAG_ENTRY_LEN <= tN2kMsg::MaxDataLen, "PGN 130903 does not fit into fast packet");
+
+enum DiagEntryType {
+    DIAG_ENTRY_TASK = 0,
+    DIAG_ENTRY_QUEUE = 1,
+    DIAG_ENTRY_FRAME_CONSUMER = 2,
+    DIAG_ENTRY_LINK = 3,
+};
+
+class TwaiFrameCursor;
+
+/// Connection of the bridge client, only the connected ones are reported
+class DiagnosticsLink {
+public:
+    virtual const char *Name() const = 0;
+    virtual bool Connected() const = 0;
+    /// Bytes per second sent since the previous call
+    virtual uint32_t TakeThroughput() = 0;
+    virtual uint32_t Drops() const = 0;
+    virtual void ResetDrops() = 0;
+};
+
+/// Collects runtime health metrics of the device and sends them as PGN 130903
+/// All methods are static, so any task can report to it without having a reference
+class DeviceDiagnostics {
+public:
+    /// Add queue to be reported in the diagnostics PGN
+    static void RegisterQueue(const char *name, QueueHandle_t queue);
+    /// Add consumer of TwaiFrameRing to be reported in the diagnostics PGN
+    static void RegisterFrameConsumer(TwaiFrameCursor *cursor);
+    /// Add client link of the bridge to be reported in the diagnostics PGN
+    static void RegisterLink(DiagnosticsLink *link);
+    /// Non blocking xQueueSend() that counts items dropped because the queue was full
+    static bool QueueSend(QueueHandle_t queue, const void *item);
+    /// Count item dropped by the caller, placed in IRAM for the ISRs that run while the flash cache is disabled
+    static void IRAM_ATTR CountDroppedSend() { s_droppedSends++; }
+    /// Report duration of one iteration of the main loop
+    static void AddLoopTime(int64_t loopTimeUs);
+    /// Reset windowed statistics
+    static void ResetStats();
+    /// Collect metrics and send PGN SCI_DIAGNOSTICS_PGN
+    static bool Send(tNMEA2000 &nmea2000, uint16_t indMfgCode, int iDev);
+
+private:
+    static int AddTaskEntries(tN2kMsg &N2kMsg, int maxEntries);
+    static void AddEntry(tN2kMsg &N2kMsg, DiagEntryType type, const char *name, uint8_t value, uint8_t capacity);
+
+    static const int MAX_QUEUES = 4;
+    static const int MAX_TASK_ENTRIES = 12;
+    static const int ENTRY_NAME_LEN = 8;
+
+    struct QueueEntry {
+        const char *name;
+        QueueHandle_t queue;
+    };
+    static QueueEntry s_queues[MAX_QUEUES];
+    static int s_queueCount;
+
+    static const int MAX_FRAME_CONSUMERS = 4;
+    static TwaiFrameCursor *s_frameConsumers[MAX_FRAME_CONSUMERS];
+    static int s_frameConsumerCount;
+
+    static const int MAX_LINKS = 8;
+    static DiagnosticsLink *s_links[MAX_LINKS];
+    static int s_linkCount;
+
+    struct TaskRunTime {
+        TaskHandle_t handle;
+        uint32_t runTime;
+    };
+    static std::vector<TaskRunTime> s_prevTaskRunTimes;
+    static uint32_t s_prevTotalRunTime;
+
+    static std::atomic<uint32_t> s_droppedSends;
+    static int64_t s_loopTimeMaxUs;
+    static int64_t s_loopTimeSumUs;
+    static uint32_t s_loopCount;
+};
+
+/// Class to handle NMEA Group function commands sent by PGN 126208 for PGN 130903 to get device diagnostics
+class DiagnosticsGroupFunctionHandler: public CustomPgnGroupFunctionHandler{
+public:
+    DiagnosticsGroupFunctionHandler(tNMEA2000 *_pNMEA2000, int mfgCode, int indCode)
+            :CustomPgnGroupFunctionHandler(_pNMEA2000, SCI_DIAGNOSTICS_PGN, mfgCode, indCode)
+            ,m_indMfgCode((indCode << 13) | (0x03 << 11) | mfgCode) {}
+protected:
+    /// Network requested diagnostics
+    /// We reply with PGN 130903 sent from the device the request was addressed to
+    bool ProcessRequest(const tN2kMsg &N2kMsg,
+                        uint32_t TransmissionInterval,
+                        uint16_t TransmissionIntervalOffset,
+                        uint8_t  NumberOfParameterPairs,
+                        int Index,
+                        int iDev) override;
+    /// Network wants to reset the statistics
+    bool ProcessCommand(const tN2kMsg &N2kMsg, uint8_t PrioritySetting, uint8_t NumberOfParameterPairs, int Index, int iDev) override;
+private:
+    uint16_t m_indMfgCode;
+};
+
+#endif //MHU2NMEA_DEVICEDIAGNOSTICS_H
@@ -0,0 +1,175 @@
+#include <cstring>
+#include "FrameStreamCodec.h"
+
+void FrameStreamDictionary::Reset() {
+    m_count = 0;
+    m_next = 0;
+}
+
+int FrameStreamDictionary::Find(uint32_t id) const {
+    for(int i = 0; i < m_count; i++){
+        if ( m_entries[i].id == id ){
+            return i;
+        }
+    }
+    return -1;
+}
+
+int FrameStreamDictionary::Add(uint32_t id) {
+    int idx = m_next;
+    m_next = (m_next + 1) % FRAME_STREAM_DICT_SIZE;
+    if ( m_count < FRAME_STREAM_DICT_SIZE ){
+        m_count++;
+    }
+    m_entries[idx] = {id, 0, {}};
+    return idx;
+}
+
+void FrameStreamEncoder::Reset() {
+    m_dict.Reset();
+    m_lastTick = 0;
+    m_started = false;
+}
+
+int FrameStreamEncoder::Encode(uint32_t id, uint8_t len, const uint8_t *data, uint32_t timestampUs, uint8_t *out) {
+    if ( len > 8 ){
+        len = 8;
+    }
+    int pos = 1;
+    uint8_t flags = len;
+
+    int idx = m_dict.Find(id);
+    if ( idx < 0 ){
+        idx = m_dict.Add(id);
+        flags |= FRAME_STREAM_NEW_ID;
+        out[pos++] = id >> 24;
+        out[pos++] = id >> 16;
+        out[pos++] = id >> 8;
+        out[pos++] = id;
+    }else{
+        out[pos++] = idx;
+    }
+
+    // First record of the session carries zero delta
+    uint32_t tick = timestampUs / FRAME_STREAM_TICK_US;
+    uint32_t delta = m_started ? tick - m_lastTick : 0;
+    m_lastTick = tick;
+    m_started = true;
+    do {
+        uint8_t b = delta & 0x7F;
+        delta >>= 7;
+        out[pos++] = delta != 0 ? b | 0x80 : b;
+    } while ( delta != 0 );
+
+    FrameStreamDictionary::Entry &entry = m_dict[idx];
+    uint8_t mask = 0;
+    int changed = 0;
+    if ( !(flags & FRAME_STREAM_NEW_ID) && entry.len == len ){
+        for(int i = 0; i < len; i++){
+            if ( data[i] != entry.data[i] ){
+                mask |= 1 << i;
+                changed++;
+            }
+        }
+    }
+    if ( !(flags & FRAME_STREAM_NEW_ID) && entry.len == len && 1 + changed < len ){
+        flags |= FRAME_STREAM_XOR;
+        out[pos++] = mask;
+        for(int i = 0; i < len; i++){
+            if ( mask & (1 << i) ){
+                out[pos++] = data[i] ^ entry.data[i];
+            }
+        }
+    }else{
+        memcpy(out + pos, data, len);
+        pos += len;
+    }
+
+    entry.len = len;
+    memcpy(entry.data, data, len);
+    out[0] = flags;
+    return pos;
+}
+
+void FrameStreamDecoder::Reset() {
+    m_dict.Reset();
+    m_lastTick = 0;
+}
+
+int FrameStreamDecoder::Decode(const uint8_t *buf, int len, uint32_t &id, uint8_t &dlc, uint8_t *data,
+                               uint32_t &timestampUs) {
+    if ( len < 1 ){
+        return 0;
+    }
+    uint8_t flags = buf[0];
+    dlc = flags & 0x0F;
+    if ( dlc > 8 ){
+        return 0;
+    }
+    int pos = 1;
+
+    int idx = 0;
+    if ( flags & FRAME_STREAM_NEW_ID ){
+        if ( pos + 4 > len ){
+            return 0;
+        }
+        id = ((uint32_t)buf[pos] << 24) | ((uint32_t)buf[pos + 1] << 16) | (buf[pos + 2] << 8) | buf[pos + 3];
+        pos += 4;
+    }else{
+        if ( pos + 1 > len ){
+            return 0;
+        }
+        idx = buf[pos++];
+        if ( idx >= FRAME_STREAM_DICT_SIZE ){
+            return 0;
+        }
+        id = m_dict[idx].id;
+    }
+
+    uint32_t delta = 0;
+    int shift = 0;
+    while ( true ){
+        if ( pos >= len || shift > 28 ){
+            return 0;
+        }
+        uint8_t b = buf[pos++];
+        delta |= (uint32_t)(b & 0x7F) << shift;
+        shift += 7;
+        if ( !(b & 0x80) ){
+            break;
+        }
+    }
+
+    if ( flags & FRAME_STREAM_XOR ){
+        if ( (flags & FRAME_STREAM_NEW_ID) || pos + 1 > len ){
+            return 0;
+        }
+        FrameStreamDictionary::Entry &entry = m_dict[idx];
+        uint8_t mask = buf[pos++];
+        for(int i = 0; i < dlc; i++){
+            data[i] = entry.data[i];
+            if ( mask & (1 << i) ){
+                if ( pos >= len ){
+                    return 0;
+                }
+                data[i] ^= buf[pos++];
+            }
+        }
+    }else{
+        if ( pos + dlc > len ){
+            return 0;
+        }
+        memcpy(data, buf + pos, dlc);
+        pos += dlc;
+    }
+
+    // Update the state only once the whole record is known to be valid
+    if ( flags & FRAME_STREAM_NEW_ID ){
+        idx = m_dict.Add(id);
+    }
+    m_dict[idx].len = dlc;
+    memcpy(m_dict[idx].data, data, dlc);
+    m_lastTick += delta;
+    timestampUs = m_lastTick * FRAME_STREAM_TICK_US;
+    return pos;
+}
@@ -0,0 +1,84 @@
+#ifndef MHU2NMEA_FRAMESTREAMCODEC_H
+#define MHU2NMEA_FRAMESTREAMCODEC_H
+
+#include <cstdint>
+
+/*
+    Compressed CAN frame stream for the low bandwidth links (BT SPP, USB serial)
+
+    The client starts the session by sending SLIP packet consisting of single FRAME_STREAM_MARKER byte.
+    Both sides reset their encoder and decoder then, and all following packets carrying the frames
+    start with FRAME_STREAM_MARKER followed by any number of records.
+    Each connection has its own session, the clients that never asked for it get no compressed packets.
+    The encoder advances as the records are encoded, so when any packet is lost afterwards, dropped for the slow
+    link or by the failed write, the device discards the packets still pending, resets its encoder and sends
+    single FRAME_STREAM_MARKER byte packet. The client resets its decoder then and continues with the records
+    that follow. On the serial link SLIP_END goes before the marker to end the packet cut short by the failed write.
+
+    Record:
+    Byte 0: Flags
+        Bits 0-3: DLC
+        Bit 4: FRAME_STREAM_NEW_ID, full CAN ID follows and it's added to the dictionary.
+               Otherwise one byte index in the dictionary follows
+        Bit 5: FRAME_STREAM_XOR, payload is XOR-ed with the previous payload of the same CAN ID,
+               one byte mask of non-zero bytes followed by these bytes.
+               Otherwise DLC bytes of the payload follow
+    Byte 1: Dictionary index, or Byte 1-4: CAN ID, big endian
+    Then: Timestamp delta since the previous record in FRAME_STREAM_TICK_US units, unsigned LEB128 varint
+    Then: Payload
+
+    Dictionary has FRAME_STREAM_DICT_SIZE entries, new CAN IDs take entries round-robin on both sides,
+    so the dictionary is never sent explicitly.
+    Decoded timestamps count from the first record of the session.
+    The code has no ESP-IDF dependencies, so the clients and the host tools can use it as is.
+ */
+const unsigned char FRAME_STREAM_MARKER = 0x83;
+const unsigned char FRAME_STREAM_NEW_ID = 0x10;
+const unsigned char FRAME_STREAM_XOR = 0x20;
+const int FRAME_STREAM_DICT_SIZE = 128;
+const uint32_t FRAME_STREAM_TICK_US = 100;
+const int FRAME_STREAM_MAX_RECORD = 1 + 4 + 5 + 1 + 8;
+
+class FrameStreamDictionary {
+public:
+    void Reset();
+    int Find(uint32_t id) const;
+    int Add(uint32_t id);
+
+    struct Entry {
+        uint32_t id;
+        uint8_t len;
+        uint8_t data[8];
+    };
+    Entry &operator[](int idx) { return m_entries[idx]; }
+
+private:
+    Entry m_entries[FRAME_STREAM_DICT_SIZE]{};
+    int m_count = 0;
+    int m_next = 0;
+};
+
+class FrameStreamEncoder {
+public:
+    void Reset();
+    /// Encode the frame into out, that must have room for FRAME_STREAM_MAX_RECORD bytes. Returns the record length
+    int Encode(uint32_t id, uint8_t len, const uint8_t *data, uint32_t timestampUs, uint8_t *out);
+
+private:
+    FrameStreamDictionary m_dict;
+    uint32_t m_lastTick = 0;
+    bool m_started = false;
+};
+
+class FrameStreamDecoder {
+public:
+    void Reset();
+    /// Decode one record from buf. Returns number of bytes consumed, 0 if the record is truncated or invalid
+    int Decode(const uint8_t *buf, int len, uint32_t &id, uint8_t &dlc, uint8_t *data, uint32_t &timestampUs);
+
+private:
+    FrameStreamDictionary m_dict;
+    uint32_t m_lastTick = 0;
+};
+
+#endif //MHU2NMEA_FRAMESTREAMCODEC_H
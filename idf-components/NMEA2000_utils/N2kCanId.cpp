@@ -0,0 +1,27 @@
+#include "N2kCanId.h"
+
+// Fast packet PGNs from the NMEA 2000 appendix B the bridges are likely to see
+static const unsigned long FAST_PACKET_PGNS[] = {
+        126208, 126464, 126996, 126998, 127233, 127237, 127489, 127496, 127497, 127498,
+        127503, 127504, 127506, 127507, 127509, 127510, 127511, 127512, 127513, 127514,
+        128275, 128520, 129029, 129038, 129039, 129040, 129041, 129044, 129045, 129284,
+        129285, 129301, 129302, 129538, 129540, 129541, 129542, 129545, 129547, 129549,
+        129551, 129556, 129792, 129793, 129794, 129795, 129796, 129797, 129798, 129799,
+        129800, 129801, 129802, 129803, 129804, 129805, 129806, 129807, 129808, 129809,
+        129810, 130060, 130061, 130064, 130065, 130066, 130067, 130068, 130069, 130070,
+        130071, 130072, 130073, 130074, 130320, 130321, 130322, 130323, 130324, 130567,
+        130577, 130578, 130580, 130581, 130583, 130584, 130586,
+};
+
+bool N2kIsFastPacketPgn(unsigned long pgn) {
+    // Proprietary fast packet PGNs, including our own 130902 and 130903
+    if ( pgn == 126720 || (pgn >= 130816 && pgn <= 131071) ){
+        return true;
+    }
+    for(unsigned long fastPgn : FAST_PACKET_PGNS){
+        if ( fastPgn == pgn ){
+            return true;
+        }
+    }
+    return false;
+}
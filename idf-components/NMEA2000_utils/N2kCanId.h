@@ -0,0 +1,34 @@
+#ifndef MHU2NMEA_N2KCANID_H
+#define MHU2NMEA_N2KCANID_H
+
+#include <cstdint>
+
+// Fields of 29 bit NMEA 2000 CAN ID
+
+inline uint8_t N2kCanIdSource(uint32_t id) { return id & 0xFF; }
+
+inline uint8_t N2kCanIdPriority(uint32_t id) { return (id >> 26) & 0x07; }
+
+inline unsigned long N2kCanIdPgn(uint32_t id) {
+    unsigned long pgn = (id >> 8) & 0x3FFFF;
+    if ( ((pgn >> 8) & 0xFF) < 240 ){
+        pgn &= 0x3FF00;  // PDU1 format, lower byte is the destination
+    }
+    return pgn;
+}
+
+inline uint8_t N2kCanIdDestination(uint32_t id) {
+    return ((id >> 16) & 0xFF) < 240 ? (id >> 8) & 0xFF : 0xFF;
+}
+
+inline uint32_t N2kCanId(uint8_t priority, unsigned long pgn, uint8_t source, uint8_t destination) {
+    if ( ((pgn >> 8) & 0xFF) < 240 ){
+        pgn = (pgn & 0x3FF00) | destination;
+    }
+    return ((uint32_t)(priority & 0x07) << 26) | (pgn << 8) | source;
+}
+
+/// PGN is sent with fast packet protocol
+bool N2kIsFastPacketPgn(unsigned long pgn);
+
+#endif //MHU2NMEA_N2KCANID_H
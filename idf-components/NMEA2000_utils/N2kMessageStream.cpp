@@ -0,0 +1,172 @@
+#include <cstring>
+#include "N2kMessageStream.h"
+#include "N2kCanId.h"
+
+int N2kEncodeMessage(const N2kStreamMessage &msg, unsigned char *buf) {
+    uint32_t prioPgn = ((uint32_t)(msg.priority & 0x07) << 21) | (msg.pgn & 0x3FFFF);
+    buf[0] = prioPgn >> 16;
+    buf[1] = prioPgn >> 8;
+    buf[2] = prioPgn;
+    buf[3] = msg.source;
+    buf[4] = msg.destination;
+    buf[5] = msg.timestampUs >> 24;
+    buf[6] = msg.timestampUs >> 16;
+    buf[7] = msg.timestampUs >> 8;
+    buf[8] = msg.timestampUs;
+    buf[9] = msg.len;
+    memcpy(buf + N2K_MESSAGE_HEADER_SIZE, msg.data, msg.len);
+    return N2K_MESSAGE_HEADER_SIZE + msg.len;
+}
+
+bool N2kDecodeMessage(const unsigned char *buf, int len, N2kStreamMessage &msg) {
+    if ( len < N2K_MESSAGE_HEADER_SIZE || buf[9] > N2K_MAX_MESSAGE_DATA || N2K_MESSAGE_HEADER_SIZE + buf[9] > len ){
+        return false;
+    }
+    uint32_t prioPgn = ((uint32_t)buf[0] << 16) | (buf[1] << 8) | buf[2];
+    msg.priority = (prioPgn >> 21) & 0x07;
+    msg.pgn = prioPgn & 0x3FFFF;
+    msg.source = buf[3];
+    msg.destination = buf[4];
+    msg.timestampUs = ((uint32_t)buf[5] << 24) | ((uint32_t)buf[6] << 16) | (buf[7] << 8) | buf[8];
+    msg.len = buf[9];
+    memcpy(msg.data, buf + N2K_MESSAGE_HEADER_SIZE, msg.len);
+    return true;
+}
+
+N2kMessageAssembler::Slot *N2kMessageAssembler::findSlot(uint8_t source, unsigned long pgn) {
+    for(Slot &slot : m_slots){
+        if ( slot.busy && slot.source == source && slot.pgn == pgn ){
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+N2kMessageAssembler::Slot *N2kMessageAssembler::allocateSlot(uint32_t nowUs) {
+    Slot *oldest = &m_slots[0];
+    for(Slot &slot : m_slots){
+        if ( !slot.busy || nowUs - slot.lastFrameUs > SLOT_TIMEOUT_US ){
+            if ( slot.busy ){
+                m_drops++;  // Never completed
+            }
+            return &slot;
+        }
+        if ( (int32_t)(slot.lastFrameUs - oldest->lastFrameUs) < 0 ){
+            oldest = &slot;
+        }
+    }
+    m_drops++;
+    return oldest;
+}
+
+bool N2kMessageAssembler::Add(const TwaiFrame &frame, N2kStreamMessage &msg) {
+    unsigned long pgn = N2kCanIdPgn(frame.id);
+    uint8_t source = N2kCanIdSource(frame.id);
+
+    if ( !N2kIsFastPacketPgn(pgn) ){
+        msg.timestampUs = frame.timestampUs;
+        msg.pgn = pgn;
+        msg.priority = N2kCanIdPriority(frame.id);
+        msg.source = source;
+        msg.destination = N2kCanIdDestination(frame.id);
+        msg.len = frame.len;
+        memcpy(msg.data, frame.data, frame.len);
+        return true;
+    }
+
+    if ( frame.len < 1 ){
+        return false;
+    }
+    uint8_t seqId = frame.data[0] >> 5;
+    uint8_t frameNum = frame.data[0] & 0x1F;
+    Slot *slot = findSlot(source, pgn);
+
+    if ( frameNum == 0 ){
+        if ( frame.len < 2 ){
+            return false;
+        }
+        if ( slot != nullptr ){
+            m_drops++;  // Previous message from this source is incomplete
+        }else{
+            slot = allocateSlot(frame.timestampUs);
+        }
+        slot->busy = true;
+        slot->source = source;
+        slot->pgn = pgn;
+        slot->seqId = seqId;
+        slot->nextFrame = 1;
+        slot->lastFrameUs = frame.timestampUs;
+        slot->msg.timestampUs = frame.timestampUs;
+        slot->msg.pgn = pgn;
+        slot->msg.priority = N2kCanIdPriority(frame.id);
+        slot->msg.source = source;
+        slot->msg.destination = N2kCanIdDestination(frame.id);
+        slot->msg.len = frame.data[1] <= N2K_MAX_MESSAGE_DATA ? frame.data[1] : N2K_MAX_MESSAGE_DATA;
+        slot->received = frame.len - 2 < slot->msg.len ? frame.len - 2 : slot->msg.len;
+        memcpy(slot->msg.data, frame.data + 2, slot->received);
+    }else{
+        if ( slot == nullptr ){
+            return false;  // Frames of the message we didn't see the start of
+        }
+        if ( slot->seqId != seqId || slot->nextFrame != frameNum ){
+            slot->busy = false;
+            m_drops++;
+            return false;
+        }
+        int n = frame.len - 1;
+        if ( n > slot->msg.len - slot->received ){
+            n = slot->msg.len - slot->received;
+        }
+        memcpy(slot->msg.data + slot->received, frame.data + 1, n);
+        slot->received += n;
+        slot->nextFrame++;
+        slot->lastFrameUs = frame.timestampUs;
+    }
+
+    if ( slot->received < slot->msg.len ){
+        return false;
+    }
+    msg = slot->msg;
+    slot->busy = false;
+    return true;
+}
+
+int N2kMessageSplitter::Split(const N2kStreamMessage &msg, TwaiFrame *frames) {
+    uint32_t id = N2kCanId(msg.priority, msg.pgn, msg.source, msg.destination);
+
+    if ( !N2kIsFastPacketPgn(msg.pgn) ){
+        if ( msg.len > 8 ){
+            m_rejected++;  // Either the PGN is missing in our fast packet list or the client is wrong
+            return 0;
+        }
+        frames[0] = {};
+        frames[0].id = id;
+        frames[0].len = msg.len;
+        memcpy(frames[0].data, msg.data, frames[0].len);
+        return 1;
+    }
+
+    uint8_t seqId = m_seqId;
+    m_seqId = (m_seqId + 1) & 0x07;
+
+    int n = 0;
+    int pos = 0;
+    while ( n < MAX_FRAMES && (n == 0 || pos < msg.len) ){
+        TwaiFrame &frame = frames[n];
+        frame = {};
+        frame.id = id;
+        frame.len = 8;
+        memset(frame.data, 0xFF, sizeof(frame.data));
+        frame.data[0] = (seqId << 5) | n;
+        int start = 1;
+        if ( n == 0 ){
+            frame.data[1] = msg.len;
+            start = 2;
+        }
+        int chunk = msg.len - pos < 8 - start ? msg.len - pos : 8 - start;
+        memcpy(frame.data + start, msg.data + pos, chunk);
+        pos += chunk;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,87 @@
+#ifndef MHU2NMEA_N2KMESSAGESTREAM_H
+#define MHU2NMEA_N2KMESSAGESTREAM_H
+
+#include <cstdint>
+#include "TwaiFrame.h"
+
+/*
+    Whole NMEA 2000 message sent by the bridges in message mode instead of the raw CAN frames
+    Byte 0-2: Priority (upper 3 bits) and PGN (lower 18 bits), big endian
+    Byte 3: Source address
+    Byte 4: Destination address, 0xFF for PDU2 PGNs
+    Byte 5-8: Timestamp, lower 32 bits of microseconds since boot, big endian
+    Byte 9: Data length
+    Byte 10-: Data
+
+    SLIP packet carrying the message starts with N2K_MESSAGE_MARKER, the packet with single CAN frame
+    starts with the upper byte of 29 bit CAN ID, so it never starts with the marker.
+ */
+const unsigned char N2K_MESSAGE_MARKER = 0x82;
+const int N2K_MESSAGE_HEADER_SIZE = 10;
+const int N2K_MAX_MESSAGE_DATA = 223;  // Fast packet limit
+const int N2K_MAX_ENCODED_MESSAGE = N2K_MESSAGE_HEADER_SIZE + N2K_MAX_MESSAGE_DATA;
+
+struct N2kStreamMessage {
+    uint32_t timestampUs;
+    unsigned long pgn;
+    uint8_t priority;
+    uint8_t source;
+    uint8_t destination;
+    uint8_t len;
+    uint8_t data[N2K_MAX_MESSAGE_DATA];
+};
+
+/// Returns encoded length, buf must have room for N2K_MAX_ENCODED_MESSAGE bytes
+int N2kEncodeMessage(const N2kStreamMessage &msg, unsigned char *buf);
+bool N2kDecodeMessage(const unsigned char *buf, int len, N2kStreamMessage &msg);
+
+/// Reassembles fast packet frames into the whole messages.
+/// Messages being assembled are kept in bounded number of slots, one per source and PGN,
+/// the oldest one is given up when there are more concurrent messages.
+/// Must be used by one task only
+class N2kMessageAssembler {
+public:
+    /// Returns true when the frame completed the message
+    bool Add(const TwaiFrame &frame, N2kStreamMessage &msg);
+    /// Number of messages given up because of missing frames or lack of slots
+    uint32_t Drops() const { return m_drops; }
+
+private:
+    static const int MAX_SLOTS = 8;
+    static const uint32_t SLOT_TIMEOUT_US = 750000;  // Max time between fast packet frames
+
+    struct Slot {
+        bool busy;
+        uint8_t source;
+        unsigned long pgn;
+        uint8_t seqId;
+        uint8_t nextFrame;
+        uint8_t received;
+        uint32_t lastFrameUs;
+        N2kStreamMessage msg;
+    };
+
+    Slot *findSlot(uint8_t source, unsigned long pgn);
+    Slot *allocateSlot(uint32_t nowUs);
+
+    Slot m_slots[MAX_SLOTS]{};
+    uint32_t m_drops = 0;
+};
+
+/// Splits messages received from the clients into CAN frames
+class N2kMessageSplitter {
+public:
+    static const int MAX_FRAMES = 32;  // Enough for N2K_MAX_MESSAGE_DATA bytes
+
+    /// Returns number of frames, frames must have room for MAX_FRAMES frames.
+    /// Returns 0 for the message longer than 8 bytes of PGN that is not sent with fast packet protocol
+    int Split(const N2kStreamMessage &msg, TwaiFrame *frames);
+    /// Number of messages rejected because they don't fit into single frame
+    uint32_t Rejected() const { return m_rejected; }
+
+private:
+    uint8_t m_seqId = 0;
+    uint32_t m_rejected = 0;
+};
+
+#endif //MHU2NMEA_N2KMESSAGESTREAM_H
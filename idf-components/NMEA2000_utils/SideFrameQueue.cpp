@@ -0,0 +1,82 @@
+#include <cstring>
+#include <esp_timer.h>
+#include "freertos/task.h"
+#include "SideFrameQueue.h"
+#include "DeviceDiagnostics.h"
+
+SideFrameQueue::SideFrameQueue(int length)
+: m_length(length)
+, m_room(length) {
+    m_queue = xQueueCreate(length, sizeof(TwaiFrame));
+    m_messageMutex = xSemaphoreCreateMutex();
+}
+
+bool SideFrameQueue::Post(unsigned long id, unsigned char len, const unsigned char *buf, TickType_t ticksToWait) {
+    TwaiFrame frame{};
+    frame.timestampUs = (uint32_t)esp_timer_get_time();
+    frame.id = id;
+    frame.len = len <= sizeof(frame.data) ? len : sizeof(frame.data);
+    memcpy(frame.data, buf, frame.len);
+
+    if ( !waitForRoom(1, ticksToWait) ){
+        DeviceDiagnostics::CountDroppedSend();
+        return false;
+    }
+    xQueueSend(m_queue, &frame, 0);
+    return true;
+}
+
+bool SideFrameQueue::reserve(int frames) {
+    int room = m_room.load();
+    do {
+        if ( room < frames ){
+            return false;
+        }
+    } while ( !m_room.compare_exchange_weak(room, room - frames) );
+    return true;
+}
+
+bool SideFrameQueue::waitForRoom(int frames, TickType_t ticksToWait) {
+    TickType_t start = xTaskGetTickCount();
+    while ( !reserve(frames) ){
+        if ( xTaskGetTickCount() - start >= ticksToWait ){
+            return false;
+        }
+        vTaskDelay(1);
+    }
+    return true;
+}
+
+bool SideFrameQueue::PostMessage(const N2kStreamMessage &msg, N2kMessageSplitter &splitter, TickType_t ticksToWait) {
+    TwaiFrame frames[N2kMessageSplitter::MAX_FRAMES];
+    int n = splitter.Split(msg, frames);
+    if ( n == 0 ){
+        return false;  // Counted by the splitter
+    }
+    if ( n > m_length ){
+        DeviceDiagnostics::CountDroppedSend();
+        return false;
+    }
+
+    if ( !waitForRoom(n, ticksToWait) ){
+        DeviceDiagnostics::CountDroppedSend();
+        return false;
+    }
+    auto timestampUs = (uint32_t)esp_timer_get_time();
+    xSemaphoreTake(m_messageMutex, portMAX_DELAY);
+    for(int i = 0; i < n; i++){
+        frames[i].timestampUs = timestampUs;
+        xQueueSend(m_queue, &frames[i], 0);
+    }
+    xSemaphoreGive(m_messageMutex);
+    return true;
+}
+
+int SideFrameQueue::Receive(TwaiFrame *frames, int maxFrames) {
+    int n = 0;
+    while ( n < maxFrames && xQueueReceive(m_queue, &frames[n], 0) == pdTRUE ){
+        n++;
+    }
+    m_room.fetch_add(n);
+    return n;
+}
@@ -0,0 +1,49 @@
+#ifndef MHU2NMEA_SIDEFRAMEQUEUE_H
+#define MHU2NMEA_SIDEFRAMEQUEUE_H
+
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "TwaiFrameRing.h"
+#include "N2kMessageStream.h"
+
+/// Frames received by the side interfaces (WiFi, BT, USB) on their way to the bus.
+/// Any number of bridge tasks post the frames, only the task owning the NMEA2000 stack receives them,
+/// so the stack is never entered from the bridge tasks.
+/// The posters don't lock each other out: each one takes the room for its frames off the free slot count first,
+/// then the sends can't fail and can't take the room another poster has taken.
+/// Only the sends of the split message are serialized, so its frames follow each other, nothing is waited for
+/// while holding that mutex.
+class SideFrameQueue {
+public:
+    explicit SideFrameQueue(int length);
+
+    /// Called by the bridge task. Waits up to ticksToWait for the room in the queue.
+    /// Returns false if the frame was dropped because the queue is full, so the sender can slow down
+    bool Post(unsigned long id, unsigned char len, const unsigned char *buf, TickType_t ticksToWait);
+    /// Split the whole message received in message mode into the frames and post them.
+    /// Waits up to ticksToWait for the room for all frames of the message, either all of them are posted or none.
+    /// Returns false if the message was dropped because the queue is full or it can't be split into the frames
+    bool PostMessage(const N2kStreamMessage &msg, N2kMessageSplitter &splitter, TickType_t ticksToWait);
+    /// Called by the N2K task. Copies up to maxFrames frames without waiting, returns number of frames copied
+    int Receive(TwaiFrame *frames, int maxFrames);
+
+    QueueHandle_t Handle() const { return m_queue; }
+
+private:
+    /// Take the room for the frames if it's there, doesn't wait
+    bool reserve(int frames);
+    /// Retry reserve() every tick up to ticksToWait
+    bool waitForRoom(int frames, TickType_t ticksToWait);
+
+    QueueHandle_t m_queue;
+    int m_length;
+    // Free slots not taken by the posters yet, never more than the queue has.
+    // Posters take it before the send, the N2K task gives it back after the receive
+    std::atomic<int> m_room;
+    // Held by PostMessage() for the sends only, after the room is taken
+    SemaphoreHandle_t m_messageMutex;
+};
+
+#endif //MHU2NMEA_SIDEFRAMEQUEUE_H
@@ -0,0 +1,102 @@
+#include <cstdio>
+#include <esp_log.h>
+#include "freertos/task.h"
+#include "Trace.h"
+#include "BlackBox.h"
+
+static const char *TAG = "mhu2nmea_Trace";
+
+static const int DUMP_CHUNK = 32;
+
+Trace::Slot Trace::s_ring[SCI_TRACE_RING_SIZE];
+std::atomic<uint32_t> Trace::s_head(0);
+std::atomic<bool> Trace::s_enabled(true);
+uint32_t Trace::s_dumped = 0;
+
+void IRAM_ATTR Trace::Record(TraceId id, uint32_t payload) {
+    if ( !s_enabled.load(std::memory_order_relaxed) ){
+        return;
+    }
+    uint32_t seq = s_head.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = s_ring[seq & (SCI_TRACE_RING_SIZE - 1)];
+
+    // The dump copying the previous content of this slot will see it changed
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.event.timestampUs = (uint32_t)esp_timer_get_time();
+    slot.event.id = id;
+    slot.event.core = (uint16_t)xPortGetCoreID();
+    slot.event.payload = payload;
+    slot.seq.store(seq + 1, std::memory_order_release);
+}
+
+int Trace::Dump(TraceSink &sink) {
+    // The writers that passed the check already finish in their slots, the torn ones are skipped below
+    s_enabled.store(false);
+    uint32_t head = s_head.load(std::memory_order_acquire);
+    uint32_t next = head - s_dumped > SCI_TRACE_RING_SIZE ? head - SCI_TRACE_RING_SIZE : s_dumped;
+
+    TraceEvent chunk[DUMP_CHUNK];
+    int n = 0;
+    int count = 0;
+    for(; next != head; next++){
+        Slot &slot = s_ring[next & (SCI_TRACE_RING_SIZE - 1)];
+        if ( slot.seq.load(std::memory_order_acquire) != next + 1 ){
+            continue;   // Not written yet or already overwritten
+        }
+        chunk[n] = slot.event;
+        // Make sure the writer didn't start overwriting the slot while we were copying it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ( slot.seq.load(std::memory_order_relaxed) != next + 1 ){
+            continue;
+        }
+        if ( ++n == DUMP_CHUNK ){
+            sink.write(chunk, n);
+            count += n;
+            n = 0;
+        }
+    }
+    if ( n > 0 ){
+        sink.write(chunk, n);
+        count += n;
+    }
+
+    s_dumped = head;
+    s_enabled.store(true);
+    return count;
+}
+
+class ConsoleTraceSink: public TraceSink {
+public:
+    void write(const TraceEvent *events, int count) override {
+        for(int i = 0; i < count; i++){
+            printf("TRC,%u,%u,%u,%u\n", events[i].timestampUs, events[i].id, events[i].core, events[i].payload);
+        }
+    }
+};
+
+int Trace::DumpToConsole() {
+    ConsoleTraceSink sink;
+    printf("TRC_BEGIN\n");
+    int count = Dump(sink);
+    printf("TRC_END,%d\n", count);
+    fflush(stdout);
+    return count;
+}
+
+void Trace::PollConsoleCommand() {
+    int c = fgetc(stdin);
+    if ( c == EOF ){
+        clearerr(stdin);
+        return;
+    }
+
+    if( c == 't' ){
+        ESP_LOGI(TAG, "Dumping trace");
+        DumpToConsole();
+    }else if( c == 'b' ){
+        ESP_LOGI(TAG, "Dumping black box");
+        BlackBox::DumpToConsole();
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef MHU2NMEA_TRACE_H
+#define MHU2NMEA_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+
+// Set to 0 to compile out all trace points
+#ifndef SCI_TRACE_ENABLED
+#define SCI_TRACE_ENABLED 1
+#endif
+
+// Number of events kept in RAM, must be power of two
+#ifndef SCI_TRACE_RING_SIZE
+#define SCI_TRACE_RING_SIZE 1024
+#endif
+
+/// Trace point identifiers. Names are decoded by mhu2nmea/scripts/trace_decoder.py directly from this file,
+/// so keep one "NAME = value," per line. Ids ending with _BEGIN and _END are shown as slices, the rest as instants
+enum TraceId : uint16_t {
+    TRACE_PCNT_ISR = 1,             // payload: PCNT unit
+    TRACE_CNT_EVENT_BEGIN = 2,      // payload: PCNT unit
+    TRACE_CNT_EVENT_END = 3,        // payload: PCNT unit
+    TRACE_COUNTER_REPORT = 4,       // payload: filtered frequency in 0.01 Hz
+    TRACE_AWA_POLL_BEGIN = 5,
+    TRACE_AWA_POLL_END = 6,         // payload: AWA in 0.1 degree or 0xFFFFFFFF if invalid
+    TRACE_N2K_LOOP_BEGIN = 7,       // payload: event source or 0xFFFFFFFF if no event
+    TRACE_N2K_LOOP_END = 8,
+    TRACE_N2K_PARSE_BEGIN = 9,
+    TRACE_N2K_PARSE_END = 10,
+    TRACE_N2K_SEND = 11,            // payload: PGN
+};
+
+/// One recorded event, dumped as is (little endian) over the network
+struct TraceEvent {
+    uint32_t timestampUs;  // Lower 32 bits of esp_timer_get_time()
+    uint16_t id;
+    uint16_t core;
+    uint32_t payload;
+};
+
+/// Receives recorded events during dump
+class TraceSink {
+public:
+    virtual void write(const TraceEvent *events, int count) = 0;
+};
+
+/// Records trace events into the RAM ring. Safe to call from ISR and from any core, the writers never lock:
+/// the slot is taken with an atomic fetch_add of the head and published with its sequence number,
+/// the same way as TwaiFrameRing does it.
+class Trace {
+public:
+    /// Placed in IRAM, so the ISRs can record while the flash cache is disabled
+    static void IRAM_ATTR Record(TraceId id, uint32_t payload);
+
+    /// Pass the events recorded since the last dump to the sink, oldest first. Recording is paused while dumping.
+    /// The event still being written or overwritten during the dump is skipped
+    /// @return number of events dumped
+    static int Dump(TraceSink &sink);
+    /// Print recorded events as text lines to the console
+    static int DumpToConsole();
+    /// Check console input for the dump commands (character 't' for the trace, 'b' for the black box)
+    static void PollConsoleCommand();
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> seq;  // Sequence number of the event + 1 once it's written, 0 while writing
+        TraceEvent event;
+    };
+
+    static Slot s_ring[SCI_TRACE_RING_SIZE];
+    static std::atomic<uint32_t> s_head;   // Sequence number of the next event to write
+    static std::atomic<bool> s_enabled;
+    static uint32_t s_dumped;              // Sequence number the next dump starts from, only touched by Dump()
+};
+
+#if SCI_TRACE_ENABLED
+#define SCI_TRACE(id, payload) Trace::Record(id, (uint32_t)(payload))
+#else
+#define SCI_TRACE(id, payload) do {} while(0)
+#endif
+
+#endif //MHU2NMEA_TRACE_H
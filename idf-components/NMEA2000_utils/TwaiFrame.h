@@ -0,0 +1,16 @@
+#ifndef MHU2NMEA_TWAIFRAME_H
+#define MHU2NMEA_TWAIFRAME_H
+
+#include <cstdint>
+
+/// CAN frame as it's passed between the bus and the bridges.
+/// The code has no ESP-IDF dependencies, so the host tools can use it as is.
+struct TwaiFrame {
+    uint32_t timestampUs;  // Lower 32 bits of esp_timer_get_time()
+    uint32_t id;
+    uint8_t len;
+    uint8_t isTx;          // Frame transmitted by this device, otherwise received from the bus
+    uint8_t data[8];
+};
+
+#endif //MHU2NMEA_TWAIFRAME_H
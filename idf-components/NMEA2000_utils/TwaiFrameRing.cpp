@@ -0,0 +1,123 @@
+#include <cstring>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "freertos/task.h"
+#include "TwaiFrameRing.h"
+
+static const char *TAG = "mhu2nmea_TwaiFrameRing";
+
+TwaiFrameRing::TwaiFrameRing() {
+    m_eventGroup = xEventGroupCreate();
+}
+
+bool TwaiFrameRing::Subscribe(TwaiFrameCursor &cursor) {
+    if ( m_consumerCount >= MAX_CONSUMERS ){
+        ESP_LOGE(TAG, "No room to subscribe %s", cursor.Name());
+        return false;
+    }
+
+    cursor.m_bit = 1 << m_consumerCount++;
+    cursor.m_next = m_head.load();
+    cursor.m_ring = this;
+    m_consumerBits |= cursor.m_bit;
+    ESP_LOGI(TAG, "Subscribed %s", cursor.Name());
+    return true;
+}
+
+void TwaiFrameRing::onTwaiFrameReceived(unsigned long id, unsigned char len, const unsigned char *buf) {
+    Publish(id, len, buf, false);
+}
+
+void TwaiFrameRing::onTwaiFrameTransmit(unsigned long id, unsigned char len, const unsigned char *buf) {
+    Publish(id, len, buf, true);
+}
+
+void TwaiFrameRing::Publish(unsigned long id, unsigned char len, const unsigned char *buf, bool isTx) {
+    uint32_t seq = m_head.fetch_add(1);
+    Slot &slot = m_slots[seq & (RING_SIZE - 1)];
+
+    // Readers that are copying the previous content of this slot will see it changed
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.frame.timestampUs = (uint32_t)esp_timer_get_time();
+    slot.frame.id = id;
+    slot.frame.len = len <= sizeof(slot.frame.data) ? len : sizeof(slot.frame.data);
+    slot.frame.isTx = isTx;
+    memcpy(slot.frame.data, buf, slot.frame.len);
+    slot.seq.store(seq + 1, std::memory_order_release);
+
+    // Single call wakes all consumers regardless how many of them are there
+    xEventGroupSetBits(m_eventGroup, m_consumerBits);
+}
+
+int TwaiFrameRing::ReadAvailable(TwaiFrameCursor &cursor, TwaiFrame *frames, int maxFrames) {
+    uint32_t head = m_head.load(std::memory_order_acquire);
+    uint32_t next = cursor.m_next;
+
+    // Writer went around the ring, the oldest frames are gone
+    if ( head - next > RING_SIZE ){
+        cursor.m_drops += head - next - RING_SIZE;
+        next = head - RING_SIZE;
+    }
+
+    int n = 0;
+    while ( n < maxFrames && next != head ){
+        Slot &slot = m_slots[next & (RING_SIZE - 1)];
+        uint32_t seq = slot.seq.load(std::memory_order_acquire);
+        if ( seq != next + 1 ){
+            if ( (int32_t)(seq - (next + 1)) > 0 ){
+                // Already overwritten by the newer frame
+                cursor.m_drops++;
+                next++;
+                continue;
+            }
+            break;  // Not written yet
+        }
+
+        frames[n] = slot.frame;
+
+        // Make sure the writer didn't start overwriting the slot while we were copying it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ( slot.seq.load(std::memory_order_relaxed) != seq ){
+            cursor.m_drops++;
+            next++;
+            continue;
+        }
+        n++;
+        next++;
+    }
+
+    cursor.m_next = next;
+    return n;
+}
+
+int TwaiFrameCursor::Read(TwaiFrame *frames, int maxFrames, TickType_t ticksToWait) {
+    if ( m_ring == nullptr ){
+        vTaskDelay(ticksToWait);  // Not subscribed yet
+        return 0;
+    }
+
+    int n = m_ring->ReadAvailable(*this, frames, maxFrames);
+    if ( n == 0 && ticksToWait > 0 ){
+        xEventGroupWaitBits(m_ring->m_eventGroup, m_bit, pdTRUE, pdFALSE, ticksToWait);
+        n = m_ring->ReadAvailable(*this, frames, maxFrames);
+    }
+    return n;
+}
+
+void TwaiFrameCursor::Reset() {
+    if ( m_ring != nullptr ){
+        m_next = m_ring->m_head.load();
+    }
+}
+
+void TwaiFrameCursor::Wake() {
+    if ( m_ring != nullptr ){
+        xEventGroupSetBits(m_ring->m_eventGroup, m_bit);
+    }
+}
+
+uint32_t TwaiFrameCursor::Lag() const {
+    return m_ring != nullptr ? m_ring->m_head.load() - m_next.load() : 0;
+}
@@ -0,0 +1,79 @@
+#ifndef MHU2NMEA_TWAIFRAMERING_H
+#define MHU2NMEA_TWAIFRAMERING_H
+
+#include <atomic>
+#include <cstdint>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "../NMEA2000_esp32_twai/NMEA2000_esp32_twai.h"
+#include "TwaiFrame.h"
+
+class TwaiFrameRing;
+
+/// Read position of one consumer (bridge) in the TwaiFrameRing
+/// Must be used by one task only
+class TwaiFrameCursor {
+public:
+    explicit TwaiFrameCursor(const char *name): m_name(name) {}
+
+    /// Copy up to maxFrames frames this consumer hasn't read yet.
+    /// Waits up to ticksToWait if there are none, returns number of frames copied
+    int Read(TwaiFrame *frames, int maxFrames, TickType_t ticksToWait);
+    /// Skip all frames not read yet
+    void Reset();
+    /// Make the waiting Read() return, e.g. to notice the connection is lost
+    void Wake();
+
+    const char *Name() const { return m_name; }
+    /// Number of frames written to the ring but not read by this consumer yet
+    uint32_t Lag() const;
+    /// Number of frames overwritten before this consumer read them
+    uint32_t Drops() const { return m_drops; }
+    void ResetDrops() { m_drops = 0; }
+
+private:
+    friend class TwaiFrameRing;
+    const char *m_name;
+    TwaiFrameRing *m_ring = nullptr;
+    EventBits_t m_bit = 0;
+    std::atomic<uint32_t> m_next{0};   // Sequence number of the next frame to read
+    std::atomic<uint32_t> m_drops{0};
+};
+
+/// Single ring of the frames seen on the bus shared by all the bridges.
+/// The frame is written once by the TWAI path, each consumer reads it with its own cursor from its own task.
+/// The writer never waits for the consumers: the consumer that falls behind by more than the ring size
+/// loses the oldest frames and counts them as drops, so a slow consumer can't slow down the others.
+class TwaiFrameRing : public TwaiBusListener {
+public:
+    TwaiFrameRing();
+    /// Start reading the frames written after this call
+    bool Subscribe(TwaiFrameCursor &cursor);
+
+    // TWAI frame received from the bus
+    void onTwaiFrameReceived(unsigned long id, unsigned char len, const unsigned char *buf) override;
+    // TWAI frame transmitted to the bus
+    void onTwaiFrameTransmit(unsigned long id, unsigned char len, const unsigned char *buf) override;
+    void flush() override {}
+
+private:
+    friend class TwaiFrameCursor;
+    static const uint32_t RING_SIZE = 256;  // Must be power of 2
+    static const int MAX_CONSUMERS = 8;
+
+    struct Slot {
+        std::atomic<uint32_t> seq{0};  // Sequence number of the frame + 1 once it's written, 0 while writing
+        TwaiFrame frame{};
+    };
+
+    void Publish(unsigned long id, unsigned char len, const unsigned char *buf, bool isTx);
+    int ReadAvailable(TwaiFrameCursor &cursor, TwaiFrame *frames, int maxFrames);
+
+    Slot m_slots[RING_SIZE];
+    std::atomic<uint32_t> m_head{0};  // Sequence number of the next frame to write
+    EventGroupHandle_t m_eventGroup;
+    EventBits_t m_consumerBits = 0;
+    int m_consumerCount = 0;
+};
+
+#endif //MHU2NMEA_TWAIFRAMERING_H
@@ -0,0 +1,150 @@
+#include <cmath>
+#include "PositionPropagator.h"
+
+static const double EARTH_RADIUS_M = 6371008.8;
+static const double DEG_TO_RAD = M_PI / 180;
+
+// Difference of two angles in -pi..pi
+static double angleDiff(double a, double b) {
+    return std::remainder(a - b, 2 * M_PI);
+}
+
+static double normalize2Pi(double a) {
+    a = std::fmod(a, 2 * M_PI);
+    return a < 0 ? a + 2 * M_PI : a;
+}
+
+void PositionPropagator::OnHeading(int64_t timeUs, double headingRad) {
+    if ( m_headingCount > 0 && timeUs <= sample(m_headingCount - 1).timeUs ){
+        return;  // Out of order, the history must stay sorted
+    }
+    m_headings[m_headingHead] = {timeUs, headingRad};
+    m_headingHead = (m_headingHead + 1) % HEADING_HISTORY;
+    if ( m_headingCount < HEADING_HISTORY ){
+        m_headingCount++;
+    }
+}
+
+bool PositionPropagator::headingAt(int64_t timeUs, double &headingRad) const {
+    if ( m_headingCount == 0 ){
+        return false;
+    }
+    int i = 0;
+    while ( i < m_headingCount && sample(i).timeUs <= timeUs ){
+        i++;
+    }
+    if ( i == 0 ){
+        headingRad = sample(0).headingRad;
+    }else if ( i == m_headingCount ){
+        headingRad = sample(i - 1).headingRad;
+    }else{
+        const HeadingSample &a = sample(i - 1);
+        const HeadingSample &b = sample(i);
+        double k = (double)(timeUs - a.timeUs) / (double)(b.timeUs - a.timeUs);
+        headingRad = a.headingRad + angleDiff(b.headingRad, a.headingRad) * k;
+    }
+    return true;
+}
+
+void PositionPropagator::OnFix(int64_t timeUs, double latitude, double longitude, double cogRad, double sogMs) {
+    double correctionNorthM = 0;
+    double correctionEastM = 0;
+    PropagatedPosition predicted{};
+    if ( timeUs > m_fix.timeUs && Propagate(timeUs, predicted) ){
+        correctionNorthM = (predicted.latitude - latitude) * DEG_TO_RAD * EARTH_RADIUS_M;
+        correctionEastM = angleDiff(predicted.longitude * DEG_TO_RAD, longitude * DEG_TO_RAD)
+                * EARTH_RADIUS_M * std::cos(latitude * DEG_TO_RAD);
+        if ( std::hypot(correctionNorthM, correctionEastM) > SNAP_DISTANCE_M ){
+            // Something else went wrong, smoothing would only hide it for longer
+            correctionNorthM = 0;
+            correctionEastM = 0;
+        }
+    }
+
+    m_fix.timeUs = timeUs;
+    m_fix.latitude = latitude;
+    m_fix.longitude = longitude;
+    m_fix.cogRad = cogRad;
+    m_fix.sogMs = sogMs;
+    m_fix.hasHeading = headingAt(timeUs, m_fix.headingRad);
+    m_fixValid = true;
+    m_correctionNorthM = correctionNorthM;
+    m_correctionEastM = correctionEastM;
+}
+
+void PositionPropagator::advance(const Fix &fix, int64_t timeUs, double &northM, double &eastM,
+                                 double &cogRad) const {
+    northM = 0;
+    eastM = 0;
+    cogRad = fix.cogRad;
+    int64_t from = fix.timeUs;
+    if ( !fix.hasHeading ){
+        double dist = fix.sogMs * (double)(timeUs - from) * 1e-6;
+        northM = dist * std::cos(cogRad);
+        eastM = dist * std::sin(cogRad);
+        return;
+    }
+
+    // Course turns with the heading, each segment between the samples takes the mean of its ends
+    double turn = 0;   // Heading change since the fix at the start of the segment, not wrapped
+    auto addSegment = [&](int64_t to, double course) {
+        double dist = fix.sogMs * (double)(to - from) * 1e-6;
+        northM += dist * std::cos(course);
+        eastM += dist * std::sin(course);
+        from = to;
+    };
+    for(int i = 0; i < m_headingCount && from < timeUs; i++){
+        const HeadingSample &s = sample(i);
+        if ( s.timeUs <= from ){
+            continue;
+        }
+        double turnAtSample = turn + angleDiff(angleDiff(s.headingRad, fix.headingRad), turn);
+        double turnTo = turnAtSample;
+        int64_t to = s.timeUs;
+        if ( to > timeUs ){
+            // Interpolate to the time asked
+            turnTo = turn + (turnAtSample - turn) * (double)(timeUs - from) / (double)(to - from);
+            to = timeUs;
+        }
+        addSegment(to, fix.cogRad + (turn + turnTo) / 2);
+        turn = turnTo;
+    }
+    if ( from < timeUs ){
+        addSegment(timeUs, fix.cogRad + turn);  // Heading stays after the last sample
+    }
+    cogRad = normalize2Pi(fix.cogRad + turn);
+}
+
+bool PositionPropagator::Propagate(int64_t timeUs, PropagatedPosition &out) const {
+    int64_t age = timeUs - m_fix.timeUs;
+    if ( !m_fixValid || age > MAX_EXTRAPOLATION_US ){
+        return false;
+    }
+    if ( age < 0 ){
+        age = 0;  // Asked a bit before the fix, e.g. the fix came with the newer time than the local clock
+        timeUs = m_fix.timeUs;
+    }
+
+    double northM, eastM, cogRad;
+    advance(m_fix, timeUs, northM, eastM, cogRad);
+
+    // What the previous fix said fades out
+    double fade = 1 - (double)age / CORRECTION_TIME_US;
+    if ( fade > 0 ){
+        northM += m_correctionNorthM * fade;
+        eastM += m_correctionEastM * fade;
+    }
+
+    double latRad = m_fix.latitude * DEG_TO_RAD;
+    out.latitude = m_fix.latitude + northM / EARTH_RADIUS_M / DEG_TO_RAD;
+    out.longitude = m_fix.longitude + eastM / (EARTH_RADIUS_M * std::cos(latRad)) / DEG_TO_RAD;
+    if ( out.longitude > 180 ){
+        out.longitude -= 360;
+    }else if ( out.longitude < -180 ){
+        out.longitude += 360;
+    }
+    out.cogRad = cogRad;
+    out.sogMs = m_fix.sogMs;
+    out.extrapolated = age > EXTRAPOLATED_AFTER_US;
+    return true;
+}
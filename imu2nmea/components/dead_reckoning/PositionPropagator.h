@@ -0,0 +1,74 @@
+#ifndef IMU2NMEA_POSITIONPROPAGATOR_H
+#define IMU2NMEA_POSITIONPROPAGATOR_H
+
+#include <cstdint>
+
+struct PropagatedPosition {
+    double latitude;        // deg
+    double longitude;       // deg
+    double cogRad;          // True
+    double sogMs;
+    bool extrapolated;      // Later than the fix it's based on
+};
+
+/// Advances the last GNSS fix to any time before the next one comes.
+///
+/// The boat keeps the speed over ground of the fix, the course over ground turns as much as the heading
+/// from the IMU turned since the fix, so the leeway and the current stay the same. The heading is integrated
+/// sample by sample, the IMU runs much faster than the fixes.
+///
+/// When the next fix comes, the difference between it and where the old fix was propagated to fades out
+/// over CORRECTION_TIME_US instead of the jump, unless it's more than SNAP_DISTANCE_M.
+/// Nothing is propagated further than MAX_EXTRAPOLATION_US from the fix.
+///
+/// All the times are UTC in us, the same clock for the fixes, the heading samples and the queries.
+class PositionPropagator {
+public:
+    static const int HEADING_HISTORY = 128;     // Integrated from the oldest one if the fix is older than that
+    static constexpr int64_t MAX_EXTRAPOLATION_US = 2000000;
+    static constexpr int64_t CORRECTION_TIME_US = 1000000;
+    static constexpr int64_t EXTRAPOLATED_AFTER_US = 20000;   // Closer to the fix counts as the fix itself
+    static constexpr double SNAP_DISTANCE_M = 25;
+
+    void OnFix(int64_t timeUs, double latitude, double longitude, double cogRad, double sogMs);
+    /// Heading of any reference, only its change matters
+    void OnHeading(int64_t timeUs, double headingRad);
+    /// The fix is gone, e.g. GNSS lost the position
+    void Invalidate() { m_fixValid = false; }
+
+    /// False if there is no fix or it's too old
+    bool Propagate(int64_t timeUs, PropagatedPosition &out) const;
+
+private:
+    struct HeadingSample {
+        int64_t timeUs;
+        double headingRad;
+    };
+
+    struct Fix {
+        int64_t timeUs;
+        double latitude;
+        double longitude;
+        double cogRad;
+        double sogMs;
+        double headingRad;      // Heading at the time of the fix
+        bool hasHeading;
+    };
+
+    void advance(const Fix &fix, int64_t timeUs, double &northM, double &eastM, double &cogRad) const;
+    bool headingAt(int64_t timeUs, double &headingRad) const;
+    const HeadingSample &sample(int i) const {
+        return m_headings[(m_headingHead + HEADING_HISTORY - m_headingCount + i) % HEADING_HISTORY];
+    }
+
+    Fix m_fix{};
+    bool m_fixValid = false;
+    double m_correctionNorthM = 0;  // Old propagated position minus the new fix
+    double m_correctionEastM = 0;
+
+    HeadingSample m_headings[HEADING_HISTORY]{};
+    int m_headingHead = 0;
+    int m_headingCount = 0;
+};
+
+#endif //IMU2NMEA_POSITIONPROPAGATOR_H
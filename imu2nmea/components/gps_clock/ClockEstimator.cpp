@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cmath>
+#include "ClockEstimator.h"
+
+void ClockEstimator::History::Push(const Sample &s) {
+    m_samples[m_head] = s;
+    m_head = (m_head + 1) % WINDOW;
+    if ( m_count < WINDOW ){
+        m_count++;
+    }
+}
+
+void ClockEstimator::AddEpoch(int64_t localUs, int64_t utcUs) {
+    Sample s = {localUs, utcUs - localUs};
+    checkSample(s);
+
+    int64_t second = utcUs / 1000000;
+    if ( m_binValid && second != m_binSecond ){
+        m_epochs.Push(m_bin);
+        m_binValid = false;
+        update();
+    }
+    // Highest offset is the one with the least delay
+    if ( !m_binValid || s.offsetUs > m_bin.offsetUs ){
+        m_bin = s;
+    }
+    m_binSecond = second;
+    m_binValid = true;
+
+    if ( !m_writerModel.valid ){
+        update();  // Rough time right away, the drift comes later
+    }
+}
+
+void ClockEstimator::AddPulse(int64_t localUs, int64_t utcUs) {
+    Sample s = {localUs, utcUs - localUs};
+    checkSample(s);
+    m_pulses.Push(s);
+    update();
+}
+
+void ClockEstimator::checkSample(const Sample &s) {
+    if ( m_writerModel.valid && std::llabs(s.offsetUs - predictOffset(s.localUs)) > RESET_THRESHOLD_US ){
+        // GPS time jumped or the local clock did, nothing learned so far applies
+        restart();
+        m_resets++;
+    }
+}
+
+void ClockEstimator::restart() {
+    m_epochs.Clear();
+    m_pulses.Clear();
+    m_binValid = false;
+    m_writerModel = {};
+    publish(m_writerModel);
+}
+
+void ClockEstimator::update() {
+    int64_t latestUs = m_binValid ? m_bin.localUs : 0;
+    if ( m_epochs.Count() > 0 && m_epochs.Last().localUs > latestUs ){
+        latestUs = m_epochs.Last().localUs;
+    }
+    bool usePulses = m_pulses.Count() > 0 && latestUs - m_pulses.Last().localUs < PULSE_TIMEOUT_US;
+    const History &h = usePulses ? m_pulses : m_epochs;
+
+    Model model = m_writerModel;
+    model.valid = true;
+    if ( h.Count() == 0 ){
+        // First second of the epochs
+        model.refLocalUs = m_bin.localUs;
+        model.offsetUs = m_bin.offsetUs + m_epochLatencyUs;
+        m_writerModel = model;
+        publish(model);
+        return;
+    }
+
+    model.slope = fitSlope(h);
+    model.refLocalUs = h.Last().localUs;
+
+    if ( usePulses ){
+        // Pulse jitter is symmetric, the mean is the best estimate
+        double sum = 0;
+        for(int i = 0; i < h.Count(); i++){
+            sum += (double)h[i].offsetUs - model.slope * (double)(h[i].localUs - model.refLocalUs);
+        }
+        model.offsetUs = llround(sum / h.Count());
+        m_writerModel = model;
+
+        // Epoch output latency is then known as well, for the time the pulses stop
+        int64_t minDelay = INT64_MAX;
+        for(int i = 0; i < m_epochs.Count(); i++){
+            if ( m_epochs[i].localUs >= h[0].localUs ){
+                minDelay = std::min(minDelay, predictOffset(m_epochs[i].localUs) - m_epochs[i].offsetUs);
+            }
+        }
+        if ( minDelay != INT64_MAX ){
+            m_epochLatencyUs = minDelay;
+        }
+    }else{
+        // Epochs are only late, never early, so the lowest delay is the closest to the truth
+        int64_t best = INT64_MIN;
+        for(int i = 0; i < h.Count(); i++){
+            int64_t r = h[i].offsetUs - llround(model.slope * (double)(h[i].localUs - model.refLocalUs));
+            best = std::max(best, r);
+        }
+        model.offsetUs = best + m_epochLatencyUs;
+        m_writerModel = model;
+    }
+    publish(model);
+}
+
+double ClockEstimator::fitSlope(const History &h) const {
+    int n = h.Count();
+    if ( n < 2 || h.Last().localUs - h[0].localUs < 1000000 ){
+        return m_writerModel.slope;  // Too short to tell the drift from the jitter
+    }
+    // Relative to the last sample, so the doubles keep the precision
+    const Sample &ref = h.Last();
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for(int i = 0; i < n; i++){
+        double x = (double)(h[i].localUs - ref.localUs);
+        double y = (double)(h[i].offsetUs - ref.offsetUs);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double d = n * sxx - sx * sx;
+    return d > 0 ? (n * sxy - sx * sy) / d : m_writerModel.slope;
+}
+
+int64_t ClockEstimator::predictOffset(int64_t localUs) const {
+    return m_writerModel.offsetUs + llround(m_writerModel.slope * (double)(localUs - m_writerModel.refLocalUs));
+}
+
+void ClockEstimator::publish(const Model &model) {
+    m_seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_model = model;
+    m_seq.fetch_add(1, std::memory_order_release);
+}
+
+ClockEstimator::Model ClockEstimator::read() const {
+    Model model;
+    uint32_t seq;
+    do {
+        seq = m_seq.load(std::memory_order_acquire);
+        model = m_model;
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ( (seq & 1) != 0 || m_seq.load(std::memory_order_relaxed) != seq );
+    return model;
+}
+
+bool ClockEstimator::ToUtc(int64_t localUs, int64_t &utcUs) const {
+    Model model = read();
+    if ( !model.valid ){
+        return false;
+    }
+    utcUs = localUs + model.offsetUs + llround(model.slope * (double)(localUs - model.refLocalUs));
+    return true;
+}
+
+double ClockEstimator::DriftPpm() const {
+    return read().slope * 1e6;
+}
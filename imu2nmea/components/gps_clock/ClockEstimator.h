@@ -0,0 +1,89 @@
+#ifndef IMU2NMEA_CLOCKESTIMATOR_H
+#define IMU2NMEA_CLOCKESTIMATOR_H
+
+#include <atomic>
+#include <cstdint>
+
+/// Learns the offset and the drift of the local microsecond clock (esp_timer) against UTC from the GPS.
+///
+/// Two kinds of samples:
+/// * Epoch: local time of the first byte of the receiver output for the navigation epoch and the UTC time of
+///   the epoch. It's late by the receiver output latency plus the UART and task jitter, never early.
+///   The best sample of each UTC second is kept, the one that came the soonest, and the offset follows the
+///   lower envelope of the delays, so the jitter doesn't get into the time. The constant part of the latency is
+///   set with SetEpochLatency() or learned from the pulses. It can't be told from the epochs alone, so without the
+///   pulses the time is within 1 ms plus the error of the latency set, behind UTC if the latency set is short.
+/// * Pulse: local time of the PPS edge and the UTC second it marks, jitter is the interrupt latency only.
+///   While the pulses come they are used instead of the epochs.
+///
+/// The drift is the least squares slope over the last WINDOW seconds. A sample off the model by more than
+/// RESET_THRESHOLD_US, e.g. after the receiver reset, starts the learning over.
+///
+/// Samples are added by one task, ToUtc() can be called from any task: the model is published with the sequence
+/// counter, the readers retry if it changed while they were copying it.
+class ClockEstimator {
+public:
+    static const int WINDOW = 32;
+    static constexpr int64_t RESET_THRESHOLD_US = 500000;
+    static constexpr int64_t PULSE_TIMEOUT_US = 3000000;   // Back to the epochs if the pulses stop
+
+    void AddEpoch(int64_t localUs, int64_t utcUs);
+    void AddPulse(int64_t localUs, int64_t utcUs);
+    /// Time from the start of the epoch to the first byte of its output
+    void SetEpochLatency(int64_t latencyUs) { m_epochLatencyUs = latencyUs; }
+
+    /// False until the first sample
+    bool ToUtc(int64_t localUs, int64_t &utcUs) const;
+    /// Positive if the local clock is slow
+    double DriftPpm() const;
+    int64_t EpochLatencyUs() const { return m_epochLatencyUs; }
+    uint32_t Resets() const { return m_resets; }
+
+private:
+    struct Sample {
+        int64_t localUs;
+        int64_t offsetUs;   // UTC - local
+    };
+
+    class History {
+    public:
+        void Push(const Sample &s);
+        void Clear() { m_count = 0; }
+        int Count() const { return m_count; }
+        const Sample &operator[](int i) const { return m_samples[(m_head + WINDOW - m_count + i) % WINDOW]; }
+        const Sample &Last() const { return (*this)[m_count - 1]; }
+    private:
+        Sample m_samples[WINDOW]{};
+        int m_head = 0;
+        int m_count = 0;
+    };
+
+    struct Model {
+        bool valid;
+        int64_t refLocalUs;
+        int64_t offsetUs;   // At refLocalUs
+        double slope;       // Offset change per local us
+    };
+
+    void checkSample(const Sample &s);
+    void restart();
+    void update();
+    double fitSlope(const History &h) const;
+    int64_t predictOffset(int64_t localUs) const;
+    void publish(const Model &model);
+    Model read() const;
+
+    History m_epochs;
+    History m_pulses;
+    Sample m_bin{};             // Best epoch of the current UTC second
+    int64_t m_binSecond = 0;
+    bool m_binValid = false;
+    int64_t m_epochLatencyUs = 0;
+    uint32_t m_resets = 0;
+
+    Model m_writerModel{};      // Writer's copy, no need to read it under the sequence counter
+    Model m_model{};
+    std::atomic<uint32_t> m_seq{0};   // Odd while m_model is being written
+};
+
+#endif //IMU2NMEA_CLOCKESTIMATOR_H
@@ -0,0 +1,94 @@
+#include <cmath>
+#include "CompassLagEstimator.h"
+
+void CompassLagEstimator::Track::Push(int64_t timeUs, double value) {
+    m_points[m_head] = {timeUs, value};
+    m_head = (m_head + 1) % SIZE;
+    if ( m_count < SIZE ){
+        m_count++;
+    }
+}
+
+bool CompassLagEstimator::Track::At(int64_t timeUs, double &value) const {
+    if ( m_count < 2 || timeUs < at(0).timeUs || timeUs > at(m_count - 1).timeUs ){
+        return false;
+    }
+    for(int i = m_count - 1; i > 0; i--){
+        const Point &a = at(i - 1);
+        if ( a.timeUs <= timeUs ){
+            const Point &b = at(i);
+            value = b.timeUs == a.timeUs ? b.value
+                    : a.value + (b.value - a.value) * (double)(timeUs - a.timeUs) / (double)(b.timeUs - a.timeUs);
+            return true;
+        }
+    }
+    return false;
+}
+
+void CompassLagEstimator::AddRate(int64_t timeUs, float rotDegS) {
+    if ( m_gyro.Empty() || timeUs - m_lastRateUs > MAX_GAP_US ){
+        m_gyro.Clear();
+        m_compass.Clear();
+        m_gyro.Push(timeUs, 0);
+    }else{
+        // Trapezoid, like HeadingEstimator
+        double dt = (double)(timeUs - m_lastRateUs) * 1e-6;
+        m_gyro.Push(timeUs, m_gyro.Last() + (m_lastRate + rotDegS) / 2 * dt);
+    }
+    m_lastRate = rotDegS;
+    m_lastRateUs = timeUs;
+}
+
+void CompassLagEstimator::AddHeading(int64_t timeUs, float hdgDeg) {
+    if ( m_gyro.Empty() ){
+        return;
+    }
+    double hdg = m_compass.Empty() ? hdgDeg : m_compass.Last() + std::remainder(hdgDeg - m_lastHdg, 360.0);
+    m_compass.Push(timeUs, hdg);
+    m_lastHdg = hdgDeg;
+
+    double before;
+    if ( !m_compass.At(timeUs - WINDOW_US, before) || std::fabs(hdg - before) < MIN_TURN_DEG ){
+        return;
+    }
+    double diffs[LAGS];
+    for(int i = 0; i < LAGS; i++){
+        int64_t lagUs = i * LAG_STEP_US;
+        double end, start;
+        if ( !m_gyro.At(timeUs - lagUs, end) || !m_gyro.At(timeUs - WINDOW_US - lagUs, start) ){
+            return;     // Not enough gyro yet, all the lags count the same windows
+        }
+        diffs[i] = (hdg - before) - (end - start);
+    }
+
+    for(int i = 0; i < LAGS; i++){
+        m_sum[i] = m_sum[i] * (1 - FORGET) + diffs[i];
+        m_sumSq[i] = m_sumSq[i] * (1 - FORGET) + diffs[i] * diffs[i];
+    }
+    m_weight = m_weight * (1 - FORGET) + 1;
+    m_windows++;
+}
+
+int64_t CompassLagEstimator::LagUs() const {
+    if ( !Valid() ){
+        return m_startLagUs;
+    }
+    double var[LAGS];
+    int best = 0;
+    for(int i = 0; i < LAGS; i++){
+        double mean = m_sum[i] / m_weight;
+        var[i] = m_sumSq[i] / m_weight - mean * mean;
+        if ( var[i] < var[best] ){
+            best = i;
+        }
+    }
+    // Parabola through the best one and its neighbours for the lag between the steps
+    double offset = 0;
+    if ( best > 0 && best < LAGS - 1 ){
+        double d = var[best - 1] - 2 * var[best] + var[best + 1];
+        if ( d > 0 ){
+            offset = 0.5 * (var[best - 1] - var[best + 1]) / d;
+        }
+    }
+    return std::llround((best + offset) * (double)LAG_STEP_US);
+}
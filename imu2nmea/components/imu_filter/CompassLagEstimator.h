@@ -0,0 +1,71 @@
+#ifndef IMU2NMEA_COMPASSLAGESTIMATOR_H
+#define IMU2NMEA_COMPASSLAGESTIMATOR_H
+
+#include <cstdint>
+
+/// Learns how late the compass heading is against the gyro. The sensors filter the heading inside and don't say
+/// for how long, so it's found from the data.
+/// Each compass heading is compared with the one WINDOW_US before it, and the change with the gyro rate integrated
+/// over the same window, moved earlier by each of the candidate lags. The lag with the least variance of the
+/// difference wins, the gyro bias only shifts its mean. Only the windows the heading changes by MIN_TURN_DEG in
+/// count, on the steady course every lag fits the same. Old windows are forgotten slowly.
+/// Until MIN_WINDOWS of them were seen LagUs() is the starting value given.
+/// Times are esp_timer microseconds of the arrival, angles deg, rates deg/s positive turning to starboard.
+/// The code has no ESP-IDF dependencies, so the host tools can use it as is.
+class CompassLagEstimator {
+public:
+    static constexpr int64_t LAG_STEP_US = 10000;
+    static constexpr int LAGS = 26;                     // 0 to 250 ms
+    static constexpr int64_t WINDOW_US = 500000;
+    static constexpr double MIN_TURN_DEG = 2;
+    static constexpr int MIN_WINDOWS = 200;
+    static constexpr double FORGET = 0.001;             // Per window
+    static constexpr int64_t MAX_GAP_US = 500000;       // The gyro lost for longer, the integral starts over
+
+    explicit CompassLagEstimator(int64_t startLagUs) : m_startLagUs(startLagUs) {}
+
+    void AddRate(int64_t timeUs, float rotDegS);
+    void AddHeading(int64_t timeUs, float hdgDeg);
+
+    /// Enough turning was seen to tell the lag
+    bool Valid() const { return m_windows >= MIN_WINDOWS; }
+    /// Learned lag, or the starting one while it's not Valid()
+    int64_t LagUs() const;
+    int Windows() const { return m_windows; }
+
+private:
+    /// Value over time, interpolated between the points
+    class Track {
+    public:
+        static constexpr int SIZE = 128;     // Longer than the window and the longest lag at 100 Hz
+        void Push(int64_t timeUs, double value);
+        void Clear() { m_count = 0; }
+        bool Empty() const { return m_count == 0; }
+        const double &Last() const { return at(m_count - 1).value; }
+        /// False if the time is out of the points kept
+        bool At(int64_t timeUs, double &value) const;
+    private:
+        struct Point {
+            int64_t timeUs;
+            double value;
+        };
+        const Point &at(int i) const { return m_points[(m_head + SIZE - m_count + i) % SIZE]; }
+        Point m_points[SIZE]{};
+        int m_head = 0;
+        int m_count = 0;
+    };
+
+    const int64_t m_startLagUs;
+    Track m_gyro;               // Rate integrated since the start
+    Track m_compass;            // Unwrapped heading
+    double m_lastRate = 0;
+    int64_t m_lastRateUs = 0;
+    float m_lastHdg = 0;
+
+    double m_sum[LAGS]{};
+    double m_sumSq[LAGS]{};
+    double m_weight = 0;
+    int m_windows = 0;
+};
+
+#endif //IMU2NMEA_COMPASSLAGESTIMATOR_H
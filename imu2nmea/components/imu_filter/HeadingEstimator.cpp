@@ -0,0 +1,89 @@
+#include <cmath>
+#include <algorithm>
+#include "HeadingEstimator.h"
+
+static double wrap360(double deg) {
+    deg = fmod(deg, 360);
+    return deg < 0 ? deg + 360 : deg;
+}
+
+void HeadingEstimator::AddRate(int64_t timeUs, float rotDegS) {
+    if ( m_hasRate && timeUs - m_timeUs > MAX_GAP_US ){
+        Reset();
+    }
+    if ( m_valid ){
+        // Trapezoid, the gyro samples come at the sensor rate
+        double dt = (double)(timeUs - m_timeUs) * 1e-6;
+        m_hdg += ((m_rate + rotDegS) / 2 - m_bias) * dt;
+        push(timeUs, m_hdg);
+    }
+    m_rate = rotDegS;
+    m_timeUs = timeUs;
+    m_hasRate = true;
+}
+
+void HeadingEstimator::AddHeading(int64_t timeUs, float hdgDeg) {
+    if ( !m_hasRate ){
+        return;
+    }
+    if ( !m_valid ){
+        m_hdg = hdgDeg;
+        m_count = 0;
+        push(m_timeUs, m_hdg);
+        m_lastHeadingUs = timeUs;
+        m_valid = true;
+        return;
+    }
+
+    double dt = std::min((double)(timeUs - m_lastHeadingUs) * 1e-6, 1.0);
+    m_lastHeadingUs = timeUs;
+    if ( dt <= 0 ){
+        return;
+    }
+    double err = std::remainder(hdgDeg - estimateAt(timeUs), 360.0);
+    double correction = HEADING_GAIN * err * dt;
+    m_hdg += correction;
+    // The history moves with the estimate, so the next compass heading is compared with the corrected one
+    for(int i = 0; i < m_count; i++){
+        m_steps[(m_head + HISTORY - m_count + i) % HISTORY].hdg += correction;
+    }
+    m_bias -= BIAS_GAIN * err * dt;
+
+    // Keep it small, the history is shifted by the same amount
+    if ( std::fabs(m_hdg) > 3600 ){
+        double shift = m_hdg - wrap360(m_hdg);
+        m_hdg -= shift;
+        for(int i = 0; i < m_count; i++){
+            m_steps[(m_head + HISTORY - m_count + i) % HISTORY].hdg -= shift;
+        }
+    }
+}
+
+float HeadingEstimator::Predict(int64_t timeUs) const {
+    int64_t ahead = std::min(std::max(timeUs - m_timeUs, (int64_t)0), MAX_PREDICTION_US);
+    return (float)wrap360(m_hdg + Rate() * (double)ahead * 1e-6);
+}
+
+void HeadingEstimator::push(int64_t timeUs, double hdg) {
+    m_steps[m_head] = {timeUs, hdg};
+    m_head = (m_head + 1) % HISTORY;
+    m_count = std::min(m_count + 1, HISTORY);
+}
+
+double HeadingEstimator::estimateAt(int64_t timeUs) const {
+    // Older than the history, the oldest one is the best there is
+    if ( timeUs <= step(0).timeUs ){
+        return step(0).hdg;
+    }
+    for(int i = m_count - 1; i > 0; i--){
+        const Step &a = step(i - 1);
+        if ( a.timeUs <= timeUs ){
+            const Step &b = step(i);
+            if ( timeUs >= b.timeUs ){
+                return b.hdg;
+            }
+            return a.hdg + (b.hdg - a.hdg) * (double)(timeUs - a.timeUs) / (double)(b.timeUs - a.timeUs);
+        }
+    }
+    return step(m_count - 1).hdg;
+}
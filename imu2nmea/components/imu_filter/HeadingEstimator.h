@@ -0,0 +1,58 @@
+#ifndef IMU2NMEA_HEADINGESTIMATOR_H
+#define IMU2NMEA_HEADINGESTIMATOR_H
+
+#include <cstdint>
+
+/// Complementary filter of the compass heading and the gyro rate of turn.
+/// The heading follows the integrated gyro, the compass pulls it back with the time constant of about a second and
+/// learns the gyro bias. The compass heading lags, it's filtered inside the sensor, so each one is compared with
+/// the estimate kept for the time it was measured, not with the current one.
+/// The estimate has the gyro latency only, and Predict() projects it forward to the time it's sent.
+/// Times are esp_timer microseconds, angles deg, rates deg/s positive turning to starboard.
+/// The code has no ESP-IDF dependencies, so the host tools can use it as is.
+class HeadingEstimator {
+public:
+    static constexpr int HISTORY = 64;                          // Gyro steps kept, longer than the compass lag
+    static constexpr double HEADING_GAIN = 1.0;             // 1/s, the compass time constant is 1 s
+    static constexpr double BIAS_GAIN = HEADING_GAIN * HEADING_GAIN / 4;    // Critically damped
+    static constexpr int64_t MAX_GAP_US = 500000;           // The gyro lost for longer, start over
+    static constexpr int64_t MAX_PREDICTION_US = 500000;
+
+    void AddRate(int64_t timeUs, float rotDegS);
+    /// Compass heading measured at timeUs, i.e. the arrival time less the sensor lag
+    void AddHeading(int64_t timeUs, float hdgDeg);
+    void Reset() { m_valid = false; m_hasRate = false; m_count = 0; }
+
+    /// False until the first compass heading after the start or the gap
+    bool Valid() const { return m_valid; }
+    /// Heading at timeUs, the last rate carries it past the last gyro sample
+    float Predict(int64_t timeUs) const;
+    /// Bias corrected rate of turn
+    float Rate() const { return (float)(m_rate - m_bias); }
+    float Bias() const { return (float)m_bias; }
+    int64_t TimeUs() const { return m_timeUs; }
+
+private:
+    struct Step {
+        int64_t timeUs;
+        double hdg;
+    };
+
+    void push(int64_t timeUs, double hdg);
+    double estimateAt(int64_t timeUs) const;
+    const Step &step(int i) const { return m_steps[(m_head + HISTORY - m_count + i) % HISTORY]; }
+
+    Step m_steps[HISTORY]{};
+    int m_head = 0;
+    int m_count = 0;
+
+    bool m_valid = false;
+    bool m_hasRate = false;
+    double m_hdg = 0;           // Not wrapped, so the history interpolates across 360
+    double m_rate = 0;
+    double m_bias = 0;
+    int64_t m_timeUs = 0;
+    int64_t m_lastHeadingUs = 0;
+};
+
+#endif //IMU2NMEA_HEADINGESTIMATOR_H
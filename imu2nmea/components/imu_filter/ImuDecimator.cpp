@@ -0,0 +1,84 @@
+#include <cmath>
+#include <algorithm>
+#include "ImuDecimator.h"
+
+// Q of the two sections of the 4th order Butterworth
+static const double BUTTERWORTH_Q[] = {0.54119610, 1.30656296};
+static const double CUTOFF_OF_OUTPUT_RATE = 0.4;
+
+ImuDecimator::ImuDecimator(int sampleRateHz, int outputRateHz)
+    : m_factor(std::max(1, sampleRateHz / std::max(1, outputRateHz)))
+{
+    double cutoffHz = CUTOFF_OF_OUTPUT_RATE * sampleRateHz / m_factor;
+    double delaySec = 0;
+    for(int s = 0; s < SECTIONS; s++){
+        for(auto &channel : m_filters){
+            channel[s].Design(cutoffHz / sampleRateHz, BUTTERWORTH_Q[s]);
+        }
+        // Group delay of the 2nd order low pass at DC is 1 / (Q * w0)
+        delaySec += 1 / (BUTTERWORTH_Q[s] * 2 * M_PI * cutoffHz);
+    }
+    m_delayUs = llround(delaySec * 1e6);
+}
+
+bool ImuDecimator::Add(const ImuSample &in, ImuSample &out) {
+    double hdgRad = in.hdg * M_PI / 180;
+    double x[CHANNELS] = {sin(hdgRad), cos(hdgRad), in.pitch, in.roll, in.rot};
+    if ( !m_primed ){
+        for(int c = 0; c < CHANNELS; c++){
+            for(auto &section : m_filters[c]){
+                section.Prime(x[c]);
+            }
+        }
+        m_primed = true;
+        m_count = 0;
+    }
+
+    double y[CHANNELS];
+    for(int c = 0; c < CHANNELS; c++){
+        y[c] = step(c, x[c]);
+    }
+    if ( ++m_count < m_factor ){
+        return false;
+    }
+    m_count = 0;
+
+    double hdg = atan2(y[0], y[1]) * 180 / M_PI;
+    out.hdg = (float)(hdg < 0 ? hdg + 360 : hdg);
+    out.pitch = (float)y[2];
+    out.roll = (float)y[3];
+    out.rot = (float)y[4];
+    return true;
+}
+
+double ImuDecimator::step(int channel, double x) {
+    for(auto &section : m_filters[channel]){
+        x = section.Step(x);
+    }
+    return x;
+}
+
+void ImuDecimator::Biquad::Design(double cutoffRatio, double q) {
+    // Bilinear transform low pass, Audio EQ Cookbook
+    double w0 = 2 * M_PI * cutoffRatio;
+    double alpha = sin(w0) / (2 * q);
+    double a0 = 1 + alpha;
+    b1 = (1 - cos(w0)) / a0;
+    b0 = b1 / 2;
+    b2 = b0;
+    a1 = -2 * cos(w0) / a0;
+    a2 = (1 - alpha) / a0;
+}
+
+void ImuDecimator::Biquad::Prime(double x) {
+    // State the transposed direct form II has after the constant input x for long
+    z1 = (1 - b0) * x;
+    z2 = (b2 - a2) * x;
+}
+
+double ImuDecimator::Biquad::Step(double x) {
+    double y = b0 * x + z1;
+    z1 = b1 * x - a1 * y + z2;
+    z2 = b2 * x - a2 * y;
+    return y;
+}
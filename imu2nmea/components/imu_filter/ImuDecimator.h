@@ -0,0 +1,57 @@
+#ifndef IMU2NMEA_IMUDECIMATOR_H
+#define IMU2NMEA_IMUDECIMATOR_H
+
+#include <cstdint>
+
+/// One output of the IMU, deg and deg/s
+struct ImuSample {
+    float hdg;
+    float pitch;
+    float roll;
+    float rot;
+};
+
+/// Brings the high rate IMU output down to the N2K rate.
+/// Every channel goes through the 4th order Butterworth low pass with the cutoff at 0.4 of the output rate,
+/// then every n-th sample is taken. The vibration and the wave slap above the output Nyquist don't alias into
+/// the slow motion the way they do when the last sample is taken.
+/// The heading is filtered as its sine and cosine, so it goes through 360 without the jump.
+/// The price is the delay, about 1/(output rate) at low frequencies, see DelayUs().
+/// The code has no ESP-IDF dependencies, so the host tools can use it as is.
+class ImuDecimator {
+public:
+    ImuDecimator(int sampleRateHz, int outputRateHz);
+
+    /// True when the decimated sample is due, it's written to out
+    bool Add(const ImuSample &in, ImuSample &out);
+    /// The next sample starts the filters at its value, e.g. after the sensor was lost
+    void Reset() { m_primed = false; }
+    /// Group delay of the filter at low frequencies
+    int64_t DelayUs() const { return m_delayUs; }
+    int Factor() const { return m_factor; }
+
+private:
+    class Biquad {
+    public:
+        void Design(double cutoffRatio, double q);
+        void Prime(double x);
+        double Step(double x);
+    private:
+        double b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+        double z1 = 0, z2 = 0;
+    };
+
+    // sin and cos of the heading, pitch, roll, rate of turn
+    static constexpr int CHANNELS = 5;
+    static constexpr int SECTIONS = 2;
+
+    double step(int channel, double x);
+
+    Biquad m_filters[CHANNELS][SECTIONS];
+    int m_factor;
+    int m_count = 0;
+    bool m_primed = false;
+    int64_t m_delayUs;
+};
+
+#endif //IMU2NMEA_IMUDECIMATOR_H
@@ -0,0 +1,150 @@
+#include <cstring>
+#include <algorithm>
+#include "GnssFramer.h"
+
+int GnssFramer::findStart(const uint8_t *buf, int len) {
+    int i = 0;
+    while ( i < len && buf[i] != UBX_SYNC_1 && buf[i] != '$' ){
+        i++;
+    }
+    return i;
+}
+
+void GnssFramer::Process(uint8_t *buf, int len) {
+    int pos = m_partialLen > 0 ? continuePartial(buf, len) : 0;
+    while ( pos < len ){
+        pos += findStart(buf + pos, len - pos);
+        if ( pos == len ){
+            break;
+        }
+        int n = tryFrame(buf + pos, len - pos);
+        if ( n == 0 ){
+            // Cut by the end of the read, the rest of it comes with the next one
+            memcpy(m_partial, buf + pos, len - pos);
+            m_partialLen = len - pos;
+            return;
+        }
+        pos += n > 0 ? n : 1;
+    }
+}
+
+int GnssFramer::continuePartial(uint8_t *buf, int len) {
+    int pos = 0;
+    while ( pos < len ){
+        // Copy no more than the frame needs, so the bytes after it are framed in place
+        int want;
+        if ( m_partial[0] == UBX_SYNC_1 ){
+            want = m_partialLen < UBX_HEADER_LEN ? UBX_HEADER_LEN - m_partialLen
+                    : UBX_HEADER_LEN + (m_partial[4] | m_partial[5] << 8) + 2 - m_partialLen;
+        }else{
+            auto *nl = (const uint8_t *)memchr(buf + pos, '\n', len - pos);
+            want = nl != nullptr ? (int)(nl - (buf + pos)) + 1 : len - pos;
+        }
+        want = std::min(std::min(want, len - pos), UBX_MAX_FRAME_LEN - m_partialLen);
+        memcpy(m_partial + m_partialLen, buf + pos, want);
+        m_partialLen += want;
+        pos += want;
+
+        int n = tryFrame(m_partial, m_partialLen);
+        if ( n == 0 ){
+            continue;
+        }
+        if ( n < 0 ){
+            n = 1;
+        }
+        // The bytes after the frame or the broken start are framed again in place.
+        // The ones left from the previous read only remain after the broken UBX header, they are dropped.
+        int rest = m_partialLen - n;
+        m_partialLen = 0;
+        return pos - std::min(rest, want);
+    }
+    return pos;
+}
+
+int GnssFramer::tryFrame(uint8_t *p, int avail) {
+    return p[0] == UBX_SYNC_1 ? tryUbx(p, avail) : tryNmea(p, avail);
+}
+
+int GnssFramer::tryUbx(uint8_t *p, int avail) {
+    if ( avail < 2 ){
+        return 0;
+    }
+    if ( p[1] != UBX_SYNC_2 ){
+        return -1;
+    }
+    if ( avail < UBX_HEADER_LEN ){
+        return 0;
+    }
+    int len = p[4] | p[5] << 8;
+    if ( len > (int)BUFFER_SIZE ){
+        m_framingErrors++;
+        return 2;
+    }
+    int total = UBX_HEADER_LEN + len + 2;
+    if ( avail < total ){
+        return 0;
+    }
+
+    uint8_t ck_a = 0, ck_b = 0;
+    for(int i = 2; i < UBX_HEADER_LEN + len; i++){
+        ck_a += p[i];
+        ck_b += ck_a;
+    }
+    if ( ck_a != p[total - 2] || ck_b != p[total - 1] ){
+        // The length might be broken as well, look for the next frame right after the sync bytes
+        m_checksumErrors++;
+        return 2;
+    }
+
+    m_ubxFrames++;
+    m_handler.onUbxFrame(p[2], p[3], p + UBX_HEADER_LEN, len);
+    return total;
+}
+
+static int hexDigit(uint8_t c) {
+    if ( c >= '0' && c <= '9' ) return c - '0';
+    if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    return -1;
+}
+
+int GnssFramer::tryNmea(uint8_t *p, int avail) {
+    int limit = std::min(avail, NMEA_MAX_LEN);
+    int nl = 1;
+    for(; nl < limit && p[nl] != '\n'; nl++){
+        if ( p[nl] == '$' || p[nl] == UBX_SYNC_1 ){
+            m_framingErrors++;  // Bytes were lost, the next frame starts here
+            return nl;
+        }
+    }
+    if ( nl == limit ){
+        if ( avail < NMEA_MAX_LEN ){
+            return 0;
+        }
+        m_framingErrors++;
+        return 1;
+    }
+
+    // $<body>*hh[\r]\n
+    int end = p[nl - 1] == '\r' ? nl - 1 : nl;
+    int star = end - 3;
+    if ( star < 1 || p[star] != '*' ){
+        m_checksumErrors++;
+        return nl + 1;
+    }
+    uint8_t sum = 0;
+    for(int i = 1; i < star; i++){
+        sum ^= p[i];
+    }
+    int hi = hexDigit(p[star + 1]);
+    int lo = hexDigit(p[star + 2]);
+    if ( hi < 0 || lo < 0 || sum != (hi << 4 | lo) ){
+        m_checksumErrors++;
+        return nl + 1;
+    }
+
+    p[end] = '\0';
+    m_nmeaSentences++;
+    m_handler.onNmeaSentence((const char *)p, end);
+    return nl + 1;
+}
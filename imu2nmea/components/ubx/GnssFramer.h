@@ -0,0 +1,59 @@
+#ifndef IMU2NMEA_GNSSFRAMER_H
+#define IMU2NMEA_GNSSFRAMER_H
+
+#include <cstddef>
+#include <cstdint>
+#include "ubx_defs.h"
+
+/// Splits the byte stream of the GNSS receiver into UBX frames and NMEA 0183 sentences in one pass.
+/// The frame is passed to the handler as the span of the buffer given to Process(), only the frame cut
+/// between two reads is copied to the internal buffer first.
+/// UBX checksum and NMEA *hh checksum are checked, the frames failing them are dropped and counted.
+/// The code has no ESP-IDF dependencies, so the host tools can use it as is.
+class GnssFramer {
+public:
+    class Handler {
+    public:
+        /// Payload of the UBX frame with the valid checksum
+        virtual void onUbxFrame(uint8_t cls, uint8_t id, const uint8_t *payload, uint16_t len) = 0;
+        /// Sentence from '$' to the checksum with the valid checksum, NUL terminated in place after it
+        virtual void onNmeaSentence(const char *sentence, int len) = 0;
+    };
+
+    static constexpr int UBX_HEADER_LEN = 6;   // Two sync bytes, class, id and two bytes of length
+    static constexpr int UBX_MAX_FRAME_LEN = UBX_HEADER_LEN + BUFFER_SIZE + 2;
+    static constexpr int NMEA_MAX_LEN = 128;   // NMEA says 82 with CR LF, leave room for proprietary ones
+
+    explicit GnssFramer(Handler &handler) : m_handler(handler) {}
+    /// The buffer is modified, each NMEA sentence gets NUL terminated
+    void Process(uint8_t *buf, int len);
+    /// Forget the frame received so far, e.g. after the UART overflow
+    void Reset() { m_partialLen = 0; }
+
+    uint32_t UbxFrames() const { return m_ubxFrames; }
+    uint32_t NmeaSentences() const { return m_nmeaSentences; }
+    uint32_t ChecksumErrors() const { return m_checksumErrors; }
+    /// Frames cut short, too long or with the broken header
+    uint32_t FramingErrors() const { return m_framingErrors; }
+
+private:
+    static constexpr uint8_t UBX_SYNC_1 = 0xB5;
+    static constexpr uint8_t UBX_SYNC_2 = 0x62;
+
+    int tryFrame(uint8_t *p, int avail);
+    int tryUbx(uint8_t *p, int avail);
+    int tryNmea(uint8_t *p, int avail);
+    int continuePartial(uint8_t *buf, int len);
+    static int findStart(const uint8_t *buf, int len);
+
+    Handler &m_handler;
+    uint8_t m_partial[UBX_MAX_FRAME_LEN]{};
+    int m_partialLen = 0;
+
+    uint32_t m_ubxFrames = 0;
+    uint32_t m_nmeaSentences = 0;
+    uint32_t m_checksumErrors = 0;
+    uint32_t m_framingErrors = 0;
+};
+
+#endif //IMU2NMEA_GNSSFRAMER_H
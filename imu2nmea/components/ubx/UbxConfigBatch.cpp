@@ -0,0 +1,88 @@
+#include <cstring>
+#include "UbxConfigBatch.h"
+
+bool UbxConfigBatch::Add(uint8_t cls, uint8_t id, const void *payload, uint16_t len) {
+    if ( m_size == MAX_MESSAGES || len > MAX_PAYLOAD ){
+        return false;
+    }
+    Message &msg = m_messages[m_size++];
+    msg.cls = cls;
+    msg.id = id;
+    msg.len = len;
+    msg.status = Status::QUEUED;
+    msg.answersDue = 0;
+    memcpy(msg.payload, payload, len);
+    return true;
+}
+
+int UbxConfigBatch::Send(UbxParser &parser) {
+    // Whatever didn't come by now is lost, the answered messages don't hold back the next ones any more
+    for(int i = 0; i < m_size; i++){
+        Message &msg = m_messages[i];
+        if ( msg.status == Status::ACK || msg.status == Status::NAK ){
+            msg.answersDue = 0;
+        }
+    }
+
+    int sent = 0;
+    for(int i = 0; i < m_size; i++){
+        Message &msg = m_messages[i];
+        if ( (msg.status == Status::QUEUED || msg.status == Status::SENT) && !sameKeyBefore(i) ){
+            parser.send_message(msg.cls, msg.id, msg.payload, msg.len);
+            msg.status = Status::SENT;
+            msg.answersDue++;
+            sent++;
+        }
+    }
+    return sent;
+}
+
+bool UbxConfigBatch::sameKeyBefore(int idx) const {
+    // Earlier message of the same class and id still unanswered or waiting for the answer to its resend
+    const Message &msg = m_messages[idx];
+    for(int i = 0; i < idx; i++){
+        const Message &before = m_messages[i];
+        if ( before.cls == msg.cls && before.id == msg.id
+                && (before.status == Status::QUEUED || before.status == Status::SENT || before.answersDue > 0) ){
+            return true;
+        }
+    }
+    return false;
+}
+
+void UbxConfigBatch::onUbxAck(uint8_t cls, uint8_t id, bool ack) {
+    // Only one message of the class and id is sent at a time, so the answer is for the first one still due one
+    for(int i = 0; i < m_size; i++){
+        Message &msg = m_messages[i];
+        if ( msg.answersDue > 0 && msg.cls == cls && msg.id == id ){
+            msg.answersDue--;
+            if ( msg.status == Status::SENT ){
+                msg.status = ack ? Status::ACK : Status::NAK;
+            }
+            return;
+        }
+    }
+}
+
+bool UbxConfigBatch::Answered() const {
+    return Count(Status::SENT) == 0 && Count(Status::QUEUED) == 0;
+}
+
+bool UbxConfigBatch::InFlight() const {
+    for(int i = 0; i < m_size; i++){
+        if ( m_messages[i].answersDue > 0 ){
+            return true;
+        }
+    }
+    return false;
+}
+
+int UbxConfigBatch::Count(Status status) const {
+    int n = 0;
+    for(int i = 0; i < m_size; i++){
+        if ( m_messages[i].status == status ){
+            n++;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,60 @@
+#ifndef IMU2NMEA_UBXCONFIGBATCH_H
+#define IMU2NMEA_UBXCONFIGBATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include "UbxParser.h"
+
+/// Set of CFG messages sent back to back without waiting for each ACK.
+/// Send() writes the ones not acknowledged yet, the acknowledgments come through onUbxAck() in the order the
+/// receiver processed the messages. ACK has only the class and id, so of the messages with the same class and id
+/// (CFG-MSG of each sentence) only one is sent at a time, the next one goes after its answer.
+/// Each message counts the answers still due for its sends, so the late ACK of a resent message isn't taken
+/// for the next one. The answers not there by the next Send() are taken as lost.
+/// The caller reads the receiver while InFlight() or till its timeout, then calls Send() again for the rest,
+/// only the calls after the timeout are retries. NAKed messages are not retried, the receiver would reject them again.
+class UbxConfigBatch : public UbxParser::AckListener {
+public:
+    static const int MAX_MESSAGES = 16;
+    static const int MAX_PAYLOAD = 40;   // CFG-PRT is 20, CFG-MSG 8, CFG-RATE 6
+
+    enum class Status : uint8_t {
+        QUEUED,     // Not sent yet or to be resent
+        SENT,       // Waiting for ACK
+        ACK,
+        NAK,
+    };
+
+    /// False if the batch is full or the payload is too long
+    bool Add(uint8_t cls, uint8_t id, const void *payload, uint16_t len);
+    /// Sends the messages without the answer, but one of the same class and id at a time. Returns how many
+    int Send(UbxParser &parser);
+    void onUbxAck(uint8_t cls, uint8_t id, bool ack) override;
+
+    /// Every message is answered
+    bool Answered() const;
+    /// Some sent message waits for the answer
+    bool InFlight() const;
+    /// Every message is acknowledged
+    bool Done() const { return Count(Status::ACK) == m_size; }
+    int Count(Status status) const;
+    int Size() const { return m_size; }
+    Status GetStatus(int idx) const { return m_messages[idx].status; }
+
+private:
+    struct Message {
+        uint8_t cls;
+        uint8_t id;
+        uint16_t len;
+        Status status;
+        uint8_t answersDue;  // Sends not answered yet
+        uint8_t payload[MAX_PAYLOAD];
+    };
+
+    bool sameKeyBefore(int idx) const;
+
+    Message m_messages[MAX_MESSAGES]{};
+    int m_size = 0;
+};
+
+#endif //IMU2NMEA_UBXCONFIGBATCH_H
@@ -1,4 +1,5 @@
 #include <cstddef>
+#include <cstring>
 #include <esp_log.h>
 #include "UbxParser.h"
 
@@ -12,204 +13,78 @@ UbxParser::UbxParser(UbxParser::Writer &writer, Listener &listener)
 
 bool UbxParser::send_message(uint8_t msg_class, uint8_t msg_id, UBX_message_t &message, uint16_t len)
 {
-    // First, calculate the checksum
-    uint8_t ck_a, ck_b;
-    calculate_checksum(msg_class, msg_id, len, message, ck_a, ck_b);
-
-    // Send message
-    write(START_BYTE_1);
-    write(START_BYTE_2);
-    write(msg_class);
-    write(msg_id);
-    write(len & 0xFF);
-    write((len >> 8) & 0xFF);
-    write(message.buffer, len);
-    write(ck_a);
-    write(ck_b);
-    return true;
+    return send_message(msg_class, msg_id, message.buffer, len);
 }
 
-void UbxParser::calculate_checksum(const uint8_t msg_cls,
-                             const uint8_t msg_id,
-                             const uint16_t len,
-                             const UBX_message_t payload,
-                             uint8_t &ck_a,
-                             uint8_t &ck_b)
+bool UbxParser::send_message(uint8_t msg_class, uint8_t msg_id, const uint8_t *payload, uint16_t len)
 {
-    ck_a = ck_b = 0;
-
-    // Add in class
-    ck_a += msg_cls;
-    ck_b += ck_a;
-
-    // Id
-    ck_a += msg_id;
-    ck_b += ck_a;
-
-    // Length
-    ck_a += len & 0xFF;
-    ck_b += ck_a;
-    ck_a += (len >> 8) & 0xFF;
-    ck_b += ck_a;
-
-    // Payload
-    for (int i = 0; i < len; i++)
-    {
-        ck_a += payload.buffer[i];
-        ck_b += ck_a;
-    }
-}
-
-void UbxParser::write(const uint8_t b) {
-    write(&b, 1);
-}
+    if (len > BUFFER_SIZE)
+        return false;
 
-void UbxParser::write(const uint8_t *b, size_t len) {
-    m_writer.writeToUbx(b, len);
+    // The whole frame goes to the UART in one write
+    out_frame_[0] = START_BYTE_1;
+    out_frame_[1] = START_BYTE_2;
+    out_frame_[2] = msg_class;
+    out_frame_[3] = msg_id;
+    out_frame_[4] = len & 0xFF;
+    out_frame_[5] = (len >> 8) & 0xFF;
+    memcpy(out_frame_ + 6, payload, len);
+
+    // Checksum covers class, id, length and payload
+    uint8_t ck_a = 0, ck_b = 0;
+    calculate_checksum(out_frame_ + 2, 4 + len, ck_a, ck_b);
+    out_frame_[6 + len] = ck_a;
+    out_frame_[7 + len] = ck_b;
+
+    m_writer.writeToUbx(out_frame_, 8 + len);
+    return true;
 }
 
-
-bool UbxParser::read(uint8_t byte)
+void UbxParser::calculate_checksum(const uint8_t *data, size_t len, uint8_t &ck_a, uint8_t &ck_b)
 {
-    switch (parse_state_)
+    for (size_t i = 0; i < len; i++)
     {
-        case START:
-            if (byte == START_BYTE_2 && prev_byte_ == START_BYTE_1)
-            {
-                buffer_head_ = 0;
-                parse_state_ = GOT_START_FRAME;
-                message_class_ = 0;
-                message_type_ = 0;
-                length_ = 0;
-                ck_a_ = 0;
-                ck_b_ = 0;
-                start_message_ = true;
-                end_message_ = false;
-            }
-            break;
-        case GOT_START_FRAME:
-            message_class_ = byte;
-            parse_state_ = GOT_CLASS;
-            break;
-        case GOT_CLASS:
-            message_type_ = byte;
-            parse_state_ = GOT_MSG_ID;
-            break;
-        case GOT_MSG_ID:
-            length_ = byte;
-            parse_state_ = GOT_LENGTH1;
-            break;
-        case GOT_LENGTH1:
-            length_ |= (uint16_t)byte << 8;
-            parse_state_ = GOT_LENGTH2;
-            if (length_ > BUFFER_SIZE)
-            {
-                ESP_LOGI(TAG, "Message 0x%x-0x%x is too long (%d > %zu)", message_class_, message_type_,
-                    length_, BUFFER_SIZE);
-                num_errors_++;
-                prev_byte_ = byte;
-                restart();
-                return false;
-            }
-            break;
-        case GOT_LENGTH2:
-            if (buffer_head_ < length_)
-            {
-                // push the byte onto the data buffer
-                in_message_.buffer[buffer_head_] = byte;
-                if (buffer_head_ == length_ - 1)
-                {
-                    parse_state_ = GOT_PAYLOAD;
-                }
-                buffer_head_++;
-            }
-            break;
-        case GOT_PAYLOAD:
-            ck_a_ = byte;
-            parse_state_ = GOT_CK_A;
-            break;
-        case GOT_CK_A:
-            ck_b_ = byte;
-            parse_state_ = GOT_CK_B;
-            break;
-        default:
-            num_errors_++;
-            parse_state_ = START;
-            end_message_ = false;
-            start_message_ = false;
-            break;
-    }
-
-    // If we have a complete packet, then try to parse it
-    if (parse_state_ == GOT_CK_B)
-    {
-        if (decode_message())
-        {
-            parse_state_ = START;
-            end_message_ = true;
-            start_message_ = false;
-            prev_byte_ = byte;
-            return true;
-        }
-        else
-        {
-            // indicate error if it didn't work
-            ESP_LOGI(TAG, "\n failed to parse message");
-            num_errors_++;
-            parse_state_ = START;
-            start_message_ = false;
-            end_message_ = false;
-        }
+        ck_a += data[i];
+        ck_b += ck_a;
     }
-    prev_byte_ = byte;
-    return false;
-}
-
-void UbxParser::restart()
-{
-    parse_state_ = START;
-    end_message_ = false;
-    start_message_ = false;
 }
 
-bool UbxParser::decode_message()
+void UbxParser::dispatch(uint8_t msg_class, uint8_t msg_id, const uint8_t *payload, uint16_t len)
 {
-    // First, check the checksum
-    uint8_t ck_a, ck_b;
-    calculate_checksum(message_class_, message_type_, length_, in_message_, ck_a, ck_b);
-    if (ck_a != ck_a_ || ck_b != ck_b_)
-        return false;
-    uint8_t version;  // 0 poll request, 1 poll (receiver to return config data key
-    // and value pairs)
-    uint8_t layer;
-    uint8_t reserved1[2];
-    uint32_t cfgDataKey;
-    uint64_t cfgData;
     num_messages_received_++;
 
     // Parse the payload
-    switch (message_class_)
+    switch (msg_class)
     {
         case CLASS_ACK:
+        {
+            // Payload is the class and id of the message being acknowledged
+            uint8_t cls = len >= sizeof(ACK_ACK_t) ? payload[0] : 0;
+            uint8_t id = len >= sizeof(ACK_ACK_t) ? payload[1] : 0;
             ESP_LOGI(TAG, "ACK_");
-            switch (message_type_)
+            switch (msg_id)
             {
                 case ACK_ACK:
                     got_ack_ = true;
-                    ESP_LOGI(TAG, "ACK");
+                    ESP_LOGI(TAG, "ACK %02x-%02x", cls, id);
+                    if (ack_listener_ != nullptr)
+                        ack_listener_->onUbxAck(cls, id, true);
                     break;
                 case ACK_NACK:
                     got_nack_ = true;
-                    ESP_LOGI(TAG, "NACK");
+                    ESP_LOGI(TAG, "NACK %02x-%02x", cls, id);
+                    if (ack_listener_ != nullptr)
+                        ack_listener_->onUbxAck(cls, id, false);
                     break;
                 default:
-                    ESP_LOGI(TAG, "%d", message_type_);
+                    ESP_LOGI(TAG, "%d", msg_id);
                     break;
             }
             break;
+        }
         case CLASS_MON:
             ESP_LOGI(TAG, "MON_");
-            switch (message_type_)
+            switch (msg_id)
             {
                 case MON_VER:
                     ESP_LOGI(TAG, "VER");
@@ -226,7 +101,7 @@ bool UbxParser::decode_message()
             break;
         case CLASS_RXM:
             ESP_LOGI(TAG, "RXM_");
-            switch (message_type_)
+            switch (msg_id)
             {
                 case RXM_RAWX:
                     ESP_LOGI(TAG, "RAWX");
@@ -236,49 +111,49 @@ bool UbxParser::decode_message()
                     break;
             }
             break;
-        case CLASS_NAV:
-            ESP_LOGI(TAG, "NAV_");
-            switch (message_type_)
+        case CLASS_NAV:  // Every navigation epoch, so don't flood the log
+            ESP_LOGD(TAG, "NAV_");
+            switch (msg_id)
             {
                 case NAV_PVT:
-                    ESP_LOGI(TAG, "PVT ");
+                    ESP_LOGD(TAG, "PVT ");
                     break;
                 case NAV_RELPOSNED:
-                    ESP_LOGI(TAG, "RELPOSNED ");
+                    ESP_LOGD(TAG, "RELPOSNED ");
                     break;
                 case NAV_POSECEF:
-                    ESP_LOGI(TAG, "POSECEF");
+                    ESP_LOGD(TAG, "POSECEF");
                     break;
                 case NAV_VELECEF:
-                    ESP_LOGI(TAG, "VELECEF");
+                    ESP_LOGD(TAG, "VELECEF");
                     break;
                 default:
-                    ESP_LOGI(TAG, " unknown (%d) ", message_type_);
+                    ESP_LOGD(TAG, " unknown (%d) ", msg_id);
             }
             break;
         case CLASS_CFG:  // only needed for getting data
             ESP_LOGI(TAG, "CFG_");
-            switch (message_type_)
+            switch (msg_id)
             {
                 case CFG_VALGET:
                 {
                     ESP_LOGI(TAG, "VALGET = ");
-                    auto value = in_message_.CFG_VALGET.cfgData;
+                    uint64_t value = 0;
+                    if (len >= offsetof(CFG_VALGET_t, cfgData) + sizeof(value))
+                        memcpy(&value, payload + offsetof(CFG_VALGET_t, cfgData), sizeof(value));
                     ESP_LOGI(TAG, "%lld ", value);
                     break;
                 }
                 default:
-                    ESP_LOGI(TAG, "unknown: %x", message_type_);
+                    ESP_LOGI(TAG, "unknown: %x", msg_id);
             }
             break;
 
         default:
-            ESP_LOGI(TAG,"Unknown (%d-%d)\n", message_class_, message_type_);
+            ESP_LOGI(TAG,"Unknown (%d-%d)\n", msg_class, msg_id);
             break;
     }
 
-    m_listener.onUbxMsg(message_class_, message_type_, in_message_);
-
-    return true;
+    m_listener.onUbxMsg(msg_class, msg_id, payload, len);
 }
 
@@ -14,49 +14,41 @@ public:
 
 class Listener{
 public:
-    virtual void onUbxMsg(uint8_t cls, uint8_t type, UBX_message_t msg) = 0;
+    /// Payload is the span of the receive buffer, it's not aligned
+    virtual void onUbxMsg(uint8_t cls, uint8_t type, const uint8_t *payload, uint16_t len) = 0;
+};
+
+class AckListener{
+public:
+    /// ACK-ACK or ACK-NAK of the message with this class and id
+    virtual void onUbxAck(uint8_t cls, uint8_t id, bool ack) = 0;
 };
 
 public:
     explicit UbxParser(Writer &writer, Listener &listener);
     bool send_message(uint8_t msg_class, uint8_t msg_id, UBX_message_t &message, uint16_t len);
-    bool read(uint8_t byte);
+    bool send_message(uint8_t msg_class, uint8_t msg_id, const uint8_t *payload, uint16_t len);
+    /// Handle the frame with the valid checksum found by GnssFramer
+    void dispatch(uint8_t msg_class, uint8_t msg_id, const uint8_t *payload, uint16_t len);
 
-private:
-    static void calculate_checksum(uint8_t msg_cls, uint8_t msg_id, uint16_t len, UBX_message_t payload,
-                       uint8_t &ck_a, uint8_t &ck_b) ;
+    /// Acknowledgments go to the listener as well, nullptr to stop
+    void set_ack_listener(AckListener *listener) { ack_listener_ = listener; }
 
-    void write(uint8_t b);
-    void write(const uint8_t *b, size_t len);
-    void restart();
+private:
+    static void calculate_checksum(const uint8_t *data, size_t len, uint8_t &ck_a, uint8_t &ck_b);
 
 private:
     Writer &m_writer;
     Listener &m_listener;
 
-    // Parsing State Working Memory
-    uint8_t prev_byte_;
-    uint16_t buffer_head_ = 0;
-    bool start_message_ = false;
-    bool end_message_ = false;
     bool got_ack_ = false;
     bool got_ver_ = false;
     bool got_nack_ = false;
-    parse_state_t parse_state_;
-    uint8_t message_class_;
-    uint8_t message_type_;
-    uint16_t length_;
-    uint8_t ck_a_;
-    uint8_t ck_b_;
-    uint32_t num_errors_ = 0;
+    AckListener *ack_listener_ = nullptr;
     uint32_t num_messages_received_ = 0;
 
-    // Main buffers for communication
-    UBX_message_t out_message_;
-    UBX_message_t in_message_;
-
-
-    bool decode_message();
+    // Header, payload and checksum
+    uint8_t out_frame_[BUFFER_SIZE + 8];
 };
 
 
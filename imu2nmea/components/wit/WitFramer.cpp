@@ -0,0 +1,92 @@
+#include <cstring>
+#include <algorithm>
+#include "WitFramer.h"
+
+void WitFramer::Process(const uint8_t *buf, int len) {
+    int pos = m_partialLen > 0 ? continuePartial(buf, len) : 0;
+    while ( pos < len ){
+        auto *p = (const uint8_t *)memchr(buf + pos, HEADER, len - pos);
+        if ( p == nullptr ){
+            break;
+        }
+        pos = (int)(p - buf);
+        if ( len - pos < FRAME_LEN ){
+            // Cut by the end of the read, the rest of it comes with the next one
+            memcpy(m_partial, p, len - pos);
+            m_partialLen = len - pos;
+            return;
+        }
+        if ( frameOk(p) ){
+            dispatch(p);
+            pos += FRAME_LEN;
+        }else{
+            m_checksumErrors++;
+            pos++;
+        }
+    }
+}
+
+int WitFramer::continuePartial(const uint8_t *buf, int len) {
+    while ( m_partialLen > 0 ){
+        int want = std::min(FRAME_LEN - m_partialLen, len);
+        memcpy(m_partial + m_partialLen, buf, want);
+        if ( m_partialLen + want < FRAME_LEN ){
+            m_partialLen += want;
+            return len;
+        }
+        if ( frameOk(m_partial) ){
+            dispatch(m_partial);
+            m_partialLen = 0;
+            return want;
+        }
+        // Next header among the bytes left from the previous read, the new ones are searched in place
+        m_checksumErrors++;
+        auto *next = (const uint8_t *)memchr(m_partial + 1, HEADER, m_partialLen - 1);
+        if ( next == nullptr ){
+            m_partialLen = 0;
+        }else{
+            m_partialLen -= (int)(next - m_partial);
+            memmove(m_partial, next, m_partialLen);
+        }
+    }
+    return 0;
+}
+
+bool WitFramer::frameOk(const uint8_t *p) {
+    // Type check makes the noise passing the 8 bit sum 16 times less likely
+    if ( (p[1] & 0xF0) != 0x50 ){
+        return false;
+    }
+    uint8_t sum = 0;
+    for(int i = 0; i < FRAME_LEN - 1; i++){
+        sum += p[i];
+    }
+    return sum == p[FRAME_LEN - 1];
+}
+
+void WitFramer::dispatch(const uint8_t *p) {
+    int16_t data[4];
+    for(int i = 0; i < 4; i++){
+        data[i] = (int16_t)(p[2 + 2 * i] | p[3 + 2 * i] << 8);
+    }
+    m_frames++;
+
+    switch ( p[1] ){
+        case ANGLE:
+            m_handler.onAngle({data[0] * ANGLE_SCALE, data[1] * ANGLE_SCALE, data[2] * ANGLE_SCALE, (uint16_t)data[3]});
+            break;
+        case GYRO:
+            m_handler.onGyro({data[0] * GYRO_SCALE, data[1] * GYRO_SCALE, data[2] * GYRO_SCALE});
+            break;
+        case ACC:
+            m_handler.onAccel({data[0] * ACC_SCALE, data[1] * ACC_SCALE, data[2] * ACC_SCALE},
+                              data[3] * TEMPERATURE_SCALE);
+            break;
+        case MAGNETIC:
+            m_handler.onMag({(float)data[0], (float)data[1], (float)data[2]}, data[3] * TEMPERATURE_SCALE);
+            break;
+        default:
+            m_handler.onRecord(p[1], data);
+            break;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef IMU2NMEA_WITFRAMER_H
+#define IMU2NMEA_WITFRAMER_H
+
+#include <cstddef>
+#include <cstdint>
+
+/// Splits the byte stream of the WIT (HWT905) sensor in the normal protocol into 11 byte frames:
+/// 0x55, the record type, four little endian int16 values and the byte sum of the first ten.
+/// The frames are checked in the buffer given to Process(), only the frame cut between two reads is copied.
+/// After the noise the next 0x55 is searched for, the bytes are never shifted.
+/// The state is per instance, so each sensor has its own framer.
+/// The code has no ESP-IDF dependencies, so the host tools can use it as is.
+class WitFramer {
+public:
+    struct Vector {
+        float x;
+        float y;
+        float z;
+    };
+
+    /// Euler angles as the sensor reports them, deg
+    struct Angle {
+        float roll;
+        float pitch;
+        float yaw;
+        uint16_t version;
+    };
+
+    class Handler {
+    public:
+        virtual void onAngle(const Angle &/*angle*/) {}
+        /// Angular rate, deg/s
+        virtual void onGyro(const Vector &/*rate*/) {}
+        /// Acceleration, g
+        virtual void onAccel(const Vector &/*acc*/, float /*temperature*/) {}
+        /// Magnetic field, raw counts
+        virtual void onMag(const Vector &/*field*/, float /*temperature*/) {}
+        /// Time, quaternion, register values and the rest
+        virtual void onRecord(uint8_t /*type*/, const int16_t * /*data*/) {}
+    };
+
+    static constexpr int FRAME_LEN = 11;
+    static constexpr uint8_t HEADER = 0x55;
+
+    // Record types
+    static constexpr uint8_t TIME = 0x50;
+    static constexpr uint8_t ACC = 0x51;
+    static constexpr uint8_t GYRO = 0x52;
+    static constexpr uint8_t ANGLE = 0x53;
+    static constexpr uint8_t MAGNETIC = 0x54;
+    static constexpr uint8_t REGVALUE = 0x5F;
+
+    // Full scale of the int16 values
+    static constexpr float ANGLE_SCALE = 180.f / 32768.f;
+    static constexpr float GYRO_SCALE = 2000.f / 32768.f;
+    static constexpr float ACC_SCALE = 16.f / 32768.f;
+    static constexpr float TEMPERATURE_SCALE = 0.01f;
+
+    explicit WitFramer(Handler &handler) : m_handler(handler) {}
+    void Process(const uint8_t *buf, int len);
+    /// Forget the frame received so far, e.g. after the UART overflow or the baud rate change
+    void Reset() { m_partialLen = 0; }
+
+    uint32_t Frames() const { return m_frames; }
+    /// Frames with the wrong sum or type, including the 0x55 bytes in the data tried while searching
+    uint32_t ChecksumErrors() const { return m_checksumErrors; }
+
+private:
+    static bool frameOk(const uint8_t *p);
+    void dispatch(const uint8_t *p);
+    int continuePartial(const uint8_t *buf, int len);
+
+    Handler &m_handler;
+    uint8_t m_partial[FRAME_LEN]{};
+    int m_partialLen = 0;
+
+    uint32_t m_frames = 0;
+    uint32_t m_checksumErrors = 0;
+};
+
+#endif //IMU2NMEA_WITFRAMER_H
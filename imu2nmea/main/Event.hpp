@@ -8,6 +8,25 @@ enum EventSource {
     ,IMU              // IMU unit
     ,GPS_DATA_RMC         // GPS data ( 5 Hz rate)
     ,GPS_DATA_GGA         // GPS data ( 1 Hz rate)
+    ,GPS_DATA_PVT         // GPS fix decoded from UBX-NAV-PVT, each navigation epoch
+};
+
+// Everything N2K GPS PGNs need from one navigation epoch
+struct GpsFix {
+    bool timeValid;
+    uint16_t daysSince1970;         // UTC
+    double secondsSinceMidnight;    // UTC, rounded to ms
+    bool positionValid;
+    double latitude;                // deg
+    double longitude;               // deg
+    double altitude;                // m above mean sea level
+    bool velocityValid;
+    double cogRad;                  // True
+    double sogMs;
+    uint8_t fixQuality;             // Same values as GGA fix quality and tN2kGNSSmethod
+    uint8_t nSatellites;
+    float hdop;                     // Negative if unknown
+    float pdop;                     // Negative if unknown
 };
 
 struct Event {
@@ -22,11 +41,15 @@ struct Event {
             float pitch;
             float roll;
             uint8_t calibrState;
+            bool rotValid;
+            float rot;          // deg/s, positive turning to starboard
+            int64_t hdgTimeUs;  // esp_timer time the heading is for, 0 if not known
         }imu;
         struct {
             minmea_sentence_rmc rmc;
             minmea_sentence_gga gga;
         }gps;
+        GpsFix gpsFix;
     }u;
 };
 
@@ -2,26 +2,39 @@
 #include <hal/uart_types.h>
 #include <driver/uart.h>
 #include <cstring>
+#include <cmath>
+#include <esp_timer.h>
 #include "GPSHandler.h"
 #include "minmea.h"
 #include "Event.hpp"
 #include "UbxParser.h"
+#include "UbxConfigBatch.h"
+#include "DeviceDiagnostics.h"
+#include "BlackBox.h"
+#include "GpsClock.h"
 
 static const char *TAG = "imu2nmea_GPSHandler";
 
-GPSHandler::GPSHandler(QueueHandle_t const &eventQueue, int tx_io_num, int rx_io_num, uart_port_t uart_num)
-: m_gpsParser(eventQueue, m_ubxParser)
+static const int SEC_IN_DAY = 24 * 60 * 60;
+
+GPSHandler::GPSHandler(QueueHandle_t const &eventQueue, int tx_io_num, int rx_io_num, uart_port_t uart_num,
+                       GpsProtocol protocol)
+: m_gpsParser(eventQueue, m_ubxParser, uart_num, protocol)
 , tx_io_num(tx_io_num)
 , rx_io_num(rx_io_num)
 , uart_num(uart_num)
+, m_protocol(protocol)
 ,m_ubxParser(*this, m_gpsParser)
 {
 
 }
 
-GpsParser::GpsParser(QueueHandle_t const &systemEventQueue, UbxParser &ubxParser)
+GpsParser::GpsParser(QueueHandle_t const &systemEventQueue, UbxParser &ubxParser, uart_port_t uart_num,
+                     GpsProtocol protocol)
         :systemEventQueue(systemEventQueue)
         ,m_ubxParser(ubxParser)
+        ,m_uartNum(uart_num)
+        ,m_protocol(protocol)
 {
 
 }
@@ -44,7 +57,7 @@ void GPSHandler::Start() {
 void GPSHandler::Task() {
     ESP_LOGI(TAG, "Opening serial port");
     uart_config_t uart_config = {
-            .baud_rate = 9600,
+            .baud_rate = GPS_BAUD_RATE,
             .data_bits = UART_DATA_8_BITS,
             .parity = UART_PARITY_DISABLE,
             .stop_bits = UART_STOP_BITS_1,
@@ -64,12 +77,21 @@ void GPSHandler::Task() {
     ESP_ERROR_CHECK(uart_driver_install(uart_num, uart_buffer_size,
                                         uart_buffer_size, 10, &m_uartEventQueue, 0));
 
+    configureReceiver();
+
+    // NMEA sentences are read one by one up to '\n', so each of them is framed in place.
+    // No wakeups on RX timeout in the middle of the burst, FIFO full still moves the bytes to the ring buffer.
+    if ( m_protocol == GpsProtocol::NMEA ){
+        ESP_ERROR_CHECK(uart_enable_pattern_det_baud_intr(uart_num, '\n', 1, 9, 0, 0));
+        ESP_ERROR_CHECK(uart_pattern_queue_reset(uart_num, PATTERN_QUEUE_LEN));
+        ESP_ERROR_CHECK(uart_disable_intr_mask(uart_num, UART_RXFIFO_TOUT_INT_ENA_M));
+    }
+    // The events of the bytes read during the configuration
+    xQueueReset(m_uartEventQueue);
 
     uart_event_t event;
     uint8_t dtmp[uart_buffer_size];
 
-    bool gotUbx = false;
-    bool ubxInitialized = false;
     for (;;) {
 
         if(xQueueReceive(m_uartEventQueue, (void * )&event, (portTickType)portMAX_DELAY)){
@@ -79,12 +101,31 @@ void GPSHandler::Task() {
                 /*We'd better handler data event fast, there would be much more data events than
                 other types of events. If we take too much time on data event, the queue might
                 be full.*/
-                case UART_DATA:
+                case UART_DATA: {
                     ESP_LOGD(TAG, "[UART DATA]: %d", event.size);
-                    uart_read_bytes(uart_num, dtmp, event.size, portMAX_DELAY);
-                    m_gpsParser.ProcessInputBytes(dtmp, event.size);
-                    gotUbx = true;
-                    break;
+                    // In NMEA mode the bytes wait for the end of the sentence unless '\n' doesn't come for too long
+                    size_t buffered = 0;
+                    uart_get_buffered_data_len(uart_num, &buffered);
+                    if ( m_protocol == GpsProtocol::NMEA && buffered < uart_buffer_size / 2 ){
+                        break;
+                    }
+                    int nread = uart_read_bytes(uart_num, dtmp, buffered, 0);
+                    if ( nread > 0 ){
+                        processInput(dtmp, nread);
+                    }
+                } break;
+                case UART_PATTERN_DET: {
+                    // Position of '\n' from the read pointer, -1 if the position queue overflowed
+                    int pos = uart_pattern_pop_pos(uart_num);
+                    size_t len = pos + 1;
+                    if ( pos < 0 ){
+                        uart_get_buffered_data_len(uart_num, &len);
+                    }
+                    int nread = uart_read_bytes(uart_num, dtmp, len < sizeof(dtmp) ? len : sizeof(dtmp), 0);
+                    if ( nread > 0 ){
+                        processInput(dtmp, nread);
+                    }
+                } break;
                     //Event of HW FIFO overflow detected
                 case UART_FIFO_OVF:
                     ESP_LOGI(TAG, "hw fifo overflow");
@@ -92,7 +133,9 @@ void GPSHandler::Task() {
                     // The ISR has already reset the rx FIFO,
                     // As an example, we directly flush the rx buffer here in order to read more data.
                     uart_flush_input(uart_num);
+                    uart_pattern_queue_reset(uart_num, PATTERN_QUEUE_LEN);
                     xQueueReset(m_uartEventQueue);
+                    m_gpsParser.Reset();
                     break;
                     //Event of UART ring buffer full
                 case UART_BUFFER_FULL:
@@ -100,7 +143,9 @@ void GPSHandler::Task() {
                     // If buffer full happened, you should consider encreasing your buffer size
                     // As an example, we directly flush the rx buffer here in order to read more data.
                     uart_flush_input(uart_num);
+                    uart_pattern_queue_reset(uart_num, PATTERN_QUEUE_LEN);
                     xQueueReset(m_uartEventQueue);
+                    m_gpsParser.Reset();
                     break;
                     //Event of UART RX break detected
                 case UART_BREAK:
@@ -114,111 +159,237 @@ void GPSHandler::Task() {
                 case UART_FRAME_ERR:
                     ESP_LOGI(TAG, "uart frame error");
                     break;
-                    //UART_PATTERN_DET
                 default:
                     ESP_LOGI(TAG, "uart event type: %d", event.type);
                     break;
             }
-            if( gotUbx && !ubxInitialized ){
-                initUbx();
-                ubxInitialized = true;
-            }
         }
     }
 }
 
+void GPSHandler::processInput(uint8_t *buf, int nread) {
+    // The last byte came about now, the first one as long before as it takes to receive them all
+    int64_t now = esp_timer_get_time();
+    m_gpsParser.MarkArrival(now - nread * m_byteTimeUs, now);
+    m_gpsParser.ProcessInputBytes(buf, nread);
+}
+
 void GPSHandler::writeToUbx(const uint8_t *b, size_t len) {
     uart_write_bytes(uart_num,  b, len);
 }
 
-void GPSHandler::initUbx() {
-    UBX_message_t msg;
-
-    // Disable GSV
-    msg.CFG_MSG.msgClass = 0xF0;
-    msg.CFG_MSG.msgID = 0x03;
-    msg.CFG_MSG.rate = 0;
-    m_ubxParser.send_message(CLASS_CFG, CFG_MSG, msg, 3);
-
-    // Disable GSA
-    msg.CFG_MSG.msgClass = 0xF0;
-    msg.CFG_MSG.msgID = 0x02;
-    msg.CFG_MSG.rate = 0;
-    m_ubxParser.send_message(CLASS_CFG, CFG_MSG, msg, 3);
-
-    // Disable VTG
-    msg.CFG_MSG.msgClass = 0xF0;
-    msg.CFG_MSG.msgID = 0x05;
-    msg.CFG_MSG.rate = 0;
-    m_ubxParser.send_message(CLASS_CFG, CFG_MSG, msg, 3);
-
-    // Disable GLL
-    msg.CFG_MSG.msgClass = 0xF0;
-    msg.CFG_MSG.msgID = 0x01;
-    msg.CFG_MSG.rate = 0;
-    m_ubxParser.send_message(CLASS_CFG, CFG_MSG, msg, 3);
-
-    // Enable GGA
-    msg.CFG_MSG.msgClass = 0xF0;
-    msg.CFG_MSG.msgID = 0x00;
-    msg.CFG_MSG.rate = 1;
-    m_ubxParser.send_message(CLASS_CFG, CFG_MSG, msg, 3);
-
-    // Enable RMC
-    msg.CFG_MSG.msgClass = 0xF0;
-    msg.CFG_MSG.msgID = 0x04;
-    msg.CFG_MSG.rate = 1;
-    m_ubxParser.send_message(CLASS_CFG, CFG_MSG, msg, 3);
-
-    // Set update rate to 5Hz
-    msg.CFG_RATE.measRate = 200;
-    msg.CFG_RATE.navRate = 1;
-    msg.CFG_RATE.timeRef = 0;
-    m_ubxParser.send_message(CLASS_CFG, CFG_RATE, msg, 6);
-
-}
-
-void GpsParser::ProcessInputBytes(const uint8_t *buff, size_t size) {
-    // Debug print
-    printHex(buff, size);
-
-    // Pass to UBX parser
-    for( int i=0; i < size; i++){
-        m_ubxParser.read(buff[i]);
-    }
-
-    // Process NMEA 0183
-    for(int i = 0; i < size; i++){
-        uint8_t ch = buff[i];
-        if( ch == '\r'){
-            m_lineBuffer[m_lineBufferIdx] = '\0';
-            ParseNmea0183Line(reinterpret_cast<const char *>(m_lineBuffer));
-        }else if ( ch == '$'){
-            m_lineBufferIdx = 0;
-            m_lineBuffer[m_lineBufferIdx] = ch;
-            m_lineBufferIdx++;
-        }else if (m_lineBufferIdx < sizeof(m_lineBuffer) - 1){
-            m_lineBuffer[m_lineBufferIdx] = ch;
-            m_lineBufferIdx++;
-        }else{
-            m_lineBufferIdx = 0;  // Start over
+void GPSHandler::configureReceiver() {
+    int64_t start = esp_timer_get_time();
+    m_configDeadlineUs = start + GPS_CONFIG_TIMEOUT_MS * 1000LL;
+
+    int baudRate = probeBaudRate();
+    if ( baudRate == 0 ){
+        // Keep going at the default, the receiver might be configured already or be of another make
+        ESP_LOGW(TAG, "No UBX answer at any baud rate, the receiver is not configured");
+        setUartBaudRate(GPS_BAUD_RATE);
+        return;
+    }
+    ESP_LOGI(TAG, "Receiver answers at %d baud", baudRate);
+
+    baudRate = configurePort(baudRate, GPS_HIGH_BAUD_RATE);
+
+    // The link has to carry the epoch in time, 9600 is only good for 5 Hz
+    int navRateHz = baudRate >= GPS_HIGH_BAUD_RATE ? GPS_NAV_RATE_HZ : GPS_LOW_BAUD_NAV_RATE_HZ;
+
+    // Messages and the rate go in one batch, only the ones without ACK are sent again
+    UbxConfigBatch batch;
+    if ( m_protocol == GpsProtocol::UBX_PVT ){
+        addUbxPvtConfig(batch);
+    }else{
+        addUbxNmeaConfig(batch);
+    }
+    addNavRateConfig(batch, navRateHz);
+    runConfig(batch, GPS_ACK_TIMEOUT_MS, GPS_CONFIG_RETRIES);
+    // The rate is the last one in the batch, the output messages are the rest
+    int rateIdx = batch.Size() - 1;
+    bool rateSet = batch.GetStatus(rateIdx) == UbxConfigBatch::Status::ACK;
+    bool messagesSet = batch.Count(UbxConfigBatch::Status::ACK) - (rateSet ? 1 : 0) == rateIdx;
+    int fallbacks = 0;
+
+    // Older receivers NAK the rates they can't do, the lower ones go alone
+    while ( batch.GetStatus(batch.Size() - 1) == UbxConfigBatch::Status::NAK
+            && navRateHz > GPS_LOW_BAUD_NAV_RATE_HZ ){
+        navRateHz = navRateHz / 2 > GPS_LOW_BAUD_NAV_RATE_HZ ? navRateHz / 2 : GPS_LOW_BAUD_NAV_RATE_HZ;
+        batch = UbxConfigBatch();
+        addNavRateConfig(batch, navRateHz);
+        runConfig(batch, GPS_ACK_TIMEOUT_MS, GPS_CONFIG_RETRIES);
+        rateSet = batch.Done();
+        fallbacks++;
+    }
+
+    int64_t elapsedMs = (esp_timer_get_time() - start) / 1000;
+    if ( messagesSet && rateSet ){
+        ESP_LOGI(TAG, "Receiver configured at %d baud, %d Hz set by the %s batch in %lld ms", baudRate, navRateHz,
+                 fallbacks == 0 ? "first" : "fallback rate", elapsedMs);
+    }else{
+        ESP_LOGW(TAG, "Receiver partly configured at %d baud in %lld ms: output messages %s, %d Hz rate %s",
+                 baudRate, elapsedMs, messagesSet ? "set" : "not set", navRateHz,
+                 !rateSet ? "not set" : fallbacks == 0 ? "set by the first batch" : "set by the fallback rate batch");
+    }
+}
+
+int GPSHandler::probeBaudRate() {
+    // Most likely first: the high rate after the ESP32 reset, then the receiver defaults
+    const int baudRates[] = {GPS_HIGH_BAUD_RATE, GPS_BAUD_RATE, 38400, 57600, 115200, 230400, 460800};
+
+    for(int round = 0; round < GPS_PROBE_ROUNDS; round++){
+        for(int i = 0; i < (int)(sizeof(baudRates) / sizeof(baudRates[0])); i++){
+            int baudRate = baudRates[i];
+            if ( i > 0 && baudRate == GPS_HIGH_BAUD_RATE ){
+                continue;
+            }
+            setUartBaudRate(baudRate);
+            if ( pollPort(1) ){
+                return baudRate;
+            }
+        }
+    }
+    return 0;
+}
+
+bool GPSHandler::pollPort(int tries) {
+    // Polling the port configuration gets CFG-PRT and ACK-ACK back
+    const uint8_t portId = CFG_PRT_t::PORT_UART1;
+    UbxConfigBatch batch;
+    batch.Add(CLASS_CFG, CFG_PRT, &portId, sizeof(portId));
+    return runConfig(batch, GPS_PROBE_TIMEOUT_MS, tries);
+}
+
+int GPSHandler::configurePort(int from, int to) {
+    UBX_message_t msg = {};
+    msg.CFG_PRT.portID = CFG_PRT_t::PORT_UART1;
+    msg.CFG_PRT.mode = CFG_PRT_t::CHARLEN_8BIT | CFG_PRT_t::PARITY_NONE | CFG_PRT_t::STOP_BITS_1;
+    msg.CFG_PRT.baudrate = to;
+    msg.CFG_PRT.inProtoMask = CFG_PRT_t::IN_UBX | CFG_PRT_t::IN_NMEA;
+    // UBX output stays on for the acknowledgments
+    msg.CFG_PRT.outProtoMask = m_protocol == GpsProtocol::UBX_PVT ? CFG_PRT_t::OUT_UBX
+            : CFG_PRT_t::OUT_UBX | CFG_PRT_t::OUT_NMEA;
+
+    // The receiver switches right after the ACK, which is often lost on the way, so check at the new rate instead
+    m_ubxParser.send_message(CLASS_CFG, CFG_PRT, msg, sizeof(CFG_PRT_t));
+    uart_wait_tx_done(uart_num, pdMS_TO_TICKS(GPS_PROBE_TIMEOUT_MS));
+    vTaskDelay(pdMS_TO_TICKS(GPS_BAUD_SWITCH_DELAY_MS));
+
+    setUartBaudRate(to);
+    if ( pollPort(GPS_CONFIG_RETRIES) ){
+        ESP_LOGI(TAG, "Port set up at %d baud, was %d", to, from);
+        return to;
+    }
+
+    ESP_LOGW(TAG, "No answer at %d baud, staying at %d", to, from);
+    setUartBaudRate(from);
+    return from;
+}
+
+void GPSHandler::setUartBaudRate(int baudRate) {
+    uart_wait_tx_done(uart_num, pdMS_TO_TICKS(GPS_PROBE_TIMEOUT_MS));
+    uart_set_baudrate(uart_num, baudRate);
+    m_byteTimeUs = 10 * 1000000 / baudRate;  // Start, 8 data and stop bits
+    // Whatever came at the old rate is garbage now
+    uart_flush_input(uart_num);
+    m_gpsParser.Reset();
+}
+
+bool GPSHandler::runConfig(UbxConfigBatch &batch, int timeoutMs, int tries) {
+    m_ubxParser.set_ack_listener(&batch);
+    // The messages held back behind the ones of the same class and id go as soon as those are answered,
+    // only the sends after the timeout count as the tries
+    int timeouts = 0;
+    while ( timeouts < tries && !batch.Answered() && esp_timer_get_time() < m_configDeadlineUs ){
+        int sent = batch.Send(m_ubxParser);
+        ESP_LOGD(TAG, "Sent %d config messages", sent);
+        if ( !waitAnswered(batch, timeoutMs) ){
+            timeouts++;
+        }
+    }
+    m_ubxParser.set_ack_listener(nullptr);
+
+    if ( batch.Count(UbxConfigBatch::Status::NAK) > 0 ){
+        ESP_LOGW(TAG, "Receiver rejected %d of %d config messages", batch.Count(UbxConfigBatch::Status::NAK),
+                 batch.Size());
+    }
+    return batch.Done();
+}
+
+bool GPSHandler::waitAnswered(const UbxConfigBatch &batch, int timeoutMs) {
+    // The event loop isn't running yet, so the bytes are read here
+    uint8_t buf[256];
+    int64_t deadline = esp_timer_get_time() + timeoutMs * 1000LL;
+    while ( batch.InFlight() && esp_timer_get_time() < deadline ){
+        int nread = uart_read_bytes(uart_num, buf, sizeof(buf), pdMS_TO_TICKS(10));
+        if ( nread > 0 ){
+            processInput(buf, nread);
         }
     }
+    return !batch.InFlight();
+}
+
+void GPSHandler::addNavRateConfig(UbxConfigBatch &batch, int rateHz) {
+    CFG_RATE_t rate = {};
+    rate.measRate = 1000 / rateHz;
+    rate.navRate = 1;
+    rate.timeRef = 0;
+    batch.Add(CLASS_CFG, CFG_RATE, &rate, sizeof(rate));
+}
+
+void GPSHandler::addUbxPvtConfig(UbxConfigBatch &batch) {
+    // Enable NAV-PVT every navigation solution
+    const uint8_t navPvt[] = {CLASS_NAV, NAV_PVT, 1};
+    batch.Add(CLASS_CFG, CFG_MSG, navPvt, sizeof(navPvt));
+}
+
+void GPSHandler::addUbxNmeaConfig(UbxConfigBatch &batch) {
+    // Only GGA and RMC are used, the rest of the default sentences are turned off
+    const uint8_t sentences[][3] = {
+            {0xF0, 0x03, 0},  // GSV
+            {0xF0, 0x02, 0},  // GSA
+            {0xF0, 0x05, 0},  // VTG
+            {0xF0, 0x01, 0},  // GLL
+            {0xF0, 0x00, 1},  // GGA
+            {0xF0, 0x04, 1},  // RMC
+    };
+    for(const auto &sentence : sentences){
+        batch.Add(CLASS_CFG, CFG_MSG, sentence, sizeof(sentence));
+    }
+}
+
+void GpsParser::MarkArrival(int64_t firstByteUs, int64_t lastByteUs) {
+    // The receiver sends the whole epoch at once and then goes quiet till the next one
+    if ( firstByteUs - m_lastByteUs > GPS_EPOCH_GAP_US ){
+        m_epochStartUs = firstByteUs;
+    }
+    m_lastByteUs = lastByteUs;
+}
+
+void GpsParser::ProcessInputBytes(uint8_t *buff, size_t size) {
+    m_framer.Process(buff, (int)size);
 }
 
-void GpsParser::printHex(const uint8_t *buff, size_t size) {
-    char acBuff[10];
-    char str[4 * 256] = "";
-    for( int j = 0; j < size; j++){
-        snprintf(acBuff, sizeof(acBuff)-1, "%02X ", buff[j]);
-        strcat(str, acBuff);
+void GpsParser::onUbxFrame(uint8_t cls, uint8_t id, const uint8_t *payload, uint16_t len) {
+    m_ubxParser.dispatch(cls, id, payload, len);
+}
+
+void GpsParser::onNmeaSentence(const char *sentence, int len) {
+    if ( m_protocol == GpsProtocol::UBX_PVT ){
+        return;  // Left over before the receiver switched to UBX
     }
-    ESP_LOGD(TAG, "HEX [%s]", str);
+    if ( len >= 6 ){
+        // Sentence type characters, e.g. RMC of $GPRMC
+        int32_t sentenceId = sentence[3] | sentence[4] << 8 | sentence[5] << 16;
+        BlackBox::Record(BB_UART_SENTENCE, m_uartNum, len, sentenceId);
+    }
+    ParseNmea0183Line(sentence);
 }
 
 void GpsParser::ParseNmea0183Line(const char *lineToParse) {
 //    ESP_LOGI(TAG, "[%s]", lineToParse);
 
+    // The checksum is already checked by GnssFramer
     switch (minmea_sentence_id(lineToParse, false)) {
         case MINMEA_SENTENCE_RMC: {
             Event evt = {
@@ -228,7 +399,11 @@ void GpsParser::ParseNmea0183Line(const char *lineToParse) {
             };
             struct minmea_sentence_rmc &frame = evt.u.gps.rmc;
             if (minmea_parse_rmc(&frame, lineToParse)) {
-                xQueueSend(systemEventQueue, &evt, 0);
+                timespec ts = {};
+                if ( minmea_gettime(&ts, &frame.date, &frame.time) == 0 ){
+                    GpsClock::OnEpoch(m_epochStartUs, ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+                }
+                DeviceDiagnostics::QueueSend(systemEventQueue, &evt);
             }
         } break;
         case MINMEA_SENTENCE_GGA: {
@@ -239,7 +414,7 @@ void GpsParser::ParseNmea0183Line(const char *lineToParse) {
             };
             struct minmea_sentence_gga &frame = evt.u.gps.gga;
             if (minmea_parse_gga(&frame, lineToParse)) {
-                xQueueSend(systemEventQueue, &evt, 0);
+                DeviceDiagnostics::QueueSend(systemEventQueue, &evt);
             }
         } break;
         default:
@@ -247,6 +422,81 @@ void GpsParser::ParseNmea0183Line(const char *lineToParse) {
     }
 }
 
-void GpsParser::onUbxMsg(uint8_t cls, uint8_t type, UBX_message_t msg) {
+void GpsParser::onUbxMsg(uint8_t cls, uint8_t type, const uint8_t *payload, uint16_t len) {
+    if ( cls == CLASS_NAV && type == NAV_PVT && len >= sizeof(NAV_PVT_t) ){
+        BlackBox::Record(BB_UART_SENTENCE, m_uartNum, len, (type << 8) | cls);
+        NAV_PVT_t pvt;
+        memcpy(&pvt, payload, sizeof(pvt));  // Payload isn't aligned
+        Event evt = {
+                .src = GPS_DATA_PVT,
+                .isValid = true,
+                .u = {}
+        };
+        evt.u.gpsFix = DecodeNavPvt(pvt);
+        const GpsFix &fix = evt.u.gpsFix;
+        if ( fix.timeValid ){
+            int64_t msOfDay = llround(fix.secondsSinceMidnight * 1000);
+            GpsClock::OnEpoch(m_epochStartUs, (fix.daysSince1970 * (int64_t)SEC_IN_DAY * 1000 + msOfDay) * 1000);
+        }
+        DeviceDiagnostics::QueueSend(systemEventQueue, &evt);
+    }
+}
+
+// Days from 1970-01-01 to the date of proleptic Gregorian calendar
+static int daysFromCivil(int y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = (unsigned)(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int)doe - 719468;
+}
+
+GpsFix GpsParser::DecodeNavPvt(const NAV_PVT_t &pvt) {
+    GpsFix fix = {};
+
+    const uint8_t validDateTime = NAV_PVT_t::VALIDITY_FLAGS_VALIDDATE | NAV_PVT_t::VALIDITY_FLAGS_VALIDTIME;
+    if ( (pvt.valid & validDateTime) == validDateTime ){
+        // nano is signed, the epoch is a bit before or after the whole second
+        int64_t msOfDay = ((pvt.hour * 60 + pvt.min) * 60 + pvt.sec) * 1000LL + (pvt.nano + 500000 * (pvt.nano < 0 ? -1 : 1)) / 1000000;
+        int days = daysFromCivil(pvt.year, pvt.month, pvt.day);
+        if ( msOfDay < 0 ){
+            msOfDay += SEC_IN_DAY * 1000LL;
+            days--;
+        }else if ( msOfDay >= SEC_IN_DAY * 1000LL ){
+            msOfDay -= SEC_IN_DAY * 1000LL;
+            days++;
+        }
+        fix.timeValid = true;
+        fix.daysSince1970 = days;
+        fix.secondsSinceMidnight = msOfDay * 0.001;
+    }
 
+    const bool fixOk = pvt.flags & NAV_PVT_t::FIX_STATUS_GNSS_FIX_OK;
+    const bool hasPosition = fixOk && pvt.fixType >= 1 && pvt.fixType <= 4;  // Not "no fix" or "time only"
+    fix.positionValid = hasPosition;
+    fix.latitude = pvt.lat * 1e-7;
+    fix.longitude = pvt.lon * 1e-7;
+    fix.altitude = pvt.hMSL * 0.001;
+    fix.velocityValid = hasPosition;
+    fix.cogRad = pvt.headMot * 1e-5 * M_PI / 180;
+    fix.sogMs = pvt.gSpeed * 0.001;
+
+    if ( !hasPosition ){
+        fix.fixQuality = 0;
+    }else if ( (pvt.flags & NAV_PVT_t::FIX_STATUS_CARR_SOLN_FIXED) == NAV_PVT_t::FIX_STATUS_CARR_SOLN_FIXED ){
+        fix.fixQuality = 4;  // RTK fixed
+    }else if ( pvt.flags & NAV_PVT_t::FIX_STATUS_CARR_SOLN_FLOAT ){
+        fix.fixQuality = 5;  // RTK float
+    }else if ( pvt.fixType == 1 ){
+        fix.fixQuality = 6;  // Dead reckoning only
+    }else if ( pvt.flags & NAV_PVT_t::FIX_STATUS_DIFF_SOLN ){
+        fix.fixQuality = 2;  // DGNSS
+    }else{
+        fix.fixQuality = 1;
+    }
+    fix.nSatellites = pvt.numSV;
+    fix.hdop = -1;  // Not in NAV-PVT
+    fix.pdop = pvt.pDOP * 0.01f;
+    return fix;
 }
@@ -7,27 +7,62 @@
 #include <hal/uart_types.h>
 #include <driver/uart.h>
 #include "UbxParser.h"
+#include "GnssFramer.h"
+#include "UbxConfigBatch.h"
+#include "Event.hpp"
 
-class GpsParser : public UbxParser::Listener {
+const int GPS_BAUD_RATE = 9600;                 // Receiver default
+const int GPS_HIGH_BAUD_RATE = 115200;          // 460800 works as well, 115200 is plenty for 25 Hz NAV-PVT
+const int GPS_NAV_RATE_HZ = 10;                 // 10 to 25 Hz, depending on the receiver and enabled GNSS
+const int GPS_LOW_BAUD_NAV_RATE_HZ = 5;         // GGA+RMC or NAV-PVT at 5 Hz take half of 9600 baud
+const int GPS_PROBE_TIMEOUT_MS = 250;           // Poll to ACK is tens of ms
+const int GPS_PROBE_ROUNDS = 2;                 // The receiver might still be booting on the first one
+const int GPS_BAUD_SWITCH_DELAY_MS = 100;
+const int GPS_ACK_TIMEOUT_MS = 500;
+const int GPS_CONFIG_RETRIES = 3;
+const int GPS_CONFIG_TIMEOUT_MS = 8000;         // Bounds the startup whatever the receiver does
+const int64_t GPS_EPOCH_GAP_US = 10000;         // Silence before the output of the next epoch
+
+enum class GpsProtocol {
+    NMEA,       // GGA and RMC sentences
+    UBX_PVT,    // UBX-NAV-PVT only, u-blox 7 or newer
+};
+
+class GpsParser : public UbxParser::Listener, public GnssFramer::Handler {
 public:
-    explicit GpsParser(QueueHandle_t const &systemEventQueue, UbxParser &ubxParser);
-    void ProcessInputBytes(const uint8_t *buff, size_t size);
-    void onUbxMsg(uint8_t cls, uint8_t type, UBX_message_t msg) override;
+    GpsParser(QueueHandle_t const &systemEventQueue, UbxParser &ubxParser, uart_port_t uart_num, GpsProtocol protocol);
+    /// esp_timer time the bytes passed to ProcessInputBytes() next were received
+    void MarkArrival(int64_t firstByteUs, int64_t lastByteUs);
+    // The buffer is modified in place, see GnssFramer
+    void ProcessInputBytes(uint8_t *buff, size_t size);
+    void Reset() { m_framer.Reset(); }
+    void onUbxMsg(uint8_t cls, uint8_t type, const uint8_t *payload, uint16_t len) override;
+    void onUbxFrame(uint8_t cls, uint8_t id, const uint8_t *payload, uint16_t len) override;
+    void onNmeaSentence(const char *sentence, int len) override;
+
+    static GpsFix DecodeNavPvt(const NAV_PVT_t &pvt);
 
 private:
-    int  m_lineBufferIdx = 0;
-    uint8_t m_lineBuffer[256]={};
+    GnssFramer m_framer{*this};
+    int64_t m_epochStartUs = 0;   // First byte of the current epoch output
+    int64_t m_lastByteUs = 0;
 
     void ParseNmea0183Line(const char *lineToParse);
-    static void printHex(const uint8_t *buff, size_t size) ;
     const xQueueHandle &systemEventQueue;
     UbxParser &m_ubxParser;
+    const uart_port_t m_uartNum;
+    const GpsProtocol m_protocol;
 };
 
 
+/// At startup finds the baud rate the receiver talks at by polling UBX-CFG-PRT, moves it to GPS_HIGH_BAUD_RATE and
+/// sends the messages and the navigation rate in one batch, confirmed by ACK-ACK.
+/// NEO-6M NAKs 10 Hz, the rate is then halved.
+/// Takes GPS_CONFIG_TIMEOUT_MS at most, after that the receiver is used as it is.
 class GPSHandler : public UbxParser::Writer{
 public:
-    GPSHandler(const xQueueHandle &eventQueue, int tx_io_num, int rx_io_num, uart_port_t uart_num);
+    GPSHandler(const xQueueHandle &eventQueue, int tx_io_num, int rx_io_num, uart_port_t uart_num,
+               GpsProtocol protocol = GpsProtocol::NMEA);
     void Start();
     [[noreturn]] void Task();
     void writeToUbx(const uint8_t *b, size_t len) override;
@@ -36,11 +71,26 @@ private:
     const int tx_io_num;
     const int rx_io_num;
     const uart_port_t uart_num;
+    const GpsProtocol m_protocol;
     UbxParser m_ubxParser;
     QueueHandle_t m_uartEventQueue = nullptr;
     const int uart_buffer_size = 4 * 1024;
+    static const int PATTERN_QUEUE_LEN = 16;  // Sentences waiting to be read
+
+    int64_t m_configDeadlineUs = 0;
+    int64_t m_byteTimeUs = 10 * 1000000 / GPS_BAUD_RATE;
 
-    void initUbx();
+    void processInput(uint8_t *buf, int nread);
+    void configureReceiver();
+    int probeBaudRate();
+    int configurePort(int from, int to);
+    void setUartBaudRate(int baudRate);
+    bool pollPort(int tries);
+    bool runConfig(UbxConfigBatch &batch, int timeoutMs, int tries);
+    bool waitAnswered(const UbxConfigBatch &batch, int timeoutMs);
+    static void addNavRateConfig(UbxConfigBatch &batch, int rateHz);
+    static void addUbxPvtConfig(UbxConfigBatch &batch);
+    static void addUbxNmeaConfig(UbxConfigBatch &batch);
 };
 
 
@@ -0,0 +1,71 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "GpsClock.h"
+
+static const char *TAG = "imu2nmea_GpsClock";
+
+static const int64_t US_IN_SEC = 1000000;
+static const uint32_t LATENCY_LOG_PULSES = 60;
+
+ClockEstimator GpsClock::s_estimator;
+volatile int64_t GpsClock::s_pulseUs = 0;
+std::atomic<uint32_t> GpsClock::s_pulseCount(0);
+uint32_t GpsClock::s_pulsesTaken = 0;
+uint32_t GpsClock::s_resets = 0;
+
+void IRAM_ATTR GpsClock::onPpsEdge(void *arg) {
+    s_pulseUs = esp_timer_get_time();
+    s_pulseCount.fetch_add(1, std::memory_order_release);
+}
+
+void GpsClock::StartPps(gpio_num_t ppsGpio) {
+    gpio_config_t config = {
+            .pin_bit_mask = 1ULL << ppsGpio,
+            .mode = GPIO_MODE_INPUT,
+            .pull_up_en = GPIO_PULLUP_DISABLE,
+            .pull_down_en = GPIO_PULLDOWN_ENABLE,
+            .intr_type = GPIO_INTR_POSEDGE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&config));
+    esp_err_t err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+    if ( err != ESP_OK && err != ESP_ERR_INVALID_STATE ){  // Already installed by somebody else is fine
+        ESP_ERROR_CHECK(err);
+    }
+    ESP_ERROR_CHECK(gpio_isr_handler_add(ppsGpio, onPpsEdge, nullptr));
+    ESP_LOGI(TAG, "PPS on GPIO %d", ppsGpio);
+}
+
+bool GpsClock::takePulse(int64_t &pulseUs) {
+    uint32_t count;
+    do {
+        count = s_pulseCount.load(std::memory_order_acquire);
+        pulseUs = s_pulseUs;
+    } while ( s_pulseCount.load(std::memory_order_acquire) != count );
+
+    bool isNew = count != s_pulsesTaken;
+    s_pulsesTaken = count;
+    return isNew;
+}
+
+void GpsClock::OnEpoch(int64_t localUs, int64_t utcUs) {
+    int64_t pulseUs;
+    if ( utcUs % US_IN_SEC == 0 && takePulse(pulseUs) && localUs > pulseUs && localUs - pulseUs < US_IN_SEC ){
+        // The pulse marks the start of the second the epoch output is about
+        s_estimator.AddPulse(pulseUs, utcUs);
+        if ( s_pulsesTaken % LATENCY_LOG_PULSES == 0 ){
+            // What GPS_EPOCH_LATENCY_US should be for the boards without the PPS
+            ESP_LOGI(TAG, "Epoch latency learned from the PPS %lld us", s_estimator.EpochLatencyUs());
+        }
+    }
+    s_estimator.AddEpoch(localUs, utcUs);
+
+    if ( s_estimator.Resets() != s_resets ){
+        s_resets = s_estimator.Resets();
+        ESP_LOGW(TAG, "GPS time jumped, clock restarted");
+    }
+    ESP_LOGD(TAG, "Drift %.2f ppm, epoch latency %lld us", s_estimator.DriftPpm(), s_estimator.EpochLatencyUs());
+}
+
+bool GpsClock::Now(int64_t &utcUs) {
+    return s_estimator.ToUtc(esp_timer_get_time(), utcUs);
+}
@@ -0,0 +1,35 @@
+#ifndef IMU2NMEA_GPSCLOCK_H
+#define IMU2NMEA_GPSCLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <driver/gpio.h>
+#include "ClockEstimator.h"
+
+/// UTC for all the tasks, esp_timer calibrated against the GPS epochs and the PPS if it's wired.
+/// The PPS edge is paired with the epoch of the whole second that comes after it, so TIM-TP isn't needed.
+class GpsClock {
+public:
+    /// PPS of the receiver on this pin, call before the GPS task starts
+    static void StartPps(gpio_num_t ppsGpio);
+    /// Time from the epoch to the first byte of its output, used without the PPS. Call before the GPS task starts
+    static void SetEpochLatency(int64_t latencyUs) { s_estimator.SetEpochLatency(latencyUs); }
+    /// esp_timer time of the first byte of the epoch output and the UTC of the epoch in us since 1970
+    static void OnEpoch(int64_t localUs, int64_t utcUs);
+    /// Current UTC in us since 1970, false until the GPS gave the time
+    static bool Now(int64_t &utcUs);
+    /// UTC of the esp_timer time
+    static bool ToUtc(int64_t localUs, int64_t &utcUs) { return s_estimator.ToUtc(localUs, utcUs); }
+
+private:
+    static void onPpsEdge(void *arg);
+    static bool takePulse(int64_t &pulseUs);
+
+    static ClockEstimator s_estimator;
+    static volatile int64_t s_pulseUs;
+    static std::atomic<uint32_t> s_pulseCount;
+    static uint32_t s_pulsesTaken;
+    static uint32_t s_resets;
+};
+
+#endif //IMU2NMEA_GPSCLOCK_H
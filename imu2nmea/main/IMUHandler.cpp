@@ -1,20 +1,27 @@
 #include <esp_log.h>
 #include "driver/i2c.h"
+#include "driver/gpio.h"
+#include "rom/ets_sys.h"
 #include "IMUHandler.h"
 #include "Event.hpp"
+#include "DeviceDiagnostics.h"
 
 static const int  I2C_MASTER_NUM = 0;              /*!< I2C master i2c port number, the number of i2c peripheral interfaces available will depend on the chip */
-static const uint32_t I2C_MASTER_FREQ_HZ = 100000; /*!< I2C master clock frequency */
+static const uint32_t I2C_MASTER_FREQ_HZ = 400000; /*!< I2C master clock frequency */
 static const int I2C_MASTER_TX_BUF_DISABLE  =  0;  /*!< I2C master doesn't need buffer */
 static const int  I2C_MASTER_RX_BUF_DISABLE =  0;  /*!< I2C master doesn't need buffer */
 static const int MS_TO_WAIT = 100;
+static const int READ_MS_TO_WAIT = 20;             // The burst takes under 1 ms at 400 kHz, two ticks at least
+static const int BUS_CLEAR_PULSES = 9;             // Enough for the slave to finish any byte it's sending
 
 // CMPS12 Internal registers ( see imu2nmea/doc/cmps12.pdf )
 static const int REG_CMD = (uint8_t) 0x00;
 static const int REG_COMP_HI = (uint8_t) 0x02;
 static const int REG_PITCH = (uint8_t) 0x04;
 static const int REG_ROLL = (uint8_t) 0x05;
+static const int REG_GYRO_Z_HI = (uint8_t) 0x16;
 static const int REG_CAL = (uint8_t) 0x1e;
+static const int BURST_LEN = REG_CAL - REG_COMP_HI + 1;    // Registers auto increment, 0x06..0x1d come along
 
 static const char *TAG = "imu2nmea_IMUHandler";
 
@@ -37,55 +44,94 @@ void IMUHandler::Start() {
             16 * 1024,        /* Stack size in words, not bytes. */
             (void *) this,  /* Parameter passed into the task. */
             tskIDLE_PRIORITY + 1, /* Priority at which the task is created. */
-            nullptr);        /* Used to pass out the created task's handle. */
+            &m_task);        /* Used to pass out the created task's handle. */
+}
+
+void IMUHandler::onTimer(void *me) {
+    // esp_timer task, the I2C is done in the IMU task
+    xTaskNotifyGive(((IMUHandler *)me)->m_task);
 }
 
 [[noreturn]] void IMUHandler::Task() {
     bool initOk = InitI2C();
 
+    esp_timer_create_args_t timerArgs = {
+            .callback = onTimer,
+            .arg = this,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "cmps12",
+            .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &m_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(m_timer, 1000000 / CMPS12_SAMPLE_RATE_HZ));
+
     for( ;; ){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
         if ( initOk) {
 
             uint8_t calibrState=0;
             uint16_t comp=0;
             int8_t pitch=0;
             int8_t roll=0;
+            int16_t gyroZ=0;
+
+            esp_err_t err = ESP_FAIL;
+            for(int i = 0; i < CMPS12_READ_RETRIES && err != ESP_OK; i++){
+                err = readSample(calibrState, comp, pitch, roll, gyroZ);
+                if ( err != ESP_OK ){
+                    m_readErrors++;
+                }
+            }
+            bool isValid = err == ESP_OK;
 
-            esp_err_t err;
-            bool isValid = true;
-            err = readReg(REG_CAL, calibrState);
-            if ( err != ESP_OK)
-                isValid = false;
-            err = readReg(REG_COMP_HI, comp);
-            if ( err != ESP_OK)
-                isValid = false;
-            err = readReg(REG_PITCH, pitch);
-            if ( err != ESP_OK)
-                isValid = false;
-            err = readReg(REG_ROLL, roll);
-            if ( err != ESP_OK)
-                isValid = false;
-
+            ImuSample sample{(float)comp / 10.f, (float)pitch, (float)roll, 0};
+            int64_t hdgTimeUs = 0;
+            bool due = true;
             if (isValid){
-                ESP_LOGD(TAG, "cal=%02X comp=%04X pitch=%02X roll=%02X", calibrState, comp, pitch, roll);
+                ESP_LOGD(TAG, "cal=%02X comp=%04X pitch=%02X roll=%02X gyroZ=%d", calibrState, comp, pitch, roll, gyroZ);
+                // Positive Z turns the sensor counterclockwise seen from above, the heading goes the other way
+                float rot = -(float)gyroZ / CMPS12_GYRO_LSB_PER_DPS;
+                int64_t readUs = esp_timer_get_time();
+                m_heading.AddRate(readUs, rot);
+                m_compassLag.AddRate(readUs, rot);
+                m_compassLag.AddHeading(readUs, sample.hdg);
+                int64_t lagUs = m_compassLag.LagUs();
+                m_heading.AddHeading(readUs - lagUs, sample.hdg);
+
+                due = m_decimator.Add({sample.hdg, sample.pitch, sample.roll, rot}, sample);
+                // The fused heading has no filter delay, the compass one is late by the decimator and the sensor
+                hdgTimeUs = readUs - m_decimator.DelayUs() - lagUs;
+                if ( m_heading.Valid() ){
+                    sample.hdg = m_heading.Predict(readUs);
+                    hdgTimeUs = readUs;
+                }
             }else{
-                ESP_LOGE(TAG, "I2C error %d %s", err, esp_err_to_name(err));
+                ESP_LOGE(TAG, "I2C error %d %s, %u errors, %u bus recoveries", err, esp_err_to_name(err),
+                         m_readErrors, m_busRecoveries + 1);
+                recoverBus();
+                m_decimator.Reset();
             }
 
-            Event evt = {
-                    .src = IMU,
-                    .isValid = isValid,
-                    .u{
-                        .imu {
-                            .hdg = (float)comp / 10.f,
-                            .pitch = (float) pitch,
-                            .roll = (float) roll,
-                            .calibrState = calibrState,
+            if ( due ){
+                Event evt = {
+                        .src = IMU,
+                        .isValid = isValid,
+                        .u{
+                            .imu {
+                                .hdg = sample.hdg,
+                                .pitch = sample.pitch,
+                                .roll = sample.roll,
+                                .calibrState = calibrState,
+                                .rotValid = isValid,
+                                .rot = sample.rot,
+                                .hdgTimeUs = hdgTimeUs,
+                            }
                         }
-                    }
-            };
+                };
 
-            xQueueSend(eventQueue, &evt, 0);
+                DeviceDiagnostics::QueueSend(eventQueue, &evt);
+            }
         }
 
         if ( gotStoreCalCmd ){
@@ -97,8 +143,6 @@ void IMUHandler::Start() {
             gotEraseCalCmd = false;
             doEraseCalibration();
         }
-
-        vTaskDelay(100 / portTICK_PERIOD_MS); // FIXME must be driven by N2K rate
     }
 }
 
@@ -128,33 +172,51 @@ bool IMUHandler::InitI2C() {
     }
 }
 
-esp_err_t IMUHandler::readReg(uint8_t regNum, uint8_t &val) const {
-    return i2c_master_write_read_device(I2C_MASTER_NUM, i2c_addr,
-                                 &regNum, 1, &val, 1, MS_TO_WAIT / portTICK_RATE_MS);
-}
-
-esp_err_t IMUHandler::readReg(uint8_t regNum, int8_t &val) const {
-    return i2c_master_write_read_device(I2C_MASTER_NUM, i2c_addr,
-                                 &regNum, 1, (uint8_t *)&val, 1, MS_TO_WAIT / portTICK_RATE_MS);
-}
-
-esp_err_t IMUHandler::readReg(uint8_t regNum, uint16_t &val) const {
-    esp_err_t err;
-
-    uint8_t hi;
-    err = readReg(regNum, hi);
-    if ( err != ESP_OK)
+esp_err_t IMUHandler::readSample(uint8_t &calibrState, uint16_t &comp, int8_t &pitch, int8_t &roll,
+                                  int16_t &gyroZ) const {
+    uint8_t reg = REG_COMP_HI;
+    uint8_t regs[BURST_LEN];
+    esp_err_t err = i2c_master_write_read_device(I2C_MASTER_NUM, i2c_addr,
+                                                 &reg, 1, regs, sizeof(regs), READ_MS_TO_WAIT / portTICK_RATE_MS);
+    if ( err != ESP_OK ){
         return err;
-
-    uint8_t lo;
-    err = readReg(regNum + 1, lo);
-    if ( err != ESP_OK)
-        return err;
-
-    val = (((uint16_t)hi) << 8) | (uint16_t)lo;
+    }
+    comp = (uint16_t)(regs[0] << 8 | regs[1]);
+    pitch = (int8_t)regs[REG_PITCH - REG_COMP_HI];
+    roll = (int8_t)regs[REG_ROLL - REG_COMP_HI];
+    gyroZ = (int16_t)(regs[REG_GYRO_Z_HI - REG_COMP_HI] << 8 | regs[REG_GYRO_Z_HI - REG_COMP_HI + 1]);
+    calibrState = regs[REG_CAL - REG_COMP_HI];
     return ESP_OK;
 }
 
+void IMUHandler::recoverBus() {
+    // The slave may hold SDA low in the middle of a byte, clock it out by hand, then STOP and start the driver over
+    m_busRecoveries++;
+    i2c_driver_delete(I2C_MASTER_NUM);
+
+    gpio_set_direction((gpio_num_t)sda_io_num, GPIO_MODE_INPUT_OUTPUT_OD);
+    gpio_set_direction((gpio_num_t)scl_io_num, GPIO_MODE_INPUT_OUTPUT_OD);
+    gpio_set_level((gpio_num_t)sda_io_num, 1);
+    for(int i = 0; i < BUS_CLEAR_PULSES && gpio_get_level((gpio_num_t)sda_io_num) == 0; i++){
+        gpio_set_level((gpio_num_t)scl_io_num, 0);
+        ets_delay_us(5);
+        gpio_set_level((gpio_num_t)scl_io_num, 1);
+        ets_delay_us(5);
+    }
+    // STOP: SDA goes up while SCL is high
+    gpio_set_level((gpio_num_t)scl_io_num, 0);
+    ets_delay_us(5);
+    gpio_set_level((gpio_num_t)sda_io_num, 0);
+    ets_delay_us(5);
+    gpio_set_level((gpio_num_t)scl_io_num, 1);
+    ets_delay_us(5);
+    gpio_set_level((gpio_num_t)sda_io_num, 1);
+
+    if ( !InitI2C() ){
+        ESP_LOGE(TAG, "I2C driver not restarted after the bus recovery");
+    }
+}
+
 void IMUHandler::StoreCalibration() {
     gotStoreCalCmd = true;
 }
@@ -3,8 +3,24 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/task.h"
+#include <esp_timer.h>
 #include "IMUCalInterface.h"
-
+#include <ImuDecimator.h>
+#include <HeadingEstimator.h>
+#include <CompassLagEstimator.h>
+
+const int CMPS12_SAMPLE_RATE_HZ = 20;           // The sensor updates at 100 Hz
+const int CMPS12_EVENT_RATE_HZ = 10;            // Decimated IMU events to N2KHandler, same as HWT_EVENT_RATE_HZ
+const int CMPS12_READ_RETRIES = 3;              // Then the bus is recovered and the sample is invalid
+const float CMPS12_GYRO_LSB_PER_DPS = 16;       // BNO055 default gyro unit dps, see doc/cmps12/bst-bno055-ds000.pdf
+const int64_t CMPS12_COMPASS_LAG_US = 0;        // BNO055 fuses its gyro into the heading, the lag is learned anyway
+
+/// Reads the CMPS12 at CMPS12_SAMPLE_RATE_HZ, the period is kept by esp_timer, not by the loop.
+/// Heading, pitch, roll, gyro Z and the calibration state come with one burst read.
+/// The samples are decimated to CMPS12_EVENT_RATE_HZ IMU events, N2KHandler sends each event as it comes.
+/// The heading is fused with the gyro Z the same way IMU_HWT905Handler does it, so the rate of turn is sent as well
+/// and the heading is as of the read time.
 class IMUHandler : public IMUCalInterface{
 public:
     IMUHandler(const xQueueHandle &eventQueue, int sda_io_num, int scl_io_num, uint8_t i2c_addr);
@@ -15,6 +31,9 @@ public:
 
 private:
     bool InitI2C();
+    void recoverBus();
+    esp_err_t readSample(uint8_t &calibrState, uint16_t &comp, int8_t &pitch, int8_t &roll, int16_t &gyroZ) const;
+    static void onTimer(void *me);
 
     const xQueueHandle &eventQueue;
 
@@ -22,9 +41,13 @@ private:
     int scl_io_num = 17;
     uint8_t i2c_addr = 0;
 
-    esp_err_t readReg(uint8_t regNum, uint8_t &val) const;
-    esp_err_t readReg(uint8_t regNum, uint16_t &val) const;
-    esp_err_t readReg(uint8_t regNum, int8_t &val) const;
+    TaskHandle_t m_task = nullptr;
+    esp_timer_handle_t m_timer = nullptr;
+    uint32_t m_readErrors = 0;
+    uint32_t m_busRecoveries = 0;
+    ImuDecimator m_decimator{CMPS12_SAMPLE_RATE_HZ, CMPS12_EVENT_RATE_HZ};
+    HeadingEstimator m_heading;
+    CompassLagEstimator m_compassLag{CMPS12_COMPASS_LAG_US};
 
     void doStoreCalibration();
     void doEraseCalibration();
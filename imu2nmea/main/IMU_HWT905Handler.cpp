@@ -1,11 +1,19 @@
+#include <cstdlib>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include "IMU_HWT905Handler.h"
 #include "wit_c_sdk/wit_c_sdk.h"
 
 #include "Event.hpp"
+#include "DeviceDiagnostics.h"
+#include "BinLog.h"
 
 static const char *TAG = "imu2nmea_IMU_HWT905Handler";
 
+static const int HWT_PROBE_FRAMES = 5;          // Valid frames to trust the baud rate, noise passes the sum now and then
+static const uint16_t SAVE_DEFAULT = 0x01;      // SAVE register value restoring the factory settings
+static const int64_t LAG_LOG_STEP_US = 5000;    // Learned compass lag is logged when it moves by that much
+
 static IMU_HWT905Handler *imuHWT905Handler = nullptr;
 
 IMU_HWT905Handler::IMU_HWT905Handler(QueueHandle_t const &eventQueue, int tx_io_num, int rx_io_num, uart_port_t uart_num)
@@ -22,11 +30,6 @@ static void SensorUartSend(uint8_t *p_data, uint32_t uiSize){
     imuHWT905Handler->writeToHwt(p_data, uiSize);
 }
 
-static void SensorDataUpdate(uint32_t uiReg, uint32_t uiRegNum){
-    ESP_LOGD(TAG, "SensorDataUpdate: 0x%02x, %d", uiReg, uiRegNum);
-    imuHWT905Handler -> onSensorData(uiReg, sReg, uiRegNum);
-}
-
 static void Delayms(uint16_t ucMs){
     vTaskDelay(ucMs / portTICK_PERIOD_MS);
 }
@@ -47,7 +50,7 @@ void IMU_HWT905Handler::Task() {
     ESP_LOGI(TAG, "Opening serial port");
 
     uart_config_t uart_config = {
-            .baud_rate = 9600,
+            .baud_rate = m_baudRate,
             .data_bits = UART_DATA_8_BITS,
             .parity = UART_PARITY_DISABLE,
             .stop_bits = UART_STOP_BITS_1,
@@ -71,17 +74,17 @@ void IMU_HWT905Handler::Task() {
     uart_event_t event;
     uint8_t dtmp[uart_buffer_size];
 
-    bool imuDetected = false;
-    bool imuInitialized = false;
+    ImuState imuState = ImuState::PROBING;
+    uint32_t probeFrames = 0;
+    int64_t probeStart = esp_timer_get_time();
 
     WitInit(WIT_PROTOCOL_NORMAL, 0x50);
     WitSerialWriteRegister(SensorUartSend);
-    WitRegisterCallBack(SensorDataUpdate);
     WitDelayMsRegister(Delayms);
 
     for (;;) {
 
-        if(xQueueReceive(m_uartEventQueue, (void * )&event, (portTickType)portMAX_DELAY)){
+        if(xQueueReceive(m_uartEventQueue, (void * )&event, pdMS_TO_TICKS(HWT_PROBE_TIMEOUT_MS))){
             ESP_LOGD(TAG, "uart[%d] event:", uart_num);
             switch(event.type) {
                 //Event of UART receving data
@@ -91,8 +94,8 @@ void IMU_HWT905Handler::Task() {
                 case UART_DATA:
                     ESP_LOGD(TAG, "[UART DATA]: %d", event.size);
                     uart_read_bytes(uart_num, dtmp, event.size, portMAX_DELAY);
-                    ProcessInputBytes(dtmp, event.size);
-                    imuDetected = true;
+                    m_readTimeUs = esp_timer_get_time();
+                    m_framer.Process(dtmp, (int)event.size);
                     break;
                     //Event of HW FIFO overflow detected
                 case UART_FIFO_OVF:
@@ -102,6 +105,7 @@ void IMU_HWT905Handler::Task() {
                     // As an example, we directly flush the rx buffer here in order to read more data.
                     uart_flush_input(uart_num);
                     xQueueReset(m_uartEventQueue);
+                    m_framer.Reset();
                     break;
                     //Event of UART ring buffer full
                 case UART_BUFFER_FULL:
@@ -110,6 +114,7 @@ void IMU_HWT905Handler::Task() {
                     // As an example, we directly flush the rx buffer here in order to read more data.
                     uart_flush_input(uart_num);
                     xQueueReset(m_uartEventQueue);
+                    m_framer.Reset();
                     break;
                     //Event of UART RX break detected
                 case UART_BREAK:
@@ -128,18 +133,46 @@ void IMU_HWT905Handler::Task() {
                     ESP_LOGI(TAG, "uart event type: %d", event.type);
                     break;
             }
-            if(imuDetected && !imuInitialized ){
+        }
+
+        if ( imuState == ImuState::PROBING ){
+            if ( m_framer.Frames() - probeFrames >= HWT_PROBE_FRAMES ){
                 initImu();
-                imuInitialized = true;
+                imuState = ImuState::SWITCHING;
+                probeFrames = m_framer.Frames();
+                probeStart = esp_timer_get_time();
+            }else if ( esp_timer_get_time() - probeStart > HWT_PROBE_TIMEOUT_MS * 1000LL ){
+                setUartBaudRate(m_baudRate == HWT_HIGH_BAUD_RATE ? HWT_BAUD_RATE : HWT_HIGH_BAUD_RATE);
+                ESP_LOGI(TAG, "No HWT905 frames, trying %d baud", m_baudRate);
+                probeFrames = m_framer.Frames();
+                probeStart = esp_timer_get_time();
+            }
+        }else if ( imuState == ImuState::SWITCHING ){
+            if ( m_framer.Frames() - probeFrames >= HWT_PROBE_FRAMES ){
+                finishInit();
+                imuState = ImuState::RUNNING;
+            }else if ( esp_timer_get_time() - probeStart > HWT_PROBE_TIMEOUT_MS * 1000LL ){
+                ESP_LOGE(TAG, "No HWT905 frames at %d baud after the switch, probing again", m_baudRate);
+                imuState = ImuState::PROBING;
+                probeFrames = m_framer.Frames();
+                probeStart = esp_timer_get_time();
             }
         }
-    }
-}
 
-void IMU_HWT905Handler::ProcessInputBytes(uint8_t *data, size_t size) {
-//    ESP_LOG_BUFFER_HEX(TAG, data, size);
-    for(int i = 0; i < size; i++){
-        WitSerialDataIn(data[i]);
+        if ( gotStoreCalCmd ){
+            gotStoreCalCmd = false;
+            doStoreCalibration();
+        }
+
+        if ( gotEraseCalCmd ){
+            gotEraseCalCmd = false;
+            doEraseCalibration();
+            // Back at the defaults, find and set it up again
+            imuState = ImuState::PROBING;
+            setUartBaudRate(HWT_BAUD_RATE);
+            probeFrames = m_framer.Frames();
+            probeStart = esp_timer_get_time();
+        }
     }
 }
 
@@ -148,48 +181,138 @@ void IMU_HWT905Handler::writeToHwt(const uint8_t *b, size_t len) const {
 }
 
 void IMU_HWT905Handler::initImu() {
+    ESP_LOGI(TAG, "HWT905 found at %d baud, switching to %d baud", m_baudRate, HWT_HIGH_BAUD_RATE);
+
+    // Content first, at the baud rate the sensor talks at now. The rate is raised only at the high baud rate,
+    // 100 Hz of records don't fit into 9600 baud
+    if ( WitSetContent(RSW_GYRO | RSW_ANGLE) != WIT_HAL_OK ){
+        ESP_LOGE(TAG, "Failed to set the output content");
+    }
+    vTaskDelay(pdMS_TO_TICKS(HWT_WRITE_DELAY_MS));
 
+    if ( m_baudRate != HWT_HIGH_BAUD_RATE ){
+        // The sensor switches right after the write
+        if ( WitSetUartBaud(WIT_BAUD_115200) != WIT_HAL_OK ){
+            ESP_LOGE(TAG, "Failed to set the baud rate");
+        }
+        setUartBaudRate(HWT_HIGH_BAUD_RATE);
+        vTaskDelay(pdMS_TO_TICKS(HWT_WRITE_DELAY_MS));
+    }
 }
 
-void IMU_HWT905Handler::StoreCalibration() {
+void IMU_HWT905Handler::finishInit() {
+    ESP_LOGI(TAG, "HWT905 talks at %d baud, setting %d Hz output", m_baudRate, HWT_OUTPUT_RATE_HZ);
+    if ( WitSetOutputRate(outputRateCode(HWT_OUTPUT_RATE_HZ)) != WIT_HAL_OK ){
+        ESP_LOGE(TAG, "Failed to set the output rate");
+    }
+    vTaskDelay(pdMS_TO_TICKS(HWT_WRITE_DELAY_MS));
+
+    // Keep the settings over the power cycle, so the next start finds it at the high rate right away
+    unlockAndWrite(SAVE, SAVE_PARAM);
+    m_decimator.Reset();
+}
 
+void IMU_HWT905Handler::setUartBaudRate(int baudRate) {
+    uart_wait_tx_done(uart_num, pdMS_TO_TICKS(HWT_PROBE_TIMEOUT_MS));
+    uart_set_baudrate(uart_num, baudRate);
+    m_baudRate = baudRate;
+    // Whatever came at the old rate is garbage now
+    uart_flush_input(uart_num);
+    m_framer.Reset();
+}
+
+void IMU_HWT905Handler::unlockAndWrite(uint32_t reg, uint16_t value) const {
+    if ( WitWriteReg(KEY, KEY_UNLOCK) != WIT_HAL_OK ){
+        ESP_LOGE(TAG, "Failed to unlock the registers");
+        return;
+    }
+    vTaskDelay(pdMS_TO_TICKS(HWT_WRITE_DELAY_MS));
+    if ( WitWriteReg(reg, value) != WIT_HAL_OK ){
+        ESP_LOGE(TAG, "Failed to write register 0x%02X", reg);
+    }
+    vTaskDelay(pdMS_TO_TICKS(HWT_WRITE_DELAY_MS));
+}
+
+int IMU_HWT905Handler::outputRateCode(int hz) {
+    if ( hz >= 200 ) return RRATE_200HZ;
+    if ( hz >= 100 ) return RRATE_100HZ;
+    if ( hz >= 50 ) return RRATE_50HZ;
+    if ( hz >= 20 ) return RRATE_20HZ;
+    return RRATE_10HZ;
+}
+
+void IMU_HWT905Handler::StoreCalibration() {
+    gotStoreCalCmd = true;
 }
 
 void IMU_HWT905Handler::EraseCalibration() {
+    gotEraseCalCmd = true;
+}
 
+void IMU_HWT905Handler::doStoreCalibration() {
+    // The magnetometer and accelerometer calibration is kept in the registers till saved
+    ESP_LOGI(TAG, "Storing HWT905 calibration");
+    unlockAndWrite(SAVE, SAVE_PARAM);
 }
 
-void IMU_HWT905Handler::onSensorData(uint32_t uiReg, const int16_t *data, uint32_t uiRegNum) {
-    switch (uiReg) {
-        case Roll:
-            m_fRoll = (float)(data[Roll]) / 32768.f * 180.f;
-            m_fPitch = (float)(data[Pitch]) / 32768.f * 180.f;
-            m_fYaw = (float)(data[Yaw]) / 32768.f * 180.f;
-            // Change coordinate system from NED to ENU
-            m_fYaw = 180 - m_fYaw;
-            // Apply magnetic deviation correction
-            m_fYaw = magDeviation.correct(m_fYaw);
-            ESP_LOGD(TAG, "Roll: %f (0x%04X), Pitch: %f (0x%04X), Yaw: %f (0x%04X)",
-                     m_fRoll, data[Roll] & 0x0000FFFF,
-                     m_fPitch, data[Pitch] & 0x0000FFFF,
-                     m_fYaw, data[Yaw] & 0x0000FFFF);
-
-            Event evt = {
-                    .src = IMU,
-                    .isValid = true,
-                    .u{
-                            .imu {
-                                    .hdg = (float)m_fYaw,
-                                    .pitch = (float) m_fPitch,
-                                    .roll = (float) m_fRoll,
-                                    .calibrState = 0xff,
-                            }
-                    }
-            };
-            xQueueSend(systemEventQueue, &evt, 0);
+void IMU_HWT905Handler::doEraseCalibration() {
+    // Factory settings, the baud rate and the output rate go back to the defaults as well
+    ESP_LOGI(TAG, "Erasing HWT905 calibration");
+    unlockAndWrite(SAVE, SAVE_DEFAULT);
+}
 
+void IMU_HWT905Handler::onGyro(const WitFramer::Vector &rate) {
+    // Positive Z turns the sensor yaw up, the heading goes the other way, see onAngle()
+    m_fRot = -rate.z;
+    m_gotGyro = true;
+    m_heading.AddRate(m_readTimeUs, m_fRot);
+    m_compassLag.AddRate(m_readTimeUs, m_fRot);
+}
 
-            break;
+void IMU_HWT905Handler::onAngle(const WitFramer::Angle &angle) {
+    m_fRoll = angle.roll;
+    m_fPitch = angle.pitch;
+    // Change coordinate system from NED to ENU
+    m_fYaw = 180 - angle.yaw;
+    // Apply magnetic deviation correction
+    m_fYaw = magDeviation.correct(m_fYaw);
+    m_compassLag.AddHeading(m_readTimeUs, m_fYaw);
+    int64_t lagUs = m_compassLag.LagUs();
+    if ( m_compassLag.Valid() && std::llabs(lagUs - m_loggedLagUs) >= LAG_LOG_STEP_US ){
+        ESP_LOGI(TAG, "Compass lag %lld ms learned from %d turning windows", lagUs / 1000, m_compassLag.Windows());
+        m_loggedLagUs = lagUs;
+    }
+    m_heading.AddHeading(m_readTimeUs - lagUs, m_fYaw);
+    ESP_LOGV(TAG, "Roll: %f, Pitch: %f, Yaw: %f, ROT: %f", m_fRoll, m_fPitch, m_fYaw, m_fRot);
 
+    ImuSample sample{};
+    if ( !m_decimator.Add({m_fYaw, m_fPitch, m_fRoll, m_fRot}, sample) ){
+        return;
     }
+    // The fused heading has no filter delay, the compass one is late by the decimator and the sensor
+    float hdg = sample.hdg;
+    int64_t hdgTimeUs = m_readTimeUs - m_decimator.DelayUs() - lagUs;
+    if ( m_heading.Valid() ){
+        hdg = m_heading.Predict(m_readTimeUs);
+        hdgTimeUs = m_readTimeUs;
+    }
+    BINLOG_D("Decimated HDG: %.1f (%.1f), Pitch: %.1f, Roll: %.1f, ROT: %.2f, gyro bias %.3f", hdg, sample.hdg,
+             sample.pitch, sample.roll, sample.rot, m_heading.Bias());
+
+    Event evt = {
+            .src = IMU,
+            .isValid = true,
+            .u{
+                    .imu {
+                            .hdg = hdg,
+                            .pitch = sample.pitch,
+                            .roll = sample.roll,
+                            .calibrState = 0xff,
+                            .rotValid = m_gotGyro,
+                            .rot = sample.rot,
+                            .hdgTimeUs = hdgTimeUs,
+                    }
+            }
+    };
+    DeviceDiagnostics::QueueSend(systemEventQueue, &evt);
 }
@@ -7,8 +7,25 @@
 #include "MagDeviation.h"
 #include <hal/uart_types.h>
 #include <driver/uart.h>
+#include <WitFramer.h>
+#include <ImuDecimator.h>
+#include <HeadingEstimator.h>
+#include <CompassLagEstimator.h>
 
-class IMU_HWT905Handler  : public IMUCalInterface{
+const int HWT_BAUD_RATE = 9600;                 // Sensor default
+const int HWT_HIGH_BAUD_RATE = 115200;
+const int HWT_OUTPUT_RATE_HZ = 100;             // 50 to 200, the gyro and angle records take 2200 bytes/s at 100 Hz
+const int HWT_EVENT_RATE_HZ = 10;               // Decimated IMU events to N2KHandler
+const int HWT_PROBE_TIMEOUT_MS = 1000;          // No frames for so long, try the other baud rate
+const int HWT_WRITE_DELAY_MS = 50;              // Between the register writes
+const int64_t HWT_COMPASS_LAG_US = 50000;       // Angle record behind the gyro to start with, then it's learned
+
+/// At startup finds the baud rate the sensor talks at, moves it to HWT_HIGH_BAUD_RATE and sets it to output the
+/// gyro and angle records at HWT_OUTPUT_RATE_HZ once the frames at the new baud rate are seen, otherwise it probes
+/// again. The records are decimated to HWT_EVENT_RATE_HZ IMU events with the
+/// rate of turn from the gyro Z. The heading is the compass fused with the gyro, as of the time the records came.
+/// How late the angle record is against the gyro isn't documented, it's learned from the turns by CompassLagEstimator.
+class IMU_HWT905Handler  : public IMUCalInterface, public WitFramer::Handler{
 public:
     IMU_HWT905Handler(const xQueueHandle &eventQueue, int tx_io_num, int rx_io_num, uart_port_t uart_num);
     void Start();
@@ -19,7 +36,8 @@ public:
 public: // For use in static functions
     [[noreturn]] void Task();
     void writeToHwt(const uint8_t *b, size_t len) const;
-    void onSensorData(uint32_t uiReg, const int16_t *data, uint32_t uiRegNum);
+    void onAngle(const WitFramer::Angle &angle) override;
+    void onGyro(const WitFramer::Vector &rate) override;
 
 private:
     const xQueueHandle &systemEventQueue;
@@ -29,9 +47,33 @@ private:
     MagDeviation magDeviation;
     const int uart_buffer_size = 4 * 1024;
     QueueHandle_t m_uartEventQueue = nullptr;
-    static void ProcessInputBytes(uint8_t *data, size_t size);
+    WitFramer m_framer{*this};
 
+    /// Where the sensor is on the way to the configured output
+    enum class ImuState {
+        PROBING,    // Looking for the frames at m_baudRate
+        SWITCHING,  // Asked to switch to HWT_HIGH_BAUD_RATE, waiting for the frames at it
+        RUNNING,
+    };
     void initImu();
+    void finishInit();
+    void setUartBaudRate(int baudRate);
+    void unlockAndWrite(uint32_t reg, uint16_t value) const;
+    void doStoreCalibration();
+    void doEraseCalibration();
+    static int outputRateCode(int hz);
+
+    int m_baudRate = HWT_HIGH_BAUD_RATE;
+    ImuDecimator m_decimator{HWT_OUTPUT_RATE_HZ, HWT_EVENT_RATE_HZ};
+    HeadingEstimator m_heading;
+    CompassLagEstimator m_compassLag{HWT_COMPASS_LAG_US};
+    int64_t m_loggedLagUs = 0;
+    int64_t m_readTimeUs = 0;
+    float m_fRot = 0.0f;
+    bool m_gotGyro = false;
+
+    volatile bool gotStoreCalCmd = false;
+    volatile bool gotEraseCalCmd = false;
 
     float m_fPitch = 0.0f;
     float m_fRoll = 0.0f;
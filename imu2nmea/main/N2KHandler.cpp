@@ -1,4 +1,5 @@
 #include <cmath>
+#include <algorithm>
 
 #include <esp_log.h>
 
@@ -6,17 +7,22 @@
 #include "Event.hpp"
 #include "CalibrationStorage.h"
 #include "wmm.h"
+#include "Trace.h"
+#include "BinLog.h"
+#include "GpsClock.h"
 
 NMEA2000_esp32_twai NMEA2000(ESP32_CAN_TX_PIN, ESP32_CAN_RX_PIN,
                              TWAI_MODE, TWAI_TX_QUEUE_LEN);
 
 static const unsigned long TX_PGNS_IMU[] PROGMEM={127250, // Vessel Heading
+                                                  127251, // Rate of Turn
                                                   127257, // Attitude
                                                   126992, // System time
                                                   129025, // Position, Rapid Update
                                                   129026,  // COG & SOG, Rapid Update
                                                   127258,  // Magnetic Variation
                                                   IMU_CALIBRATION_PGN,
+                                                  SCI_DIAGNOSTICS_PGN,
                                                   0};
 
 static const unsigned long RX_PGNS_IMU[] PROGMEM={
@@ -26,12 +32,14 @@ static const char *TAG = "imu2nmea_N2KHandler";
 
 tN2kSyncScheduler N2KHandler::s_HdgScheduler(false, DEFAULT_HDG_TX_RATE, 0);
 tN2kSyncScheduler N2KHandler::s_AttScheduler(false, DEFAULT_ATTITUDE_TX_RATE, 0);
+tN2kSyncScheduler N2KHandler::s_PosScheduler(false, DEFAULT_POSITION_RAPID_TX_RATE, 0);
 
 N2KHandler::N2KHandler(const xQueueHandle &evtQueue, LEDBlinker &ledBlinker, IMUCalInterface &imuCalInterface)
     :m_evtQueue(evtQueue)
     ,m_ledBlinker(ledBlinker)
     ,imuCalInterface(imuCalInterface)
     ,m_imuCalGroupFunctionHandler(*this, &NMEA2000)
+    ,m_diagnosticsGroupFunctionHandler(&NMEA2000, SCI_MFG_CODE, SCI_INDUSTRY_CODE)
     ,m_busListener(evtQueue, ledBlinker)
 {
 }
@@ -84,6 +92,7 @@ void N2KHandler::Init() {
     NMEA2000.ExtendReceiveMessages(RX_PGNS_IMU, DEV_IMU);
 
     NMEA2000.AddGroupFunctionHandler(&m_imuCalGroupFunctionHandler);
+    NMEA2000.AddGroupFunctionHandler(&m_diagnosticsGroupFunctionHandler);
     NMEA2000.SetOnOpen(OnOpen);
     
 }
@@ -93,6 +102,10 @@ static void n2k_task( void *me ) {
 }
 
 void N2KHandler::Start() {
+    // All the bridges read from this ring, so the TWAI path writes each frame once
+    NMEA2000.addBusListener(&m_frameRing);
+    DeviceDiagnostics::RegisterQueue("side", m_sideFrames.Handle());
+
     xTaskCreate(
             n2k_task,         /* Function that implements the task. */
             "N2KTask",            /* Text name for the task. */
@@ -113,6 +126,8 @@ void N2KHandler::Start() {
     for( ;; ) {
         Event evt{};
         portBASE_TYPE res = xQueueReceive(m_evtQueue, &evt, 1);
+        int64_t loopStart = esp_timer_get_time();
+        SCI_TRACE(TRACE_N2K_LOOP_BEGIN, res == pdTRUE ? (uint32_t)evt.src : 0xFFFFFFFF);
 
         // Check if new  data is available
         if (res == pdTRUE) {
@@ -124,9 +139,19 @@ void N2KHandler::Start() {
                     roll = - NormalizeDeg180(evt.u.imu.pitch + RadToDeg(m_pitchCorrRad));
                     pitch = NormalizeDeg180(evt.u.imu.roll + RadToDeg(m_rollCorrRad));
                     calibrState = evt.u.imu.calibrState;
+                    rot = evt.u.imu.rotValid ? evt.u.imu.rot : N2kDoubleNA;
+                    hdgTimeUs = evt.u.imu.hdgTimeUs;
                     isImuValid = evt.isValid;
                     if( isImuValid ){
                         imuUpdateTime = esp_timer_get_time();
+                        int64_t utcUs;
+                        if ( GpsClock::ToUtc(hdgTimeUs != 0 ? hdgTimeUs : imuUpdateTime, utcUs) ){
+                            m_propagator.OnHeading(utcUs, DegToRad(hdg));
+                        }
+                        // The IMU handlers decimate to the N2K rate, so each event goes out as it comes
+                        transmitImuData();
+                        s_HdgScheduler.UpdateNextTime();
+                        s_AttScheduler.UpdateNextTime();
                     }
                     break;
                 case GPS_DATA_RMC:
@@ -137,12 +162,15 @@ void N2KHandler::Start() {
                     m_gga = evt.u.gps.gga;
                     gotGga = true;
                     break;
+                case GPS_DATA_PVT:
+                    transmitGpsData(evt.u.gpsFix);
+                    break;
                 case CAN_DRIVER_EVENT:
                     break;
             }
 
             if( gotRmc && gotGga ){
-                transmitGpsData(m_rmc);
+                transmitGpsData(gpsFixFromNmea(m_rmc, m_gga));
                 gotRmc = false;
                 gotGga = false;
             }
@@ -154,102 +182,134 @@ void N2KHandler::Start() {
             isImuValid = false;
         }
 
-        // Check if it's time to send the messages
+        // Not available values while there is no IMU, the IMU events don't let the schedulers fire otherwise
         if ( s_HdgScheduler.IsTime() ) {
             s_HdgScheduler.UpdateNextTime();
 
-            double localHdgRad = isImuValid ? DegToRad(hdg) : N2kDoubleNA;
-
             tN2kMsg N2kMsg;
-            SetN2kMagneticHeading(N2kMsg, this->uc_SeqId, localHdgRad);
+            SetN2kMagneticHeading(N2kMsg, this->uc_SeqId, N2kDoubleNA);
             N2kMsg.Priority = DEFAULT_HDG_TX_PRIO;
             bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
             m_ledBlinker.SetBusState(sentOk);
-            ESP_LOGD(TAG, "SetN2kMagneticHeading HDG=%.1f  %s", RadToDeg(localHdgRad), sentOk ? "OK" : "Failed");
+            ESP_LOGD(TAG, "SetN2kMagneticHeading no IMU %s", sentOk ? "OK" : "Failed");
         }
 
-        // Check if it's time to send the messages
         if ( s_AttScheduler.IsTime() ) {
             s_AttScheduler.UpdateNextTime();
 
-            double localYawRad = N2kDoubleNA;  // Not quite sure what it's supposed to be referenced to. Just don't send it
-            double localRollRad = isImuValid ? DegToRad(roll) : N2kDoubleNA;
-            double localPitchRad = isImuValid ? DegToRad(pitch) : N2kDoubleNA;
-
             tN2kMsg N2kMsg;
-            // Use heading sequence id to bin them together
-            SetN2kAttitude(N2kMsg, this->uc_SeqId, localYawRad, localPitchRad, localRollRad);
+            SetN2kAttitude(N2kMsg, this->uc_SeqId, N2kDoubleNA, N2kDoubleNA, N2kDoubleNA);
             N2kMsg.Priority = DEFAULT_ATTITUDE_TX_PRIO;
             bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
             m_ledBlinker.SetBusState(sentOk);
-            ESP_LOGD(TAG, "SetN2kAttitude HDG=%.1f PITCH=%.0f ROLL=%.0f %s", RadToDeg(localYawRad), RadToDeg(localPitchRad), RadToDeg(localRollRad), sentOk ? "OK" : "Failed");
+            ESP_LOGD(TAG, "SetN2kAttitude no IMU %s", sentOk ? "OK" : "Failed");
+        }
+
+        if ( s_PosScheduler.IsTime() ) {
+            s_PosScheduler.UpdateNextTime();
+            transmitPositionRapid();
         }
 
         this->uc_SeqId = (this->uc_SeqId + 1) % 253;
 
+        // Frames from the bridges are only passed to the NMEA2000 stack from this task
+        injectSideFrames();
+
         // crank NMEA2000 state machine
+        SCI_TRACE(TRACE_N2K_PARSE_BEGIN, 0);
         NMEA2000.ParseMessages();
+        SCI_TRACE(TRACE_N2K_PARSE_END, 0);
 
-        for(int i = 0; i < m_listenerCount; i++){
-            m_listeners[i]->flush();
-        }
+        DeviceDiagnostics::AddLoopTime(esp_timer_get_time() - loopStart);
+        SCI_TRACE(TRACE_N2K_LOOP_END, 0);
+
+    }
+}
 
+GpsFix N2KHandler::gpsFixFromNmea(const minmea_sentence_rmc &rmc, const minmea_sentence_gga &gga) {
+    GpsFix fix = {};
+    timespec ts = {};
+    if(minmea_gettime(&ts, &rmc.date, &rmc.time) == 0 ) {
+        fix.timeValid = true;
+        fix.daysSince1970 = ts.tv_sec / SEC_IN_DAY;
+        fix.secondsSinceMidnight = fmod(ts.tv_sec + ts.tv_nsec * 1.e-9, SEC_IN_DAY);
     }
+    fix.positionValid = rmc.valid;
+    fix.latitude = minmea_tocoord(&rmc.latitude);
+    fix.longitude = minmea_tocoord(&rmc.longitude);
+    fix.altitude = minmea_tofloat(&gga.altitude);
+    fix.velocityValid = rmc.valid;
+    fix.cogRad = DegToRad(minmea_tofloat(&rmc.course));
+    fix.sogMs = KnotsToms(minmea_tofloat(&rmc.speed));
+    fix.fixQuality = gga.fix_quality;
+    fix.nSatellites = gga.satellites_tracked;
+    fix.hdop = gga.fix_quality ? minmea_tofloat(&gga.hdop) : -1;
+    fix.pdop = -1;
+    return fix;
 }
 
-void N2KHandler::transmitFullGpsData(minmea_sentence_gga gga, uint16_t DaysSince1970) {
+void N2KHandler::transmitFullGpsData(const GpsFix &fix) {
 
-    double SecondsSinceMidnight = gga.time.hours * 3600 + gga.time.minutes * 60 + gga.time.seconds + gga.time.microseconds * 1e-6;
-    double Latitude =  gga.fix_quality ?  minmea_tocoord(&gga.latitude) : N2kDoubleNA;
-    double Longitude = gga.fix_quality ?  minmea_tocoord(&gga.longitude)  : N2kDoubleNA;
-    double Altitude = gga.fix_quality ? minmea_tofloat(&gga.altitude) : N2kDoubleNA;
+    double Latitude =  fix.fixQuality ?  fix.latitude : N2kDoubleNA;
+    double Longitude = fix.fixQuality ?  fix.longitude  : N2kDoubleNA;
+    double Altitude = fix.fixQuality ? fix.altitude : N2kDoubleNA;
     tN2kGNSStype GNSStype = N2kGNSSt_GPS;
-    auto GNSSmethod = (tN2kGNSSmethod) gga.fix_quality;
-    unsigned char nSatellites = gga.satellites_tracked;
-    double HDOP = gga.fix_quality ? minmea_tofloat(&gga.hdop) : N2kDoubleNA;
+    auto GNSSmethod = (tN2kGNSSmethod) fix.fixQuality;
+    double HDOP = fix.hdop >= 0 ? fix.hdop : N2kDoubleNA;
+    double PDOP = fix.pdop >= 0 ? fix.pdop : N2kDoubleNA;
 
     tN2kMsg N2kMsg;
-    SetN2kGNSS(N2kMsg, this->uc_SeqId, DaysSince1970,  SecondsSinceMidnight,
+    SetN2kGNSS(N2kMsg, this->uc_SeqId, fix.daysSince1970,  fix.secondsSinceMidnight,
                Latitude,  Longitude,  Altitude,
                GNSStype,  GNSSmethod,
-               nSatellites,  HDOP);
+               fix.nSatellites,  HDOP, PDOP);
 
     bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
     m_ledBlinker.SetBusState(sentOk);
     ESP_LOGD(TAG, "SetN2kGNSS  %s", sentOk ? "OK" : "Failed");
 }
 
-void N2KHandler::transmitGpsData(const minmea_sentence_rmc &rmc)  {
+void N2KHandler::transmitGpsData(const GpsFix &fix)  {
     tN2kMsg N2kMsg;
-    timespec ts = {};
 
-    // seconds since midnight
     bool wholeSecFrame = true;
     uint16_t systemDate = 0;
 
-    if(minmea_gettime(&ts, &rmc.date, &rmc.time) == 0 ) {
-        wholeSecFrame = ts.tv_nsec == 0;
-        systemDate = ts.tv_sec / SEC_IN_DAY; // Days since 1970-01-01
-        double systemTime = fmod(ts.tv_sec + ts.tv_nsec * 1.e-9, SEC_IN_DAY);
+    if( fix.timeValid ) {
+        wholeSecFrame = llround(fix.secondsSinceMidnight * 1000) % 1000 == 0;
+        systemDate = fix.daysSince1970; // Days since 1970-01-01
+        double systemTime = fix.secondsSinceMidnight;
+        // System time is the time it's sent, the fix is older by the UART, parse and queue latency
+        int64_t utcUs;
+        if ( GpsClock::Now(utcUs) ){
+            int64_t usInDay = SEC_IN_DAY * 1000000LL;
+            systemDate = utcUs / usInDay;
+            systemTime = (utcUs % usInDay) / 1000 * 0.001;
+        }
         SetN2kSystemTime(N2kMsg, this->uc_SeqId, systemDate, systemTime);
         bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
         m_ledBlinker.SetBusState(sentOk);
         ESP_LOGD(TAG, "SetN2kSystemTime date=%d time=%.3f  %s", systemDate, systemTime, sentOk ? "OK" : "Failed");
     }
 
-    double cog = rmc.valid ? DegToRad(minmea_tofloat(&rmc.course)) : N2kDoubleNA;
-    double sog = rmc.valid ? KnotsToms(minmea_tofloat(&rmc.speed)): N2kDoubleNA;
-    SetN2kCOGSOGRapid(N2kMsg, this->uc_SeqId, N2khr_true, cog, sog);
-    bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
-    m_ledBlinker.SetBusState(sentOk);
-    ESP_LOGD(TAG, "SetN2kCOGSOGRapid cog=%.5f sog=%.5f  %s", cog, sog, sentOk ? "OK" : "Failed");
+    if ( fix.timeValid && fix.positionValid && fix.velocityValid ){
+        // 129025 and 129026 go out from s_PosScheduler, advanced from this fix
+        int64_t fixUtcUs = (fix.daysSince1970 * (int64_t)SEC_IN_DAY * 1000 + llround(fix.secondsSinceMidnight * 1000)) * 1000;
+        m_propagator.OnFix(fixUtcUs, fix.latitude, fix.longitude, fix.cogRad, fix.sogMs);
+    }else{
+        m_propagator.Invalidate();
+        SetN2kCOGSOGRapid(N2kMsg, this->uc_SeqId, N2khr_true, N2kDoubleNA, N2kDoubleNA);
+        bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
+        m_ledBlinker.SetBusState(sentOk);
+        ESP_LOGD(TAG, "SetN2kCOGSOGRapid no fix %s", sentOk ? "OK" : "Failed");
+    }
 
     if ( wholeSecFrame ){  // Send full GPS data
-        transmitFullGpsData(m_gga, systemDate);
-        if( rmc.valid) {
+        transmitFullGpsData(fix);
+        if( fix.positionValid) {
             if ( ! m_magDeclComputed ) {
                 double year = systemDate / 365.25 + 1970;
-                m_magDecl = computeMagDecl(minmea_tocoord(&m_gga.latitude), minmea_tocoord(&m_gga.longitude),  year);
+                m_magDecl = computeMagDecl(fix.latitude, fix.longitude,  year);
                 m_magDeclComputed = true;
             }
 
@@ -257,19 +317,65 @@ void N2KHandler::transmitGpsData(const minmea_sentence_rmc &rmc)  {
             double magVar = DegToRad(m_magDecl);
             SetN2kMagneticVariation(N2kMsg, this->uc_SeqId, N2kmagvar_WMM2020, systemDate, magVar);
             N2kMsg.Priority = 6;
-            sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
+            bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
             m_ledBlinker.SetBusState(sentOk);
             ESP_LOGD(TAG, "SetN2kMagneticVariation var=%.5f %s", magVar, sentOk ? "OK" : "Failed");
         }
-    }else {  // Send rapid update
-        double latitude = rmc.valid ? minmea_tocoord(&rmc.latitude) : N2kDoubleNA;
-        double longitude = rmc.valid ? minmea_tocoord(&rmc.longitude) : N2kDoubleNA;
-        SetN2kLatLonRapid(N2kMsg, latitude, longitude);
+    }
+
+}
+
+void N2KHandler::transmitImuData() {
+    // Heading as of now, not as of when the IMU had it
+    double sendHdg = hdg;
+    if ( hdgTimeUs != 0 && !N2kIsNA(rot) ){
+        int64_t ahead = std::min(esp_timer_get_time() - hdgTimeUs, IMU_MAX_PREDICTION_US);
+        sendHdg = NormalizeDeg360(hdg + rot * (double)ahead * 1e-6);
+    }
+
+    tN2kMsg N2kMsg;
+    SetN2kMagneticHeading(N2kMsg, this->uc_SeqId, DegToRad(sendHdg));
+    N2kMsg.Priority = DEFAULT_HDG_TX_PRIO;
+    bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
+    m_ledBlinker.SetBusState(sentOk);
+    BINLOG_D("SetN2kMagneticHeading HDG=%.1f (%.1f)  %s", sendHdg, hdg, sentOk ? "OK" : "Failed");
+
+    if ( !N2kIsNA(rot) ){
+        SetN2kRateOfTurn(N2kMsg, this->uc_SeqId, DegToRad(rot));
+        N2kMsg.Priority = DEFAULT_HDG_TX_PRIO;
         sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
         m_ledBlinker.SetBusState(sentOk);
-        ESP_LOGD(TAG, "SetN2kLatLonRapid lat=%.5f time=%.5f  %s", latitude, longitude, sentOk ? "OK" : "Failed");
+        BINLOG_D("SetN2kRateOfTurn ROT=%.2f  %s", rot, sentOk ? "OK" : "Failed");
+    }
+
+    double localYawRad = N2kDoubleNA;  // Not quite sure what it's supposed to be referenced to. Just don't send it
+    // Use heading sequence id to bin them together
+    SetN2kAttitude(N2kMsg, this->uc_SeqId, localYawRad, DegToRad(pitch), DegToRad(roll));
+    N2kMsg.Priority = DEFAULT_ATTITUDE_TX_PRIO;
+    sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
+    m_ledBlinker.SetBusState(sentOk);
+    BINLOG_D("SetN2kAttitude PITCH=%.0f ROLL=%.0f %s", pitch, roll, sentOk ? "OK" : "Failed");
+}
+
+void N2KHandler::transmitPositionRapid() {
+    int64_t utcUs;
+    PropagatedPosition pos{};
+    if ( !GpsClock::Now(utcUs) || !m_propagator.Propagate(utcUs, pos) ){
+        return;
     }
 
+    tN2kMsg N2kMsg;
+    SetN2kLatLonRapid(N2kMsg, pos.latitude, pos.longitude);
+    bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU);
+    m_ledBlinker.SetBusState(sentOk);
+
+    // No SID for the extrapolated ones, they don't belong to any GNSS epoch
+    unsigned char sid = pos.extrapolated ? 0xFF : this->uc_SeqId;
+    SetN2kCOGSOGRapid(N2kMsg, sid, N2khr_true, pos.cogRad, pos.sogMs);
+    sentOk = NMEA2000.SendMsg(N2kMsg, DEV_IMU) && sentOk;
+    m_ledBlinker.SetBusState(sentOk);
+    ESP_LOGD(TAG, "Position rapid lat=%.6f lon=%.6f cog=%.3f sog=%.2f%s %s", pos.latitude, pos.longitude,
+             pos.cogRad, pos.sogMs, pos.extrapolated ? " extrapolated" : "", sentOk ? "OK" : "Failed");
 }
 
 // *****************************************************************************
@@ -278,6 +384,7 @@ void N2KHandler::OnOpen() {
     // Start schedulers now.
     s_HdgScheduler.UpdateNextTime();
     s_AttScheduler.UpdateNextTime();
+    s_PosScheduler.UpdateNextTime();
 }
 
 N2KTwaiBusAlertListener::N2KTwaiBusAlertListener(QueueHandle_t const &evtQueue, LEDBlinker &ledBlinker)
@@ -299,7 +406,7 @@ void N2KTwaiBusAlertListener::onAlert(uint32_t alerts, bool isError) {
                 .u= {.uiValue = alerts}
 
         };
-        xQueueSend(m_evtQueue, &evt, 0);
+        DeviceDiagnostics::QueueSend(m_evtQueue, &evt);
     }
 }
 
@@ -391,22 +498,30 @@ float N2KHandler::NormalizeDeg180(double deg) {
     return (float)deg;
 }
 
-bool N2KHandler::addBusListener(TwaiBusListener *listener) {
-    // Add listener to the list
-    if (m_listenerCount < MAX_TWAI_LISTENERS) {
-        m_listeners[m_listenerCount++] = listener;
-    }
-
-    return NMEA2000.addBusListener(listener);
+bool N2KHandler::addFrameConsumer(TwaiFrameCursor &cursor) {
+    if ( !m_frameRing.Subscribe(cursor) )
+        return false;
+    DeviceDiagnostics::RegisterFrameConsumer(&cursor);
+    return true;
 }
 
-void N2KHandler::onSideIfcTwaiFrame(unsigned long id, unsigned char len, const unsigned char *buf) {
-    // Send frame to CAN bus
+void N2KHandler::injectSideFrames() {
+    TwaiFrame frames[MAX_SIDE_FRAMES_PER_LOOP];
+    int n = m_sideFrames.Receive(frames, MAX_SIDE_FRAMES_PER_LOOP);
+    if ( n == 0 )
+        return;
+
     // Prevent loopback by suspending side interface
     NMEA2000.SuspendSideInterface(true);
-    NMEA2000.CANSendFrame(id, len, buf, false);
+    for(int i = 0; i < n; i++){
+        // Send frame to CAN bus
+        NMEA2000.CANSendFrame(frames[i].id, frames[i].len, frames[i].data, false);
+        ESP_LOGD(TAG, "CAN< sent %d bytes: id=%08X", frames[i].len, (unsigned)frames[i].id);
+    }
     NMEA2000.SuspendSideInterface(false);
 
-    // Send frame to local NMEA200 stack
-    NMEA2000.InjectSideTwaiFrame(id, len, buf);
+    // Send frames to local NMEA200 stack
+    for(int i = 0; i < n; i++){
+        NMEA2000.InjectSideTwaiFrame(frames[i].id, frames[i].len, frames[i].data);
+    }
 }
@@ -7,6 +7,10 @@
 #include <freertos/task.h>
 #include <freertos/timers.h>
 #include <CustomPgnGroupFunctionHandler.h>
+#include <DeviceDiagnostics.h>
+#include <TwaiFrameRing.h>
+#include <SideFrameQueue.h>
+#include <PositionPropagator.h>
 
 #define ESP32_CAN_TX_PIN GPIO_NUM_32
 #define ESP32_CAN_RX_PIN GPIO_NUM_34
@@ -15,6 +19,7 @@
 #include "NMEA2000_esp32_twai.h"
 #include "LEDBlinker.h"
 #include "minmea.h"
+#include "Event.hpp"
 #include "IMUCalInterface.h"
 
 class N2KTwaiBusAlertListener: public TwaiBusAlertListener{
@@ -65,21 +70,26 @@ enum Cmps12CalState {
 };
 
 static const int IMU_TOUT = 10 * 1000000;
+static const int64_t IMU_MAX_PREDICTION_US = 500000;   // Heading projected with the rate of turn no further
 
 //static const int DEFAULT_IMU_TX_RATE = 200;
 static const int TWAI_TX_QUEUE_LEN = 20;
 
+// Heading, rate of turn and attitude go out with each IMU event, the rates are for the not available ones without IMU
 static const int DEFAULT_HDG_TX_RATE = 200;
 static const unsigned char  DEFAULT_HDG_TX_PRIO = 2;
 
 static const int DEFAULT_ATTITUDE_TX_RATE = 1000;
 static const unsigned char  DEFAULT_ATTITUDE_TX_PRIO = 3;
 
+// 129025 and 129026 dead reckoned between the fixes, 50 to 100 ms
+static const int DEFAULT_POSITION_RAPID_TX_RATE = 100;
+
 static const int SEC_IN_DAY = 24 * 60 * 60;
 
 static const int JAVELIN_COMPASS_MOUNT_OFFSET = 0; // experimental value after installation on Javelin
 
-class N2KHandler : public SideTwaiBusInterface{
+class N2KHandler {
 
     /// Class to handle NMEA Group function commands sent by PGN 126208  for PGN 130902 to send/receive IMU calibration
     class ImuCalGroupFunctionHandler: public CustomPgnGroupFunctionHandler{
@@ -107,19 +117,26 @@ class N2KHandler : public SideTwaiBusInterface{
 public:
     explicit N2KHandler(const xQueueHandle &evtQueue,  LEDBlinker &ledBlinker, IMUCalInterface &imuCalInterface);
     void Start();
-    bool addBusListener(TwaiBusListener *listener);
-    void onSideIfcTwaiFrame(unsigned long id, unsigned char len, const unsigned char *buf) override;
+    /// Bridge reads the frames seen on the bus with this cursor
+    bool addFrameConsumer(TwaiFrameCursor &cursor);
+    /// Bridges post the frames received from their clients to this queue
+    SideFrameQueue &SideFrames() { return m_sideFrames; }
 
     [[noreturn]] void N2KTask();
 
 private:
     void Init();
     static void OnOpen();
+    void injectSideFrames();
+
+    static const int SIDE_FRAME_QUEUE_LEN = 32;
+    static const int MAX_SIDE_FRAMES_PER_LOOP = 16;
 
     const xQueueHandle &m_evtQueue;
     LEDBlinker &m_ledBlinker;
     IMUCalInterface &imuCalInterface;
     ImuCalGroupFunctionHandler m_imuCalGroupFunctionHandler;
+    DiagnosticsGroupFunctionHandler m_diagnosticsGroupFunctionHandler;
     N2KTwaiBusAlertListener m_busListener;
 
     unsigned char uc_SeqId = 0;
@@ -131,13 +148,16 @@ private:
     float hdg=0;
     float pitch=0;
     float roll=0;
+    double rot=N2kDoubleNA;    // deg/s
+    int64_t hdgTimeUs = 0;     // 0 if the IMU doesn't tell
 
     ESP32N2kStream debugStream;
     static tN2kSyncScheduler s_HdgScheduler;
     static tN2kSyncScheduler s_AttScheduler;
+    static tN2kSyncScheduler s_PosScheduler;
 
-    TwaiBusListener *m_listeners[MAX_TWAI_LISTENERS] = {nullptr};
-    int m_listenerCount = 0;
+    TwaiFrameRing m_frameRing;
+    SideFrameQueue m_sideFrames{SIDE_FRAME_QUEUE_LEN};
 
     bool SendImuCalValues() const;
 
@@ -151,11 +171,16 @@ private:
     minmea_sentence_rmc m_rmc = {};
     bool gotRmc = false;
 
+    PositionPropagator m_propagator;
+
     double m_magDecl = 0;
     bool m_magDeclComputed = false;
 
-    void transmitGpsData(const minmea_sentence_rmc &rmc) ;
-    void transmitFullGpsData(minmea_sentence_gga gga, uint16_t DaysSince1970);
+    static GpsFix gpsFixFromNmea(const minmea_sentence_rmc &rmc, const minmea_sentence_gga &gga);
+    void transmitGpsData(const GpsFix &fix) ;
+    void transmitFullGpsData(const GpsFix &fix);
+    void transmitImuData();
+    void transmitPositionRapid();
 
     static float NormalizeDeg360(double deg);
 
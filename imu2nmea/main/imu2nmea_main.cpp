@@ -6,13 +6,19 @@
 #include "Event.hpp"
 #include "IMUHandler.h"
 #include "N2KHandler.h"
+#include "DeviceDiagnostics.h"
+#include "Trace.h"
+#include "BinLog.h"
+#include "BlackBox.h"
 #include "LEDBlinker.h"
 #include "GPSHandler.h"
+#include "GpsClock.h"
 #include "IMU_HWT905Handler.h"
 
 //#define ENABLE_WIFI
 
 //#define ENABLE_BT
+//#define BRIDGE_MESSAGE_MODE  // Bridges send whole N2K messages instead of CAN frames
 
 xQueueHandle evt_queue;   // A queue to handle  send events from sensors to N2K
 
@@ -23,6 +29,12 @@ static const uint8_t CMPS12_i2C_ADDR = 0xC0 >> 1;  //  CMPS12 I2C address
 #define USE_IMU_HWT905
 //#define USE_IMU_CMPS12
 
+//#define GPS_UBX_PVT  // Binary UBX-NAV-PVT instead of NMEA 0183 from the receiver, needs u-blox 7 or newer
+//#define GPS_PPS_GPIO GPIO_NUM_27  // Receiver time pulse wired to this pin, makes GpsClock accurate to microseconds
+// Epoch to the first byte of its output. Without the PPS GpsClock is off by the error of it, behind UTC if it's short.
+// Not measured on this board yet, see "GPS time" in README.md for how to
+#define GPS_EPOCH_LATENCY_US 35000
+
 LEDBlinker ledBlinker(GPIO_NUM_2);
 
 #ifdef USE_IMU_CMPS12
@@ -36,15 +48,19 @@ IMUCalInterface &imuCalInterface = imuHWT905Handler;
 #endif
 
 N2KHandler n2KHandler(evt_queue, ledBlinker, imuCalInterface);
+#ifdef GPS_UBX_PVT
+GPSHandler gpsHandler(evt_queue, 15, 13, UART_NUM_2, GpsProtocol::UBX_PVT);
+#else
 GPSHandler gpsHandler(evt_queue, 15, 13, UART_NUM_2);
+#endif
 
 #ifdef ENABLE_WIFI
-N2kWifi n2kWifi(n2KHandler);
+N2kWifi n2kWifi(n2KHandler.SideFrames());
 #endif
 
 #ifdef ENABLE_BT
 #include "N2kBt.h"
-N2kBt n2kBt(n2KHandler);
+N2kBt n2kBt(n2KHandler.SideFrames());
 #endif
 
 static const char *TAG = "imu2nmea_main";
@@ -55,6 +71,10 @@ extern "C" [[noreturn]] void app_main(void)
 
     // Initialize event queue
     evt_queue = xQueueCreate(10, sizeof(Event));
+    DeviceDiagnostics::RegisterQueue("evt", evt_queue);
+
+    BinLog::Start();
+    BlackBox::Start();
 
 #ifdef ENABLE_WIFI
     //Initialize NVS
@@ -64,17 +84,27 @@ extern "C" [[noreturn]] void app_main(void)
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+#ifdef BRIDGE_MESSAGE_MODE
+    n2kWifi.SetMessageMode(true);
+#endif
     n2kWifi.Start();
-    n2KHandler.addBusListener(&n2kWifi);
+    n2KHandler.addFrameConsumer(n2kWifi.FrameCursor());
 #endif
 
 #ifdef ENABLE_BT
+#ifdef BRIDGE_MESSAGE_MODE
+    n2kBt.SetMessageMode(true);
+#endif
     n2kBt.Start();
-    n2KHandler.addBusListener((TwaiBusListener *)&n2kBt);
+    n2KHandler.addFrameConsumer(n2kBt.FrameCursor());
 #endif
 
     ledBlinker.Start();
     n2KHandler.Start();
+    GpsClock::SetEpochLatency(GPS_EPOCH_LATENCY_US);
+#ifdef GPS_PPS_GPIO
+    GpsClock::StartPps(GPS_PPS_GPIO);
+#endif
     gpsHandler.Start();
 #ifdef USE_IMU_CMPS12
     imuHandler.Start();
@@ -85,6 +115,7 @@ extern "C" [[noreturn]] void app_main(void)
 #endif
 
     while (true) {
+        Trace::PollConsoleCommand();
         vTaskDelay(1000 / portTICK_PERIOD_MS);
     }
 
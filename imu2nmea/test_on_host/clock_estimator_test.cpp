@@ -0,0 +1,127 @@
+#include <iostream>
+#include <random>
+#include <cmath>
+#include <cstdint>
+
+#include "ClockEstimator.h"
+
+// Feeds ClockEstimator with the made up 10 Hz epochs late by the receiver latency and the jitter,
+// with and without the PPS, and checks the UTC it gives against the true one.
+// Usage: clock_estimator_test
+
+static const int64_t LATENCY_US = 35000;      // Epoch to the first byte of its output
+static const double DRIFT = 30e-6;            // Local clock is slow by 30 ppm
+static const int64_t EPOCH_US = 100000;
+
+struct Simulation {
+    std::mt19937 rng{1};
+    int64_t utc0 = 1700000000LL * 1000000;    // UTC at local 0
+    double drift = DRIFT;
+
+    int64_t utcAt(int64_t localUs) const { return utc0 + llround(localUs * (1 + drift)); }
+    int64_t localAt(int64_t utcUs) const { return llround((utcUs - utc0) / (1 + drift)); }
+
+    // Exponential UART and task jitter with the occasional long stall
+    int64_t epochArrival(int64_t utcUs) {
+        std::exponential_distribution<double> jitter(1 / 1500.);
+        int64_t delay = LATENCY_US + (int64_t)jitter(rng);
+        if ( rng() % 20 == 0 ){
+            delay += 15000;
+        }
+        return localAt(utcUs) + delay;
+    }
+    int64_t pulseEdge(int64_t utcUs) {
+        std::normal_distribution<double> jitter(0, 3);
+        return localAt(utcUs) + (int64_t)jitter(rng);
+    }
+};
+
+// Runs the epochs from utc on for the seconds given, returns the worst error over the last 10 seconds
+static int64_t run(ClockEstimator &clock, Simulation &sim, int64_t &utc, int seconds, bool pulses) {
+    int64_t worst = 0;
+    int64_t end = utc + seconds * 1000000LL;
+    for(; utc < end; utc += EPOCH_US){
+        if ( pulses && utc % 1000000 == 0 ){
+            clock.AddPulse(sim.pulseEdge(utc), utc);
+        }
+        int64_t arrival = sim.epochArrival(utc);
+        clock.AddEpoch(arrival, utc);
+
+        // Somebody asks for the time in between the epochs
+        int64_t local = arrival + 40000;
+        int64_t estimate = 0;
+        if ( end - utc <= 10000000 ){
+            int64_t err = clock.ToUtc(local, estimate) ? std::llabs(estimate - sim.utcAt(local)) : INT64_MAX;
+            worst = std::max(worst, err);
+        }
+    }
+    return worst;
+}
+
+static bool check(const char *what, bool ok) {
+    std::cout << what << (ok ? " OK" : " FAILED") << std::endl;
+    return ok;
+}
+
+int main() {
+    bool ok = true;
+
+    {
+        // Latency known from the receiver, no PPS
+        Simulation sim;
+        ClockEstimator clock;
+        clock.SetEpochLatency(LATENCY_US);
+        int64_t utc = sim.utc0 + 5 * 1000000;
+        int64_t worst = run(clock, sim, utc, 60, false);
+        std::cout << "Epochs: worst error " << worst << " us, drift " << clock.DriftPpm() << " ppm" << std::endl;
+        ok &= check("Epochs within 1 ms", worst < 1000);
+        ok &= check("Drift within 5 ppm", std::fabs(clock.DriftPpm() - DRIFT * 1e6) < 5);
+    }
+
+    {
+        // Latency set wrong or not at all: the epochs alone can't tell, the time is off by the error of it
+        for(int64_t setUs : {LATENCY_US - 10000, (int64_t)0}){
+            Simulation sim;
+            ClockEstimator clock;
+            clock.SetEpochLatency(setUs);
+            int64_t utc = sim.utc0 + 5 * 1000000;
+            int64_t worst = run(clock, sim, utc, 60, false);
+            int64_t bound = LATENCY_US - setUs + 1000;
+            std::cout << "Epochs, latency set to " << setUs << " us: worst error " << worst << " us" << std::endl;
+            ok &= check("Epochs within 1 ms plus the latency error", worst < bound && worst > bound - 2000);
+        }
+    }
+
+    {
+        // PPS, the latency is learned from it and used once the pulses stop
+        Simulation sim;
+        ClockEstimator clock;
+        int64_t utc = sim.utc0 + 5 * 1000000;
+        int64_t worst = run(clock, sim, utc, 60, true);
+        std::cout << "Pulses: worst error " << worst << " us, drift " << clock.DriftPpm() << " ppm, latency "
+                  << clock.EpochLatencyUs() << " us" << std::endl;
+        ok &= check("Pulses within 50 us", worst < 50);
+        ok &= check("Latency learned within 1 ms", std::llabs(clock.EpochLatencyUs() - LATENCY_US) < 1000);
+
+        worst = run(clock, sim, utc, 60, false);
+        std::cout << "Pulses lost: worst error " << worst << " us" << std::endl;
+        ok &= check("Back to the epochs within 1 ms", worst < 1000);
+    }
+
+    {
+        // Receiver reset with the wrong time, then the right one again
+        Simulation sim;
+        ClockEstimator clock;
+        clock.SetEpochLatency(LATENCY_US);
+        int64_t utc = sim.utc0 + 5 * 1000000;
+        run(clock, sim, utc, 20, false);
+        sim.utc0 += 2 * 1000000;
+        utc += 2 * 1000000;
+        int64_t worst = run(clock, sim, utc, 40, false);
+        std::cout << "Time jump: " << clock.Resets() << " resets, worst error " << worst << " us" << std::endl;
+        ok &= check("Relearned after the jump", clock.Resets() == 1 && worst < 1000);
+    }
+
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
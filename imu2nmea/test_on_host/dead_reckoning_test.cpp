@@ -0,0 +1,177 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstdint>
+
+#include "PositionPropagator.h"
+
+// Checks PositionPropagator against the track: propagated positions between the fixes against the true ones,
+// and against simply holding the last fix.
+// Usage: dead_reckoning_test [track.csv [fix_every_n]]
+// The track is CSV of time_s,lat_deg,lon_deg,sog_ms,cog_deg,heading_deg rows, e.g. logged 10 Hz NAV-PVT with
+// the compass. Every n-th row (5 by default) is the fix, the rows in between are what the propagator is checked on.
+// Without the track the boat sails straight, circles and sails straight again.
+
+static const double EARTH_RADIUS_M = 6371008.8;
+static const double DEG_TO_RAD = M_PI / 180;
+
+struct TrackPoint {
+    int64_t timeUs;
+    double latitude;
+    double longitude;
+    double sogMs;
+    double cogRad;
+    double headingRad;
+};
+
+static double distanceM(double lat1, double lon1, double lat2, double lon2) {
+    double north = (lat2 - lat1) * DEG_TO_RAD * EARTH_RADIUS_M;
+    double east = (lon2 - lon1) * DEG_TO_RAD * EARTH_RADIUS_M * std::cos(lat1 * DEG_TO_RAD);
+    return std::hypot(north, east);
+}
+
+// 3 m/s with 5 deg of leeway, 1 ms steps, 100 Hz points
+static std::vector<TrackPoint> makeTrack() {
+    std::vector<TrackPoint> track;
+    double lat = 37.8, lon = -122.4;
+    double heading = 30 * DEG_TO_RAD;
+    const double leeway = 5 * DEG_TO_RAD;
+    const double speed = 3;
+    int64_t t0 = 1700000000LL * 1000000;
+    for(int ms = 0; ms <= 80000; ms++){
+        double s = ms * 0.001;
+        double rate = s > 20 && s < 50 ? 6 * DEG_TO_RAD : 0;   // Full circle and a quarter
+        if ( ms % 10 == 0 ){
+            track.push_back({t0 + ms * 1000LL, lat, lon, speed, std::remainder(heading + leeway, 2 * M_PI), heading});
+        }
+        double cog = heading + leeway;
+        lat += speed * 0.001 * std::cos(cog) / EARTH_RADIUS_M / DEG_TO_RAD;
+        lon += speed * 0.001 * std::sin(cog) / (EARTH_RADIUS_M * std::cos(lat * DEG_TO_RAD)) / DEG_TO_RAD;
+        heading += rate * 0.001;
+    }
+    return track;
+}
+
+static bool readTrack(const char *path, std::vector<TrackPoint> &track) {
+    std::ifstream in(path);
+    if ( !in ){
+        return false;
+    }
+    std::string line;
+    while ( std::getline(in, line) ){
+        double t, lat, lon, sog, cog, hdg;
+        char c;
+        std::istringstream row(line);
+        if ( row >> t >> c >> lat >> c >> lon >> c >> sog >> c >> cog >> c >> hdg ){
+            track.push_back({(int64_t)llround(t * 1e6), lat, lon, sog, cog * DEG_TO_RAD, hdg * DEG_TO_RAD});
+        }
+    }
+    return !track.empty();
+}
+
+struct Result {
+    double rms = 0;
+    double max = 0;
+    double holdRms = 0;     // Last fix held till the next one
+    double maxStepError = 0;  // Largest jump between the outputs beyond the distance sailed
+    bool flagsOk = true;
+};
+
+static Result replay(const std::vector<TrackPoint> &track, int fixEvery, double fixNoiseM, double headingNoiseDeg) {
+    std::mt19937 rng(1);
+    std::normal_distribution<double> posNoise(0, fixNoiseM);
+    std::normal_distribution<double> hdgNoise(0, headingNoiseDeg * DEG_TO_RAD);
+
+    PositionPropagator propagator;
+    Result r;
+    double sum = 0, holdSum = 0;
+    int n = 0;
+    const TrackPoint *lastFix = nullptr;
+    PropagatedPosition prev{};
+    bool hasPrev = false;
+    int64_t prevTime = 0;
+
+    for(size_t i = 0; i < track.size(); i++){
+        const TrackPoint &p = track[i];
+        propagator.OnHeading(p.timeUs, p.headingRad + hdgNoise(rng));
+        bool isFix = i % fixEvery == 0;
+        if ( isFix ){
+            double lat = p.latitude + posNoise(rng) / EARTH_RADIUS_M / DEG_TO_RAD;
+            double lon = p.longitude + posNoise(rng) / EARTH_RADIUS_M / DEG_TO_RAD;
+            propagator.OnFix(p.timeUs, lat, lon, p.cogRad, p.sogMs);
+            lastFix = &p;
+        }
+
+        PropagatedPosition out{};
+        if ( lastFix == nullptr || !propagator.Propagate(p.timeUs, out) ){
+            continue;
+        }
+        if ( out.extrapolated != (p.timeUs - lastFix->timeUs > PositionPropagator::EXTRAPOLATED_AFTER_US) ){
+            r.flagsOk = false;
+        }
+        if ( hasPrev ){
+            double sailed = p.sogMs * (double)(p.timeUs - prevTime) * 1e-6;
+            double step = distanceM(prev.latitude, prev.longitude, out.latitude, out.longitude);
+            r.maxStepError = std::max(r.maxStepError, std::fabs(step - sailed));
+        }
+        prev = out;
+        prevTime = p.timeUs;
+        hasPrev = true;
+
+        if ( !isFix ){
+            double err = distanceM(p.latitude, p.longitude, out.latitude, out.longitude);
+            double holdErr = distanceM(p.latitude, p.longitude, lastFix->latitude, lastFix->longitude);
+            sum += err * err;
+            holdSum += holdErr * holdErr;
+            r.max = std::max(r.max, err);
+            n++;
+        }
+    }
+    r.rms = n > 0 ? std::sqrt(sum / n) : 0;
+    r.holdRms = n > 0 ? std::sqrt(holdSum / n) : 0;
+    return r;
+}
+
+static void print(const char *what, const Result &r) {
+    std::cout << what << ": error rms " << r.rms << " m, max " << r.max << " m, holding the fix rms " << r.holdRms
+              << " m, largest step error " << r.maxStepError << " m" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    bool ok = true;
+
+    if ( argc > 1 ){
+        std::vector<TrackPoint> track;
+        if ( !readTrack(argv[1], track) ){
+            std::cout << "Can't read " << argv[1] << std::endl;
+            return 1;
+        }
+        int fixEvery = argc > 2 ? atoi(argv[2]) : 5;
+        Result r = replay(track, fixEvery, 0, 0);
+        print(argv[1], r);
+        ok = r.rms < r.holdRms && r.flagsOk;
+    }else{
+        std::vector<TrackPoint> track = makeTrack();
+
+        // 5 Hz fixes and 100 Hz outputs, exact data
+        Result r = replay(track, 20, 0, 0);
+        print("5 Hz fixes", r);
+        ok &= r.max < 0.05 && r.flagsOk;
+
+        // Noisy fixes and compass: no jumps from the corrections
+        r = replay(track, 20, 0.3, 0.5);
+        print("5 Hz noisy fixes", r);
+        ok &= r.rms < 0.5 && r.rms < r.holdRms / 2 && r.maxStepError < 0.2 && r.flagsOk;
+
+        // 1 Hz fixes, the heading carries the circle
+        r = replay(track, 100, 0.3, 0.5);
+        print("1 Hz noisy fixes", r);
+        ok &= r.rms < 1 && r.rms < r.holdRms / 2 && r.flagsOk;
+    }
+
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,298 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstring>
+
+#include "GnssFramer.h"
+
+// Compares the single pass UBX/NMEA framer with the byte at a time UBX parser and the line accumulator it replaced.
+// Usage: gnss_framer_benchmark [capture_file]
+// Without the capture the stream of NMEA sentences, UBX frames, junk and broken checksums is made up.
+
+static const int UART_READ_SIZE = 120;  // Bytes the UART task gets at a time at 9600 baud
+
+// What came out of the stream, same form for both implementations
+struct Collector : public GnssFramer::Handler {
+    std::vector<std::string> frames;
+    void onUbxFrame(uint8_t cls, uint8_t id, const uint8_t *payload, uint16_t len) override {
+        std::string s = "UBX ";
+        s += (char)cls;
+        s += (char)id;
+        s.append((const char *)payload, len);
+        frames.push_back(s);
+    }
+    void onNmeaSentence(const char *sentence, int len) override {
+        if ( (int)strlen(sentence) != len ){
+            frames.emplace_back("NOT TERMINATED");
+        }
+        frames.emplace_back(sentence, len);
+    }
+};
+
+static bool nmeaChecksumOk(const std::string &line) {
+    // The checksum check minmea did on the accumulated line
+    size_t star = line.find('*');
+    if ( line.size() < 2 || line[0] != '$' || star == std::string::npos || star + 3 != line.size() ){
+        return false;
+    }
+    uint8_t sum = 0;
+    for(size_t i = 1; i < star; i++){
+        sum ^= (uint8_t)line[i];
+    }
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02X", sum);
+    return strncasecmp(hex, line.c_str() + star + 1, 2) == 0;
+}
+
+// Byte at a time UBX state machine and NMEA line accumulator as they were before, every byte goes to both
+class ByteGnssParser {
+public:
+    explicit ByteGnssParser(GnssFramer::Handler &handler) : handler(handler) {}
+    void __attribute__((noinline)) Process(const uint8_t *buf, int len) {
+        for(int i = 0; i < len; i++){
+            ubxByte(buf[i]);
+        }
+        for(int i = 0; i < len; i++){
+            nmeaByte(buf[i]);
+        }
+    }
+private:
+    enum State { START, GOT_START, GOT_CLASS, GOT_ID, GOT_LEN1, GOT_LEN2, GOT_CK_A };
+
+    void ubxByte(uint8_t b) {
+        switch (state) {
+            case START:
+                if ( b == 0x62 && prev == 0xB5 ){
+                    state = GOT_START;
+                    head = 0;
+                }
+                break;
+            case GOT_START: cls = b; state = GOT_CLASS; break;
+            case GOT_CLASS: id = b; state = GOT_ID; break;
+            case GOT_ID: length = b; state = GOT_LEN1; break;
+            case GOT_LEN1:
+                length |= b << 8;
+                state = length > BUFFER_SIZE ? START : GOT_LEN2;
+                if ( length == 0 && state == GOT_LEN2 ){
+                    state = GOT_CK_A;
+                }
+                break;
+            case GOT_LEN2:
+                payload[head++] = b;
+                if ( head == length ){
+                    state = GOT_CK_A;
+                }
+                break;
+            case GOT_CK_A:
+                ckA = b;
+                state = (State)(GOT_CK_A + 1);
+                break;
+            default: {
+                uint8_t a = 0, c = 0;
+                uint8_t hdr[4] = {cls, id, (uint8_t)length, (uint8_t)(length >> 8)};
+                for(uint8_t h : hdr){ a += h; c += a; }
+                for(int i = 0; i < length; i++){ a += payload[i]; c += a; }
+                if ( a == ckA && c == b ){
+                    handler.onUbxFrame(cls, id, payload, length);
+                }
+                state = START;
+            }
+        }
+        prev = b;
+    }
+
+    void nmeaByte(uint8_t ch) {
+        if ( ch == '\r' ){
+            line[lineIdx] = '\0';
+            std::string s(line);
+            if ( nmeaChecksumOk(s) ){
+                handler.onNmeaSentence(line, lineIdx);
+            }
+        }else if ( ch == '$' ){
+            lineIdx = 0;
+            line[lineIdx++] = (char)ch;
+        }else if ( lineIdx < (int)sizeof(line) - 1 ){
+            line[lineIdx++] = (char)ch;
+        }else{
+            lineIdx = 0;
+        }
+    }
+
+    GnssFramer::Handler &handler;
+    State state = START;
+    uint8_t prev = 0;
+    uint8_t cls = 0, id = 0, ckA = 0;
+    uint16_t length = 0;
+    int head = 0;
+    uint8_t payload[BUFFER_SIZE]{};
+    char line[GnssFramer::NMEA_MAX_LEN]{};
+    int lineIdx = 0;
+};
+
+static void appendNmea(std::vector<uint8_t> &out, const std::string &body, bool corrupt) {
+    uint8_t sum = 0;
+    for(char c : body){
+        sum ^= (uint8_t)c;
+    }
+    char tail[8];
+    snprintf(tail, sizeof(tail), "*%02X\r\n", corrupt ? sum ^ 0x10 : sum);
+    out.push_back('$');
+    out.insert(out.end(), body.begin(), body.end());
+    out.insert(out.end(), tail, tail + strlen(tail));
+}
+
+static void appendUbx(std::vector<uint8_t> &out, uint8_t cls, uint8_t id, const std::vector<uint8_t> &payload,
+                      bool corrupt) {
+    size_t start = out.size();
+    out.push_back(0xB5);
+    out.push_back(0x62);
+    out.push_back(cls);
+    out.push_back(id);
+    out.push_back(payload.size() & 0xFF);
+    out.push_back(payload.size() >> 8);
+    out.insert(out.end(), payload.begin(), payload.end());
+    uint8_t a = 0, b = 0;
+    for(size_t i = start + 2; i < out.size(); i++){
+        a += out[i];
+        b += a;
+    }
+    out.push_back(corrupt ? a + 1 : a);
+    out.push_back(b);
+}
+
+// One second of the receiver output repeated, random UBX payloads, some junk and some broken checksums
+static std::vector<uint8_t> makeStream(int seconds) {
+    std::mt19937 rng(1);
+    std::vector<uint8_t> out;
+    for(int s = 0; s < seconds; s++){
+        bool corrupt = s % 7 == 3;
+        appendNmea(out, "GPRMC,081836.00,A,3751.65,S,14507.36,E,000.0,360.0,130998,011.3,E,A", false);
+        appendNmea(out, "GPGGA,081836.00,3751.65,S,14507.36,E,1,05,1.5,280.2,M,-34.0,M,,", corrupt);
+        appendNmea(out, "GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1", false);
+
+        std::vector<uint8_t> pvt(92);
+        for(auto &b : pvt){
+            b = (uint8_t)rng();
+        }
+        appendUbx(out, 0x01, 0x07, pvt, s % 5 == 2);
+        appendUbx(out, 0x05, 0x01, {0x06, 0x01}, false);
+        if ( s % 3 == 0 ){
+            // Junk between the frames, e.g. after the baud rate change, no start bytes or line ends in it
+            for(int i = 0; i < 17; i++){
+                uint8_t b = (uint8_t)('A' + rng() % 26);
+                out.push_back(b);
+            }
+        }
+        appendNmea(out, "GPVTG,360.0,T,348.7,M,000.0,N,000.0,K,A", false);
+    }
+    return out;
+}
+
+static std::vector<std::string> runFramer(const std::vector<uint8_t> &stream, int chunk, bool printStats = false) {
+    Collector collector;
+    auto *framer = new GnssFramer(collector);
+    std::vector<uint8_t> buf(stream);  // Process() writes the NUL terminators
+    for(size_t pos = 0; pos < buf.size(); pos += chunk){
+        int n = (int)std::min(buf.size() - pos, (size_t)chunk);
+        framer->Process(buf.data() + pos, n);
+    }
+    if ( printStats ){
+        std::cout << stream.size() << " bytes: " << framer->UbxFrames() << " UBX frames, "
+                  << framer->NmeaSentences() << " NMEA sentences, " << framer->ChecksumErrors()
+                  << " checksum errors, " << framer->FramingErrors() << " framing errors" << std::endl;
+    }
+    delete framer;
+    return collector.frames;
+}
+
+static std::vector<std::string> runByteParser(const std::vector<uint8_t> &stream, int chunk) {
+    Collector collector;
+    auto *parser = new ByteGnssParser(collector);
+    for(size_t pos = 0; pos < stream.size(); pos += chunk){
+        int n = (int)std::min(stream.size() - pos, (size_t)chunk);
+        parser->Process(stream.data() + pos, n);
+    }
+    delete parser;
+    return collector.frames;
+}
+
+static bool checkSplits(const std::vector<uint8_t> &stream, const std::vector<std::string> &whole) {
+    // Every two way split of the start of the stream, then every chunk size up to the longest frame
+    size_t prefix = std::min(stream.size(), (size_t)2048);
+    std::vector<uint8_t> head(stream.begin(), stream.begin() + prefix);
+    std::vector<std::string> expected = runFramer(head, (int)prefix);
+    for(size_t cut = 1; cut < prefix; cut++){
+        Collector collector;
+        GnssFramer framer(collector);
+        std::vector<uint8_t> buf(head);
+        framer.Process(buf.data(), (int)cut);
+        framer.Process(buf.data() + cut, (int)(prefix - cut));
+        if ( collector.frames != expected ){
+            std::cout << "Split at " << cut << " gives different frames" << std::endl;
+            return false;
+        }
+    }
+    for(int chunk = 1; chunk <= GnssFramer::UBX_MAX_FRAME_LEN; chunk += chunk < 64 ? 1 : 61){
+        if ( runFramer(stream, chunk) != whole ){
+            std::cout << "Reading by " << chunk << " bytes gives different frames" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    std::vector<uint8_t> stream;
+    if ( argc > 1 ){
+        std::ifstream in(argv[1], std::ios::binary);
+        if ( !in ){
+            std::cout << "Can't open " << argv[1] << std::endl;
+            return 1;
+        }
+        stream.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }else{
+        stream = makeStream(3600);
+    }
+
+    auto frames = runFramer(stream, UART_READ_SIZE, true);
+
+    bool ok = checkSplits(stream, frames);
+    // The old parser ran the whole read through the UBX parser first, so only the order within each kind matters
+    auto reference = runByteParser(stream, UART_READ_SIZE);
+    for(bool ubx : {true, false}){
+        std::vector<std::string> expected, got;
+        for(auto &f : reference){
+            if ( (f.compare(0, 4, "UBX ") == 0) == ubx ) expected.push_back(f);
+        }
+        for(auto &f : frames){
+            if ( (f.compare(0, 4, "UBX ") == 0) == ubx ) got.push_back(f);
+        }
+        if ( expected != got ){
+            std::cout << "Byte at a time parser found " << expected.size() << (ubx ? " UBX frames" : " NMEA sentences")
+                      << ", the framer " << got.size() << std::endl;
+            ok = false;
+        }
+    }
+
+    const int REPEAT = 20;
+    auto t0 = std::chrono::steady_clock::now();
+    for(int r = 0; r < REPEAT; r++){
+        runByteParser(stream, UART_READ_SIZE);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for(int r = 0; r < REPEAT; r++){
+        runFramer(stream, UART_READ_SIZE);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    double mb = (double)stream.size() * REPEAT / 1e6;
+    double byteSec = std::chrono::duration<double>(t1 - t0).count();
+    double framerSec = std::chrono::duration<double>(t2 - t1).count();
+    std::cout << "Byte at a time: " << mb / byteSec << " MB/s" << std::endl;
+    std::cout << "Framer:         " << mb / framerSec << " MB/s" << std::endl;
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
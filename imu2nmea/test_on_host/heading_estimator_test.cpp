@@ -0,0 +1,232 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstdint>
+
+#include "ImuDecimator.h"
+#include "HeadingEstimator.h"
+#include "CompassLagEstimator.h"
+
+// Replays the IMU stream through the compass only path (ImuDecimator, as IMU_HWT905Handler did before) and through
+// HeadingEstimator with the projection to the send time, and measures how late the heading on the bus is.
+// The compass lag is learned by CompassLagEstimator from the stream, starting from the value the handlers start with.
+// Usage: heading_estimator_test [imu.csv [compass_lag_ms]]
+// The stream is CSV of time_s,heading_deg,gyro_z_dps rows at the sensor rate, e.g. logged HWT905 output.
+// It has no truth, so the reference is the recorded heading smoothed without the delay and moved earlier by the
+// compass lag, the given one or the learned one. Without the stream the boat tacks every 20 s, 40 deg/s at most,
+// with the waves yawing it, and the compass lags by STREAM_COMPASS_LAG_US the estimators aren't told about.
+
+static const int SAMPLE_RATE_HZ = 100;
+static const int OUTPUT_RATE_HZ = 10;
+static const int64_t SEND_DELAY_US = 5000;      // Queue to N2KHandler and the send
+static const int64_t START_LAG_US = 50000;      // HWT_COMPASS_LAG_US
+static const int64_t STREAM_COMPASS_LAG_US = 80000;
+
+struct ImuRow {
+    int64_t timeUs;
+    double hdg;
+    double rot;
+};
+
+// Heading as the bus sees it: when it was sent and what it was
+struct BusHeading {
+    int64_t timeUs;
+    double hdg;
+};
+
+static double wrapDiff(double a, double b) {
+    return std::remainder(a - b, 360.0);
+}
+
+// Tack from 45 to 315 and back, smoothstep profile over 4 s
+static double trueHeading(double t, double &rate) {
+    double period = 20, turn = 4, angle = -90;
+    double phase = std::fmod(t, period);
+    int n = (int)(t / period);
+    double start = n % 2 == 0 ? 45 : -45;
+    double sign = n % 2 == 0 ? 1 : -1;
+    double hdg = start, r = 0;
+    if ( phase > period - turn ){
+        double x = (phase - (period - turn)) / turn;
+        hdg = start + sign * angle * (3 * x * x - 2 * x * x * x);
+        r = sign * angle * (6 * x - 6 * x * x) / turn;
+    }
+    // Waves
+    double w = 2 * M_PI * 0.3;
+    hdg += 3 * sin(w * t);
+    r += 3 * w * cos(w * t);
+    rate = r;
+    return std::fmod(hdg + 720, 360);
+}
+
+static std::vector<ImuRow> makeStream(double compassLagSec, std::vector<double> &truth) {
+    std::mt19937 rng(1);
+    std::normal_distribution<double> hdgNoise(0, 0.5);
+    std::normal_distribution<double> gyroNoise(0, 0.3);
+    const double bias = 0.7;
+    std::vector<ImuRow> rows;
+    for(int i = 0; i < SAMPLE_RATE_HZ * 300; i++){
+        double t = (double)i / SAMPLE_RATE_HZ;
+        double rate, lagRate;
+        truth.push_back(trueHeading(t, rate));
+        double hdg = trueHeading(t - compassLagSec, lagRate);
+        rows.push_back({(int64_t)i * 1000000 / SAMPLE_RATE_HZ, std::fmod(hdg + hdgNoise(rng) + 360, 360),
+                        rate + bias + gyroNoise(rng)});
+    }
+    return rows;
+}
+
+static bool readStream(const char *path, std::vector<ImuRow> &rows) {
+    std::ifstream in(path);
+    std::string line;
+    while ( std::getline(in, line) ){
+        double t, hdg, rot;
+        char c;
+        std::istringstream row(line);
+        if ( row >> t >> c >> hdg >> c >> rot ){
+            rows.push_back({(int64_t)llround(t * 1e6), hdg, rot});
+        }
+    }
+    return !rows.empty();
+}
+
+// Recorded heading smoothed over 0.2 s both ways and moved earlier by the compass lag
+static std::vector<double> makeReference(const std::vector<ImuRow> &rows, int lagSamples) {
+    std::vector<double> unwrapped(rows.size());
+    for(size_t i = 0; i < rows.size(); i++){
+        unwrapped[i] = i == 0 ? rows[0].hdg : unwrapped[i - 1] + wrapDiff(rows[i].hdg, rows[i - 1].hdg);
+    }
+    const int half = SAMPLE_RATE_HZ / 10;
+    std::vector<double> ref(rows.size());
+    for(size_t i = 0; i < rows.size(); i++){
+        size_t from = i > (size_t)half ? i - half : 0, to = std::min(rows.size() - 1, i + half);
+        double sum = 0;
+        for(size_t j = from; j <= to; j++){
+            sum += unwrapped[j];
+        }
+        size_t at = i >= (size_t)lagSamples ? i - lagSamples : 0;
+        ref[at] = sum / (double)(to - from + 1);
+    }
+    return ref;
+}
+
+static std::vector<BusHeading> runDecimator(const std::vector<ImuRow> &rows) {
+    ImuDecimator decimator(SAMPLE_RATE_HZ, OUTPUT_RATE_HZ);
+    std::vector<BusHeading> bus;
+    for(auto &r : rows){
+        ImuSample out{};
+        if ( decimator.Add({(float)r.hdg, 0, 0, (float)r.rot}, out) ){
+            bus.push_back({r.timeUs + SEND_DELAY_US, out.hdg});
+        }
+    }
+    return bus;
+}
+
+// The lag is learned unless it's given
+static std::vector<BusHeading> runEstimator(const std::vector<ImuRow> &rows, int64_t givenLagUs, double &bias,
+                                            CompassLagEstimator &lag) {
+    HeadingEstimator estimator;
+    std::vector<BusHeading> bus;
+    int n = 0;
+    for(auto &r : rows){
+        estimator.AddRate(r.timeUs, (float)r.rot);
+        lag.AddRate(r.timeUs, (float)r.rot);
+        lag.AddHeading(r.timeUs, (float)r.hdg);
+        estimator.AddHeading(r.timeUs - (givenLagUs >= 0 ? givenLagUs : lag.LagUs()), (float)r.hdg);
+        if ( ++n % (SAMPLE_RATE_HZ / OUTPUT_RATE_HZ) == 0 && estimator.Valid() ){
+            int64_t sendUs = r.timeUs + SEND_DELAY_US;
+            bus.push_back({sendUs, estimator.Predict(sendUs)});
+        }
+    }
+    bias = estimator.Bias();
+    return bus;
+}
+
+// RMS error against the reference at the send time, and the delay of the reference that fits the bus best
+static void measure(const std::vector<BusHeading> &bus, const std::vector<double> &ref, double &rms, double &latencyMs) {
+    auto refAt = [&ref](int64_t timeUs) {
+        double idx = (double)timeUs * SAMPLE_RATE_HZ * 1e-6;
+        auto i = (size_t)std::min(std::max(idx, 0.0), (double)ref.size() - 2);
+        double f = std::min(idx - (double)i, 1.0);
+        return ref[i] + (ref[i + 1] - ref[i]) * f;
+    };
+    auto rmsAtLag = [&](int64_t lagUs) {
+        double sum = 0;
+        int n = 0;
+        for(auto &b : bus){
+            if ( b.timeUs < 5000000 ) continue;     // Settling
+            double e = wrapDiff(b.hdg, refAt(b.timeUs - lagUs));
+            sum += e * e;
+            n++;
+        }
+        return std::sqrt(sum / std::max(n, 1));
+    };
+    rms = rmsAtLag(0);
+    double best = rms;
+    latencyMs = 0;
+    for(int64_t lagUs = -100000; lagUs <= 400000; lagUs += 2000){
+        double r = rmsAtLag(lagUs);
+        if ( r < best ){
+            best = r;
+            latencyMs = (double)lagUs / 1000;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<ImuRow> rows;
+    std::vector<double> ref;
+    int64_t givenLagUs = -1;
+    int64_t referenceLagUs = STREAM_COMPASS_LAG_US;
+    if ( argc > 1 ){
+        if ( !readStream(argv[1], rows) ){
+            std::cout << "Can't read " << argv[1] << std::endl;
+            return 1;
+        }
+        if ( argc > 2 ){
+            givenLagUs = atoi(argv[2]) * 1000LL;
+        }
+        int64_t t0 = rows[0].timeUs;
+        for(auto &r : rows){
+            r.timeUs -= t0;
+        }
+        if ( givenLagUs >= 0 ){
+            referenceLagUs = givenLagUs;
+        }else{
+            // The lag learned over the whole stream
+            CompassLagEstimator lag(START_LAG_US);
+            double unused;
+            runEstimator(rows, -1, unused, lag);
+            referenceLagUs = lag.LagUs();
+        }
+        ref = makeReference(rows, (int)(referenceLagUs * SAMPLE_RATE_HZ / 1000000));
+    }else{
+        rows = makeStream((double)STREAM_COMPASS_LAG_US * 1e-6, ref);
+        for(auto &h : ref){
+            // Unwrapped, like the recorded reference
+            h = &h == &ref[0] ? h : *(&h - 1) + wrapDiff(h, *(&h - 1));
+        }
+    }
+
+    double bias = 0;
+    double oldRms, oldLatency, newRms, newLatency;
+    CompassLagEstimator lag(START_LAG_US);
+    measure(runDecimator(rows), ref, oldRms, oldLatency);
+    measure(runEstimator(rows, givenLagUs, bias, lag), ref, newRms, newLatency);
+    std::cout << "Compass decimated:  error rms " << oldRms << " deg, latency " << oldLatency << " ms" << std::endl;
+    std::cout << "Gyro aided:         error rms " << newRms << " deg, latency " << newLatency << " ms, gyro bias "
+              << bias << " deg/s" << std::endl;
+    std::cout << "Compass lag:        " << (double)lag.LagUs() / 1000 << " ms learned from " << lag.Windows()
+              << " turning windows" << (lag.Valid() ? "" : ", too few, the starting value") << std::endl;
+
+    bool ok = newRms < oldRms && std::fabs(newLatency) < oldLatency / 4;
+    if ( argc == 1 ){
+        ok &= std::fabs(bias - 0.7) < 0.1 && std::fabs(newLatency) < 10 && newRms < 1;
+        ok &= lag.Valid() && std::llabs(lag.LagUs() - STREAM_COMPASS_LAG_US) < 10000;
+    }
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <cmath>
+
+#include "ImuDecimator.h"
+
+// Checks ImuDecimator on the boat rolling with the engine vibration on top: the decimated output against the true
+// motion delayed by DelayUs(), and against taking the last sample at the output rate as N2KHandler did.
+
+static const int SAMPLE_RATE_HZ = 100;
+static const int OUTPUT_RATE_HZ = 10;
+
+static double angleDiff(double a, double b) {
+    return std::remainder(a - b, 360.0);
+}
+
+// Heading swings through north, the roll is the swell, the vibration is 23 Hz and aliases to 3 Hz at 10 Hz
+static ImuSample motion(double t, bool vibration) {
+    double w = 2 * M_PI * 0.1;
+    double vib = vibration ? sin(2 * M_PI * 23 * t) : 0;
+    ImuSample s{};
+    s.hdg = (float)std::fmod(360 + 355 + 20 * sin(w * t) + 1.5 * vib, 360);
+    s.pitch = (float)(2 * sin(2 * M_PI * 0.15 * t) + 1.0 * vib);
+    s.roll = (float)(10 * sin(2 * M_PI * 0.2 * t) + 3.0 * vib);
+    s.rot = (float)(20 * w * cos(w * t) + 5.0 * vib);
+    return s;
+}
+
+struct Errors {
+    double hdg = 0;
+    double roll = 0;
+    double rot = 0;
+};
+
+int main() {
+    ImuDecimator decimator(SAMPLE_RATE_HZ, OUTPUT_RATE_HZ);
+    double delay = decimator.DelayUs() * 1e-6;
+    std::cout << "Factor " << decimator.Factor() << ", delay " << delay * 1000 << " ms" << std::endl;
+
+    Errors filtered, last;
+    int n = 0;
+    bool wrapOk = true;
+    for(int i = 0; i < SAMPLE_RATE_HZ * 120; i++){
+        double t = (double)i / SAMPLE_RATE_HZ;
+        ImuSample in = motion(t, true);
+        ImuSample out{};
+        if ( !decimator.Add(in, out) || t < 5 ){
+            continue;
+        }
+        if ( out.hdg < 0 || out.hdg >= 360 ){
+            wrapOk = false;
+        }
+        ImuSample truthDelayed = motion(t - delay, false);
+        ImuSample truth = motion(t, false);
+        filtered.hdg = std::max(filtered.hdg, std::fabs(angleDiff(out.hdg, truthDelayed.hdg)));
+        filtered.roll = std::max(filtered.roll, (double)std::fabs(out.roll - truthDelayed.roll));
+        filtered.rot = std::max(filtered.rot, (double)std::fabs(out.rot - truthDelayed.rot));
+        last.hdg = std::max(last.hdg, std::fabs(angleDiff(in.hdg, truth.hdg)));
+        last.roll = std::max(last.roll, (double)std::fabs(in.roll - truth.roll));
+        last.rot = std::max(last.rot, (double)std::fabs(in.rot - truth.rot));
+        n++;
+    }
+
+    std::cout << n << " outputs, max error hdg " << filtered.hdg << " roll " << filtered.roll << " rot "
+              << filtered.rot << std::endl;
+    std::cout << "Last sample,  max error hdg " << last.hdg << " roll " << last.roll << " rot " << last.rot << std::endl;
+
+    bool ok = n == (120 - 5) * OUTPUT_RATE_HZ && wrapOk
+              && filtered.hdg < last.hdg / 5 && filtered.roll < last.roll / 5 && filtered.rot < last.rot / 5;
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,292 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstring>
+
+#include "WitFramer.h"
+#include "wit_c_sdk.h"
+
+// Compares the WIT framer with WitSerialDataIn() of the WIT SDK it replaced and checks how it recovers from the noise.
+// Usage: wit_framer_benchmark [capture_file]
+// The capture is the raw HWT905 UART output. Without it the 200 Hz angle, gyro, accel and mag records are made up,
+// then the noise is injected: random bytes, lost bytes and flipped bits.
+
+static const int UART_READ_SIZE = 120;  // Bytes the UART task gets at a time
+
+// What came out of the stream, same form for both implementations
+struct Collector : public WitFramer::Handler {
+    std::vector<std::string> records;
+    void add(uint8_t type, float a, float b, float c, float d) {
+        char s[96];
+        snprintf(s, sizeof(s), "%02X %.4f %.4f %.4f %.4f", type, a, b, c, d);
+        records.emplace_back(s);
+    }
+    void onAngle(const WitFramer::Angle &angle) override {
+        add(WitFramer::ANGLE, angle.roll, angle.pitch, angle.yaw, angle.version);
+    }
+    void onGyro(const WitFramer::Vector &rate) override { add(WitFramer::GYRO, rate.x, rate.y, rate.z, 0); }
+    void onAccel(const WitFramer::Vector &acc, float temperature) override {
+        add(WitFramer::ACC, acc.x, acc.y, acc.z, temperature);
+    }
+    void onMag(const WitFramer::Vector &field, float temperature) override {
+        add(WitFramer::MAGNETIC, field.x, field.y, field.z, temperature);
+    }
+};
+
+// Only counts the records, so the timing is the parsing
+struct Counter : public WitFramer::Handler {
+    uint32_t records = 0;
+    void onAngle(const WitFramer::Angle &) override { records++; }
+    void onGyro(const WitFramer::Vector &) override { records++; }
+    void onAccel(const WitFramer::Vector &, float) override { records++; }
+    void onMag(const WitFramer::Vector &, float) override { records++; }
+};
+
+// The SDK has one global parser, so the collector is global too
+static Collector *sdkCollector = nullptr;
+
+static void sdkUpdate(uint32_t uiReg, uint32_t) {
+    // The SDK stores the records to the registers, the second half of ACC and ANGLE comes with another call
+    switch ( uiReg ){
+        case TEMP:
+            sdkCollector->add(WitFramer::ACC, sReg[AX] * WitFramer::ACC_SCALE, sReg[AY] * WitFramer::ACC_SCALE,
+                              sReg[AZ] * WitFramer::ACC_SCALE, sReg[TEMP] * WitFramer::TEMPERATURE_SCALE);
+            break;
+        case GX:
+            sdkCollector->add(WitFramer::GYRO, sReg[GX] * WitFramer::GYRO_SCALE, sReg[GY] * WitFramer::GYRO_SCALE,
+                              sReg[GZ] * WitFramer::GYRO_SCALE, 0);
+            break;
+        case VERSION:
+            sdkCollector->add(WitFramer::ANGLE, sReg[Roll] * WitFramer::ANGLE_SCALE,
+                              sReg[Pitch] * WitFramer::ANGLE_SCALE, sReg[Yaw] * WitFramer::ANGLE_SCALE,
+                              (uint16_t)sReg[VERSION]);
+            break;
+        case HX:
+            sdkCollector->add(WitFramer::MAGNETIC, sReg[HX], sReg[HY], sReg[HZ], sReg[HZ + 1] * WitFramer::TEMPERATURE_SCALE);
+            break;
+        default:
+            break;
+    }
+}
+
+static uint32_t sdkCount = 0;
+static void sdkCountUpdate(uint32_t, uint32_t) {
+    sdkCount++;
+}
+
+static void __attribute__((noinline)) timeSdk(const std::vector<uint8_t> &stream) {
+    WitInit(WIT_PROTOCOL_NORMAL, 0x50);
+    WitRegisterCallBack(sdkCountUpdate);
+    for(uint8_t b : stream){
+        WitSerialDataIn(b);
+    }
+}
+
+static void __attribute__((noinline)) timeFramer(const std::vector<uint8_t> &stream, Counter &counter) {
+    WitFramer framer(counter);
+    for(size_t pos = 0; pos < stream.size(); pos += UART_READ_SIZE){
+        framer.Process(stream.data() + pos, (int)std::min(stream.size() - pos, (size_t)UART_READ_SIZE));
+    }
+}
+
+static std::vector<std::string> runFramer(const std::vector<uint8_t> &stream, int chunk, bool printStats = false) {
+    Collector collector;
+    WitFramer framer(collector);
+    for(size_t pos = 0; pos < stream.size(); pos += chunk){
+        framer.Process(stream.data() + pos, (int)std::min(stream.size() - pos, (size_t)chunk));
+    }
+    if ( printStats ){
+        std::cout << stream.size() << " bytes: " << framer.Frames() << " frames, " << framer.ChecksumErrors()
+                  << " checksum errors" << std::endl;
+    }
+    return collector.records;
+}
+
+static std::vector<std::string> runSdk(const std::vector<uint8_t> &stream, int chunk) {
+    Collector collector;
+    sdkCollector = &collector;
+    WitInit(WIT_PROTOCOL_NORMAL, 0x50);
+    WitRegisterCallBack(sdkUpdate);
+    for(size_t pos = 0; pos < stream.size(); pos += chunk){
+        size_t end = std::min(stream.size(), pos + chunk);
+        for(size_t i = pos; i < end; i++){
+            WitSerialDataIn(stream[i]);
+        }
+    }
+    sdkCollector = nullptr;
+    return collector.records;
+}
+
+static void appendFrame(std::vector<uint8_t> &out, uint8_t type, const int16_t data[4]) {
+    uint8_t f[WitFramer::FRAME_LEN] = {WitFramer::HEADER, type};
+    for(int i = 0; i < 4; i++){
+        f[2 + 2 * i] = data[i] & 0xFF;
+        f[3 + 2 * i] = (data[i] >> 8) & 0xFF;
+    }
+    for(int i = 0; i < WitFramer::FRAME_LEN - 1; i++){
+        f[WitFramer::FRAME_LEN - 1] += f[i];
+    }
+    out.insert(out.end(), f, f + WitFramer::FRAME_LEN);
+}
+
+// Boat rolling and turning, 0x55 shows up in the data now and then as in the real output
+static std::vector<uint8_t> makeStream(int samples, std::vector<size_t> &frameStarts) {
+    std::mt19937 rng(1);
+    std::vector<uint8_t> out;
+    for(int s = 0; s < samples; s++){
+        double t = s * 0.005;
+        auto noise = [&rng]() { return (int16_t)(rng() % 64) - 32; };
+        int16_t acc[4] = {(int16_t)(300 * sin(t) + noise()), (int16_t)(200 * cos(t) + noise()), (int16_t)(2048 + noise()), 2512};
+        int16_t gyro[4] = {(int16_t)(500 * cos(t) + noise()), (int16_t)(300 * sin(t) + noise()), (int16_t)(150 + noise()), 0};
+        int16_t angle[4] = {(int16_t)(2000 * sin(t)), (int16_t)(1000 * cos(t)), (int16_t)(s * 13), 0x1055};
+        int16_t mag[4] = {(int16_t)(3000 * cos(t * 0.1)), (int16_t)(3000 * sin(t * 0.1)), (int16_t)(-4000 + noise()), 2512};
+        frameStarts.push_back(out.size());
+        appendFrame(out, WitFramer::ACC, acc);
+        frameStarts.push_back(out.size());
+        appendFrame(out, WitFramer::GYRO, gyro);
+        frameStarts.push_back(out.size());
+        appendFrame(out, WitFramer::ANGLE, angle);
+        if ( s % 4 == 0 ){
+            frameStarts.push_back(out.size());
+            appendFrame(out, WitFramer::MAGNETIC, mag);
+        }
+    }
+    return out;
+}
+
+// Noise somewhere in every tenth frame, the records of the frames left intact have to come out and nothing else
+static bool checkNoise(const std::vector<uint8_t> &clean, const std::vector<size_t> &frameStarts) {
+    std::mt19937 rng(2);
+    std::vector<uint8_t> noisy;
+    std::vector<bool> intact;
+    for(size_t f = 0; f < frameStarts.size(); f++){
+        auto *frame = clean.data() + frameStarts[f];
+        bool hit = f % 10 == 7;
+        if ( !hit ){
+            noisy.insert(noisy.end(), frame, frame + WitFramer::FRAME_LEN);
+        }else{
+            switch ( rng() % 3 ){
+                case 0:  // Junk before the frame, with the header byte in it
+                    for(int i = 0, n = 1 + (int)(rng() % 30); i < n; i++){
+                        noisy.push_back(rng() % 4 == 0 ? WitFramer::HEADER : (uint8_t)rng());
+                    }
+                    noisy.insert(noisy.end(), frame, frame + WitFramer::FRAME_LEN);
+                    hit = false;
+                    break;
+                case 1: {  // Byte lost
+                    int lost = (int)(rng() % WitFramer::FRAME_LEN);
+                    for(int i = 0; i < WitFramer::FRAME_LEN; i++){
+                        if ( i != lost ) noisy.push_back(frame[i]);
+                    }
+                    break;
+                }
+                default: {  // Bit flipped
+                    size_t at = noisy.size() + rng() % WitFramer::FRAME_LEN;
+                    noisy.insert(noisy.end(), frame, frame + WitFramer::FRAME_LEN);
+                    noisy[at] ^= 1 << (rng() % 8);
+                    break;
+                }
+            }
+        }
+        intact.push_back(!hit);
+    }
+
+    auto all = runFramer(clean, (int)clean.size());
+    auto got = runFramer(noisy, UART_READ_SIZE, true);
+    std::vector<std::string> expected;
+    for(size_t f = 0; f < all.size(); f++){
+        if ( intact[f] ) expected.push_back(all[f]);
+    }
+    // Noise passes the checksum once in a while and eats the frame after it, allow one in a thousand
+    size_t e = 0, missed = 0, bogus = 0;
+    for(auto &r : got){
+        size_t i = e;
+        while ( i < std::min(expected.size(), e + 10) && r != expected[i] ){
+            i++;
+        }
+        if ( i < expected.size() && r == expected[i] ){
+            missed += i - e;
+            e = i + 1;
+        }else{
+            bogus++;
+        }
+    }
+    missed += expected.size() - e;
+    std::cout << "Noise: " << expected.size() << " intact frames, " << missed << " missed, " << bogus << " bogus"
+              << std::endl;
+    if ( missed > expected.size() / 1000 || bogus > expected.size() / 1000 ){
+        return false;
+    }
+    // The SDK is not run on the noise, it shifts its buffer with the overlapping memcpy() on every mismatch
+    return true;
+}
+
+static bool checkSplits(const std::vector<uint8_t> &stream, const std::vector<std::string> &whole) {
+    size_t prefix = std::min(stream.size(), (size_t)512);
+    std::vector<uint8_t> head(stream.begin(), stream.begin() + prefix);
+    auto expected = runFramer(head, (int)prefix);
+    for(size_t cut = 1; cut < prefix; cut++){
+        Collector collector;
+        WitFramer framer(collector);
+        framer.Process(head.data(), (int)cut);
+        framer.Process(head.data() + cut, (int)(prefix - cut));
+        if ( collector.records != expected ){
+            std::cout << "Split at " << cut << " gives different records" << std::endl;
+            return false;
+        }
+    }
+    for(int chunk = 1; chunk <= 64; chunk++){
+        if ( runFramer(stream, chunk) != whole ){
+            std::cout << "Reading by " << chunk << " bytes gives different records" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    std::vector<uint8_t> stream;
+    std::vector<size_t> frameStarts;
+    if ( argc > 1 ){
+        std::ifstream in(argv[1], std::ios::binary);
+        if ( !in ){
+            std::cout << "Can't open " << argv[1] << std::endl;
+            return 1;
+        }
+        stream.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }else{
+        stream = makeStream(200 * 60, frameStarts);
+    }
+
+    auto records = runFramer(stream, UART_READ_SIZE, true);
+    bool ok = checkSplits(stream, records);
+    auto reference = runSdk(stream, UART_READ_SIZE);
+    if ( reference != records ){
+        std::cout << "WIT SDK found " << reference.size() << " records, the framer " << records.size() << std::endl;
+        ok = false;
+    }
+    if ( !frameStarts.empty() ){
+        ok &= checkNoise(stream, frameStarts);
+    }
+
+    const int REPEAT = 20;
+    auto t0 = std::chrono::steady_clock::now();
+    for(int r = 0; r < REPEAT; r++){
+        timeSdk(stream);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    Counter counter;
+    for(int r = 0; r < REPEAT; r++){
+        timeFramer(stream, counter);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    double mb = (double)stream.size() * REPEAT / 1e6;
+    std::cout << "WIT SDK: " << mb / std::chrono::duration<double>(t1 - t0).count() << " MB/s" << std::endl;
+    std::cout << "Framer:  " << mb / std::chrono::duration<double>(t2 - t1).count() << " MB/s" << std::endl;
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
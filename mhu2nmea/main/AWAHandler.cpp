@@ -1,6 +1,10 @@
 #include <cmath>
 #include "esp_log.h"
 #include "AWAHandler.h"
+#include "DeviceDiagnostics.h"
+#include "Trace.h"
+#include "BinLog.h"
+#include "BlackBox.h"
 
 static const char *TAG = "mhu2nmea_AWAHandler";
 
@@ -67,6 +71,7 @@ bool AWAHandler::pollAwa(float &awaRad) {
         auto red = adc_data[0];
         auto green = adc_data[1];
         auto blue = adc_data[2];
+        BlackBox::Record(BB_AWA_ADC, 0, red, green, blue);
 
         // Estimate amplitude to check if the sensor is connected
         auto raw_a = (red + green + blue);
@@ -80,11 +85,11 @@ bool AWAHandler::pollAwa(float &awaRad) {
             awaRad = awaComputer.computeAwa(red, green, blue, dt_sec);
             float awaDeg = RAD_2_DEG(awaRad);
 
-            ESP_LOGI(TAG, "AWA,adc_red,%d,adc_green,%d,adc_blue,%d,awa,%.1f", adc_data[0], adc_data[1], adc_data[2], awaDeg);
+            BINLOG_I("AWA,adc_red,%d,adc_green,%d,adc_blue,%d,awa,%.1f", adc_data[0], adc_data[1], adc_data[2], awaDeg);
             return true;
         }
         else{
-            ESP_LOGI(TAG, "AWA,adc_red,%d,adc_green,%d,adc_blue,%d,awa,", adc_data[0], adc_data[1], adc_data[2]);
+            BINLOG_I("AWA,adc_red,%d,adc_green,%d,adc_blue,%d,awa,", adc_data[0], adc_data[1], adc_data[2]);
             return false; // Apparently sensor is not connected
         }
     }
@@ -97,13 +102,15 @@ bool AWAHandler::pollAwa(float &awaRad) {
 
     for( ;; ){
         float awa;
+        SCI_TRACE(TRACE_AWA_POLL_BEGIN, 0);
         bool validAwa = this->pollAwa(awa);
+        SCI_TRACE(TRACE_AWA_POLL_END, validAwa ? (uint32_t)(RAD_2_DEG(awa) * 10) : 0xFFFFFFFF);
         Event evt = {
             .src = AWA,
             .isValid = validAwa,
             .u { .fValue = awa }
         };
-        xQueueSend(eventQueue, &evt, 0);
+        DeviceDiagnostics::QueueSend(eventQueue, &evt);
         vTaskDelay(100 / portTICK_PERIOD_MS); // 100 mS
     }
 }
@@ -1,5 +1,6 @@
 #include "AWSHandler.h"
-static const char *TAG = "mhu2nmea_AWSHandler";
+#include "DeviceDiagnostics.h"
+#include "BinLog.h"
 
 AWSHandler::AWSHandler(QueueHandle_t const &dataQueue)
 :CounterHandler("AWS",AWS_CUTOFF_FREQ_HZ)
@@ -14,12 +15,12 @@ void AWSHandler::onCounted(bool isValid, float Hz) {
     if(Hz >= AWS_THR_HZ){
         kts = AWS_A0 + Hz * AWS_B0;
     }
-    ESP_LOGI(TAG, "AWS_KTS,%.1f", kts);
+    BINLOG_I("AWS_KTS,%.1f", kts);
     Event dataEvt = {
             .src = AWS,
             .isValid = isValid,
             .u = {.fValue = kts}
     };
-    xQueueSend(m_dataQueue, &dataEvt, 0);
+    DeviceDiagnostics::QueueSend(m_dataQueue, &dataEvt);
 }
 
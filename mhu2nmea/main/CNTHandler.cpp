@@ -1,5 +1,10 @@
 #include "CNTHandler.h"
 #include "esp_log.h"
+#include "soc/pcnt_struct.h"
+#include "DeviceDiagnostics.h"
+#include "Trace.h"
+#include "BinLog.h"
+#include "BlackBox.h"
 
 #define PCNT_L_LIM_VAL     (-15)
 
@@ -24,15 +29,18 @@ static void IRAM_ATTR pcnt_intr_handler(void *arg)
     int64_t current_timer_value = esp_timer_get_time();
 
     auto pcnt_unit = (pcnt_unit_t)(int)arg;
+    SCI_TRACE(TRACE_PCNT_ISR, pcnt_unit);
     pcnt_evt_t evt = {
             .unit = pcnt_unit,
             .status = 0,
             .elapsed_us = current_timer_value - CNTHandler::last_timer_values[pcnt_unit]
     };
     /* Save the PCNT event type that caused an interrupt
-       to pass it to the main program */
-    pcnt_get_event_status(pcnt_unit, &evt.status);
-    xQueueSendFromISR(evtQueue, &evt, NULL);
+       to pass it to the main program. Read the register directly, pcnt_get_event_status() is not in IRAM */
+    evt.status = PCNT.status_unit[pcnt_unit].val;
+    if ( xQueueSendFromISR(evtQueue, &evt, NULL) != pdTRUE ){
+        DeviceDiagnostics::CountDroppedSend();
+    }
     CNTHandler::last_timer_values[pcnt_unit] = current_timer_value;
 }
 
@@ -44,6 +52,7 @@ void CNTHandler::Start() {
     ESP_LOGI(TAG, "Starting counter tasks and interrupts");
 
     evtQueue = xQueueCreate(10, sizeof(pcnt_evt_t));
+    DeviceDiagnostics::RegisterQueue("cnt", evtQueue);
     xTaskCreate(
             counter_task,      /* Function that implements the task. */
             "CTRTask",            /* Text name for the task. */
@@ -103,9 +112,10 @@ void CNTHandler::StartUnit(pcnt_unit_t unit, int pulseGpio, int16_t pulsesPerInt
     pcnt_counter_pause(unit);
     pcnt_counter_clear(unit);
 
-    /* Install interrupt service and add isr callback handler */
+    /* Install interrupt service and add isr callback handler.
+     * The service runs from IRAM, so the black box flash writes don't hold off the pulse interrupts */
     if(! m_IsrInstalled ){
-        pcnt_isr_service_install(0);
+        pcnt_isr_service_install(ESP_INTR_FLAG_IRAM);
         m_IsrInstalled = true;
     }
 
@@ -120,7 +130,7 @@ float CNTHandler::convertToHz(const pcnt_evt_t &evt, int16_t pulsesPerInterrupt)
     if (evt.status & PCNT_EVT_H_LIM) {
         // Convert to knots
         float freqHz = 1.f / (float)(evt.elapsed_us) * 1000000.f * (float)pulsesPerInterrupt;
-        ESP_LOGD(TAG, "H_LIM EVT unit=%d elapsed time=%lld us ppi=%d f=%.3fHz" ,evt.unit, evt.elapsed_us, pulsesPerInterrupt, freqHz);
+        BINLOG_D("H_LIM EVT unit=%d elapsed time=%lld us ppi=%d f=%.3fHz" ,evt.unit, evt.elapsed_us, pulsesPerInterrupt, freqHz);
         return freqHz;
     }
 
@@ -138,8 +148,11 @@ float CNTHandler::convertToHz(const pcnt_evt_t &evt, int16_t pulsesPerInterrupt)
         int unit = evt.unit;
 
         if (res == pdTRUE) {
+            SCI_TRACE(TRACE_CNT_EVENT_BEGIN, unit);
+            BlackBox::Record(BB_PULSE_PERIOD, unit, (int32_t)evt.elapsed_us, m_pulsesPerInterrupt[unit]);
             float hz = convertToHz(evt, m_pulsesPerInterrupt[unit]);
             m_CtrHandlers[unit]->report(true, hz);
+            SCI_TRACE(TRACE_CNT_EVENT_END, unit);
         }
 
         for( int i = 0; i < m_unitsUsed ; i++){
@@ -176,7 +189,8 @@ void CounterHandler::report(bool isValid, float raw_hz) {
 
         // Filter the raw frequency
         filtered_hz = m_lpf.filter(raw_hz, dt_sec);
-        ESP_LOGD(TAG,"%s,dt_sec,%.3f,raw_hz,%.2f,hz,%.2f", m_name, dt_sec, raw_hz, filtered_hz);
+        SCI_TRACE(TRACE_COUNTER_REPORT, filtered_hz * 100);
+        BINLOG_D("%s,dt_sec,%.3f,raw_hz,%.2f,hz,%.2f", m_name, dt_sec, raw_hz, filtered_hz);
     }else{
         ESP_LOGE(TAG,"%s,dt_sec,,raw_hz,,hz,", m_name);
     }
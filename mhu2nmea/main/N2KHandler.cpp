@@ -7,16 +7,21 @@
 #include "CalibrationStorage.h"
 #include "LEDBlinker.h"
 #include "TrueWindComputer.h"
+#include "Trace.h"
+#include "BinLog.h"
+#include "BlackBox.h"
 
 NMEA2000_esp32_twai NMEA2000(ESP32_CAN_TX_PIN, ESP32_CAN_RX_PIN, TWAI_MODE_NORMAL);
 
 static const unsigned long TX_PGNS_MHU[] PROGMEM={130306,   // Wind Speed
                                               MHU_CALIBRATION_PGN,
+                                              SCI_DIAGNOSTICS_PGN,
                                                   0};
 
 static const unsigned long TX_PGNS_SPEED[] PROGMEM={   // Wind Speed
                                               128259L,  // Boat speed
                                               SPEED_CALIBRATION_PGN,
+                                              SCI_DIAGNOSTICS_PGN,
                                                 0};
 
 static const unsigned long RX_PGNS_MHU[] PROGMEM={
@@ -35,6 +40,7 @@ N2KHandler::N2KHandler(const xQueueHandle &evtQueue, LEDBlinker &ledBlinker)
     , m_ledBlinker(ledBlinker)
     , m_MhuCalGroupFunctionHandler(*this, &NMEA2000)
     , m_BoatSpeedCalGroupFunctionHandler(*this, &NMEA2000)
+    , m_DiagnosticsGroupFunctionHandler(&NMEA2000, SCI_MFG_CODE, SCI_INDUSTRY_CODE)
     , m_busListener(evtQueue, ledBlinker)
 {
 }
@@ -114,6 +120,7 @@ void N2KHandler::Init() {
 
     NMEA2000.AddGroupFunctionHandler(&m_MhuCalGroupFunctionHandler);
     NMEA2000.AddGroupFunctionHandler(&m_BoatSpeedCalGroupFunctionHandler);
+    NMEA2000.AddGroupFunctionHandler(&m_DiagnosticsGroupFunctionHandler);
 
     NMEA2000.SetOnOpen(OnOpen);
 }
@@ -142,6 +149,8 @@ void N2KHandler::StartTask() {
     for( ;; ) {
         Event evt{};
         portBASE_TYPE res = xQueueReceive(m_evtQueue, &evt, 1);
+        int64_t loopStart = esp_timer_get_time();
+        SCI_TRACE(TRACE_N2K_LOOP_BEGIN, res == pdTRUE ? (uint32_t)evt.src : 0xFFFFFFFF);
 
         // Check if new  data is available
         if (res == pdTRUE) {
@@ -191,7 +200,10 @@ void N2KHandler::StartTask() {
             SetN2kWindSpeed(N2kMsg, this->uc_WindSeqId, localAwsMs, localAwaRad, windRef );
             N2kMsg.Priority = DEFAULT_WIND_PRIO;
             bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_MHU);
-            ESP_LOGD(TAG, "SetN2kWindSpeed AWS=%.0f AWA=%.1f ref=%d %s", msToKnots(localAwsMs), RadToDeg(localAwaRad), windRef, sentOk ? "OK" : "Failed");
+            SCI_TRACE(TRACE_N2K_SEND, N2kMsg.PGN);
+            BINLOG_D("SetN2kWindSpeed AWS=%.0f AWA=%.1f ref=%d %s", msToKnots(localAwsMs), RadToDeg(localAwaRad), windRef, sentOk ? "OK" : "Failed");
+            BlackBox::RecordPgnValue(N2kMsg.PGN, 0, localAwsMs, windRef);
+            BlackBox::RecordPgnValue(N2kMsg.PGN, 1, localAwaRad, windRef);
             m_ledBlinker.SetBusState(sentOk);
 
             // Send true wind
@@ -201,7 +213,9 @@ void N2KHandler::StartTask() {
                 isTwsTwaValid = TrueWindComputer::computeTrueWind(sowKts, awsKts, awaRad, twaRad, twsKts);
                 if ( isTwsTwaValid ) {
                     SetN2kWindSpeed(N2kMsg, this->uc_WindSeqId, KnotsToms(twsKts), twaRad, N2kWind_True_water);
-                    ESP_LOGD(TAG, "SetN2kWindSpeed TWS=%.0f TWA=%.1f", msToKnots(twsKts), RadToDeg(twaRad));
+                    BINLOG_D("SetN2kWindSpeed TWS=%.0f TWA=%.1f", msToKnots(twsKts), RadToDeg(twaRad));
+                    BlackBox::RecordPgnValue(N2kMsg.PGN, 0, KnotsToms(twsKts), N2kWind_True_water);
+                    BlackBox::RecordPgnValue(N2kMsg.PGN, 1, twaRad, N2kWind_True_water);
                 }
             }
 
@@ -211,6 +225,7 @@ void N2KHandler::StartTask() {
 
             N2kMsg.Priority = DEFAULT_WIND_PRIO;
             sentOk = NMEA2000.SendMsg(N2kMsg, DEV_MHU);
+            SCI_TRACE(TRACE_N2K_SEND, N2kMsg.PGN);
             m_ledBlinker.SetBusState(sentOk);
 
             this->uc_WindSeqId++;
@@ -224,12 +239,19 @@ void N2KHandler::StartTask() {
             SetN2kBoatSpeed(N2kMsg, this->uc_BoatSpeedSeqId++, boatSpeed, N2kDoubleNA, N2kSWRT_Paddle_wheel );
             N2kMsg.Priority = DEFAULT_SPEED_PRIO;
             bool sentOk = NMEA2000.SendMsg(N2kMsg, DEV_SPEED);
-            ESP_LOGD(TAG, "SetN2kBoatSpeed SOW=%.0f %s", msToKnots(boatSpeed), sentOk ? "OK" : "Failed");
+            SCI_TRACE(TRACE_N2K_SEND, N2kMsg.PGN);
+            BINLOG_D("SetN2kBoatSpeed SOW=%.0f %s", msToKnots(boatSpeed), sentOk ? "OK" : "Failed");
+            BlackBox::RecordPgnValue(N2kMsg.PGN, 0, boatSpeed);
             m_ledBlinker.SetBusState(sentOk);
         }
 
         // crank NMEA2000 state machine
+        SCI_TRACE(TRACE_N2K_PARSE_BEGIN, 0);
         NMEA2000.ParseMessages();
+        SCI_TRACE(TRACE_N2K_PARSE_END, 0);
+
+        DeviceDiagnostics::AddLoopTime(esp_timer_get_time() - loopStart);
+        SCI_TRACE(TRACE_N2K_LOOP_END, 0);
     }
 }
 
@@ -260,7 +282,7 @@ void N2KTwaiBusAlertListener::onAlert(uint32_t alerts, bool isError) {
                 .u= {.uiValue = alerts}
 
         };
-        xQueueSend(m_evtQueue, &evt, 0);
+        DeviceDiagnostics::QueueSend(m_evtQueue, &evt);
     }
 }
 
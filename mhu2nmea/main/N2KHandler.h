@@ -7,6 +7,7 @@
 #include <freertos/task.h>
 #include <freertos/timers.h>
 #include <CustomPgnGroupFunctionHandler.h>
+#include <DeviceDiagnostics.h>
 
 #define ESP32_CAN_TX_PIN GPIO_NUM_32
 #define ESP32_CAN_RX_PIN GPIO_NUM_34
@@ -138,6 +139,7 @@ private:
     LEDBlinker &m_ledBlinker;
     MhuCalGroupFunctionHandler m_MhuCalGroupFunctionHandler;
     BoatSpeedCalGroupFunctionHandler m_BoatSpeedCalGroupFunctionHandler;
+    DiagnosticsGroupFunctionHandler m_DiagnosticsGroupFunctionHandler;
     N2KTwaiBusAlertListener m_busListener;
     unsigned char uc_WindSeqId = 0;
     unsigned char uc_BoatSpeedSeqId = 0;
@@ -1,6 +1,6 @@
 #include "SOWHandler.h"
-
-static const char *TAG = "mhu2nmea_SOWHandler";
+#include "DeviceDiagnostics.h"
+#include "BinLog.h"
 
 SOWHandler::SOWHandler(QueueHandle_t const &dataQueue)
         :CounterHandler("SOW",SPD_CUTOFF_FREQ_HZ)
@@ -11,12 +11,12 @@ SOWHandler::SOWHandler(QueueHandle_t const &dataQueue)
 
 void SOWHandler::onCounted(bool isValid, float Hz) {
     float speedKts = Hz / PW_HERTZ_PER_KTS;
-    ESP_LOGI(TAG, "SOW_KTS,%.1f", speedKts);
+    BINLOG_I("SOW_KTS,%.1f", speedKts);
 
     Event dataEvt = {
             .src = SOW,
             .isValid = isValid,
             .u = {.fValue = speedKts}
     };
-    xQueueSend(m_dataQueue, &dataEvt, 0);
+    DeviceDiagnostics::QueueSend(m_dataQueue, &dataEvt);
 }
@@ -4,6 +4,10 @@
 #include "driver/pcnt.h"
 
 #include "N2KHandler.h"
+#include "DeviceDiagnostics.h"
+#include "Trace.h"
+#include "BinLog.h"
+#include "BlackBox.h"
 #include "CNTHandler.h"
 
 #define HAS_ADC
@@ -39,6 +43,10 @@ extern "C" [[noreturn]] void app_main(void)
 
     // Initialize event queue
     evt_queue = xQueueCreate(10, sizeof(Event));
+    DeviceDiagnostics::RegisterQueue("evt", evt_queue);
+
+    BinLog::Start();
+    BlackBox::Start();
 
     ledBlinker.Start();
 
@@ -53,6 +61,7 @@ extern "C" [[noreturn]] void app_main(void)
 #endif
 
     while (true) {
+        Trace::PollConsoleCommand();
         vTaskDelay(1000 / portTICK_PERIOD_MS);
     }
 
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+""" Decodes binary log records written by BinLog.h
+
+The format strings are found by scanning the firmware sources for BINLOG_x("...") calls,
+so the decoder has to be run against the same sources the firmware was built from.
+The lines that are not binary log records are passed through unchanged.
+"""
+import argparse
+import base64
+import os
+import re
+import struct
+import sys
+
+REPO_ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '../..')
+SOURCE_DIRS = ['mhu2nmea/main', 'imu2nmea/main', 'aoa2nmea/main', 'idf-components']
+
+LEVELS = {1: 'E', 2: 'W', 3: 'I', 4: 'D', 5: 'V'}
+HEADER_FMT = '<IIBB'
+HEADER_LEN = struct.calcsize(HEADER_FMT)
+
+BINLOG_CALL = re.compile(r'BINLOG_[EWIDV]\s*\(\s*"((?:[^"\\]|\\.)*)"')
+C_LENGTH_MODIFIERS = re.compile(r'%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z|j|t)?([diouxXfFeEgGcs])')
+C_CONVERSION = re.compile(r'%%|%[-+ #0]*\d*(?:\.\d+)?(hh|h|ll|l|z|j|t)?([diouxXfFeEgGcs])')
+TRUNCATED_FLAG = 0x80
+TRUNCATED_MARK = '<cut>'
+
+
+def fnv1a(s):
+    h = 2166136261
+    for b in s.encode('latin-1'):
+        h ^= b
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def c_unescape(s):
+    return s.encode('latin-1').decode('unicode_escape')
+
+
+def read_formats(root, source_dirs):
+    """ Map of format id to (format, source file) """
+    formats = {}
+    for d in source_dirs:
+        for dir_path, _, files in os.walk(os.path.join(root, d)):
+            for name in files:
+                if not name.endswith(('.cpp', '.h', '.hpp')):
+                    continue
+                path = os.path.join(dir_path, name)
+                with open(path, 'rt', encoding='latin-1') as f:
+                    for m in BINLOG_CALL.finditer(f.read()):
+                        fmt = c_unescape(m.group(1))
+                        fmt_id = fnv1a(fmt)
+                        if fmt_id in formats and formats[fmt_id][0] != fmt:
+                            print(f'Format id collision: "{fmt}" and "{formats[fmt_id][0]}"', file=sys.stderr)
+                        formats[fmt_id] = (fmt, os.path.splitext(name)[0])
+    return formats
+
+
+def to_python_format(fmt):
+    # Python % formatting understands C conversions without length modifiers, except %u
+    return C_LENGTH_MODIFIERS.sub(lambda m: '%' + m.group(1) + ('d' if m.group(2) == 'u' else m.group(2)), fmt)
+
+
+def arg_types(fmt):
+    """ Argument types as written by BinLog::Put(), the records carry no type tags """
+    types = []
+    for m in C_CONVERSION.finditer(fmt):
+        length, conv = m.group(1), m.group(2)
+        if conv is None:
+            continue  # %%
+        if conv == 's':
+            types.append('s')
+        elif conv in 'fFeEgG':
+            types.append('<f')
+        elif conv in 'dic':
+            types.append('<q' if length == 'll' else '<i')
+        else:
+            types.append('<Q' if length == 'll' else '<I')
+    return types
+
+
+def decode_args(data, types):
+    """ Returns decoded arguments and True if all of them were present and consumed the data exactly """
+    args = []
+    i = 0
+    for t in types:
+        if t == 's':
+            if i >= len(data):
+                break
+            n = data[i] & ~TRUNCATED_FLAG
+            text = data[i + 1:i + 1 + n].decode('latin-1')
+            args.append(text + TRUNCATED_MARK if data[i] & TRUNCATED_FLAG else text)
+            i += 1 + n
+        else:
+            if i + struct.calcsize(t) > len(data):
+                break
+            args.append(struct.unpack_from(t, data, i)[0])
+            i += struct.calcsize(t)
+    return args, len(args) == len(types) and i == len(data)
+
+
+def decode_records(data, formats):
+    lines = []
+    i = 0
+    while i + HEADER_LEN <= len(data):
+        fmt_id, timestamp_us, level, args_len = struct.unpack_from(HEADER_FMT, data, i)
+        truncated = bool(args_len & TRUNCATED_FLAG)
+        args_len &= ~TRUNCATED_FLAG
+        arg_data = data[i + HEADER_LEN:i + HEADER_LEN + args_len]
+        i += HEADER_LEN + args_len
+
+        lvl = LEVELS.get(level, '?')
+        if fmt_id in formats:
+            fmt, module = formats[fmt_id]
+            args, complete = decode_args(arg_data, arg_types(fmt))
+            if complete:
+                text = to_python_format(fmt) % tuple(args)
+            else:
+                # Arguments that did not fit into the record are missing
+                text = f'{fmt} {args}'
+            if truncated:
+                text += ' ' + TRUNCATED_MARK
+        else:
+            module = 'unknown'
+            text = f'format {fmt_id:08X} {arg_data.hex()}'
+        lines.append(f'{lvl} ({timestamp_us // 1000}) {module}: {text}')
+    return lines
+
+
+def decode_stream(in_file, out_file, formats, stats=None):
+    for line in in_file:
+        # Remover terminal escape sequences
+        clean = re.sub(r'\x1b\[[0-9;]*m', '', line).strip()
+        if clean.startswith('BL:'):
+            try:
+                data = base64.b64decode(clean[3:])
+            except ValueError:
+                out_file.write(line)
+                continue
+            for text in decode_records(data, formats):
+                out_file.write(text + '\n')
+                if stats is not None:
+                    stats['text'] += len(text) + 1
+            if stats is not None:
+                stats['binary'] += len(clean) + 1
+        else:
+            out_file.write(line)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(fromfile_prefix_chars='@')
+    parser.add_argument("--log-file", help="recorded log file, stdin if not specified", required=False)
+    parser.add_argument("--root", help="sources root", default=REPO_ROOT)
+    parser.add_argument("--stats", help="print console bytes of the records vs the decoded text", action='store_true')
+    args = parser.parse_args()
+
+    fmts = read_formats(args.root, SOURCE_DIRS)
+    byte_stats = {'binary': 0, 'text': 0} if args.stats else None
+    if args.log_file is None:
+        decode_stream(sys.stdin, sys.stdout, fmts, byte_stats)
+    else:
+        with open(args.log_file, 'rt', encoding='latin-1') as log_file:
+            decode_stream(log_file, sys.stdout, fmts, byte_stats)
+    if byte_stats is not None and byte_stats['binary'] > 0:
+        print(f'Binary log {byte_stats["binary"]} bytes, text {byte_stats["text"]} bytes, '
+              f'ratio {byte_stats["text"] / byte_stats["binary"]:.2f}', file=sys.stderr)
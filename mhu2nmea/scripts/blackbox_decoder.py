@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+""" Converts black box records recorded by BlackBox.h into the replay log
+
+Records are taken either from the console log (press 'b' in the idf monitor to dump BBX,... lines)
+or requested over WiFi by sending "BLACKBOX" to the device UDP port 2023.
+Each UDP datagram starts with 4 bytes sequence number, the gaps are reported as lost datagrams.
+The output has the same AWA_ADC and AWA,dt_sec lines as the firmware console log,
+so it can be fed to test_on_host and awa_decoder.py.
+Other records are written as PULSE, UART and PGN lines.
+"""
+import argparse
+import math
+import re
+import socket
+import struct
+
+UDP_RX_PORT = 2023
+UDP_TRACE_PORT = 2025
+BLACKBOX_DUMP_CMD = b'BLACKBOX'
+RECORD_FMT = '<IBBHiii'  # Must match struct BlackBoxRecord
+RECORD_SIZE = struct.calcsize(RECORD_FMT)
+
+# enum BlackBoxRecordType
+BB_BOOT = 1
+BB_AWA_ADC = 2
+BB_PULSE_PERIOD = 3
+BB_UART_SENTENCE = 4
+BB_PGN_VALUE = 5
+
+VALUE_NA = -(1 << 31)
+WIND_PGN = 130306
+TAG = 'mhu2nmea_BlackBox'
+
+
+def unescape(line):
+    # Remover terminal escape sequences
+    line = re.sub(r'\x1b\[[0-9;]*m', '', line)
+    return line
+
+
+def read_log_records(log_file):
+    records = []
+    with open(log_file, 'rt', encoding='latin-1') as f:
+        for line in f:
+            line = unescape(line).strip()
+            if line.startswith('BBX_BEGIN'):
+                records = []  # Keep the last dump only
+            elif line.startswith('BBX,'):
+                t = line.split(',')
+                if len(t) < 7:
+                    continue
+                records.append(tuple(int(x) for x in t[1:7]))
+    return records
+
+
+def read_udp_records(host, timeout):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(('', UDP_TRACE_PORT))
+    sock.settimeout(timeout)
+    sock.sendto(BLACKBOX_DUMP_CMD, (host, UDP_RX_PORT))
+
+    records = []
+    expected_seq = 0
+    lost = 0
+    try:
+        while True:
+            data = sock.recv(65536)
+            if len(data) < 4:
+                continue
+            seq, = struct.unpack_from('<I', data, 0)
+            if seq != expected_seq:
+                print(f'Datagrams {expected_seq}..{seq - 1} lost')
+                lost += seq - expected_seq
+            expected_seq = seq + 1
+            for i in range(4, len(data) - RECORD_SIZE + 1, RECORD_SIZE):
+                ts, rec_type, channel, _, v0, v1, v2 = struct.unpack_from(RECORD_FMT, data, i)
+                records.append((ts, rec_type, channel, v0, v1, v2))
+    except socket.timeout:
+        pass
+    sock.close()
+    if lost > 0:
+        print(f'{lost} datagrams lost, the records around the gaps are missing')
+    return records
+
+
+def scaled(v):
+    return '' if v == VALUE_NA else f'{v / 1000.:.3f}'
+
+
+def to_replay_log(records, out):
+    last_ts = None
+    wraps = 0
+    last_adc_ts = None
+    awa_deg = 'nan'  # test_on_host can't parse empty fields
+    lines = 0
+    for ts, rec_type, channel, v0, v1, v2 in records:
+        if rec_type == BB_BOOT:
+            # Timestamps restart from zero
+            last_ts = None
+            wraps = 0
+            last_adc_ts = None
+            out.write(f'I (0) {TAG}: BOOT,sequence,{v0}\n')
+            lines += 1
+            continue
+
+        # Timestamps are lower 32 bits of microseconds counter
+        if last_ts is not None and last_ts - ts > (1 << 31):
+            wraps += 1
+        last_ts = ts
+        ts_us = ts + (wraps << 32)
+        prefix = f'I ({ts_us // 1000}) {TAG}: '
+
+        if rec_type == BB_AWA_ADC:
+            dt_sec = 0 if last_adc_ts is None else (ts_us - last_adc_ts) / 1e6
+            last_adc_ts = ts_us
+            out.write(f'{prefix}AWA_ADC,red,{v0},green,{v1},blue,{v2}\n')
+            # AWA sent in the most recent wind PGN stands for the firmware estimate
+            out.write(f'{prefix}AWA,dt_sec,{dt_sec:.3f},raw_awa,{awa_deg},est_awa,{awa_deg},'
+                      f'r,{v0},g,{v1},b,{v2},fw_raw_awa,{awa_deg},fw_est_awa,{awa_deg}\n')
+            lines += 2
+        elif rec_type == BB_PULSE_PERIOD:
+            out.write(f'{prefix}PULSE,unit,{channel},elapsed_us,{v0},ppi,{v1}\n')
+            lines += 1
+        elif rec_type == BB_UART_SENTENCE:
+            sentence = bytes([v1 & 0xFF, (v1 >> 8) & 0xFF, (v1 >> 16) & 0xFF]).decode('latin-1')
+            out.write(f'{prefix}UART,port,{channel},sentence,{sentence},len,{v0}\n')
+            lines += 1
+        elif rec_type == BB_PGN_VALUE:
+            if v0 == WIND_PGN and channel == 1 and v2 == 2:  # N2kWind_Apparent
+                awa_deg = 'nan' if v1 == VALUE_NA else f'{math.degrees(v1 / 1000.):.1f}'
+            out.write(f'{prefix}PGN,{v0},field,{channel},value,{scaled(v1)},ref,{v2}\n')
+            lines += 1
+    return lines
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(fromfile_prefix_chars='@')
+    parser.add_argument("--log-file", help="idf monitor log containing the black box dump", required=False)
+    parser.add_argument("--host", help="request black box dump from this device over WiFi", required=False)
+    parser.add_argument("--timeout", help="UDP receive timeout in seconds", type=float, default=5)
+    parser.add_argument("--out", help="output replay log", default='blackbox.log')
+    args = parser.parse_args()
+
+    if args.log_file is not None:
+        recs = read_log_records(args.log_file)
+    elif args.host is not None:
+        recs = read_udp_records(args.host, args.timeout)
+    else:
+        parser.error('Either --log-file or --host is required')
+
+    with open(args.out, 'wt') as out_file:
+        n = to_replay_log(recs, out_file)
+    print(f'{len(recs)} records converted into {n} lines of {args.out}')
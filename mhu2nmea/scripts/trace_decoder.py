@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+""" Decodes trace events recorded by Trace.h into Chrome trace / Perfetto JSON
+
+Events are taken either from the console log (press 't' in the idf monitor to dump TRC,... lines)
+or requested over WiFi by sending "TRACE" to the device UDP port 2023.
+Open the resulting JSON in chrome://tracing or https://ui.perfetto.dev
+"""
+import argparse
+import json
+import os
+import re
+import socket
+import struct
+
+TRACE_H = os.path.join(os.path.dirname(os.path.abspath(__file__)), '../../idf-components/NMEA2000_utils/Trace.h')
+
+UDP_RX_PORT = 2023
+UDP_TRACE_PORT = 2025
+TRACE_DUMP_CMD = b'TRACE'
+TRACE_EVENT_FMT = '<IHHI'  # Must match struct TraceEvent
+TRACE_EVENT_SIZE = struct.calcsize(TRACE_EVENT_FMT)
+
+
+def read_trace_ids(trace_h):
+    """ Read trace ids from the enum TraceId, so the decoder is always in sync with the firmware """
+    ids = {}
+    with open(trace_h, 'rt') as f:
+        for line in f:
+            m = re.match(r'\s*TRACE_(\w+)\s*=\s*(\d+)\s*,', line)
+            if m:
+                ids[int(m.group(2))] = m.group(1)
+    return ids
+
+
+def unescape(line):
+    # Remover terminal escape sequences
+    line = re.sub(r'\x1b\[[0-9;]*m', '', line)
+    return line
+
+
+def read_log_events(log_file):
+    events = []
+    with open(log_file, 'rt', encoding='latin-1') as f:
+        for line in f:
+            line = unescape(line).strip()
+            if line.startswith('TRC_BEGIN'):
+                events = []  # Keep the last dump only
+            elif line.startswith('TRC,'):
+                t = line.split(',')
+                if len(t) < 5:
+                    continue
+                events.append((int(t[1]), int(t[2]), int(t[3]), int(t[4])))
+    return events
+
+
+def read_udp_events(host, timeout):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(('', UDP_TRACE_PORT))
+    sock.settimeout(timeout)
+    sock.sendto(TRACE_DUMP_CMD, (host, UDP_RX_PORT))
+
+    events = []
+    try:
+        while True:
+            data = sock.recv(65536)
+            for i in range(0, len(data) - TRACE_EVENT_SIZE + 1, TRACE_EVENT_SIZE):
+                events.append(struct.unpack_from(TRACE_EVENT_FMT, data, i))
+    except socket.timeout:
+        pass
+    sock.close()
+    return events
+
+
+def to_chrome_trace(events, ids):
+    trace_events = []
+    tids = {}
+    last_ts = None
+    wraps = 0
+    for ts, trace_id, core, payload in events:
+        # Timestamps are lower 32 bits of microseconds counter, events from two cores may be slightly out of order
+        if last_ts is not None and last_ts - ts > (1 << 31):
+            wraps += 1
+        last_ts = ts
+        ts_us = ts + (wraps << 32)
+
+        name = ids.get(trace_id, f'ID_{trace_id}')
+        if name.endswith('_BEGIN'):
+            ph = 'B'
+            name = name[:-len('_BEGIN')]
+        elif name.endswith('_END'):
+            ph = 'E'
+            name = name[:-len('_END')]
+        else:
+            ph = 'i'
+
+        # Use the trace point as a thread so begin/end pairs match even if the task migrates between cores
+        if name not in tids:
+            tids[name] = len(tids) + 1
+            trace_events.append({'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': tids[name],
+                                 'args': {'name': name}})
+        trace_event = {'name': name, 'ph': ph, 'ts': ts_us, 'pid': 0, 'tid': tids[name],
+                       'args': {'core': core, 'payload': payload}}
+        if ph == 'i':
+            trace_event['s'] = 't'
+        trace_events.append(trace_event)
+
+    return {'traceEvents': trace_events, 'displayTimeUnit': 'ms'}
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(fromfile_prefix_chars='@')
+    parser.add_argument("--log-file", help="idf monitor log containing the trace dump", required=False)
+    parser.add_argument("--host", help="request trace dump from this device over WiFi", required=False)
+    parser.add_argument("--timeout", help="UDP receive timeout in seconds", type=float, default=2)
+    parser.add_argument("--trace-h", help="path to Trace.h", default=TRACE_H)
+    parser.add_argument("--out", help="output JSON file", default='trace.json')
+    args = parser.parse_args()
+
+    if args.log_file is not None:
+        trace = read_log_events(args.log_file)
+    elif args.host is not None:
+        trace = read_udp_events(args.host, args.timeout)
+    else:
+        parser.error('Either --log-file or --host is required')
+
+    with open(args.out, 'wt') as out:
+        json.dump(to_chrome_trace(trace, read_trace_ids(args.trace_h)), out)
+    print(f'{len(trace)} events written to {args.out}')
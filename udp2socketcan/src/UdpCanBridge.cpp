@@ -0,0 +1,409 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "UdpCanBridge.h"
+
+static const int64_t NS_PER_MS = 1000000;
+static const int64_t NS_PER_SEC = 1000000000;
+static const int MAX_DATAGRAM_SIZE = 2048;
+
+void LatencyStats::Add(int64_t us) {
+    if ( count == 0 || us < min ){
+        min = us;
+    }
+    if ( count == 0 || us > max ){
+        max = us;
+    }
+    sum += us;
+    count++;
+}
+
+// Kernel receive time of the message, fallback if the socket doesn't provide one
+static int64_t rxTimestamp(struct msghdr &hdr, int64_t fallback) {
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)){
+        if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS ){
+            struct timespec ts{};
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+        }
+    }
+    return fallback;
+}
+
+UdpCanBridge::UdpCanBridge(int canSock, int udpSock, int subscribeSock, const BridgeConfig &config)
+        : m_canSock(canSock)
+        , m_udpSock(udpSock)
+        , m_subscribeSock(subscribeSock)
+        , m_config(config) {
+    m_device.sin_family = AF_INET;
+    m_device.sin_port = htons(config.devicePort);
+    if ( !config.deviceAddress.empty() && inet_pton(AF_INET, config.deviceAddress.c_str(), &m_device.sin_addr) != 1 ){
+        fprintf(stderr, "Invalid device address %s, will learn it from the datagrams\n", config.deviceAddress.c_str());
+        m_device.sin_addr.s_addr = 0;
+    }
+}
+
+int64_t UdpCanBridge::clockNs() {
+    struct timespec ts{};
+    clock_gettime(CLOCK_REALTIME, &ts);  // Same clock as SO_TIMESTAMPNS
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+int UdpCanBridge::OpenCanSocket(const std::string &interface) {
+    int sock = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
+    if ( sock < 0 ){
+        fprintf(stderr, "Failed to create CAN socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct ifreq ifr{};
+    strncpy(ifr.ifr_name, interface.c_str(), IFNAMSIZ - 1);
+    if ( ioctl(sock, SIOCGIFINDEX, &ifr) < 0 ){
+        fprintf(stderr, "No CAN interface %s: %s\n", interface.c_str(), strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    struct sockaddr_can addr{};
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if ( bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ){
+        fprintf(stderr, "Failed to bind to %s: %s\n", interface.c_str(), strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+    return sock;
+}
+
+int UdpCanBridge::OpenUdpSocket(int port) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if ( sock < 0 ){
+        fprintf(stderr, "Failed to create UDP socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+    int rcvBuf = 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ( bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ){
+        fprintf(stderr, "Failed to bind to UDP port %d: %s\n", port, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void UdpCanBridge::Run(volatile sig_atomic_t &stop) {
+    int64_t now = clockNs();
+    m_nextStatsNs = now + m_config.statsIntervalSec * NS_PER_SEC;
+    m_nextSubscribeNs = now;
+
+    while ( !stop ){
+        struct pollfd fds[3] = {
+                {m_udpSock, POLLIN, 0},
+                {m_canSock, POLLIN, 0},
+                {m_subscribeSock, POLLIN, 0},   // Negative fd is skipped by poll()
+        };
+        if ( poll(fds, 3, pollTimeoutMs(now)) < 0 && errno != EINTR ){
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+        now = clockNs();
+
+        if ( fds[0].revents & POLLIN ){
+            receiveUdp(m_udpSock, m_broadcastDecoder, !m_config.subscribe, now);
+        }
+        if ( fds[2].revents & POLLIN ){
+            receiveUdp(m_subscribeSock, m_subscribeDecoder, true, now);
+        }
+        if ( !m_pendingCan.empty() && (!m_canBlocked || now >= m_canRetryNs) ){
+            writeCan();
+        }
+
+        if ( fds[1].revents & POLLIN ){
+            receiveCan(now);
+        }
+        if ( !m_encoder.Empty() && now - m_encoderRxNs.front() >= m_config.batchDelayMs * NS_PER_MS ){
+            finishDatagram();
+        }
+        if ( !m_outDatagrams.empty() ){
+            sendDatagrams();
+        }
+
+        if ( m_config.subscribe && deviceKnown() && now >= m_nextSubscribeNs ){
+            sendCommand("SUBSCRIBE,0");
+            m_nextSubscribeNs = now + SUBSCRIBE_INTERVAL_SEC * NS_PER_SEC;
+        }
+        if ( now >= m_nextStatsNs ){
+            printStats();
+            m_nextStatsNs = now + m_config.statsIntervalSec * NS_PER_SEC;
+        }
+    }
+
+    if ( m_config.subscribe && deviceKnown() ){
+        sendCommand("UNSUBSCRIBE");
+    }
+}
+
+int UdpCanBridge::pollTimeoutMs(int64_t nowNs) const {
+    int64_t deadline = m_nextStatsNs;
+    if ( m_config.subscribe && deviceKnown() ){
+        deadline = std::min(deadline, m_nextSubscribeNs);
+    }
+    if ( !m_encoder.Empty() ){
+        deadline = std::min(deadline, m_encoderRxNs.front() + m_config.batchDelayMs * NS_PER_MS);
+    }
+    if ( m_canBlocked ){
+        deadline = std::min(deadline, m_canRetryNs);
+    }
+    return deadline <= nowNs ? 0 : (int)((deadline - nowNs + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+void UdpCanBridge::receiveUdp(int sock, UdpBatchDecoder &decoder, bool toCan, int64_t nowNs) {
+    static uint8_t bufs[UDP_VLEN][MAX_DATAGRAM_SIZE];
+    static char control[UDP_VLEN][CMSG_SPACE(sizeof(struct timespec))];
+    struct mmsghdr msgs[UDP_VLEN];
+    struct iovec iovs[UDP_VLEN];
+    struct sockaddr_in addrs[UDP_VLEN];
+    std::vector<can_frame> frames;
+
+    for(;;){
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < UDP_VLEN; i++){
+            iovs[i] = {bufs[i], MAX_DATAGRAM_SIZE};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+
+        int n = recvmmsg(sock, msgs, UDP_VLEN, MSG_DONTWAIT, nullptr);
+        if ( n <= 0 ){
+            if ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ){
+                fprintf(stderr, "UDP receive failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        for(int i = 0; i < n; i++){
+            frames.clear();
+            BatchType type = decoder.Decode(bufs[i], (int)msgs[i].msg_len, frames);
+            if ( type == BatchType::INVALID ){
+                continue;  // E.g. SUBSCRIBED reply
+            }
+            if ( type == BatchType::MESSAGES && !m_messageModeReported ){
+                fprintf(stderr, "Device sends whole N2K messages, turn off its message mode\n");
+                m_messageModeReported = true;
+            }
+            if ( !deviceKnown() ){
+                m_device.sin_addr = addrs[i].sin_addr;
+                printf("Device at %s\n", inet_ntoa(m_device.sin_addr));
+            }
+            if ( !toCan ){
+                m_ignoredDatagrams++;   // The same frames come with the unicast stream
+                continue;
+            }
+            m_udpToCan.datagrams++;
+
+            int64_t rxNs = rxTimestamp(msgs[i].msg_hdr, nowNs);
+            for(const can_frame &frame : frames){
+                if ( m_pendingCan.size() >= MAX_PENDING_CAN_FRAMES ){
+                    m_pendingCan.pop_front();   // The oldest one is the most stale anyway
+                    m_udpToCan.dropped++;
+                }
+                m_pendingCan.push_back({frame, rxNs});
+            }
+        }
+
+        if ( n < UDP_VLEN ){
+            return;
+        }
+    }
+}
+
+void UdpCanBridge::writeCan() {
+    struct mmsghdr msgs[CAN_VLEN];
+    struct iovec iovs[CAN_VLEN];
+
+    while ( !m_pendingCan.empty() ){
+        int n = (int)std::min<size_t>(CAN_VLEN, m_pendingCan.size());
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < n; i++){
+            iovs[i] = {&m_pendingCan[i].frame, sizeof(can_frame)};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int sent = sendmmsg(m_canSock, msgs, n, MSG_DONTWAIT);
+        if ( sent < 0 ){
+            if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ){
+                // Interface queue is full, POLLOUT isn't reliable for CAN_RAW so retry a bit later
+                m_canBlocked = true;
+                m_canRetryNs = clockNs() + CAN_RETRY_MS * NS_PER_MS;
+                return;
+            }
+            fprintf(stderr, "CAN write failed: %s\n", strerror(errno));
+            m_pendingCan.pop_front();
+            m_udpToCan.dropped++;
+            continue;
+        }
+
+        int64_t now = clockNs();
+        for(int i = 0; i < sent; i++){
+            m_udpToCan.latency.Add((now - m_pendingCan.front().rxNs) / 1000);
+            m_pendingCan.pop_front();
+        }
+        m_udpToCan.frames += sent;
+        if ( sent < n ){
+            m_canBlocked = true;
+            m_canRetryNs = now + CAN_RETRY_MS * NS_PER_MS;
+            return;
+        }
+    }
+    m_canBlocked = false;
+}
+
+void UdpCanBridge::receiveCan(int64_t nowNs) {
+    can_frame frames[CAN_VLEN];
+    static char control[CAN_VLEN][CMSG_SPACE(sizeof(struct timespec))];
+    struct mmsghdr msgs[CAN_VLEN];
+    struct iovec iovs[CAN_VLEN];
+
+    for(;;){
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < CAN_VLEN; i++){
+            iovs[i] = {&frames[i], sizeof(can_frame)};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+
+        int n = recvmmsg(m_canSock, msgs, CAN_VLEN, MSG_DONTWAIT, nullptr);
+        if ( n <= 0 ){
+            if ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ){
+                fprintf(stderr, "CAN receive failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        for(int i = 0; i < n; i++){
+            const can_frame &frame = frames[i];
+            // N2K uses extended data frames only
+            if ( msgs[i].msg_len < sizeof(can_frame) || !(frame.can_id & CAN_EFF_FLAG)
+                    || (frame.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) || frame.can_dlc > CAN_MAX_DLEN ){
+                continue;
+            }
+            if ( !deviceKnown() ){
+                m_canToUdp.dropped++;
+                continue;
+            }
+            if ( !m_encoder.Fits(frame) ){
+                finishDatagram();
+            }
+            m_encoder.Add(frame);
+            m_encoderRxNs.push_back(rxTimestamp(msgs[i].msg_hdr, nowNs));
+        }
+
+        if ( n < CAN_VLEN ){
+            return;
+        }
+    }
+}
+
+void UdpCanBridge::finishDatagram() {
+    m_outDatagrams.emplace_back();
+    OutDatagram &datagram = m_outDatagrams.back();
+    datagram.len = m_encoder.Finish(datagram.buf);
+    datagram.rxNs.swap(m_encoderRxNs);
+}
+
+void UdpCanBridge::sendDatagrams() {
+    struct mmsghdr msgs[UDP_VLEN];
+    struct iovec iovs[UDP_VLEN];
+
+    size_t first = 0;
+    while ( first < m_outDatagrams.size() ){
+        int n = (int)std::min<size_t>(UDP_VLEN, m_outDatagrams.size() - first);
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < n; i++){
+            OutDatagram &datagram = m_outDatagrams[first + i];
+            iovs[i] = {datagram.buf, (size_t)datagram.len};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &m_device;
+            msgs[i].msg_hdr.msg_namelen = sizeof(m_device);
+        }
+
+        int sent = sendmmsg(m_udpSock, msgs, n, MSG_DONTWAIT);
+        if ( sent <= 0 ){
+            // The device sees the gap in the sequence numbers
+            fprintf(stderr, "UDP send failed: %s\n", strerror(errno));
+            m_udpSendErrors++;
+            m_canToUdp.dropped += m_outDatagrams[first].rxNs.size();
+            first++;
+            continue;
+        }
+
+        int64_t now = clockNs();
+        for(int i = 0; i < sent; i++){
+            for(int64_t rxNs : m_outDatagrams[first + i].rxNs){
+                m_canToUdp.latency.Add((now - rxNs) / 1000);
+            }
+            m_canToUdp.frames += m_outDatagrams[first + i].rxNs.size();
+        }
+        m_canToUdp.datagrams += sent;
+        first += sent;
+    }
+    m_outDatagrams.clear();
+}
+
+void UdpCanBridge::sendCommand(const char *cmd) {
+    // The device unicasts to the address the command came from
+    if ( sendto(m_subscribeSock, cmd, strlen(cmd), 0, (struct sockaddr *)&m_device, sizeof(m_device)) < 0 ){
+        fprintf(stderr, "Failed to send %s: %s\n", cmd, strerror(errno));
+    }
+}
+
+static void printDirection(const char *name, const DirectionStats &stats) {
+    const LatencyStats &l = stats.latency;
+    printf("%s %llu frames in %llu datagrams, %llu dropped, latency us min %lld avg %lld max %lld\n",
+           name, (unsigned long long)stats.frames, (unsigned long long)stats.datagrams,
+           (unsigned long long)stats.dropped, (long long)l.min, (long long)(l.count ? l.sum / (int64_t)l.count : 0),
+           (long long)l.max);
+}
+
+void UdpCanBridge::printStats() {
+    printDirection("UDP->CAN", m_udpToCan);
+    const UdpBatchDecoder &decoder = m_config.subscribe ? m_subscribeDecoder : m_broadcastDecoder;
+    printf("         %llu datagrams lost, %llu invalid frames since start\n",
+           (unsigned long long)decoder.LostDatagrams(), (unsigned long long)decoder.InvalidFrames());
+    if ( m_config.subscribe ){
+        printf("         %llu broadcast datagrams ignored since start\n", (unsigned long long)m_ignoredDatagrams);
+    }
+    printDirection("CAN->UDP", m_canToUdp);
+    printf("         %llu send errors since start\n", (unsigned long long)m_udpSendErrors);
+    fflush(stdout);
+    m_udpToCan = DirectionStats();
+    m_canToUdp = DirectionStats();
+}
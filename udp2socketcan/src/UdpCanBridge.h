@@ -0,0 +1,116 @@
+#ifndef UDP2SOCKETCAN_UDPCANBRIDGE_H
+#define UDP2SOCKETCAN_UDPCANBRIDGE_H
+
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <linux/can.h>
+#include "UdpFrameBatch.h"
+
+struct BridgeConfig {
+    std::string canInterface = "vcan0";
+    std::string deviceAddress;      // Empty to learn it from the datagrams the device broadcasts
+    int listenPort = UDP_TX_PORT;
+    int devicePort = UDP_RX_PORT;
+    int batchDelayMs = 20;          // Same as DEFAULT_UDP_BATCH_DELAY_MS of the device
+    int statsIntervalSec = 10;
+    bool subscribe = false;         // Ask the device for the unicast stream instead of the broadcast one
+};
+
+/// Min, average and max latency in microseconds over the stats interval
+struct LatencyStats {
+    void Add(int64_t us);
+    void Reset() { *this = LatencyStats(); }
+    uint64_t count = 0;
+    int64_t sum = 0;
+    int64_t min = 0;
+    int64_t max = 0;
+};
+
+/// Counters of one direction
+struct DirectionStats {
+    uint64_t frames = 0;
+    uint64_t datagrams = 0;
+    uint64_t dropped = 0;      // Frames dropped by the bridge itself
+    LatencyStats latency;
+};
+
+/// Moves the frames between the N2kWifi UDP stream and the CAN_RAW socket in a single thread.
+/// Both directions are batched: recvmmsg() and sendmmsg() on the UDP socket and on the CAN socket.
+/// With BridgeConfig::subscribe the unicast stream comes to its own socket, the device keeps broadcasting,
+/// so the broadcast datagrams are then only used to learn the device address, each frame is written once.
+/// The latency is measured from the kernel receive timestamp to the return of the send call,
+/// so UDP to CAN is the time spent in the bridge and CAN to UDP includes the batching delay.
+class UdpCanBridge {
+public:
+    /// Sockets are opened by the caller, all of them non blocking.
+    /// subscribeSock is bound to an ephemeral port for the unicast stream, -1 unless config.subscribe is set
+    UdpCanBridge(int canSock, int udpSock, int subscribeSock, const BridgeConfig &config);
+    /// Returns when stop is set
+    void Run(volatile sig_atomic_t &stop);
+
+    /// CAN_RAW socket bound to the interface with receive timestamps on, -1 on error
+    static int OpenCanSocket(const std::string &interface);
+    /// UDP socket bound to the port, 0 for an ephemeral one, with receive timestamps on, -1 on error
+    static int OpenUdpSocket(int port);
+
+private:
+    static const int UDP_VLEN = 32;
+    static const int CAN_VLEN = 64;
+    static const size_t MAX_PENDING_CAN_FRAMES = 4096;
+    static const int CAN_RETRY_MS = 1;
+    static const int SUBSCRIBE_INTERVAL_SEC = 10;   // Well within UDP_CLIENT_TIMEOUT_SEC of the device
+
+    struct PendingFrame {
+        can_frame frame;
+        int64_t rxNs;
+    };
+
+    struct OutDatagram {
+        uint8_t buf[MAX_UDP_BATCH_SIZE];
+        int len;
+        std::vector<int64_t> rxNs;
+    };
+
+    /// Frames of the datagrams are written to CAN only if toCan, the stream is counted by its own decoder
+    void receiveUdp(int sock, UdpBatchDecoder &decoder, bool toCan, int64_t nowNs);
+    void writeCan();
+    void receiveCan(int64_t nowNs);
+    void finishDatagram();
+    void sendDatagrams();
+    void sendCommand(const char *cmd);
+    void printStats();
+    int pollTimeoutMs(int64_t nowNs) const;
+    bool deviceKnown() const { return m_device.sin_addr.s_addr != 0; }
+
+    static int64_t clockNs();
+
+    int m_canSock;
+    int m_udpSock;
+    int m_subscribeSock;
+    BridgeConfig m_config;
+    struct sockaddr_in m_device{};
+
+    UdpBatchDecoder m_broadcastDecoder;
+    UdpBatchDecoder m_subscribeDecoder;
+    std::deque<PendingFrame> m_pendingCan;
+    bool m_canBlocked = false;
+    int64_t m_canRetryNs = 0;
+
+    UdpBatchEncoder m_encoder;
+    std::vector<int64_t> m_encoderRxNs;
+    std::vector<OutDatagram> m_outDatagrams;
+
+    DirectionStats m_udpToCan;
+    DirectionStats m_canToUdp;
+    uint64_t m_udpSendErrors = 0;
+    uint64_t m_ignoredDatagrams = 0;    // Broadcast ones while subscribed
+    bool m_messageModeReported = false;
+    int64_t m_nextStatsNs = 0;
+    int64_t m_nextSubscribeNs = 0;
+};
+
+#endif //UDP2SOCKETCAN_UDPCANBRIDGE_H
@@ -0,0 +1,104 @@
+#include <cstring>
+#include "UdpFrameBatch.h"
+
+static const int MAX_DLC = 8;
+
+bool UdpBatchDecoder::decodeFrame(const uint8_t *buf, int len, can_frame &frame) {
+    if ( len < 5 ){
+        return false;
+    }
+    uint32_t id = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    int dlc = buf[4];
+    if ( dlc > MAX_DLC || 5 + dlc > len ){
+        return false;
+    }
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    frame.can_dlc = dlc;
+    memcpy(frame.data, buf + 5, dlc);
+    return true;
+}
+
+BatchType UdpBatchDecoder::Decode(const uint8_t *buf, int len, std::vector<can_frame> &out) {
+    if ( len < 1 ){
+        return BatchType::INVALID;
+    }
+
+    // Legacy datagram starts with the upper byte of 29 bit CAN ID
+    if ( buf[0] <= (CAN_EFF_MASK >> 24) ){
+        can_frame frame{};
+        if ( !decodeFrame(buf, len, frame) ){
+            return BatchType::INVALID;
+        }
+        out.push_back(frame);
+        return BatchType::LEGACY_FRAME;
+    }
+
+    if ( (buf[0] != UDP_BATCH_VERSION && buf[0] != UDP_MESSAGE_BATCH_VERSION) || len < UDP_BATCH_HEADER_SIZE ){
+        return BatchType::INVALID;
+    }
+
+    uint16_t seq = (buf[1] << 8) | buf[2];
+    if ( m_seqValid ){
+        uint16_t gap = seq - (uint16_t)(m_seq + 1);
+        if ( gap != 0 && gap < 0x8000 ){
+            m_lostDatagrams += gap;
+        }
+    }
+    m_seq = seq;
+    m_seqValid = true;
+
+    if ( buf[0] == UDP_MESSAGE_BATCH_VERSION ){
+        return BatchType::MESSAGES;
+    }
+
+    int frameCount = buf[3];
+    int pos = UDP_BATCH_HEADER_SIZE;
+    for(int i = 0; i < frameCount; i++){
+        if ( pos >= len || pos + 1 + buf[pos] > len ){
+            m_invalidFrames += frameCount - i;
+            break;
+        }
+        can_frame frame{};
+        if ( decodeFrame(buf + pos + 1, buf[pos], frame) ){
+            out.push_back(frame);
+        }else{
+            m_invalidFrames++;
+        }
+        pos += 1 + buf[pos];
+    }
+    return BatchType::FRAMES;
+}
+
+void UdpBatchEncoder::Add(const can_frame &frame) {
+    uint32_t id = frame.can_id & CAN_EFF_MASK;
+    uint8_t *p = m_buf + m_len;
+    p[0] = 5 + frame.can_dlc;
+    p[1] = id >> 24;
+    p[2] = id >> 16;
+    p[3] = id >> 8;
+    p[4] = id;
+    p[5] = frame.can_dlc;
+    memcpy(p + 6, frame.data, frame.can_dlc);
+    m_len += 6 + frame.can_dlc;
+    m_frames++;
+}
+
+int UdpBatchEncoder::Finish(uint8_t *out) {
+    m_buf[0] = UDP_BATCH_VERSION;
+    m_buf[1] = m_seq >> 8;
+    m_buf[2] = m_seq & 0xFF;
+    m_buf[3] = m_frames;
+    memcpy(out, m_buf, m_len);
+    int len = m_len;
+
+    m_seq++;
+    m_len = UDP_BATCH_HEADER_SIZE;
+    m_frames = 0;
+    return len;
+}
+
+void UdpBatchEncoder::Reset() {
+    m_len = UDP_BATCH_HEADER_SIZE;
+    m_frames = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef UDP2SOCKETCAN_UDPFRAMEBATCH_H
+#define UDP2SOCKETCAN_UDPFRAMEBATCH_H
+
+#include <cstdint>
+#include <vector>
+#include <linux/can.h>
+
+/*
+    Host side of the N2kWifi UDP protocol, see idf-components/N2K_WIFI/UdpBatch.h for the datagram format.
+    The device sends the batches from UDP_TX_PORT and receives them on UDP_RX_PORT.
+    The legacy datagram with single frame (CAN ID, DLC, Data) is accepted as well.
+ */
+const int UDP_RX_PORT = 2023;
+const int UDP_TX_PORT = 2024;
+const unsigned char UDP_BATCH_VERSION = 0x81;
+const unsigned char UDP_MESSAGE_BATCH_VERSION = 0x82;
+const int UDP_BATCH_HEADER_SIZE = 4;
+const int MAX_UDP_BATCH_SIZE = 1400;
+
+enum class BatchType {
+    FRAMES,
+    LEGACY_FRAME,
+    MESSAGES,   // Whole N2K messages, the device is in message mode
+    INVALID,    // Not a batch, e.g. the reply to SUBSCRIBE
+};
+
+/// Decodes the datagrams from the device into CAN frames and counts the lost ones by the sequence number gaps
+class UdpBatchDecoder {
+public:
+    /// Frames are appended to out
+    BatchType Decode(const uint8_t *buf, int len, std::vector<can_frame> &out);
+    uint64_t LostDatagrams() const { return m_lostDatagrams; }
+    uint64_t InvalidFrames() const { return m_invalidFrames; }
+
+private:
+    static bool decodeFrame(const uint8_t *buf, int len, can_frame &frame);
+
+    bool m_seqValid = false;
+    uint16_t m_seq = 0;
+    uint64_t m_lostDatagrams = 0;
+    uint64_t m_invalidFrames = 0;
+};
+
+/// Collects CAN frames into the batched datagram for the device
+class UdpBatchEncoder {
+public:
+    UdpBatchEncoder() { Reset(); }
+    bool Empty() const { return m_frames == 0; }
+    bool Fits(const can_frame &frame) const { return m_len + 6 + frame.can_dlc <= MAX_UDP_BATCH_SIZE; }
+    void Add(const can_frame &frame);
+    /// Fill in the header and return the datagram length, the next Add() starts the new datagram
+    int Finish(uint8_t *out);
+    void Reset();
+
+private:
+    uint8_t m_buf[MAX_UDP_BATCH_SIZE]{};
+    int m_len = UDP_BATCH_HEADER_SIZE;
+    int m_frames = 0;
+    uint16_t m_seq = 0;
+};
+
+#endif //UDP2SOCKETCAN_UDPFRAMEBATCH_H
@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "UdpCanBridge.h"
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int) {
+    stopRequested = 1;
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [options]\n"
+           "Bridges N2kWifi UDP stream to SocketCAN interface\n"
+           "  -i, --interface <name>   CAN interface, default vcan0\n"
+           "  -d, --device <ip>        Device address, learned from its datagrams if not set\n"
+           "  -l, --listen-port <port> Port the device sends to, default %d\n"
+           "  -p, --device-port <port> Port the device listens on, default %d\n"
+           "  -b, --batch-delay <ms>   Longest time CAN frame waits for the datagram to fill up, default 20\n"
+           "  -s, --stats <sec>        Stats interval, default 10\n"
+           "  -u, --subscribe          Ask the device for unicast stream instead of the broadcast one\n",
+           name, UDP_TX_PORT, UDP_RX_PORT);
+}
+
+int main(int argc, char **argv) {
+
+    BridgeConfig config;
+    const struct option options[] = {
+            {"interface",   required_argument, nullptr, 'i'},
+            {"device",      required_argument, nullptr, 'd'},
+            {"listen-port", required_argument, nullptr, 'l'},
+            {"device-port", required_argument, nullptr, 'p'},
+            {"batch-delay", required_argument, nullptr, 'b'},
+            {"stats",       required_argument, nullptr, 's'},
+            {"subscribe",   no_argument,       nullptr, 'u'},
+            {"help",        no_argument,       nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ( (opt = getopt_long(argc, argv, "i:d:l:p:b:s:uh", options, nullptr)) != -1 ){
+        switch (opt) {
+            case 'i': config.canInterface = optarg; break;
+            case 'd': config.deviceAddress = optarg; break;
+            case 'l': config.listenPort = atoi(optarg); break;
+            case 'p': config.devicePort = atoi(optarg); break;
+            case 'b': config.batchDelayMs = atoi(optarg); break;
+            case 's': config.statsIntervalSec = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'u': config.subscribe = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    int canSock = UdpCanBridge::OpenCanSocket(config.canInterface);
+    if ( canSock < 0 ){
+        return 1;
+    }
+    int udpSock = UdpCanBridge::OpenUdpSocket(config.listenPort);
+    if ( udpSock < 0 ){
+        close(canSock);
+        return 1;
+    }
+    // The unicast stream comes to the port the subscription was sent from, not to the broadcast one
+    int subscribeSock = config.subscribe ? UdpCanBridge::OpenUdpSocket(0) : -1;
+    if ( config.subscribe && subscribeSock < 0 ){
+        close(udpSock);
+        close(canSock);
+        return 1;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    printf("Bridging UDP port %d and %s\n", config.listenPort, config.canInterface.c_str());
+    UdpCanBridge bridge(canSock, udpSock, subscribeSock, config);
+    bridge.Run(stopRequested);
+
+    printf("Exiting ...\n");
+    if ( subscribeSock >= 0 ){
+        close(subscribeSock);
+    }
+    close(udpSock);
+    close(canSock);
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "UdpFrameBatch.h"
+
+// Stands in for the N2kWifi device to test the bridge on the host:
+// sends batches of numbered frames to the bridge and counts the batches the bridge sends back.
+// Like the device it keeps sending to the bridge port after SUBSCRIBE and sends the same batches to the subscriber.
+// Usage: udp_device_sim [-a bridge_ip] [-r frames_per_sec] [-t seconds] [-x loss_percent]
+
+static const uint32_t SIM_FRAME_ID = 0x09F80103;   // PGN 129025 from source 3
+static const int BATCH_DELAY_MS = 20;
+
+int main(int argc, char **argv) {
+    const char *bridgeAddr = "127.0.0.1";
+    int bridgePort = UDP_TX_PORT;
+    int listenPort = UDP_RX_PORT;
+    int rate = 1000;
+    int seconds = 10;
+    int lossPercent = 0;
+
+    int opt;
+    while ( (opt = getopt(argc, argv, "a:p:l:r:t:x:")) != -1 ){
+        switch (opt) {
+            case 'a': bridgeAddr = optarg; break;
+            case 'p': bridgePort = atoi(optarg); break;
+            case 'l': listenPort = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'x': lossPercent = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-a bridge_ip] [-p bridge_port] [-l listen_port] [-r frames_per_sec]"
+                                " [-t seconds] [-x loss_percent]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(listenPort);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ( sock < 0 || bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0 ){
+        perror("Failed to bind");
+        return 1;
+    }
+    struct sockaddr_in bridge{};
+    bridge.sin_family = AF_INET;
+    bridge.sin_port = htons(bridgePort);
+    inet_pton(AF_INET, bridgeAddr, &bridge.sin_addr);
+    struct sockaddr_in subscriber{};
+    bool subscribed = false;
+
+    std::mt19937 rng(1);
+    UdpBatchEncoder encoder;
+    UdpBatchDecoder decoder;
+    std::vector<can_frame> received;
+    uint8_t buf[MAX_UDP_BATCH_SIZE + 100];
+    uint64_t sentFrames = 0, sentDatagrams = 0, skippedDatagrams = 0;
+    uint64_t receivedFrames = 0, receivedDatagrams = 0;
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    auto batchStart = start;
+    auto end = start + std::chrono::seconds(seconds);
+    uint64_t counter = 0;
+
+    auto send = [&](){
+        int len = encoder.Finish(buf);
+        if ( (int)(rng() % 100) < lossPercent ){
+            skippedDatagrams++;  // The bridge sees the gap in the sequence numbers
+            return;
+        }
+        if ( sendto(sock, buf, len, 0, (struct sockaddr *)&bridge, sizeof(bridge)) > 0 ){
+            sentDatagrams++;
+        }
+        if ( subscribed ){
+            sendto(sock, buf, len, 0, (struct sockaddr *)&subscriber, sizeof(subscriber));
+        }
+    };
+
+    while ( clock::now() < end ){
+        struct pollfd fd = {sock, POLLIN, 0};
+        if ( poll(&fd, 1, 1) > 0 ){
+            struct sockaddr_in from{};
+            socklen_t fromLen = sizeof(from);
+            int len = (int)recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromLen);
+            received.clear();
+            if ( len >= 9 && memcmp(buf, "SUBSCRIBE", 9) == 0 ){
+                if ( !subscribed ){
+                    printf("Subscribed from port %d\n", ntohs(from.sin_port));
+                }
+                subscriber = from;
+                subscribed = true;
+                sendto(sock, "SUBSCRIBED,0", 12, 0, (struct sockaddr *)&from, sizeof(from));
+            }else if ( len >= 11 && memcmp(buf, "UNSUBSCRIBE", 11) == 0 ){
+                subscribed = false;
+            }else if ( len > 0 && decoder.Decode(buf, len, received) != BatchType::INVALID ){
+                receivedDatagrams++;
+                receivedFrames += received.size();
+            }
+        }
+
+        auto now = clock::now();
+        uint64_t due = (uint64_t)(std::chrono::duration<double>(now - start).count() * rate);
+        for(; counter < due; counter++){
+            can_frame frame{};
+            frame.can_id = SIM_FRAME_ID | CAN_EFF_FLAG;
+            frame.can_dlc = 8;
+            memcpy(frame.data, &counter, 8);
+            if ( !encoder.Fits(frame) ){
+                send();
+            }
+            if ( encoder.Empty() ){
+                batchStart = now;
+            }
+            encoder.Add(frame);
+            sentFrames++;
+        }
+        if ( !encoder.Empty() && now - batchStart >= std::chrono::milliseconds(BATCH_DELAY_MS) ){
+            send();
+        }
+    }
+    if ( !encoder.Empty() ){
+        send();
+    }
+
+    printf("Sent %llu frames in %llu datagrams, %llu datagrams skipped on purpose\n",
+           (unsigned long long)sentFrames, (unsigned long long)sentDatagrams, (unsigned long long)skippedDatagrams);
+    printf("Received %llu frames in %llu datagrams, %llu datagrams lost\n",
+           (unsigned long long)receivedFrames, (unsigned long long)receivedDatagrams,
+           (unsigned long long)decoder.LostDatagrams());
+    close(sock);
+    return 0;
+}